@@ -0,0 +1,514 @@
+/**
+ * @example vncloadgen.c
+ * Opens many client sessions to one server from a single process, to see
+ * how the server copes with hundreds of viewers without needing hundreds
+ * of machines.
+ *
+ * Every session runs in a thread of its own. Sessions can use different
+ * encodings, ask for updates in different ways, read slowly and send
+ * pointer and key events. At the end, the aggregate throughput is printed,
+ * followed by the percentiles of the update intervals and Fence round trip
+ * times of every session. If the server serves /metrics (see
+ * rfbScreenInfo::httpMetrics), its counters are scraped before and after
+ * the run as well.
+ *
+ * Usage: vncloadgen [options] host[:display]
+ *
+ *   -clients n          sessions to open (10)
+ *   -duration s         seconds to measure once all are connected (30)
+ *   -ramp ms            pause between two connects (10)
+ *   -encodings a,b,..   encodings strings the sessions take in turns,
+ *                       e.g. "tight copyrect,zrle copyrect"
+ *   -quality q          JPEG quality 0-9, -1 for lossless
+ *   -compress c         compression level 0-9
+ *   -requests mode      continuous: ContinuousUpdates if the server has it,
+ *                       incremental: one request after each update,
+ *                       full: a full update request after each update
+ *   -slow n             the first n sessions read no faster than
+ *   -slowrate b         b bytes per second (65536)
+ *   -pointer r          pointer motions per second per session (0)
+ *   -keys r             Shift key presses per second per session (0)
+ *   -metrics host:port  the server's HTTP server to scrape /metrics from
+ *
+ * All sessions decode into one shared framebuffer: the pixels are garbage,
+ * but memory does not grow with the number of sessions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#include <rfb/rfbclient.h>
+#include <rfb/keysym.h>
+
+#define MAX_SESSION_ENCODINGS 16
+#define MAX_METRICS 64
+
+enum { REQUEST_CONTINUOUS, REQUEST_INCREMENTAL, REQUEST_FULL };
+
+typedef struct {
+	uint32_t *values;
+	int n, size;
+} samples;
+
+typedef struct {
+	int index;
+	pthread_t thread;
+	const char *encodings;
+	int slow;
+	int connected, failed;
+	uint64_t bytesAtStart, bytes;
+	uint64_t updatesAtStart, updates;
+	uint64_t lastUpdate;
+	samples interval;	/* between two updates, in us */
+	samples rtt;		/* Fence round trip times, in ms */
+} session;
+
+typedef struct {
+	char name[96];
+	double value;
+} metric;
+
+static const char *server;
+static int quality = -2, compressLevel = -1, requests = REQUEST_CONTINUOUS;
+static int slowRate = 65536;
+static double pointerRate, keyRate;
+
+static volatile int measuring, stopping;
+static uint64_t measureStart;
+
+static pthread_mutex_t frameBufferMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *frameBuffer;
+static size_t frameBufferSize;
+
+static uint64_t nowUs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void quietLog(const char *format, ...)
+{
+}
+
+static void addSample(samples *s, uint32_t value)
+{
+	uint32_t *values;
+
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 256;
+		values = realloc(s->values, s->size * sizeof(*values));
+		if (!values)
+			return;
+		s->values = values;
+	}
+	s->values[s->n++] = value;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* the p-th percentile of sorted samples */
+static uint32_t percentile(samples *s, int p)
+{
+	if (s->n == 0)
+		return 0;
+	return s->values[s->n * p / 100 < s->n ? s->n * p / 100 : s->n - 1];
+}
+
+/* the client side */
+
+static rfbBool mallocFrameBuffer(rfbClient *client)
+{
+	size_t size = (size_t)client->width * client->height * client->format.bitsPerPixel / 8;
+	uint8_t *buffer;
+
+	pthread_mutex_lock(&frameBufferMutex);
+	if (size > frameBufferSize) {
+		/* the old one stays, others may still be decoding into it */
+		buffer = calloc(size, 1);
+		if (buffer) {
+			frameBuffer = buffer;
+			frameBufferSize = size;
+		}
+	}
+	client->frameBuffer = frameBuffer;
+	pthread_mutex_unlock(&frameBufferMutex);
+	return client->frameBuffer != NULL && size <= frameBufferSize;
+}
+
+static void finishedUpdate(rfbClient *client)
+{
+	session *s = rfbClientGetClientData(client, (void *)mallocFrameBuffer);
+	uint64_t now = nowUs();
+
+	if (measuring && s->lastUpdate)
+		addSample(&s->interval, (uint32_t)(now - s->lastUpdate));
+	s->lastUpdate = now;
+	s->updates++;
+	if (requests == REQUEST_FULL)
+		SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+}
+
+static void gotNetworkStats(rfbClient *client, int rtt, uint32_t bytesPerSecond)
+{
+	session *s = rfbClientGetClientData(client, (void *)mallocFrameBuffer);
+
+	if (measuring && rtt >= 0)
+		addSample(&s->rtt, rtt);
+}
+
+static void *sessionLoop(void *data)
+{
+	session *s = data;
+	rfbClient *client;
+	char *argv[2];
+	int argc = 2, n;
+	uint64_t now, start, nextPointer, nextKey, due, wait;
+
+	client = rfbGetClient(8, 3, 4);
+	if (!client) {
+		s->failed = 1;
+		return NULL;
+	}
+	argv[0] = "vncloadgen";
+	argv[1] = (char *)server;
+	client->MallocFrameBuffer = mallocFrameBuffer;
+	client->FinishedFrameBufferUpdate = finishedUpdate;
+	client->GotNetworkStats = gotNetworkStats;
+	client->useContinuousUpdates = requests == REQUEST_CONTINUOUS;
+	if (s->encodings)
+		client->appData.encodingsString = s->encodings;
+	if (quality >= 0)
+		client->appData.qualityLevel = quality;
+	else if (quality == -1)
+		client->appData.enableJPEG = FALSE;
+	if (compressLevel >= 0)
+		client->appData.compressLevel = compressLevel;
+	rfbClientSetClientData(client, (void *)mallocFrameBuffer, s);
+
+	/* cleans up the client if it fails */
+	if (!rfbInitClient(client, &argc, argv)) {
+		s->failed = 1;
+		return NULL;
+	}
+	s->connected = 1;
+
+	start = nextPointer = nextKey = nowUs();
+	while (!stopping) {
+		now = nowUs();
+		due = now + 100000;
+		if (pointerRate > 0) {
+			if (now >= nextPointer) {
+				SendPointerEvent(client, rand() % client->width, rand() % client->height, 0);
+				nextPointer += (uint64_t)(1e6 / pointerRate);
+			}
+			if (nextPointer < due)
+				due = nextPointer;
+		}
+		if (keyRate > 0) {
+			if (now >= nextKey) {
+				SendKeyEvent(client, XK_Shift_L, TRUE);
+				SendKeyEvent(client, XK_Shift_L, FALSE);
+				nextKey += (uint64_t)(1e6 / keyRate);
+			}
+			if (nextKey < due)
+				due = nextKey;
+		}
+
+		/* a slow reader lets the server's data pile up in the socket */
+		if (s->slow) {
+			wait = (uint64_t)(client->bytesReceived * 1e6 / slowRate);
+			if (start + wait > now) {
+				usleep((useconds_t)(start + wait - now < due - now ?
+						    start + wait - now : due - now));
+				continue;
+			}
+		}
+
+		/* what libvncclient read ahead is not seen by select() */
+		n = client->buffered ? 1 : WaitForMessage(client, (unsigned int)(due > now ? due - now : 0));
+		if (n < 0 || (n > 0 && !HandleRFBServerMessage(client))) {
+			s->failed = 1;
+			break;
+		}
+		s->bytes = client->bytesReceived;
+	}
+
+	s->bytes = client->bytesReceived;
+	client->appData.encodingsString = NULL;
+	client->frameBuffer = NULL;
+	rfbClientCleanup(client);
+	return NULL;
+}
+
+/* the server side */
+
+static int findMetric(metric *metrics, int *n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < *n; i++)
+		if (strcmp(metrics[i].name, name) == 0)
+			return i;
+	if (*n == MAX_METRICS)
+		return -1;
+	snprintf(metrics[*n].name, sizeof(metrics[*n].name), "%s", name);
+	metrics[*n].value = 0;
+	return (*n)++;
+}
+
+/* sums up the series of every metric /metrics has, but the histograms */
+static int scrapeMetrics(const char *hostPort, metric *metrics)
+{
+	struct addrinfo hints, *res;
+	char host[256], *port, *text = NULL, *line, *end, *value, name[96];
+	static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	size_t len = 0, size = 0;
+	ssize_t got;
+	int sock, n = 0, i;
+
+	snprintf(host, sizeof(host), "%s", hostPort);
+	port = strrchr(host, ':');
+	if (!port)
+		return 0;
+	*port++ = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return 0;
+	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) < 0 ||
+	    write(sock, request, sizeof(request) - 1) < 0) {
+		if (sock >= 0)
+			close(sock);
+		freeaddrinfo(res);
+		return 0;
+	}
+	freeaddrinfo(res);
+
+	do {
+		if (size - len < 4096) {
+			size = size ? size * 2 : 65536;
+			end = realloc(text, size);
+			if (!end)
+				break;
+			text = end;
+		}
+		got = read(sock, text + len, size - len - 1);
+		if (got > 0)
+			len += got;
+	} while (got > 0);
+	close(sock);
+	if (!text)
+		return 0;
+	text[len] = '\0';
+
+	line = strstr(text, "\r\n\r\n");
+	for (line = line ? line + 4 : text + len; *line; line = end) {
+		end = strchr(line, '\n');
+		if (end)
+			*end++ = '\0';
+		else
+			end = line + strlen(line);
+		value = strrchr(line, ' ');
+		if (line[0] == '#' || !value)
+			continue;
+		snprintf(name, sizeof(name), "%.*s", (int)strcspn(line, "{ "), line);
+		if (strstr(name, "_bucket") || strstr(name, "_count"))
+			continue;
+		i = findMetric(metrics, &n, name);
+		if (i >= 0)
+			metrics[i].value += atof(value + 1);
+	}
+	free(text);
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	session *sessions;
+	char *encodings[MAX_SESSION_ENCODINGS], *metricsServer = NULL, *e;
+	int clients = 10, duration = 30, ramp = 10, nEncodings = 0, slow = 0;
+	int i, connected = 0, failed = 0, nBefore = 0, nAfter = 0, j;
+	uint64_t bytes = 0, updates = 0, elapsed;
+	samples allIntervals = { NULL, 0, 0 }, allRtts = { NULL, 0, 0 };
+	metric before[MAX_METRICS], after[MAX_METRICS];
+	double seconds;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-clients") == 0 && i + 1 < argc)
+			clients = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-duration") == 0 && i + 1 < argc)
+			duration = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-ramp") == 0 && i + 1 < argc)
+			ramp = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-encodings") == 0 && i + 1 < argc) {
+			for (e = strtok(argv[++i], ","); e && nEncodings < MAX_SESSION_ENCODINGS; e = strtok(NULL, ","))
+				encodings[nEncodings++] = e;
+		} else if (strcmp(argv[i], "-quality") == 0 && i + 1 < argc)
+			quality = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-compress") == 0 && i + 1 < argc)
+			compressLevel = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-requests") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "continuous") == 0)
+				requests = REQUEST_CONTINUOUS;
+			else if (strcmp(argv[i], "incremental") == 0)
+				requests = REQUEST_INCREMENTAL;
+			else if (strcmp(argv[i], "full") == 0)
+				requests = REQUEST_FULL;
+			else {
+				fprintf(stderr, "unknown request mode %s\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-slow") == 0 && i + 1 < argc)
+			slow = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-slowrate") == 0 && i + 1 < argc)
+			slowRate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-pointer") == 0 && i + 1 < argc)
+			pointerRate = atof(argv[++i]);
+		else if (strcmp(argv[i], "-keys") == 0 && i + 1 < argc)
+			keyRate = atof(argv[++i]);
+		else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc)
+			metricsServer = argv[++i];
+		else if (argv[i][0] != '-' && !server)
+			server = argv[i];
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (!server || clients < 1 || duration < 1 || slowRate < 1) {
+		fprintf(stderr, "usage: %s [-clients n] [-duration s] [-ramp ms] [-encodings a,b,..]\n"
+			"\t[-quality q] [-compress c] [-requests continuous|incremental|full]\n"
+			"\t[-slow n] [-slowrate bytes/s] [-pointer rate] [-keys rate]\n"
+			"\t[-metrics host:port] host[:display]\n", argv[0]);
+		return 1;
+	}
+
+	rfbClientLog = rfbClientErr = quietLog;
+	/* the server dropping a session must not end the run */
+	signal(SIGPIPE, SIG_IGN);
+	sessions = calloc(clients, sizeof(*sessions));
+	if (!sessions)
+		return 1;
+
+	fprintf(stderr, "connecting %d sessions to %s\n", clients, server);
+	for (i = 0; i < clients; i++) {
+		sessions[i].index = i;
+		sessions[i].encodings = nEncodings ? encodings[i % nEncodings] : NULL;
+		sessions[i].slow = i < slow;
+		if (pthread_create(&sessions[i].thread, NULL, sessionLoop, &sessions[i]) != 0) {
+			sessions[i].failed = 1;
+			sessions[i].thread = pthread_self();
+		}
+		if (ramp > 0)
+			usleep(ramp * 1000);
+	}
+	/* wait for the connections to be made or to fail */
+	for (j = 0; j < 3000; j++) {
+		connected = failed = 0;
+		for (i = 0; i < clients; i++) {
+			connected += sessions[i].connected;
+			failed += sessions[i].failed && !sessions[i].connected;
+		}
+		if (connected + failed == clients)
+			break;
+		usleep(10000);
+	}
+	fprintf(stderr, "%d connected, %d failed, measuring for %d s\n", connected, failed, duration);
+
+	if (metricsServer)
+		nBefore = scrapeMetrics(metricsServer, before);
+	for (i = 0; i < clients; i++) {
+		sessions[i].bytesAtStart = sessions[i].bytes;
+		sessions[i].updatesAtStart = sessions[i].updates;
+	}
+	measureStart = nowUs();
+	measuring = 1;
+	sleep(duration);
+	measuring = 0;
+	elapsed = nowUs() - measureStart;
+	for (i = 0; i < clients; i++) {
+		sessions[i].bytes -= sessions[i].bytesAtStart;
+		sessions[i].updates -= sessions[i].updatesAtStart;
+	}
+	if (metricsServer)
+		nAfter = scrapeMetrics(metricsServer, after);
+
+	stopping = 1;
+	for (i = 0; i < clients; i++)
+		if (!pthread_equal(sessions[i].thread, pthread_self()))
+			pthread_join(sessions[i].thread, NULL);
+
+	/* one line per session */
+	seconds = elapsed / 1e6;
+	printf("session,encodings,slow,failed,bytes_per_s,updates_per_s,"
+	       "interval_p50_ms,interval_p90_ms,interval_p99_ms,rtt_p50_ms,rtt_p90_ms,rtt_p99_ms\n");
+	for (i = 0; i < clients; i++) {
+		session *s = &sessions[i];
+
+		qsort(s->interval.values, s->interval.n, sizeof(uint32_t), compareSamples);
+		qsort(s->rtt.values, s->rtt.n, sizeof(uint32_t), compareSamples);
+		printf("%d,%s,%d,%d,%.0f,%.1f,%.1f,%.1f,%.1f,%u,%u,%u\n", i,
+		       s->encodings ? s->encodings : "default", s->slow, s->failed,
+		       s->bytes / seconds, s->updates / seconds,
+		       percentile(&s->interval, 50) / 1e3, percentile(&s->interval, 90) / 1e3,
+		       percentile(&s->interval, 99) / 1e3,
+		       percentile(&s->rtt, 50), percentile(&s->rtt, 90), percentile(&s->rtt, 99));
+		bytes += s->bytes;
+		updates += s->updates;
+		for (j = 0; j < s->interval.n; j++)
+			addSample(&allIntervals, s->interval.values[j]);
+		for (j = 0; j < s->rtt.n; j++)
+			addSample(&allRtts, s->rtt.values[j]);
+	}
+
+	/* and the totals */
+	qsort(allIntervals.values, allIntervals.n, sizeof(uint32_t), compareSamples);
+	qsort(allRtts.values, allRtts.n, sizeof(uint32_t), compareSamples);
+	printf("\n# sessions %d connected %d failed %d\n", clients, connected, failed);
+	printf("# seconds %.1f\n", seconds);
+	printf("# throughput_mbytes_per_s %.2f\n", bytes / seconds / 1e6);
+	printf("# updates_per_s %.1f\n", updates / seconds);
+	printf("# interval_ms p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+	       percentile(&allIntervals, 50) / 1e3, percentile(&allIntervals, 90) / 1e3,
+	       percentile(&allIntervals, 99) / 1e3, percentile(&allIntervals, 100) / 1e3);
+	printf("# rtt_ms p50 %u p90 %u p99 %u max %u\n",
+	       percentile(&allRtts, 50), percentile(&allRtts, 90),
+	       percentile(&allRtts, 99), percentile(&allRtts, 100));
+
+	/* counters as increments over the run, gauges as they were at its end */
+	for (i = 0; i < nAfter; i++) {
+		double value = after[i].value;
+
+		if (strstr(after[i].name, "_total"))
+			for (j = 0; j < nBefore; j++)
+				if (strcmp(before[j].name, after[i].name) == 0)
+					value -= before[j].value;
+		printf("# server %s %.6g\n", after[i].name, value);
+	}
+	if (metricsServer && nAfter == 0)
+		fprintf(stderr, "could not scrape http://%s/metrics\n", metricsServer);
+
+	for (i = 0; i < clients; i++) {
+		free(sessions[i].interval.values);
+		free(sessions[i].rtt.values);
+	}
+	free(allIntervals.values);
+	free(allRtts.values);
+	free(sessions);
+	free(frameBuffer);
+	return 0;
+}
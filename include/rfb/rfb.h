@@ -265,10 +265,11 @@ typedef struct _rfbScreenInfo
         view only password. */
     int authPasswdFirstViewOnly;
 
-    /** send only this many rectangles in one update */
+    /** send only this many rectangles in one update, merging neighbouring
+     * ones where that adds the fewest pixels; see simplify.c */
     int maxRectsPerUpdate;
-    /** this is the amount of milliseconds to wait at least before sending
-     * an update. */
+    /** this is the maximum amount of milliseconds an update is held back
+     * to coalesce more damage; see deferQuietTime and deferSmallUpdateArea. */
     int deferUpdateTime;
 #ifdef TODELETE
     char* screen;
@@ -376,6 +377,90 @@ typedef struct _rfbScreenInfo
 #endif
     /* Timeout value for select() calls, mainly used for multithreaded servers. */
     int select_timeout_usec;
+    /** an update is held back only as long as new damage keeps arriving
+     * at least every this many milliseconds (and at most deferUpdateTime). */
+    int deferQuietTime;
+    /** damage covering at most this many pixels is sent right away if no
+     * update was sent to the client within the last deferUpdateTime ms. */
+    int deferSmallUpdateArea;
+    /** adapt JPEG quality, subsampling and compression level of each client
+     * to its link, aiming at adaptiveTargetLatency ms per update. The client's
+     * requested quality and compression level are upper bounds, the quality
+     * does not go below adaptiveMinQuality (1-100 scale). */
+    rfbBool adaptiveQuality;
+    int adaptiveTargetLatency;
+    int adaptiveMinQuality;
+    /** pick an encoding per rectangle from what the client advertised,
+     * according to the rectangle's content. Only applies to clients
+     * preferring Hextile, Zlib, ZRLE, ZYWRLE or Tight. Off by default, as
+     * it changes what those clients are sent. */
+    rfbBool contentAwareEncoding;
+    /** number of threads helping the clients' output threads to encode
+     * large updates, 0 to encode everything on the output thread. Takes
+     * effect in rfbInitServer(). */
+    int encoderThreads;
+    struct rfbWorkerPool *workerPool;
+    /** encode updates made of Raw, RRE, CoRRE, Hextile or Ultra rectangles
+     * on the encoder threads, cut into bands of rows. Needs encoderThreads. */
+    rfbBool parallelRectEncoding;
+    /** for a scaled copy of the framebuffer: the damage not applied to it
+     * yet, in coordinates of the original. A scaled copy is brought up to
+     * date when its clients are sent an update, and only where they are. */
+    struct sraRegion *scaledScreenDamage;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(scaledScreenMutex);
+#endif
+    /** damage waiting for the clients to pick it up, see damage.c */
+    struct rfbDamageJournal *damageJournal;
+    /** what the client iterators walk instead of clientHead, so that
+     * they take no lock, and what waits for them to finish. See
+     * rfbserver.c. */
+    struct rfbClientSnapshot *clientSnapshot;
+    struct rfbClientSnapshot *retiredClientSnapshots;
+    long clientListEpoch;
+    long clientListReaders[2];
+    /** serve the counters of the screen and its clients at /metrics of the
+     * HTTP server, in the Prometheus text format. Off by default; the HTTP
+     * server is then started even without httpDir. See httpd.c. */
+    rfbBool httpMetrics;
+    /** tiles sent to clients supporting the TileCache pseudo-encoding are
+     * kept by them, to be redrawn from a short reference when they are
+     * shown again. This many bytes of each client's memory are used at
+     * most, 0 disables it. See tilecache.c. */
+    int tileCacheSize;
+    /** areas sent as JPEG are sent again losslessly once they were left
+     * alone for this many milliseconds, a little at a time. 0, the
+     * default, disables it. See losslessrefresh.c. */
+    int losslessRefreshDelay;
+    /** rectangles are sent nearest to where the client last moved its
+     * pointer first. With focusSize, the square of that size around it
+     * is sent ahead as rectangles of its own, with focusSplit as well even
+     * as an update of its own while the client is interacting. See
+     * focus.c. */
+    int focusSize;
+    rfbBool focusSplit;
+    /** share the time spent encoding among the clients by their
+     * scheduleWeight, clients sending input counting more. maxFps and
+     * maxBandwidth (bytes/s) are what new clients are capped to, 0 for no
+     * limit; newClientHook may change a client's. See schedule.c. */
+    rfbBool fairScheduling;
+    int maxFps;
+    int maxBandwidth;
+    /** the virtual time of the latest update started, see schedule.c */
+    uint64_t scheduleVirtualTime;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(scheduleMutex);
+#endif
+    /** the encoder state of a client that was sent no update for this
+     * many milliseconds is freed, to be created again when it is needed.
+     * 0 keeps it. See reclaim.c. */
+    int reclaimIdleTime;
+    /** with httpMetrics, give every client series of its own, labelled
+     * with its address and socket. Off, the series add up all clients the
+     * screen had. See httpd.c. */
+    rfbBool httpMetricsPerClient;
+    /** what the clients gone so far add to /metrics */
+    struct rfbMetricsTotals *metricsTotals;
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -414,15 +499,61 @@ typedef struct _rfbFileTransferData {
 
 typedef struct _rfbStatList {
     uint32_t type;
-    uint32_t sentCount;
-    uint32_t bytesSent;
-    uint32_t bytesSentIfRaw;
-    uint32_t rcvdCount;
-    uint32_t bytesRcvd;
-    uint32_t bytesRcvdIfRaw;
+    uint64_t sentCount;
+    uint64_t bytesSent;
+    uint64_t bytesSentIfRaw;
+    uint64_t rcvdCount;
+    uint64_t bytesRcvd;
+    uint64_t bytesRcvdIfRaw;
     struct _rfbStatList *Next;
 } rfbStatList;
 
+/** number of buckets of the time histograms of rfbStats. Bucket 0 counts
+ * what took less than 2 microseconds, bucket i what took from 2^i up to
+ * 2^(i+1) microseconds, the last bucket also everything longer. */
+#define rfbStatBuckets 20
+/** how many rectangle encodings rfbStats can hold */
+#define rfbStatEncodings 16
+
+typedef struct {
+    uint32_t encoding;
+    uint64_t rects;
+    uint64_t bytes;
+    uint64_t bytesIfRaw;
+    /** time spent encoding and sending, summed over the encoder threads */
+    uint64_t encodeTimeUs;
+    /** per rectangle, or per band with parallelRectEncoding */
+    uint64_t encodeTimeHistogram[rfbStatBuckets];
+} rfbEncodingStats;
+
+/** what rfbGetStats() returns about a client */
+typedef struct {
+    uint64_t bytesSent;
+    uint64_t bytesSentIfRaw;
+    uint64_t bytesRcvd;
+    uint64_t updates;
+    /** updates sent with damage that was marked while earlier damage was
+     * already waiting, so that the client never saw the screen in
+     * between. At most one per update. */
+    uint64_t droppedUpdates;
+    /** tiles the client was sent a TileCache reference for, and tiles it
+     * could have kept but did not have yet */
+    uint64_t tileCacheHits;
+    uint64_t tileCacheMisses;
+    /** per update, from the first damage it carries being marked to its
+     * last byte being written, at millisecond resolution, and the sum of
+     * those times */
+    uint64_t latencyHistogram[rfbStatBuckets];
+    uint64_t latencyMs;
+    /** estimated memory the client takes, mostly encoder state, as of its
+     * last update or reclamation, and how often the encoder state of the
+     * idle client was freed. See rfbClientMemoryUsage(). */
+    uint64_t memoryBytes;
+    uint64_t memoryReclaims;
+    int nEncodings;
+    rfbEncodingStats encodings[rfbStatEncodings];
+} rfbStats;
+
 typedef struct _rfbSslCtx rfbSslCtx;
 typedef struct _wsCtx wsCtx;
 
@@ -550,7 +681,8 @@ typedef struct _rfbClientRec {
        - when the framebuffer is modified and the client is ready, in most
        cases it is more efficient to defer sending the update by a few
        milliseconds so that several changes to the framebuffer can be combined
-       into a single update. */
+       into a single update.
+       startDeferring is no longer used, see firstDamageTime below. */
 
       struct timeval startDeferring;
       struct timeval startPtrDeferring;
@@ -710,6 +842,133 @@ typedef struct _rfbClientRec {
     void *tightTJ;
     int tightPngDstDataLen;
 #endif
+#endif
+
+    /** State of the update coalescing scheduler, in milliseconds of
+       rfbGetMonotonicTimeMs(). firstDamageTime is 0 if no damage is
+       pending. Protected by updateMutex. */
+    uint32_t firstDamageTime;
+    uint32_t lastDamageTime;
+    uint32_t lastUpdateSentTime;
+    /** the damage journal generation up to which the client has picked up
+       damage into modifiedRegion. Protected by updateMutex. */
+    uint64_t damageGeneration;
+    /** whether the output thread waits for more, on the journal's list of
+       sleepers. Protected by the journal's mutex. */
+    rfbBool waitingForDamage;
+    struct _rfbClientRec *prevSleeper, *nextSleeper;
+
+    /** Fence and ContinuousUpdates protocol extensions */
+    rfbBool enableFence;
+    rfbBool enableContinuousUpdates;
+    /** if set, continuousUpdatesRegion is requested again after each update.
+       Protected by updateMutex. */
+    rfbBool continuousUpdates;
+    sraRegionPtr continuousUpdatesRegion;
+    /** a Fence request measuring the round trip time is on its way.
+       This and the round trip times are protected by sendMutex. */
+    rfbBool fenceProbePending;
+    /** last and smallest measured round trip time in ms, -1 if unknown */
+    int fenceRTT;
+    int fenceMinRTT;
+
+    /** adaptive quality controller, see adaptive.c. The maxima are what
+       the client asked for in its last SetEncodings. */
+    int adaptiveMaxQuality;         /**< 1-100, -1 if JPEG is off */
+    int adaptiveMaxSubsamp;
+    int adaptiveMaxTightCompress;
+    int adaptiveMaxZlibCompress;
+    int adaptiveQuality;
+    int adaptiveCompressReduction;  /**< levels below the maxima */
+    int adaptiveLatency;            /**< smoothed update latency in ms */
+    int adaptiveGoodUpdates;
+    uint64_t adaptiveUpdateStart;   /**< us, see rfbAdaptiveUpdateStart() */
+    uint64_t adaptiveWriteTime;     /**< us spent in writes of this update */
+    uint32_t adaptiveBytes;         /**< bytes written for this update */
+    uint32_t adaptiveBandwidth;     /**< estimated link bandwidth, bytes/s */
+    uint32_t adaptiveChanges;
+
+    /** (1 << encoding) for every rectangle encoding below 32 the client
+       advertised in its last SetEncodings */
+    uint32_t advertisedEncodings;
+
+    /** bands of the update being encoded on the encoder threads, see
+       parallelrects.c */
+    void *parallelRects;
+    /** if set, rfbSendUpdateBuf() appends updateBuf to this instead of
+       writing it to the socket */
+    struct rfbUpdateCapture *updateCapture;
+
+    /** encode times, update latencies and quick access to statEncList for
+       the rectangle encodings, see stats.c */
+    struct rfbStatSlots *statSlots;
+    /** see rfbStats. Protected by updateMutex, like damageSuperseded,
+       which tells that damage was marked while earlier damage was
+       waiting to be sent. */
+    uint64_t droppedUpdates;
+    rfbBool damageSuperseded;
+
+    /** the tiles the client keeps, see tilecache.c. tileCacheClientSize is
+       what it offered in its last SetEncodings, in MiB, and
+       tileCacheReset tells that the tiles it keeps are of no use any more.
+       Both are protected by updateMutex. */
+    struct rfbTileCache *tileCache;
+    uint32_t tileCacheClientSize;
+    rfbBool tileCacheReset;
+    uint64_t tileCacheHits;
+    uint64_t tileCacheMisses;
+    /** lossless refresh, see losslessrefresh.c. lossyRegion is what the
+       client shows only approximately, lossyRecentRegion the part of it
+       sent since lossyTickTime, and lossyStaticRegion the part left alone
+       for a whole tick before. Created with the first JPEG rectangle and
+       protected by updateMutex. */
+    sraRegionPtr lossyRegion;
+    sraRegionPtr lossyRecentRegion;
+    sraRegionPtr lossyStaticRegion;
+    uint32_t lossyTickTime;
+    /** where the client last moved its pointer in the framebuffer, -1 if
+       it did not, and when it last sent a key or pointer event. See
+       focus.c. focusSplitPending is set while the rest of an update cut
+       down to the focus is still to be sent. */
+    int focusX, focusY;
+    uint32_t lastInputTime;
+    rfbBool focusSplitPending;
+    /** scheduling, see schedule.c. scheduleWeight is the client's share of
+       the encoding time relative to the other clients', 1 by default,
+       maxFps and maxBandwidth (bytes/s) cap its updates, 0 for no limit.
+       All three may be set from newClientHook. */
+    int scheduleWeight;
+    int maxFps;
+    int maxBandwidth;
+    /** protected by the screen's scheduleMutex: the client's encoding time
+       in us divided by its weight, when it became due (ms, 0 while it is
+       not), and its token bucket in bytes, last filled at tokenBucketTime
+       (us). */
+    uint64_t scheduleVirtualTime;
+    uint32_t scheduleReadyTime;
+    int64_t tokenBucket;
+    uint64_t tokenBucketTime;
+    /** the update being sent, started at scheduleUpdateStart (us) */
+    uint64_t scheduleUpdateStart;
+    uint64_t scheduleWriteTime;
+    /** memory reclamation, see reclaim.c: the estimate of the memory the
+       client takes and how often its encoder state was freed, reported
+       by rfbGetStats(), the lastUpdateSentTime it was last freed at, and
+       a bit for every Tight zlib stream the client is still to be told
+       to reset. */
+    size_t memoryUsage;
+    uint64_t memoryReclaims;
+    uint32_t reclaimTime;
+    int tightResetStreams;
+    /** Tight subrectangles waiting for the encoder threads */
+    void *tightQueue;
+    /** tile buffers for ZRLE on the encoder threads */
+    void *zrleTileJobs;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    /** protects statEncList, statMsgList, statSlots, the tile cache and
+       memory counters and fenceRTT, which other threads read. See
+       stats.c. */
+    MUTEX(statsMutex);
 #endif
 } rfbClientRec, *rfbClientPtr;
 
@@ -787,7 +1046,9 @@ extern rfbBool webSocketsHasDataInBuffer(rfbClientPtr cl);
 /* rfbserver.c */
 
 /* Routines to iterate over the client list in a thread-safe way.
-   Only a single iterator can be in use at a time process-wide. */
+   Iterators take no lock and see the clients as they were when they were
+   created; a client that is gone in the meantime stays valid, with an
+   invalid socket, until the iterators looking at it are released. */
 typedef struct rfbClientIterator *rfbClientIteratorPtr;
 
 extern void rfbClientListInit(rfbScreenInfoPtr rfbScreen);
@@ -912,6 +1173,7 @@ extern rfbBool rfbSendRectEncodingZlib(rfbClientPtr cl, int x, int y, int w,
 extern int rfbNumCodedRectsTight(rfbClientPtr cl, int x,int y,int w,int h);
 
 extern rfbBool rfbSendRectEncodingTight(rfbClientPtr cl, int x,int y,int w,int h);
+extern rfbBool rfbSendRectEncodingTightLossless(rfbClientPtr cl, int x,int y,int w,int h);
 extern rfbBool rfbSendTightHeader(rfbClientPtr cl, int x, int y, int w, int h);
 extern rfbBool rfbSendCompressedDataTight(rfbClientPtr cl, char *buf, int compressedLen);
 
@@ -1032,6 +1294,10 @@ void rfbDoCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,i
 
 void rfbMarkRectAsModified(rfbScreenInfoPtr rfbScreen,int x1,int y1,int x2,int y2);
 void rfbMarkRegionAsModified(rfbScreenInfoPtr rfbScreen,sraRegionPtr modRegion);
+/* for many small changes: note them, rounded up to tiles, and mark all of
+   them as modified at once when the frame is done */
+void rfbAccumulateModifiedRect(rfbScreenInfoPtr rfbScreen,int x1,int y1,int x2,int y2);
+void rfbCommitModifiedRects(rfbScreenInfoPtr rfbScreen);
 void rfbDoNothingWithClient(rfbClientPtr cl);
 enum rfbNewClientAction defaultNewClientHook(rfbClientPtr cl);
 void rfbRegisterProtocolExtension(rfbProtocolExtension* extension);
@@ -1100,17 +1366,33 @@ extern void rfbStatRecordEncodingSentAdd(rfbClientPtr cl, uint32_t type, int byt
 extern void rfbStatRecordEncodingRcvd(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw);
 extern void rfbStatRecordMessageSent(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw);
 extern void rfbStatRecordMessageRcvd(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw);
+/* Logs and counts a decision of the adaptive quality controller */
+extern void rfbStatRecordAdaptiveChange(rfbClientPtr cl, const char *reason);
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
 
-extern int rfbStatGetSentBytes(rfbClientPtr cl);
-extern int rfbStatGetSentBytesIfRaw(rfbClientPtr cl);
-extern int rfbStatGetRcvdBytes(rfbClientPtr cl);
-extern int rfbStatGetRcvdBytesIfRaw(rfbClientPtr cl);
-extern int rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type);
-extern int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type);
-extern int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type);
-extern int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type);
+extern uint64_t rfbStatGetSentBytes(rfbClientPtr cl);
+extern uint64_t rfbStatGetSentBytesIfRaw(rfbClientPtr cl);
+extern uint64_t rfbStatGetRcvdBytes(rfbClientPtr cl);
+extern uint64_t rfbStatGetRcvdBytesIfRaw(rfbClientPtr cl);
+extern uint64_t rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type);
+extern uint64_t rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type);
+extern uint64_t rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type);
+extern uint64_t rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type);
+/** Adds the time a rectangle of the given encoding took to encode and send
+ * to the statistics, and to the histogram of encode times. */
+extern void rfbStatRecordEncodeTime(rfbClientPtr cl, uint32_t type, uint64_t us);
+/** Records an update that went out ms milliseconds after the first damage
+ * it carries was marked. */
+extern void rfbStatRecordUpdateLatency(rfbClientPtr cl, uint32_t ms);
+/** Fills stats with the totals of the client and the counts, bytes and
+ * encode times of each rectangle encoding it was sent. Any thread may
+ * call it, it takes the client's updateMutex and statsMutex. */
+extern void rfbGetStats(rfbClientPtr cl, rfbStats *stats);
+/** Estimates the memory cl takes, mostly the state and buffers of its
+ * encoders. Call it from the thread sending the client's updates;
+ * rfbGetStats() has the estimate as of the last update. */
+extern size_t rfbClientMemoryUsage(rfbClientPtr cl);
 
 /** Set which version you want to advertise 3.3, 3.6, 3.7 and 3.8 are currently supported*/
 extern void rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_);
@@ -1126,6 +1408,17 @@ extern rfbBool rfbSendTextChatMessage(rfbClientPtr cl, uint32_t length, char *bu
 rfbBool rfbProcessNewConnection(rfbScreenInfoPtr rfbScreen);
 rfbBool rfbUpdateClient(rfbClientPtr cl);
 
+/**
+ * Returns the number of milliseconds the pending framebuffer update of cl
+ * is still held back to coalesce more damage or by the scheduler (see
+ * schedule.c), 0 if it is due now, or -1 if there is no update to send.
+ * Without one, the time until areas sent lossy are due to be refreshed is
+ * returned.
+ */
+int rfbClientTimeToSend(rfbClientPtr cl);
+/** Milliseconds of a monotonic clock, never 0. Wraps around after 49 days. */
+uint32_t rfbGetMonotonicTimeMs(void);
+
 
 #if(defined __cplusplus)
 }
@@ -1183,6 +1476,16 @@ rfbBool rfbUpdateClient(rfbClientPtr cl);
  @endcode
  This tells LibVNCServer to send updates to all connected clients.
 
+ If you draw a lot of small things per frame, call
+ @code
+  rfbAccumulateModifiedRect(screen,x1,y1,x2,y2).
+ @endcode
+ for each of them instead, which is a lot cheaper, and
+ @code
+  rfbCommitModifiedRects(screen).
+ @endcode
+ once the frame is complete.
+
  There exist the following IO functions as members of rfbScreen:
  rfbScreenInfo::kbdAddEvent(), rfbScreenInfo::kbdReleaseAllKeys(), rfbScreenInfo::ptrAddEvent(),
  rfbScreenInfo::setXCutText() and rfbScreenInfo::setXCutTextUTF8()
@@ -219,6 +219,15 @@ typedef rfbBool (*MallocFrameBufferProc)(struct _rfbClient* client);
 typedef void (*GotXCutTextProc)(struct _rfbClient* client, const char *text, int textlen);
 typedef void (*GotXCutTextUTF8Proc)(struct _rfbClient* client, const char* buffer, int buffer_len);
 typedef void (*BellProc)(struct _rfbClient* client);
+/**
+   Callback reporting network statistics, called each time a Fence sent to the
+   server came back. This requires a server supporting the Fence extension.
+   @param client The client which measured the statistics
+   @param rtt The round trip time in milliseconds, including the time the
+   server needed to send everything queued before the fence
+   @param bytesPerSecond The rate data was received at since the previous report
+ */
+typedef void (*GotNetworkStatsProc)(struct _rfbClient* client, int rtt, uint32_t bytesPerSecond);
 /**
     Called when a cursor shape update was received from the server. The decoded cursor shape
     will be in client->rcSource. It's up to the application to do something with this, e.g. draw
@@ -239,6 +248,13 @@ typedef char* (*GetUserProc)(struct _rfbClient* client);
 typedef char* (*GetSASLMechanismProc)(struct _rfbClient* client, char* mechlist);
 #endif /* LIBVNCSERVER_HAVE_SASL */
 
+/** a tile kept for the server's TileCache references */
+typedef struct {
+  int w, h, bitsPerPixel;
+  int size;
+  uint8_t *pixels;
+} rfbTileCacheSlot;
+
 typedef struct _rfbClient {
 	uint8_t* frameBuffer;
 	int width, height;
@@ -489,6 +505,45 @@ typedef struct _rfbClient {
 
         /* flag to indicate wheter updateRect is managed by lib or user */
         rfbBool isUpdateRectManagedByLib;
+
+        /**
+         * Ask servers supporting it to stream updates of updateRect instead of
+         * waiting for a request after each update. TRUE by default, set to FALSE
+         * before rfbInitClient() to request updates one by one.
+         */
+        rfbBool useContinuousUpdates;
+        /** the server announced ContinuousUpdates support */
+        rfbBool continuousUpdatesSupported;
+        /** continuous updates are enabled, no update requests are needed */
+        rfbBool continuousUpdatesActive;
+        /** the server sent a Fence, so it can answer ours */
+        rfbBool fenceSupported;
+        /** one of our Fences is on its way */
+        rfbBool fencePending;
+        /** last and smallest measured round trip time in ms, -1 if unknown */
+        int fenceRTT;
+        int fenceMinRTT;
+        /** number of bytes received from the server so far */
+        uint64_t bytesReceived;
+        uint64_t fenceBytesReceived;
+        uint32_t fenceSentTime;
+        /** Callback reporting the measured round trip time and throughput */
+        GotNetworkStatsProc GotNetworkStats;
+
+        /**
+         * Keep up to this many bytes of tiles the server sent, for it to
+         * draw them again by reference. 16 MiB by default, less than 1 MiB
+         * disables it. The server is offered the largest power of two that
+         * fits, changes take effect with the next SetFormatAndEncodings().
+         */
+        int tileCacheSize;
+        /** the tiles kept, for internal use. Offered to the server was
+            tileCacheOffered bytes at most. */
+        rfbTileCacheSlot *tileCacheSlots;
+        int tileCacheNSlots;
+        uint64_t tileCacheOffered;
+        /** tiles drawn from a reference */
+        uint64_t tileCacheHits;
 } rfbClient;
 
 /* cursor.c */
@@ -556,6 +611,23 @@ extern rfbBool SendIncrementalFramebufferUpdateRequest(rfbClient* client);
 extern rfbBool SendFramebufferUpdateRequest(rfbClient* client,
 					 int x, int y, int w, int h,
 					 rfbBool incremental);
+/**
+ * Enables or disables continuous updates. While enabled, the server sends
+ * updates of the given rectangle whenever it changes, without waiting for
+ * update requests, and SendIncrementalFramebufferUpdateRequest() does nothing.
+ * The library enables continuous updates of updateRect by itself if the server
+ * supports them and useContinuousUpdates is set.
+ * @param client The client through which to send the message
+ * @param enable true to enable, false to disable continuous updates
+ * @param x The horizontal position of the rectangle
+ * @param y The vertical position of the rectangle
+ * @param w The width of the rectangle
+ * @param h The height of the rectangle
+ * @return true if the message was sent successfully or the server does not
+ * support continuous updates, false otherwise
+ */
+extern rfbBool SendEnableContinuousUpdates(rfbClient* client, rfbBool enable,
+					 int x, int y, int w, int h);
 extern rfbBool SendScaleSetting(rfbClient* client,int scaleSetting);
 /**
  * Sends a pointer event to the server. A pointer event includes a cursor
@@ -408,6 +408,8 @@ typedef struct {
 /* Modif sf@2002 */
 #define rfbResizeFrameBuffer 4
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+/* ContinuousUpdates extension */
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -436,6 +438,10 @@ typedef struct {
 /* SetDesktopSize client -> server message */
 #define rfbSetDesktopSize 251
 #define rfbQemuEvent 255
+/* ContinuousUpdates extension */
+#define rfbEnableContinuousUpdates 150
+/* Fence message - bidirectional */
+#define rfbFence 248
 
 
 
@@ -516,6 +522,8 @@ typedef struct {
 #define rfbEncodingLastRect           0xFFFFFF20
 #define rfbEncodingNewFBSize          0xFFFFFF21
 #define rfbEncodingExtDesktopSize     0xFFFFFECC
+#define rfbEncodingFence              0xFFFFFEC8 /* -312 */
+#define rfbEncodingContinuousUpdates  0xFFFFFEC7 /* -313 */
 
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
@@ -536,6 +544,10 @@ typedef struct {
 #define rfbEncodingSupportedMessages  0xFFFE0001
 #define rfbEncodingSupportedEncodings 0xFFFE0002
 #define rfbEncodingServerIdentity     0xFFFE0003
+#define rfbEncodingTileCacheStore     0xFFFE0004
+#define rfbEncodingTileCacheRef       0xFFFE0005
+#define rfbEncodingTileCache0         0xFFFE0010
+#define rfbEncodingTileCache15        0xFFFE001F
 
 
 /*****************************************************************************
@@ -951,6 +963,36 @@ typedef struct {
 #define rfbZRLETileHeight 64
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * TileCache - the client keeps tiles it was sent before, the server sends
+ * a reference instead of the pixels when they are displayed again.
+ *
+ * A client able to keep tiles lists one of rfbEncodingTileCache0 to
+ * rfbEncodingTileCache15 in SetEncodings, for a store of (1 MiB << n). It
+ * has room for that many bytes divided by the size of a tile of
+ * rfbTileCacheTileSize square in its pixel format, in slots numbered from 0.
+ *
+ * The rectangle of both is a row of tiles, each rfbTileCacheTileSize wide
+ * but the last, which may be narrower, and at most rfbTileCacheTileSize
+ * high. It is followed by a slot number for every tile, from left to right.
+ *
+ * TileCacheStore - the client copies what its framebuffer shows in each tile
+ * into its slot.
+ * TileCacheRef - the client draws the contents of each slot, stored for a
+ * tile of the same size, into its tile.
+ *
+ * A slot keeps its contents until the server stores another tile in it.
+ */
+
+typedef struct {
+    uint32_t slot;
+} rfbTileCacheMsg;
+
+#define sz_rfbTileCacheMsg 4
+
+#define rfbTileCacheTileSize 64
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * ZLIBHEX - zlib compressed Hextile Encoding.  Essentially, this is the
  * hextile encoding with zlib compression on the tiles that can not be
@@ -1212,6 +1254,51 @@ typedef struct rfbSetDesktopSizeMsg {
 #define sz_rfbSetDesktopSizeMsg (8)
 
 
+/*-----------------------------------------------------------------------------
+ * Fence - bidirectional synchronisation point
+ *
+ * A Fence with the Request flag set must be answered by echoing it back with
+ * the Request flag cleared and any flags the recipient does not support
+ * removed. BlockBefore: answer only after all preceding messages were
+ * processed. BlockAfter: do not process following messages before the
+ * answer was sent. SyncNext: the next message is processed atomically with
+ * respect to the answer. The payload is opaque and echoed unchanged.
+ *
+ * A side declares support by listing the rfbEncodingFence pseudo-encoding
+ * (client) or by sending a Fence request (server).
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;			/* at most rfbFenceMaxPayload */
+    /* followed by char payload[length] */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg 9
+
+#define rfbFenceFlagBlockBefore 0x00000001
+#define rfbFenceFlagBlockAfter  0x00000002
+#define rfbFenceFlagSyncNext    0x00000004
+#define rfbFenceFlagRequest     0x80000000
+#define rfbFenceFlagsSupported  (rfbFenceFlagBlockBefore|rfbFenceFlagBlockAfter|rfbFenceFlagRequest)
+
+#define rfbFenceMaxPayload 64
+
+
+/*-----------------------------------------------------------------------------
+ * EndOfContinuousUpdates - the server stopped sending continuous updates,
+ * or (sent once) it supports the ContinuousUpdates extension.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEndOfContinuousUpdates */
+} rfbEndOfContinuousUpdatesMsg;
+
+#define sz_rfbEndOfContinuousUpdatesMsg 1
+
+
 /*-----------------------------------------------------------------------------
  * Modif sf@2002
  * ResizeFrameBuffer - The Client must change the size of its framebuffer  
@@ -1267,6 +1354,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbExtDesktopSizeMsg eds;
+	rfbFenceMsg f;
+	rfbEndOfContinuousUpdatesMsg eocu;
 } rfbServerToClientMsg;
 
 
@@ -1465,6 +1554,27 @@ typedef struct {
 
 
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates - with enable set, the server sends updates for
+ * the given area whenever it changes, without waiting for
+ * FramebufferUpdateRequests. Disabling is confirmed by the server with an
+ * EndOfContinuousUpdates message. Only to be sent after the server
+ * announced support with an EndOfContinuousUpdates message.
+ */
+
+typedef struct {
+    uint8_t type;			/* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg 10
+
+
+
 /*-----------------------------------------------------------------------------
  * sf@2002 - Set Server Scale
  * SetServerScale - Server must change the scale of the client buffer.
@@ -1545,6 +1655,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbSetDesktopSizeMsg sdm;
+	rfbFenceMsg f;
+	rfbEnableContinuousUpdatesMsg ecu;
 } rfbClientToServerMsg;
 
 /* 
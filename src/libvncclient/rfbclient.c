@@ -1427,6 +1427,12 @@ SetFormatAndEncodings(rfbClient* client)
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingExtDesktopSize);
 
+  /* Fence and ContinuousUpdates */
+  if (se->nEncodings < MAX_ENCODINGS)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingFence);
+  if (se->nEncodings < MAX_ENCODINGS && client->useContinuousUpdates)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingContinuousUpdates);
+
   /* Last Rect */
   if (se->nEncodings < MAX_ENCODINGS && requestLastRectEncoding)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingLastRect);
@@ -1439,6 +1445,17 @@ SetFormatAndEncodings(rfbClient* client)
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingServerIdentity);
 
+  /* Tile Cache, the largest power of two that fits. What was offered
+     before stays valid until the server notices the change. */
+  if (se->nEncodings < MAX_ENCODINGS && client->tileCacheSize >= (1 << 20)) {
+    int level = 0;
+    while (level < 15 && ((uint64_t)2 << (level + 20)) <= (uint64_t)client->tileCacheSize)
+      level++;
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingTileCache0 + level);
+    if (client->tileCacheOffered < ((uint64_t)1 << (level + 20)))
+      client->tileCacheOffered = (uint64_t)1 << (level + 20);
+  }
+
   /* xvp */
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingXvp);
@@ -1479,6 +1496,10 @@ SetFormatAndEncodings(rfbClient* client)
 rfbBool
 SendIncrementalFramebufferUpdateRequest(rfbClient* client)
 {
+	/* the server keeps sending updates by itself */
+	if (client->continuousUpdatesActive)
+		return TRUE;
+
 	return SendFramebufferUpdateRequest(client,
 			client->updateRect.x, client->updateRect.y,
 			client->updateRect.w, client->updateRect.h, TRUE);
@@ -1515,6 +1536,113 @@ SendFramebufferUpdateRequest(rfbClient* client, int x, int y, int w, int h, rfbB
 }
 
 
+/*
+ * SendEnableContinuousUpdates.
+ */
+
+rfbBool
+SendEnableContinuousUpdates(rfbClient* client, rfbBool enable, int x, int y, int w, int h)
+{
+  rfbEnableContinuousUpdatesMsg ecu;
+
+  if (!client->continuousUpdatesSupported) return TRUE;
+
+  ecu.type = rfbEnableContinuousUpdates;
+  ecu.enable = enable ? 1 : 0;
+  ecu.x = rfbClientSwap16IfLE(x);
+  ecu.y = rfbClientSwap16IfLE(y);
+  ecu.w = rfbClientSwap16IfLE(w);
+  ecu.h = rfbClientSwap16IfLE(h);
+
+  if (!WriteToRFBServer(client, (char *)&ecu, sz_rfbEnableContinuousUpdatesMsg))
+    return FALSE;
+
+  /* disabling takes effect when the server's EndOfContinuousUpdates arrives */
+  if (enable)
+    client->continuousUpdatesActive = TRUE;
+
+  return TRUE;
+}
+
+
+/*
+ * Fence helpers. Our own fences carry the time they were sent at, so the
+ * answer tells the round trip time.
+ */
+
+static uint32_t
+MonotonicTimeMs(void)
+{
+#ifdef WIN32
+  return (uint32_t)GetTickCount();
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint32_t)tv.tv_sec*1000 + tv.tv_usec/1000;
+#endif
+}
+
+static rfbBool
+SendFence(rfbClient* client, uint32_t flags, uint8_t length, const char *data)
+{
+  char buf[sz_rfbFenceMsg + rfbFenceMaxPayload];
+  rfbFenceMsg f;
+
+  memset((char *)&f, 0, sizeof(f));
+  f.type = rfbFence;
+  f.flags = rfbClientSwap32IfLE(flags);
+  f.length = length;
+  memcpy(buf, (char *)&f, sz_rfbFenceMsg);
+  memcpy(buf + sz_rfbFenceMsg, data, length);
+
+  return WriteToRFBServer(client, buf, sz_rfbFenceMsg + length);
+}
+
+static rfbBool
+SendFenceProbe(rfbClient* client)
+{
+  uint32_t now = MonotonicTimeMs();
+
+  if (!client->fenceSupported || client->fencePending)
+    return TRUE;
+
+  /* the throughput is measured from here to the response */
+  client->fenceBytesReceived = client->bytesReceived;
+  client->fencePending = TRUE;
+  client->fenceSentTime = now;
+  return SendFence(client, rfbFenceFlagRequest | rfbFenceFlagBlockBefore,
+                   sizeof(now), (char *)&now);
+}
+
+static void
+HandleFenceResponse(rfbClient* client, const char *payload, int length)
+{
+  uint32_t sent, now = MonotonicTimeMs();
+  uint32_t interval = now - client->fenceSentTime;
+  uint64_t bytes = client->bytesReceived - client->fenceBytesReceived;
+  uint32_t bytesPerSecond;
+
+  if (!client->fencePending || length != sizeof(sent))
+    return;
+  memcpy((char *)&sent, payload, sizeof(sent));
+
+  client->fencePending = FALSE;
+  client->fenceRTT = (int)(now - sent);
+  if (client->fenceMinRTT < 0 || client->fenceRTT < client->fenceMinRTT)
+    client->fenceMinRTT = client->fenceRTT;
+
+  /* throughput over the time since the probe went out */
+  bytesPerSecond = interval ? (uint32_t)(bytes * 1000 / interval) : 0;
+
+  if (client->GotNetworkStats)
+    client->GotNetworkStats(client, client->fenceRTT, bytesPerSecond);
+}
+
+
 /*
  * SendScaleSetting.
  */
@@ -1689,6 +1817,11 @@ ResizeClientBuffer(rfbClient* client, int width, int height)
       client->updateRect.x = client->updateRect.y = 0;
       client->updateRect.w = client->width;
       client->updateRect.h = client->height;
+      if (client->continuousUpdatesActive &&
+          !SendEnableContinuousUpdates(client, TRUE,
+                                       client->updateRect.x, client->updateRect.y,
+                                       client->updateRect.w, client->updateRect.h))
+          return FALSE;
   }
   return client->MallocFrameBuffer(client);
 }
@@ -2037,6 +2170,94 @@ void rfbClientGetUpdateRect(rfbClient *client, rfbRectangle *rect, rfbBool *isMa
     *isManagedByLib = client->isUpdateRectManagedByLib;
 }
 
+/*
+ * TileCache: keep a tile of the framebuffer in a slot, and draw it again.
+ */
+
+static rfbTileCacheSlot *
+GetTileCacheSlot(rfbClient* client, uint32_t slot, int w, int h)
+{
+  int bytesPerPixel = client->format.bitsPerPixel / 8;
+  uint64_t nSlots = client->tileCacheOffered /
+    (rfbTileCacheTileSize * rfbTileCacheTileSize * bytesPerPixel);
+  rfbTileCacheSlot *slots;
+
+  if (w <= 0 || h <= 0 || w > rfbTileCacheTileSize || h > rfbTileCacheTileSize ||
+      slot >= nSlots) {
+    rfbClientLog("Invalid tile cache slot %u for %dx%d\n", slot, w, h);
+    return NULL;
+  }
+  if (slot >= (uint32_t)client->tileCacheNSlots) {
+    slots = realloc(client->tileCacheSlots, (slot + 1) * sizeof(rfbTileCacheSlot));
+    if (!slots)
+      return NULL;
+    memset(slots + client->tileCacheNSlots, 0,
+           (slot + 1 - client->tileCacheNSlots) * sizeof(rfbTileCacheSlot));
+    client->tileCacheSlots = slots;
+    client->tileCacheNSlots = slot + 1;
+  }
+  return &client->tileCacheSlots[slot];
+}
+
+/* the rectangle is a row of tiles, each followed by its slot */
+static rfbBool
+HandleTileCacheStore(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  rfbTileCacheMsg tc;
+  rfbTileCacheSlot *slot;
+  int bytesPerPixel = client->format.bitsPerPixel / 8, stride = client->width * bytesPerPixel;
+  int x, w, j, rowBytes;
+  uint8_t *pixels;
+
+  if (rx + rw > client->width || ry + rh > client->height)
+    return FALSE;
+  for (x = rx; x < rx + rw; x += w) {
+    w = rx + rw - x < rfbTileCacheTileSize ? rx + rw - x : rfbTileCacheTileSize;
+    rowBytes = w * bytesPerPixel;
+    if (!ReadFromRFBServer(client, (char *)&tc, sz_rfbTileCacheMsg) ||
+        !(slot = GetTileCacheSlot(client, rfbClientSwap32IfLE(tc.slot), w, rh)))
+      return FALSE;
+
+    if (slot->size < rowBytes * rh) {
+      if (!(pixels = realloc(slot->pixels, rowBytes * rh)))
+        return FALSE;
+      slot->pixels = pixels;
+      slot->size = rowBytes * rh;
+    }
+    for (j = 0; j < rh; j++)
+      memcpy(slot->pixels + j * rowBytes,
+             client->frameBuffer + (ry + j) * stride + x * bytesPerPixel, rowBytes);
+    slot->w = w;
+    slot->h = rh;
+    slot->bitsPerPixel = client->format.bitsPerPixel;
+  }
+  return TRUE;
+}
+
+static rfbBool
+HandleTileCacheRef(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  rfbTileCacheMsg tc;
+  rfbTileCacheSlot *slot;
+  int x, w;
+
+  for (x = rx; x < rx + rw; x += w) {
+    w = rx + rw - x < rfbTileCacheTileSize ? rx + rw - x : rfbTileCacheTileSize;
+    if (!ReadFromRFBServer(client, (char *)&tc, sz_rfbTileCacheMsg) ||
+        !(slot = GetTileCacheSlot(client, rfbClientSwap32IfLE(tc.slot), w, rh)))
+      return FALSE;
+    if (slot->w != w || slot->h != rh ||
+        slot->bitsPerPixel != client->format.bitsPerPixel) {
+      rfbClientLog("Tile cache slot %u does not hold a %dx%d tile\n",
+                   rfbClientSwap32IfLE(tc.slot), w, rh);
+      return FALSE;
+    }
+    client->GotBitmap(client, slot->pixels, x, ry, w, rh);
+    client->tileCacheHits++;
+  }
+  return TRUE;
+}
+
 /*
  * HandleRFBServerMessage.
  */
@@ -2238,6 +2459,13 @@ HandleRFBServerMessage(rfbClient* client)
           continue;
       }
 
+      /* nothing changes on screen */
+      if (rect.encoding == rfbEncodingTileCacheStore) {
+          if (!HandleTileCacheStore(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+              return FALSE;
+          continue;
+      }
+
       /* rfbEncodingUltraZip is a collection of subrects.   x = # of subrects, and h is always 0 */
       if (rect.encoding != rfbEncodingUltraZip)
       {
@@ -2538,6 +2766,11 @@ HandleRFBServerMessage(rfbClient* client)
         SetClient2Server(client, rfbQemuEvent);
         break;
 
+      case rfbEncodingTileCacheRef:
+        if (!HandleTileCacheRef(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+          return FALSE;
+        break;
+
       default:
 	 {
 	   rfbBool handled = FALSE;
@@ -2564,12 +2797,66 @@ HandleRFBServerMessage(rfbClient* client)
     if (!SendIncrementalFramebufferUpdateRequest(client))
       return FALSE;
 
+    if (!SendFenceProbe(client))
+      return FALSE;
+
     if (client->FinishedFrameBufferUpdate)
       client->FinishedFrameBufferUpdate(client);
 
     break;
   }
 
+  case rfbEndOfContinuousUpdates:
+  {
+    if (!client->continuousUpdatesSupported) {
+      /* the first one announces support */
+      client->continuousUpdatesSupported = TRUE;
+      if (client->useContinuousUpdates) {
+        rfbClientLog("Enabling continuous updates\n");
+        if (!SendEnableContinuousUpdates(client, TRUE,
+                                         client->updateRect.x, client->updateRect.y,
+                                         client->updateRect.w, client->updateRect.h))
+          return FALSE;
+      }
+    } else if (client->continuousUpdatesActive) {
+      /* back to requesting updates one by one */
+      client->continuousUpdatesActive = FALSE;
+      if (!SendIncrementalFramebufferUpdateRequest(client))
+        return FALSE;
+    }
+    break;
+  }
+
+  case rfbFence:
+  {
+    char payload[rfbFenceMaxPayload];
+    uint32_t flags;
+
+    if (!ReadFromRFBServer(client, ((char *)&msg) + 1, sz_rfbFenceMsg - 1))
+      return FALSE;
+    if (msg.f.length > rfbFenceMaxPayload) {
+      rfbClientLog("Fence payload too large (%d bytes)\n", msg.f.length);
+      return FALSE;
+    }
+    if (msg.f.length > 0 && !ReadFromRFBServer(client, payload, msg.f.length))
+      return FALSE;
+
+    flags = rfbClientSwap32IfLE(msg.f.flags);
+
+    if (flags & rfbFenceFlagRequest) {
+      /* a server sending fences understands ours */
+      client->fenceSupported = TRUE;
+      /* messages are handled in order, so BlockBefore and BlockAfter hold;
+         SyncNext is not supported */
+      if (!SendFence(client, flags & rfbFenceFlagsSupported & ~rfbFenceFlagRequest,
+                     msg.f.length, payload))
+        return FALSE;
+    } else {
+      HandleFenceResponse(client, payload, msg.f.length);
+    }
+    break;
+  }
+
   case rfbBell:
   {
     client->Bell(client);
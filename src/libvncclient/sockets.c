@@ -176,6 +176,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	}
       }
       client->buffered += i;
+      client->bytesReceived += i;
     }
 
     memcpy(out, client->bufoutptr, n);
@@ -226,6 +227,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
       }
       out += i;
       n -= i;
+      client->bytesReceived += i;
     }
   }
 
@@ -366,6 +366,12 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   client->screen.width = 0;
   client->screen.height = 0;
 
+  client->useContinuousUpdates = TRUE;
+  client->fenceRTT = -1;
+  client->fenceMinRTT = -1;
+
+  client->tileCacheSize = 16 << 20;
+
   return client;
 }
 
@@ -513,9 +519,9 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
 }
 
 void rfbClientCleanup(rfbClient* client) {
-#ifdef LIBVNCSERVER_HAVE_LIBZ
   int i;
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
   for ( i = 0; i < 4; i++ ) {
     if (client->zlibStreamActive[i] == TRUE ) {
       if (inflateEnd (&client->zlibStream[i]) != Z_OK &&
@@ -541,6 +547,10 @@ void rfbClientCleanup(rfbClient* client) {
   free(client->ultra_buffer);
   free(client->raw_buffer);
 
+  for (i = 0; i < client->tileCacheNSlots; i++)
+    free(client->tileCacheSlots[i].pixels);
+  free(client->tileCacheSlots);
+
   FreeTLS(client);
 
   while (client->clientData) {
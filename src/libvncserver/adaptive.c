@@ -0,0 +1,233 @@
+/*
+ * adaptive.c - adapt image quality and compression to each client's link.
+ *
+ * Every framebuffer update is timed from the start of encoding to the end
+ * of the last write. The time spent blocked in writes tells how much of an
+ * update was spent waiting for the link and gives a bandwidth estimate,
+ * the fence round trip (if the client supports fences) covers the part of
+ * the latency that is not visible from the socket.
+ *
+ * When the smoothed latency exceeds the screen's adaptiveTargetLatency the
+ * controller steps down: a saturated link gets lower JPEG quality and more
+ * chroma subsampling, a busy encoder gets a cheaper zlib level. When there
+ * is plenty of headroom it steps back up. The values the client asked for
+ * in SetEncodings are never exceeded.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+/* quality step per decision, on the 1-100 scale */
+#define ADAPTIVE_QUALITY_STEP 10
+/* consecutive updates needed before stepping down or up */
+#define ADAPTIVE_BAD_UPDATES 2
+#define ADAPTIVE_GOOD_UPDATES 8
+
+/* turboSubsampLevel values, ordered by how much chroma they drop */
+#define SUBSAMP_1X 0
+#define SUBSAMP_4X 1
+#define SUBSAMP_2X 2
+
+static int subsampRank(int level)
+{
+    switch (level) {
+    case SUBSAMP_1X: return 0;
+    case SUBSAMP_2X: return 1;
+    case SUBSAMP_4X: return 2;
+    }
+    return 3; /* grayscale and friends, never touched */
+}
+
+static int maxCompressLevel(rfbClientPtr cl)
+{
+    int level = 0;
+
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    if (cl->adaptiveMaxTightCompress > level)
+        level = cl->adaptiveMaxTightCompress;
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (cl->adaptiveMaxZlibCompress > level)
+        level = cl->adaptiveMaxZlibCompress;
+#endif
+    return level;
+}
+
+static int reducedLevel(int max, int reduction)
+{
+    if (reduction <= 0 || max <= 1)
+        return max;
+    return max - reduction < 1 ? 1 : max - reduction;
+}
+
+/*
+ * Write the controller state into the per-client encoder settings.
+ */
+
+static void rfbAdaptiveApply(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    if (cl->adaptiveMaxQuality != -1) {
+        int q = cl->adaptiveQuality, want;
+
+        cl->turboQualityLevel = q;
+        if (cl->tightQualityLevel != -1)
+            cl->tightQualityLevel = q / 10 > 9 ? 9 : q / 10;
+
+        want = q >= 80 ? SUBSAMP_1X : q >= 50 ? SUBSAMP_2X : SUBSAMP_4X;
+        if (subsampRank(cl->adaptiveMaxSubsamp) >= subsampRank(want))
+            cl->turboSubsampLevel = cl->adaptiveMaxSubsamp;
+        else
+            cl->turboSubsampLevel = want;
+    }
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    cl->tightCompressLevel = reducedLevel(cl->adaptiveMaxTightCompress,
+                                          cl->adaptiveCompressReduction);
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    cl->zlibCompressLevel = reducedLevel(cl->adaptiveMaxZlibCompress,
+                                         cl->adaptiveCompressReduction);
+#endif
+}
+
+/*
+ * Called after a SetEncodings message: whatever the client asked for
+ * becomes the upper bound of the controller.
+ */
+
+void rfbAdaptiveReset(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    cl->adaptiveMaxQuality = cl->turboQualityLevel;
+    cl->adaptiveMaxSubsamp = cl->turboSubsampLevel;
+#else
+    cl->adaptiveMaxQuality = -1;
+    cl->adaptiveMaxSubsamp = 0;
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+    cl->adaptiveMaxTightCompress = cl->tightCompressLevel;
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    cl->adaptiveMaxZlibCompress = cl->zlibCompressLevel;
+#endif
+    cl->adaptiveQuality = cl->adaptiveMaxQuality;
+    cl->adaptiveCompressReduction = 0;
+    cl->adaptiveGoodUpdates = 0;
+}
+
+void rfbAdaptiveUpdateStart(rfbClientPtr cl)
+{
+    if (!cl->screen->adaptiveQuality)
+        return;
+    cl->adaptiveUpdateStart = rfbGetMonotonicTimeUs();
+    cl->adaptiveWriteTime = 0;
+    cl->adaptiveBytes = 0;
+}
+
+/*
+ * Called once the whole update has been written.
+ */
+
+void rfbAdaptiveUpdateDone(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr s = cl->screen;
+    uint64_t total, encode;
+    int sample, target, minQuality;
+    rfbBool linkBound, changed = FALSE;
+    const char *reason = NULL;
+
+    if (!s->adaptiveQuality || cl->adaptiveUpdateStart == 0)
+        return;
+
+    total = rfbGetMonotonicTimeUs() - cl->adaptiveUpdateStart;
+    cl->adaptiveUpdateStart = 0;
+    encode = total > cl->adaptiveWriteTime ? total - cl->adaptiveWriteTime : 0;
+    linkBound = cl->adaptiveWriteTime > encode;
+
+    /* only blocking writes say anything about the link's capacity */
+    if (cl->adaptiveWriteTime >= 1000 && cl->adaptiveBytes > 0) {
+        uint32_t bw = (uint32_t)((uint64_t)cl->adaptiveBytes * 1000000
+                                 / cl->adaptiveWriteTime);
+        cl->adaptiveBandwidth = cl->adaptiveBandwidth == 0 ? bw :
+            (uint32_t)(((uint64_t)cl->adaptiveBandwidth * 3 + bw) / 4);
+    }
+
+    sample = (int)(total / 1000);
+    if (cl->fenceRTT > sample)
+        sample = cl->fenceRTT;
+    cl->adaptiveLatency = cl->adaptiveLatency == 0 ? sample :
+        (cl->adaptiveLatency * 3 + sample) / 4;
+
+    target = s->adaptiveTargetLatency > 0 ? s->adaptiveTargetLatency : 100;
+    minQuality = s->adaptiveMinQuality > 0 ? s->adaptiveMinQuality : 1;
+    if (cl->adaptiveMaxQuality != -1 && minQuality > cl->adaptiveMaxQuality)
+        minQuality = cl->adaptiveMaxQuality;
+
+    if (cl->adaptiveLatency > target) {
+        if (cl->adaptiveGoodUpdates > 0)
+            cl->adaptiveGoodUpdates = 0;
+        if (--cl->adaptiveGoodUpdates > -ADAPTIVE_BAD_UPDATES)
+            return;
+        cl->adaptiveGoodUpdates = 0;
+
+        if (linkBound && cl->adaptiveCompressReduction > 0) {
+            cl->adaptiveCompressReduction--;
+            reason = "link saturated, more compression";
+        } else if (!linkBound &&
+                   maxCompressLevel(cl) - cl->adaptiveCompressReduction > 1) {
+            cl->adaptiveCompressReduction++;
+            reason = "encoder busy, less compression";
+        } else if (cl->adaptiveMaxQuality != -1 &&
+                   cl->adaptiveQuality > minQuality) {
+            cl->adaptiveQuality -= ADAPTIVE_QUALITY_STEP;
+            if (cl->adaptiveQuality < minQuality)
+                cl->adaptiveQuality = minQuality;
+            reason = linkBound ? "link saturated, lower quality" :
+                                 "encoder busy, lower quality";
+        }
+        changed = reason != NULL;
+    } else if (cl->adaptiveLatency <= target / 2) {
+        if (cl->adaptiveGoodUpdates < 0)
+            cl->adaptiveGoodUpdates = 0;
+        if (++cl->adaptiveGoodUpdates < ADAPTIVE_GOOD_UPDATES)
+            return;
+        cl->adaptiveGoodUpdates = 0;
+
+        if (cl->adaptiveMaxQuality != -1 &&
+            cl->adaptiveQuality < cl->adaptiveMaxQuality) {
+            cl->adaptiveQuality += ADAPTIVE_QUALITY_STEP;
+            if (cl->adaptiveQuality > cl->adaptiveMaxQuality)
+                cl->adaptiveQuality = cl->adaptiveMaxQuality;
+            reason = "headroom, raise quality";
+        } else if (cl->adaptiveCompressReduction > 0) {
+            cl->adaptiveCompressReduction--;
+            reason = "headroom, more compression";
+        }
+        changed = reason != NULL;
+    } else {
+        cl->adaptiveGoodUpdates = 0;
+    }
+
+    if (changed) {
+        rfbAdaptiveApply(cl);
+        rfbStatRecordAdaptiveChange(cl, reason);
+    }
+}
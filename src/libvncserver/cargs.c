@@ -36,6 +36,28 @@ rfbUsage(void)
                                                              "(default 40)\n");
     fprintf(stderr, "-deferptrupdate time   time in ms to defer pointer updates"
                                                            " (default none)\n");
+    fprintf(stderr, "-adaptive latency      adapt quality and compression to each client's\n"
+                    "                       link, aiming at latency ms per update\n");
+    fprintf(stderr, "-contentaware          choose Tight or ZRLE per rectangle by its content\n"
+                    "                       for clients preferring a compressing encoding\n");
+    fprintf(stderr, "-encoderthreads n      use n extra threads to encode large updates\n");
+    fprintf(stderr, "-parallelrects         also encode Raw, RRE, CoRRE, Hextile and Ultra\n"
+                    "                       updates on the encoder threads\n");
+    fprintf(stderr, "-tilecache mbytes      let clients keep up to mbytes of sent tiles\n"
+                    "                       (default 16, 0 to disable)\n");
+    fprintf(stderr, "-losslessrefresh ms    send areas shown as JPEG again losslessly\n"
+                    "                       once left alone for ms, 1000 is a good\n"
+                    "                       start (default 0, disabled)\n");
+    fprintf(stderr, "-focussize pixels      send the square this big around the pointer\n"
+                    "                       of each client ahead of the rest of an update\n");
+    fprintf(stderr, "-focussplit            send it as an update of its own while the\n"
+                    "                       client is interacting\n");
+    fprintf(stderr, "-fairschedule          share the encoding time fairly among clients,\n"
+                    "                       preferring those sending input\n");
+    fprintf(stderr, "-maxfps n              send each client at most n updates per second\n");
+    fprintf(stderr, "-maxbandwidth kbytes   send each client at most kbytes per second\n");
+    fprintf(stderr, "-reclaimidle ms        free the encoder state of clients sent no\n"
+                    "                       update for ms (default 30000, 0 to disable)\n");
     fprintf(stderr, "-desktop name          VNC desktop name (default \"LibVNCServer\")\n");
     fprintf(stderr, "-alwaysshared          always treat new clients as shared\n");
     fprintf(stderr, "-nevershared           never treat new clients as shared\n");
@@ -53,6 +75,8 @@ rfbUsage(void)
     fprintf(stderr, "-httpportv6 portnum    use portnum for IPv6 http connection\n");
 #endif
     fprintf(stderr, "-enablehttpproxy       enable http proxy support\n");
+    fprintf(stderr, "-httpmetrics           serve counters at /metrics of the http server\n");
+    fprintf(stderr, "-httpmetricsperclient  label them by client address and socket\n");
     fprintf(stderr, "-progressive height    enable progressive updating for slow links\n");
     fprintf(stderr, "-listen ipaddr         listen for connections only on network interface with\n");
     fprintf(stderr, "                       addr ipaddr. '-listen localhost' and hostname work too.\n");
@@ -146,6 +170,63 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->deferPtrUpdateTime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-adaptive") == 0) {  /* -adaptive milliseconds */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->adaptiveQuality = TRUE;
+            rfbScreen->adaptiveTargetLatency = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-contentaware") == 0) {
+            rfbScreen->contentAwareEncoding = TRUE;
+        } else if (strcmp(argv[i], "-encoderthreads") == 0) {  /* -encoderthreads n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->encoderThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-tilecache") == 0) {  /* -tilecache mbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->tileCacheSize = atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "-losslessrefresh") == 0) {  /* -losslessrefresh ms */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->losslessRefreshDelay = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-focussize") == 0) {  /* -focussize pixels */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->focusSize = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-focussplit") == 0) {
+            rfbScreen->focusSplit = TRUE;
+        } else if (strcmp(argv[i], "-fairschedule") == 0) {
+            rfbScreen->fairScheduling = TRUE;
+        } else if (strcmp(argv[i], "-maxfps") == 0) {  /* -maxfps n */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->maxFps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-maxbandwidth") == 0) {  /* -maxbandwidth kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->maxBandwidth = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-reclaimidle") == 0) {  /* -reclaimidle ms */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->reclaimIdleTime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-parallelrects") == 0) {
+            rfbScreen->parallelRectEncoding = TRUE;
         } else if (strcmp(argv[i], "-desktop") == 0) {  /* -desktop desktop-name */
             if (i + 1 >= *argc) {
 		rfbUsage();
@@ -180,6 +261,10 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 #endif
         } else if (strcmp(argv[i], "-enablehttpproxy") == 0) {
             rfbScreen->httpEnableProxyConnect = TRUE;
+        } else if (strcmp(argv[i], "-httpmetrics") == 0) {
+            rfbScreen->httpMetrics = TRUE;
+        } else if (strcmp(argv[i], "-httpmetricsperclient") == 0) {
+            rfbScreen->httpMetricsPerClient = TRUE;
         } else if (strcmp(argv[i], "-progressive") == 0) {  /* -httpport portnum */
             if (i + 1 >= *argc) {
 		rfbUsage();
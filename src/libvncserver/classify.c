@@ -0,0 +1,128 @@
+/*
+ * classify.c - guess what kind of content a rectangle holds, so that
+ * rfbSendFramebufferUpdate() can pick an encoding per rectangle.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+/* rectangles smaller than this are not worth looking at */
+#define CLASSIFY_MIN_PIXELS 256
+/* at most this many pixels are sampled per rectangle */
+#define CLASSIFY_MAX_SAMPLES 1024
+/* colour hash, must be a power of two larger than the counting limit */
+#define CLASSIFY_HASH_SIZE 256
+#define CLASSIFY_MAX_COLOURS 128
+/* distinct colours up to which a rectangle counts as palette */
+#define CLASSIFY_PALETTE_COLOURS 16
+/* distinct colours from which a rectangle may be a photo */
+#define CLASSIFY_PHOTO_COLOURS 64
+/* neighbour difference (sum over 8-bit channels) that still is a gradient */
+#define CLASSIFY_SMOOTH_DELTA 48
+
+static uint32_t getPixel(const char *p, int bpp)
+{
+    switch (bpp) {
+    case 8:  return *(const uint8_t *)p;
+    case 16: return *(const uint16_t *)p;
+    }
+    return *(const uint32_t *)p;
+}
+
+static int channelDelta(uint32_t a, uint32_t b, int shift, int max)
+{
+    int d;
+
+    if (max == 0)
+        return 0;
+    d = (int)((a >> shift) & max) - (int)((b >> shift) & max);
+    if (d < 0)
+        d = -d;
+    return d * 255 / max;
+}
+
+/*
+ * Sample the rectangle on a regular grid, count its distinct colours and
+ * look at how neighbouring pixels differ. Photos have many colours with
+ * small steps between them, text and UI elements have few colours with
+ * flat areas and sharp edges.
+ */
+
+int rfbClassifyRect(rfbScreenInfoPtr screen, int x, int y, int w, int h)
+{
+    rfbPixelFormat *fmt = &screen->serverFormat;
+    int bpp = fmt->bitsPerPixel, bytesPerPixel = bpp / 8;
+    uint32_t colours[CLASSIFY_HASH_SIZE];
+    char used[CLASSIFY_HASH_SIZE];
+    int nColours = 0, flat = 0, smooth = 0, sharp = 0;
+    int step = 1, i, j;
+
+    if (w * h < CLASSIFY_MIN_PIXELS || screen->frameBuffer == NULL)
+        return RFB_RECT_UNKNOWN;
+
+    while ((w / step) * (h / step) > CLASSIFY_MAX_SAMPLES)
+        step++;
+
+    memset(used, 0, sizeof(used));
+
+    for (j = y; j < y + h; j += step) {
+        const char *row = screen->frameBuffer + j * screen->paddedWidthInBytes;
+        for (i = x; i < x + w; i += step) {
+            uint32_t pix = getPixel(row + i * bytesPerPixel, bpp);
+
+            if (nColours <= CLASSIFY_MAX_COLOURS) {
+                unsigned int k = (pix * 2654435761U) >> 24;
+                while (used[k] && colours[k] != pix)
+                    k = (k + 1) & (CLASSIFY_HASH_SIZE - 1);
+                if (!used[k]) {
+                    used[k] = 1;
+                    colours[k] = pix;
+                    nColours++;
+                }
+            }
+
+            if (i + 1 < x + w) {
+                uint32_t next = getPixel(row + (i + 1) * bytesPerPixel, bpp);
+                int d;
+
+                if (next == pix) {
+                    flat++;
+                    continue;
+                }
+                d = channelDelta(pix, next, fmt->redShift, fmt->redMax) +
+                    channelDelta(pix, next, fmt->greenShift, fmt->greenMax) +
+                    channelDelta(pix, next, fmt->blueShift, fmt->blueMax);
+                if (d <= CLASSIFY_SMOOTH_DELTA)
+                    smooth++;
+                else
+                    sharp++;
+            }
+        }
+    }
+
+    if (nColours == 1)
+        return RFB_RECT_SOLID;
+    if (nColours <= CLASSIFY_PALETTE_COLOURS)
+        return RFB_RECT_PALETTE;
+    if (nColours >= CLASSIFY_PHOTO_COLOURS && smooth > sharp &&
+        smooth * 4 >= flat + smooth + sharp)
+        return RFB_RECT_PHOTO;
+    return RFB_RECT_TEXT;
+}
@@ -318,7 +318,7 @@ getBgColour(char *data, int size, int bpp)
 
 #define NUMCLRS 256
   
-  static int counts[NUMCLRS];
+  int counts[NUMCLRS];
   int i,j,k;
 
   int maxcount = 0;
@@ -0,0 +1,517 @@
+/*
+ * damage.c - the damage journal of a screen.
+ *
+ * Damage is not handed to every client when it is marked. It is stamped
+ * into a grid of tiles instead, each tile remembering the generation in
+ * which it was damaged last, and the clients catch up on it when they
+ * build their next update: every tile stamped since the client's own
+ * generation is added to its modifiedRegion, and a new generation is
+ * started. Marking costs the same however many clients are connected,
+ * and the clients get the damage rounded up to whole tiles.
+ *
+ * The output threads of clients without anything to send put themselves
+ * on a list of sleepers, and marking damage wakes only those, taking them
+ * off the list.
+ *
+ * Applications drawing many small things can note them with
+ * rfbAccumulateModifiedRect(), which only sets the bits of the tiles in a
+ * bitmap, and mark all of them as modified with rfbCommitModifiedRects()
+ * once the frame is done.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+/* the time of the first damage is kept for this many generations; clients
+   further behind take the oldest one known */
+#define DAMAGE_GENERATIONS 64
+
+/* sleepers are taken off the list this many at a time to be woken */
+#define WAKE_BATCH 16
+
+struct rfbDamageJournal {
+    MUTEX(mutex);
+    /* 64 bits wide, so that the stamps never wrap around and a tile left
+       alone for long never looks freshly damaged */
+    uint64_t generation;        /* stamped onto the tiles damaged now */
+    int tilesX, tilesY;
+    uint64_t *tiles;            /* generation each tile was damaged last */
+    uint64_t *rows;             /* latest generation of each row of tiles */
+    /* time of the first damage in each of the last generations, 0 if
+       there was none */
+    uint32_t firstDamage[DAMAGE_GENERATIONS];
+    uint32_t lastDamage;
+    /* output threads waiting for damage, in the order they went to
+       sleep */
+    rfbClientPtr sleepers, lastSleeper;
+    int sleeperCount;
+    /* a bit per tile noted by rfbAccumulateModifiedRect(), rows starting
+       at whole words */
+    uint32_t *accumulated;
+    int wordsPerRow;
+    rfbBool anyAccumulated;
+};
+
+#define STAMPED_SINCE(stamp, generation) ((stamp) >= (generation))
+
+static void
+freeTiles(struct rfbDamageJournal *journal)
+{
+    free(journal->tiles);
+    free(journal->rows);
+    free(journal->accumulated);
+    journal->tiles = journal->rows = NULL;
+    journal->accumulated = NULL;
+    journal->tilesX = journal->tilesY = journal->wordsPerRow = 0;
+}
+
+static rfbBool
+allocateTiles(struct rfbDamageJournal *journal, int width, int height)
+{
+    journal->tilesX = (width + RFB_DAMAGE_TILE - 1) / RFB_DAMAGE_TILE;
+    journal->tilesY = (height + RFB_DAMAGE_TILE - 1) / RFB_DAMAGE_TILE;
+    journal->tiles = (uint64_t *)calloc((size_t)journal->tilesX *
+                                        journal->tilesY, sizeof(uint64_t));
+    journal->rows = (uint64_t *)calloc(journal->tilesY, sizeof(uint64_t));
+    journal->wordsPerRow = (journal->tilesX + 31) / 32;
+    journal->accumulated = (uint32_t *)calloc((size_t)journal->wordsPerRow *
+                                              journal->tilesY, sizeof(uint32_t));
+    journal->anyAccumulated = FALSE;
+    if (journal->tiles && journal->rows && journal->accumulated)
+        return TRUE;
+
+    freeTiles(journal);
+    return FALSE;
+}
+
+void rfbDamageJournalInit(rfbScreenInfoPtr screen)
+{
+    struct rfbDamageJournal *journal;
+
+    journal = (struct rfbDamageJournal *)calloc(1, sizeof(*journal));
+    if (!journal || !allocateTiles(journal, screen->width, screen->height)) {
+        rfbErr("rfbDamageJournalInit: out of memory\n");
+        free(journal);
+        return;
+    }
+    /* the tiles start out stamped 0, before any client's generation */
+    journal->generation = 1;
+    INIT_MUTEX(journal->mutex);
+    screen->damageJournal = journal;
+}
+
+void rfbDamageJournalFree(rfbScreenInfoPtr screen)
+{
+    struct rfbDamageJournal *journal = screen->damageJournal;
+
+    if (!journal)
+        return;
+    TINI_MUTEX(journal->mutex);
+    freeTiles(journal);
+    free(journal);
+    screen->damageJournal = NULL;
+}
+
+/* the old damage is dropped, the clients are sent everything anyway */
+void rfbDamageJournalResize(rfbScreenInfoPtr screen)
+{
+    struct rfbDamageJournal *journal = screen->damageJournal;
+
+    if (!journal)
+        return;
+    LOCK(journal->mutex);
+    freeTiles(journal);
+    if (!allocateTiles(journal, screen->width, screen->height))
+        rfbErr("rfbDamageJournalResize: out of memory\n");
+    UNLOCK(journal->mutex);
+}
+
+uint64_t rfbDamageJournalGeneration(rfbScreenInfoPtr screen)
+{
+    struct rfbDamageJournal *journal = screen->damageJournal;
+    uint64_t generation = 0;
+
+    if (journal) {
+        LOCK(journal->mutex);
+        generation = journal->generation;
+        UNLOCK(journal->mutex);
+    }
+    return generation;
+}
+
+/* call with the journal mutex held */
+static void
+stampRect(struct rfbDamageJournal *journal, int x1, int y1, int x2, int y2)
+{
+    int tx, ty, tx1, tx2, ty1, ty2;
+    uint64_t *tile;
+
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x1 >= x2 || y1 >= y2)
+        return;
+    tx1 = x1 / RFB_DAMAGE_TILE;
+    ty1 = y1 / RFB_DAMAGE_TILE;
+    tx2 = (x2 + RFB_DAMAGE_TILE - 1) / RFB_DAMAGE_TILE;
+    ty2 = (y2 + RFB_DAMAGE_TILE - 1) / RFB_DAMAGE_TILE;
+    if (tx2 > journal->tilesX) tx2 = journal->tilesX;
+    if (ty2 > journal->tilesY) ty2 = journal->tilesY;
+
+    for (ty = ty1; ty < ty2; ty++) {
+        journal->rows[ty] = journal->generation;
+        tile = journal->tiles + ty * journal->tilesX;
+        for (tx = tx1; tx < tx2; tx++)
+            tile[tx] = journal->generation;
+    }
+}
+
+/* call with the journal mutex held */
+static void
+removeSleeper(struct rfbDamageJournal *journal, rfbClientPtr cl)
+{
+    if (cl->prevSleeper)
+        cl->prevSleeper->nextSleeper = cl->nextSleeper;
+    else
+        journal->sleepers = cl->nextSleeper;
+    if (cl->nextSleeper)
+        cl->nextSleeper->prevSleeper = cl->prevSleeper;
+    else
+        journal->lastSleeper = cl->prevSleeper;
+    cl->prevSleeper = cl->nextSleeper = NULL;
+    cl->waitingForDamage = FALSE;
+    journal->sleeperCount--;
+}
+
+/* takes up to max sleepers off the list, holding a reference to each so
+   that they can be woken once the journal mutex is released; call with
+   it held */
+static int
+takeSleepers(struct rfbDamageJournal *journal, rfbClientPtr *woken, int max)
+{
+    int n = 0;
+
+    while (n < max && journal->sleepers) {
+        woken[n] = journal->sleepers;
+        removeSleeper(journal, woken[n]);
+        rfbIncrClientRef(woken[n]);
+        n++;
+    }
+    return n;
+}
+
+/* the output thread may not be waiting yet, but it holds updateMutex
+   until it is */
+static void
+wakeSleepers(rfbClientPtr *woken, int n)
+{
+    int k;
+
+    for (k = 0; k < n; k++) {
+        LOCK(woken[k]->updateMutex);
+        TSIGNAL(woken[k]->updateCond);
+        UNLOCK(woken[k]->updateMutex);
+        rfbDecrClientRef(woken[k]);
+    }
+}
+
+void rfbDamageJournalAdd(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    struct rfbDamageJournal *journal = screen->damageJournal;
+    sraRectangleIterator *i;
+    sraRect rect;
+    uint32_t now;
+    rfbClientPtr woken[WAKE_BATCH];
+    int slot, left, n;
+
+    if (!journal)
+        return;
+
+    now = rfbGetMonotonicTimeMs();
+    LOCK(journal->mutex);
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect))
+        stampRect(journal, rect.x1, rect.y1, rect.x2, rect.y2);
+    sraRgnReleaseIterator(i);
+
+    slot = journal->generation % DAMAGE_GENERATIONS;
+    if (journal->firstDamage[slot] == 0)
+        journal->firstDamage[slot] = now;
+    journal->lastDamage = now;
+    /* updateMutex comes before the journal mutex, so the sleepers are
+       woken a batch at a time outside of it. Those who go to sleep
+       meanwhile have seen this damage; they queue up behind the ones
+       counted here and need not be woken. */
+    left = journal->sleeperCount;
+    n = takeSleepers(journal, woken, left < WAKE_BATCH ? left : WAKE_BATCH);
+    UNLOCK(journal->mutex);
+
+    while (n > 0) {
+        wakeSleepers(woken, n);
+        left -= n;
+        if (left <= 0)
+            break;
+        LOCK(journal->mutex);
+        n = takeSleepers(journal, woken, left < WAKE_BATCH ? left : WAKE_BATCH);
+        UNLOCK(journal->mutex);
+    }
+}
+
+/* whether anything may have been stamped since the given generation, and
+   when that started; call with the journal mutex held */
+static rfbBool
+damagedSince(struct rfbDamageJournal *journal, uint64_t since,
+             uint32_t *firstDamage)
+{
+    uint64_t g;
+    uint32_t t, first = 0;
+    rfbBool behind = journal->generation - since >= DAMAGE_GENERATIONS;
+
+    if (behind)
+        since = journal->generation - (DAMAGE_GENERATIONS - 1);
+    for (g = since; STAMPED_SINCE(journal->generation, g); g++) {
+        t = journal->firstDamage[g % DAMAGE_GENERATIONS];
+        if (t != 0 && (first == 0 || (int32_t)(t - first) < 0))
+            first = t;
+    }
+    /* the generations forgotten about may have seen damage */
+    if (behind && first == 0)
+        first = journal->lastDamage;
+    *firstDamage = first;
+    return first != 0;
+}
+
+void rfbDamageJournalCatchUp(rfbClientPtr cl)
+{
+    struct rfbDamageJournal *journal = cl->screen->damageJournal;
+    sraRegionPtr tiles;
+    uint64_t since, *tile;
+    uint32_t firstDamage;
+    int tx, ty, end, x2, y2, width, height;
+    rfbBool found = FALSE;
+
+    if (!journal)
+        return;
+
+    LOCK(journal->mutex);
+    since = cl->damageGeneration;
+    if (damagedSince(journal, since, &firstDamage)) {
+        width = cl->screen->width;
+        height = cl->screen->height;
+        for (ty = 0; ty < journal->tilesY; ty++) {
+            if (!STAMPED_SINCE(journal->rows[ty], since))
+                continue;
+            tile = journal->tiles + ty * journal->tilesX;
+            y2 = (ty + 1) * RFB_DAMAGE_TILE;
+            if (y2 > height)
+                y2 = height;
+            if (y2 <= ty * RFB_DAMAGE_TILE)
+                break;
+            for (tx = 0; tx < journal->tilesX; tx = end) {
+                if (!STAMPED_SINCE(tile[tx], since)) {
+                    end = tx + 1;
+                    continue;
+                }
+                for (end = tx + 1; end < journal->tilesX &&
+                         STAMPED_SINCE(tile[end], since); end++)
+                    ;
+                x2 = end * RFB_DAMAGE_TILE;
+                if (x2 > width)
+                    x2 = width;
+                if (x2 <= tx * RFB_DAMAGE_TILE)
+                    break;
+                tiles = sraRgnCreateRect(tx * RFB_DAMAGE_TILE,
+                                         ty * RFB_DAMAGE_TILE, x2, y2);
+                sraRgnOr(cl->modifiedRegion, tiles);
+                sraRgnDestroy(tiles);
+                found = TRUE;
+            }
+        }
+
+        if (found) {
+            /* the screen as of the damage still waiting to be sent is
+               never going to be seen by the client */
+            if (cl->firstDamageTime == 0)
+                cl->firstDamageTime = firstDamage;
+            else
+                cl->damageSuperseded = TRUE;
+            cl->lastDamageTime = journal->lastDamage;
+        }
+
+        /* what is marked from now on is new to this client */
+        journal->generation++;
+        journal->firstDamage[journal->generation % DAMAGE_GENERATIONS] = 0;
+    }
+    cl->damageGeneration = journal->generation;
+    UNLOCK(journal->mutex);
+}
+
+/*
+ * The output thread of a client that has nothing to send calls this with
+ * updateMutex held before it waits for updateCond, and
+ * rfbDamageJournalWakeUp() when it is woken. Returns FALSE if there is
+ * new damage to catch up on instead.
+ */
+rfbBool rfbDamageJournalSleep(rfbClientPtr cl)
+{
+    struct rfbDamageJournal *journal = cl->screen->damageJournal;
+    uint32_t firstDamage;
+    rfbBool sleep = TRUE;
+
+    if (!journal)
+        return TRUE;
+
+    LOCK(journal->mutex);
+    if (damagedSince(journal, cl->damageGeneration, &firstDamage)) {
+        sleep = FALSE;
+    } else if (!cl->waitingForDamage) {
+        cl->waitingForDamage = TRUE;
+        cl->prevSleeper = journal->lastSleeper;
+        cl->nextSleeper = NULL;
+        if (journal->lastSleeper)
+            journal->lastSleeper->nextSleeper = cl;
+        else
+            journal->sleepers = cl;
+        journal->lastSleeper = cl;
+        journal->sleeperCount++;
+    }
+    UNLOCK(journal->mutex);
+    return sleep;
+}
+
+void rfbDamageJournalWakeUp(rfbClientPtr cl)
+{
+    struct rfbDamageJournal *journal = cl->screen->damageJournal;
+
+    if (!journal)
+        return;
+
+    /* unless marking damage took it off the list already */
+    LOCK(journal->mutex);
+    if (cl->waitingForDamage)
+        removeSleeper(journal, cl);
+    UNLOCK(journal->mutex);
+}
+
+void rfbAccumulateModifiedRect(rfbScreenInfoPtr screen,
+                               int x1, int y1, int x2, int y2)
+{
+    struct rfbDamageJournal *journal = screen->damageJournal;
+    int i, tx, ty, tx1, tx2, ty1, ty2, first, last;
+    uint32_t *row, firstMask, lastMask;
+
+    if (!journal || !journal->accumulated) {
+        rfbMarkRectAsModified(screen, x1, y1, x2, y2);
+        return;
+    }
+
+    if (x1 > x2) { i = x1; x1 = x2; x2 = i; }
+    if (y1 > y2) { i = y1; y1 = y2; y2 = i; }
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > screen->width) x2 = screen->width;
+    if (y2 > screen->height) y2 = screen->height;
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    LOCK(journal->mutex);
+    tx1 = x1 / RFB_DAMAGE_TILE;
+    ty1 = y1 / RFB_DAMAGE_TILE;
+    tx2 = (x2 + RFB_DAMAGE_TILE - 1) / RFB_DAMAGE_TILE;
+    ty2 = (y2 + RFB_DAMAGE_TILE - 1) / RFB_DAMAGE_TILE;
+    if (tx2 > journal->tilesX) tx2 = journal->tilesX;
+    if (ty2 > journal->tilesY) ty2 = journal->tilesY;
+
+    if (tx1 < tx2) {
+        first = tx1 / 32;
+        last = (tx2 - 1) / 32;
+        firstMask = 0xffffffffU << (tx1 % 32);
+        lastMask = 0xffffffffU >> (31 - (tx2 - 1) % 32);
+        for (ty = ty1; ty < ty2; ty++) {
+            row = journal->accumulated + ty * journal->wordsPerRow;
+            if (first == last) {
+                row[first] |= firstMask & lastMask;
+            } else {
+                row[first] |= firstMask;
+                for (tx = first + 1; tx < last; tx++)
+                    row[tx] = 0xffffffffU;
+                row[last] |= lastMask;
+            }
+        }
+        journal->anyAccumulated = TRUE;
+    }
+    UNLOCK(journal->mutex);
+}
+
+#define TILE_NOTED(row, tx) (((row)[(tx) / 32] >> ((tx) % 32)) & 1)
+
+void rfbCommitModifiedRects(rfbScreenInfoPtr screen)
+{
+    struct rfbDamageJournal *journal = screen->damageJournal;
+    sraRegionPtr region, tiles;
+    uint32_t *row;
+    int tx, ty, end, x2, y2;
+
+    if (!journal)
+        return;
+
+    region = sraRgnCreate();
+    LOCK(journal->mutex);
+    if (journal->anyAccumulated) {
+        for (ty = 0; ty < journal->tilesY; ty++) {
+            row = journal->accumulated + ty * journal->wordsPerRow;
+            y2 = (ty + 1) * RFB_DAMAGE_TILE;
+            if (y2 > screen->height)
+                y2 = screen->height;
+            if (y2 <= ty * RFB_DAMAGE_TILE)
+                break;
+            for (tx = 0; tx < journal->tilesX; tx = end) {
+                if (tx % 32 == 0 && row[tx / 32] == 0) {
+                    end = tx + 32;
+                    continue;
+                }
+                if (!TILE_NOTED(row, tx)) {
+                    end = tx + 1;
+                    continue;
+                }
+                for (end = tx + 1; end < journal->tilesX &&
+                         TILE_NOTED(row, end); end++)
+                    ;
+                x2 = end * RFB_DAMAGE_TILE;
+                if (x2 > screen->width)
+                    x2 = screen->width;
+                if (x2 <= tx * RFB_DAMAGE_TILE)
+                    break;
+                tiles = sraRgnCreateRect(tx * RFB_DAMAGE_TILE,
+                                         ty * RFB_DAMAGE_TILE, x2, y2);
+                sraRgnOr(region, tiles);
+                sraRgnDestroy(tiles);
+            }
+        }
+        memset(journal->accumulated, 0, (size_t)journal->wordsPerRow *
+               journal->tilesY * sizeof(uint32_t));
+        journal->anyAccumulated = FALSE;
+    }
+    UNLOCK(journal->mutex);
+
+    if (!sraRgnEmpty(region))
+        rfbMarkRegionAsModified(screen, region);
+    sraRgnDestroy(region);
+}
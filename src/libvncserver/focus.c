@@ -0,0 +1,194 @@
+/*
+ * focus.c - send what is near the user's pointer first.
+ *
+ * The rectangles of an update are encoded and sent nearest to the focus of
+ * the client first, that is where it last moved its pointer, or the
+ * screen's cursor for clients which did not. With focusSize, the square of
+ * that size around the focus is cut out of the update as rectangles of its
+ * own, so that a large rectangle does not make the client wait for all of
+ * it. With focusSplit as well, and while the client is typing or moving
+ * its pointer, the square even goes out as an update of its own and the
+ * rest follows in the next one.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+/* input this recent makes the client count as interacting */
+#define FOCUS_ACTIVE_MS 1000
+
+typedef struct {
+    sraRect rect;
+    uint64_t distance;
+    int index;
+} rfbFocusRect;
+
+static void getFocus(rfbClientPtr cl, int *x, int *y)
+{
+    *x = cl->focusX;
+    *y = cl->focusY;
+    if (*x < 0) {
+        *x = cl->screen->cursorX;
+        *y = cl->screen->cursorY;
+    }
+}
+
+static sraRegionPtr focusSquare(rfbClientPtr cl)
+{
+    int x, y, size = cl->screen->focusSize;
+
+    getFocus(cl, &x, &y);
+    return sraRgnCreateRect(x - size / 2, y - size / 2,
+                            x - size / 2 + size, y - size / 2 + size);
+}
+
+/* squared distance of the focus to the nearest pixel of rect */
+static uint64_t distanceTo(const sraRect *rect, int x, int y)
+{
+    int64_t dx = 0, dy = 0;
+
+    if (x < rect->x1)
+        dx = rect->x1 - x;
+    else if (x >= rect->x2)
+        dx = x - (rect->x2 - 1);
+    if (y < rect->y1)
+        dy = rect->y1 - y;
+    else if (y >= rect->y2)
+        dy = y - (rect->y2 - 1);
+    return (uint64_t)(dx * dx + dy * dy);
+}
+
+static int compareFocusRects(const void *a, const void *b)
+{
+    const rfbFocusRect *r = (const rfbFocusRect *)a, *s = (const rfbFocusRect *)b;
+
+    if (r->distance != s->distance)
+        return r->distance < s->distance ? -1 : 1;
+    return r->index - s->index;
+}
+
+static int addRects(rfbFocusRect *rects, int n, sraRegionPtr region, int x, int y)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+        rects[n].rect = rect;
+        rects[n].distance = distanceTo(&rect, x, y);
+        rects[n].index = n;
+        n++;
+    }
+    sraRgnReleaseIterator(i);
+    return n;
+}
+
+/*
+ * Returns the rectangles of region in the order they are to be sent, and
+ * their number in *nRects. The array is to be freed by the caller; it is
+ * NULL if region is empty or memory ran out, *nRects is -1 in the latter
+ * case.
+ */
+
+sraRect *rfbFocusOrderRects(rfbClientPtr cl, sraRegionPtr region, int *nRects)
+{
+    rfbFocusRect *order;
+    sraRegionPtr inside = NULL, outside = NULL;
+    sraRect *rects;
+    int x, y, n = 0, i;
+
+    getFocus(cl, &x, &y);
+    if (cl->screen->focusSize > 0) {
+        inside = focusSquare(cl);
+        outside = sraRgnCreateRgn(region);
+        sraRgnSubtract(outside, inside);
+        sraRgnAnd(inside, region);
+        *nRects = sraRgnCountRects(inside) + sraRgnCountRects(outside);
+    } else
+        *nRects = sraRgnCountRects(region);
+
+    if (*nRects == 0) {
+        rects = NULL;
+        goto done;
+    }
+    order = (rfbFocusRect *)malloc(*nRects * sizeof(rfbFocusRect));
+    rects = (sraRect *)malloc(*nRects * sizeof(sraRect));
+    if (!order || !rects) {
+        free(order);
+        free(rects);
+        rects = NULL;
+        *nRects = -1;
+        goto done;
+    }
+
+    if (inside) {
+        n = addRects(order, n, inside, x, y);
+        n = addRects(order, n, outside, x, y);
+    } else
+        n = addRects(order, n, region, x, y);
+    qsort(order, n, sizeof(rfbFocusRect), compareFocusRects);
+    for (i = 0; i < n; i++)
+        rects[i] = order[i].rect;
+    free(order);
+
+done:
+    if (inside) {
+        sraRgnDestroy(inside);
+        sraRgnDestroy(outside);
+    }
+    return rects;
+}
+
+/*
+ * Call with cl->updateMutex held. Cuts updateRegion down to the focus
+ * square if the client is interacting and there is more to send than
+ * that. The update after a cut one is never cut, so that the rest is not
+ * held back by ongoing changes at the focus.
+ */
+
+void rfbFocusSplitLocked(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+    sraRegionPtr square, rest;
+    rfbBool split = FALSE;
+
+    if (cl->focusSplitPending) {
+        cl->focusSplitPending = FALSE;
+        return;
+    }
+    if (!cl->screen->focusSplit || cl->screen->focusSize <= 0 ||
+        cl->lastInputTime == 0 ||
+        rfbGetMonotonicTimeMs() - cl->lastInputTime > FOCUS_ACTIVE_MS)
+        return;
+
+    square = focusSquare(cl);
+    sraRgnAnd(square, cl->requestedRegion);
+    rest = sraRgnCreateRgn(updateRegion);
+    sraRgnSubtract(rest, square);
+    /* something at the focus to send now, something else later */
+    if (sraRgnAnd(square, updateRegion) && !sraRgnEmpty(rest)) {
+        sraRgnMakeEmpty(updateRegion);
+        sraRgnOr(updateRegion, square);
+        split = TRUE;
+    }
+    sraRgnDestroy(square);
+    sraRgnDestroy(rest);
+    cl->focusSplitPending = split;
+}
@@ -26,6 +26,7 @@
  */
 
 #include <rfb/rfb.h>
+#include "simd.h"
 
 static rfbBool sendHextiles8(rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool sendHextiles16(rfbClientPtr cl, int x, int y, int w, int h);
@@ -96,6 +97,8 @@ static rfbBool subrectEncode##bpp(rfbClientPtr cli, uint##bpp##_t *data,
 		int w, int h, uint##bpp##_t bg, uint##bpp##_t fg, rfbBool mono);\
 static void testColours##bpp(uint##bpp##_t *data, int size, rfbBool *mono,      \
                   rfbBool *solid, uint##bpp##_t *bg, uint##bpp##_t *fg);        \
+static rfbBool solidInFramebuffer##bpp(rfbClientPtr cl, char *fbptr,            \
+                                      int w, int h);                           \
                                                                                 \
                                                                                 \
 /*                                                                              \
@@ -130,17 +133,25 @@ sendHextiles##bpp(rfbClientPtr cl, int rx, int ry, int rw, int rh) {
             fbptr = (cl->scaledScreen->frameBuffer + (cl->scaledScreen->paddedWidthInBytes * y)   \
                      + (x * (cl->scaledScreen->bitsPerPixel / 8)));                   \
                                                                                 \
-            (*cl->translateFn)(cl->translateLookupTable, &(cl->screen->serverFormat),      \
-                               &cl->format, fbptr, (char *)clientPixelData,     \
-                               cl->scaledScreen->paddedWidthInBytes, w, h);           \
+            solid = solidInFramebuffer##bpp(cl, fbptr, w, h);                   \
+            if (solid) {                                                        \
+                mono = TRUE;                                                    \
+                newBg = *(uint##bpp##_t *)fbptr;                                \
+            } else {                                                            \
+                (*cl->translateFn)(cl->translateLookupTable,                    \
+                                   &(cl->screen->serverFormat), &cl->format,    \
+                                   fbptr, (char *)clientPixelData,              \
+                                   cl->scaledScreen->paddedWidthInBytes, w, h); \
+            }                                                                   \
                                                                                 \
             startUblen = cl->ublen;                                             \
             cl->updateBuf[startUblen] = 0;                                      \
             cl->ublen++;                                                        \
             rfbStatRecordEncodingSentAdd(cl, rfbEncodingHextile, 1);            \
                                                                                 \
-            testColours##bpp(clientPixelData, w * h,                            \
-                             &mono, &solid, &newBg, &newFg);                    \
+            if (!solid)                                                         \
+                testColours##bpp(clientPixelData, w * h,                        \
+                                 &mono, &solid, &newBg, &newFg);                \
                                                                                 \
             if (!validBg || (newBg != bg)) {                                    \
                 validBg = TRUE;                                                 \
@@ -173,13 +184,23 @@ sendHextiles##bpp(rfbClientPtr cl, int rx, int ry, int rw, int rh) {
                 validFg = FALSE;                                                \
                 cl->ublen = startUblen;                                         \
                 cl->updateBuf[cl->ublen++] = rfbHextileRaw;                     \
-                (*cl->translateFn)(cl->translateLookupTable,                    \
-                                   &(cl->screen->serverFormat), &cl->format, fbptr,        \
-                                   (char *)clientPixelData,                     \
-                                   cl->scaledScreen->paddedWidthInBytes, w, h); \
-                                                                                \
-                memcpy(&cl->updateBuf[cl->ublen], (char *)clientPixelData,      \
-                       (size_t)w * h * (bpp/8));                                \
+                if (cl->translateFn == rfbTranslateNone) {                      \
+                    /* a plain copy, which can go to updateBuf unaligned */     \
+                    rfbTranslateNone(NULL, &(cl->screen->serverFormat),         \
+                                     &cl->format, fbptr,                        \
+                                     &cl->updateBuf[cl->ublen],                 \
+                                     cl->scaledScreen->paddedWidthInBytes,      \
+                                     w, h);                                     \
+                } else {                                                        \
+                    (*cl->translateFn)(cl->translateLookupTable,                \
+                                       &(cl->screen->serverFormat),             \
+                                       &cl->format, fbptr,                      \
+                                       (char *)clientPixelData,                 \
+                                       cl->scaledScreen->paddedWidthInBytes,    \
+                                       w, h);                                   \
+                    memcpy(&cl->updateBuf[cl->ublen], (char *)clientPixelData,  \
+                           (size_t)w * h * (bpp/8));                            \
+                }                                                               \
                                                                                 \
                 cl->ublen += w * h * (bpp/8);                                   \
                 rfbStatRecordEncodingSentAdd(cl, rfbEncodingHextile,            \
@@ -290,6 +311,28 @@ subrectEncode##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w, int h,
 }                                                                               \
                                                                                 \
                                                                                 \
+/*                                                                              \
+ * solidInFramebuffer() tells whether a tile is one colour when the client has  \
+ * the server's pixel format, in which case it is sent without a copy.          \
+ */                                                                             \
+                                                                                \
+static rfbBool                                                                  \
+solidInFramebuffer##bpp(rfbClientPtr cl, char *fbptr, int w, int h) {           \
+    uint##bpp##_t c = *(uint##bpp##_t *)fbptr;                                  \
+    int y;                                                                      \
+                                                                                \
+    if (cl->translateFn != rfbTranslateNone)                                    \
+        return FALSE;                                                           \
+    for (y = 0; y < h; y++) {                                                   \
+        if (rfbSimd->run##bpp((uint##bpp##_t *)fbptr, w, c,                     \
+                              (uint##bpp##_t)~0) < w)                           \
+            return FALSE;                                                       \
+        fbptr += cl->scaledScreen->paddedWidthInBytes;                          \
+    }                                                                           \
+    return TRUE;                                                                \
+}                                                                               \
+                                                                                \
+                                                                                \
 /*                                                                              \
  * testColours() tests if there are one (solid), two (mono) or more             \
  * colours in a tile and gets a reasonable guess at the best background         \
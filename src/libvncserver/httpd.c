@@ -41,9 +41,13 @@
 #include <fcntl.h>
 #endif
 #include <errno.h>
+#include <stdarg.h>
 #ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
 
 #ifdef WIN32
 #include <io.h>
@@ -58,6 +62,7 @@
 #endif
 
 #include "sockets.h"
+#include "private.h"
 
 #ifdef USE_LIBWRAP
 #include <tcpd.h>
@@ -76,6 +81,7 @@
 
 
 static void httpProcessInput(rfbScreenInfoPtr screen);
+static void httpSendMetrics(rfbScreenInfoPtr screen);
 static rfbBool compareAndSkip(char **ptr, const char *str);
 static rfbBool parseParams(const char *request, char *result, int max_bytes);
 static rfbBool validateString(char *str);
@@ -85,6 +91,14 @@ static rfbBool validateString(char *str);
 static char buf[BUF_SIZE];
 static size_t buf_filled=0;
 
+/* what the clients gone so far counted, see /metrics below */
+struct rfbMetricsTotals {
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(mutex);
+#endif
+    rfbStats gone;
+};
+
 /*
  * httpInitSockets sets up the TCP socket to listen for HTTP connections.
  */
@@ -99,9 +113,15 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
 
     rfbScreen->httpInitDone = TRUE;
 
-    if (!rfbScreen->httpDir)
+    if (!rfbScreen->httpDir && !rfbScreen->httpMetrics)
 	return;
 
+    if (rfbScreen->httpMetrics && !rfbScreen->metricsTotals) {
+	rfbScreen->metricsTotals = calloc(1, sizeof(*rfbScreen->metricsTotals));
+	if (rfbScreen->metricsTotals)
+	    INIT_MUTEX(rfbScreen->metricsTotals->mutex);
+    }
+
     if (rfbScreen->httpPort == 0) {
 	rfbScreen->httpPort = rfbScreen->port-100;
     }
@@ -186,7 +206,7 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 #endif
     socklen_t addrlen = sizeof(addr);
 
-    if (!rfbScreen->httpDir)
+    if (!rfbScreen->httpDir && !rfbScreen->httpMetrics)
 	return;
 
     if (rfbScreen->httpListenSock == RFB_INVALID_SOCKET)
@@ -300,12 +320,12 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
    
     cl.sock=rfbScreen->httpSock;
 
-    if (strlen(rfbScreen->httpDir) > 255) {
+    if (rfbScreen->httpDir && strlen(rfbScreen->httpDir) > 255) {
 	rfbErr("-httpd directory too long\n");
 	httpCloseSock(rfbScreen);
 	return;
     }
-    strcpy(fullFname, rfbScreen->httpDir);
+    strcpy(fullFname, rfbScreen->httpDir ? rfbScreen->httpDir : "");
     fname = &fullFname[strlen(fullFname)];
     maxFnameLen = 511 - strlen(fullFname);
 
@@ -405,6 +425,21 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 	return;
     }
 
+    /* Scrapers come often, so neither log them nor touch the disk */
+
+    if (rfbScreen->httpMetrics && strncmp(fname, "/metrics", 8) == 0 &&
+	(fname[8] == '\0' || fname[8] == '?')) {
+	httpSendMetrics(rfbScreen);
+	httpCloseSock(rfbScreen);
+	return;
+    }
+
+    if (!rfbScreen->httpDir) {
+	rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
+	httpCloseSock(rfbScreen);
+	return;
+    }
+
 
     getpeername(rfbScreen->httpSock, (struct sockaddr *)&addr, &addrlen);
 #ifdef LIBVNCSERVER_IPv6
@@ -579,6 +614,355 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 }
 
 
+/*
+ * /metrics: the counters of the screen and its clients in the Prometheus
+ * text format. Rates are left to the scraper, which derives them from the
+ * totals. The clients are walked with a client iterator and their counters
+ * copied under their statsMutex and updateMutex, which are never held
+ * while an update is encoded, so a scrape does not wait for one.
+ *
+ * By default the series add up all clients the screen had, those gone
+ * included, so that the totals never go back. With httpMetricsPerClient
+ * every client has series of its own, labelled with its address and
+ * socket, which the scraper keeps for as long as it retains its data.
+ */
+
+typedef struct {
+    char *text;
+    size_t len;
+    size_t size;
+} httpMetricsText;
+
+typedef struct {
+    char labels[128];
+    rfbStats stats;
+    int rtt;                /* ms, -1 if unknown */
+    uint32_t pendingTime;   /* ms since the oldest unsent damage, 0 if none */
+    int queued;             /* bytes in the socket's send buffer, -1 if unknown */
+} httpMetricsClient;
+
+/* adds the counters of from to those of to */
+static void
+metricsAddStats(rfbStats *to, const rfbStats *from)
+{
+    const rfbEncodingStats *f;
+    rfbEncodingStats *t;
+    int i, j;
+
+    to->bytesSent += from->bytesSent;
+    to->bytesSentIfRaw += from->bytesSentIfRaw;
+    to->bytesRcvd += from->bytesRcvd;
+    to->updates += from->updates;
+    to->droppedUpdates += from->droppedUpdates;
+    to->tileCacheHits += from->tileCacheHits;
+    to->tileCacheMisses += from->tileCacheMisses;
+    for (i = 0; i < rfbStatBuckets; i++)
+	to->latencyHistogram[i] += from->latencyHistogram[i];
+    to->latencyMs += from->latencyMs;
+    to->memoryBytes += from->memoryBytes;
+    to->memoryReclaims += from->memoryReclaims;
+
+    for (i = 0; i < from->nEncodings; i++) {
+	f = &from->encodings[i];
+	for (j = 0; j < to->nEncodings; j++)
+	    if (to->encodings[j].encoding == f->encoding)
+		break;
+	if (j == to->nEncodings) {
+	    if (j == rfbStatEncodings)
+		continue;
+	    to->nEncodings++;
+	    memset(&to->encodings[j], 0, sizeof(to->encodings[j]));
+	    to->encodings[j].encoding = f->encoding;
+	}
+	t = &to->encodings[j];
+	t->rects += f->rects;
+	t->bytes += f->bytes;
+	t->bytesIfRaw += f->bytesIfRaw;
+	t->encodeTimeUs += f->encodeTimeUs;
+	for (j = 0; j < rfbStatBuckets; j++)
+	    t->encodeTimeHistogram[j] += f->encodeTimeHistogram[j];
+    }
+}
+
+/* keeps what a client counted, for the totals of the screen */
+void
+rfbMetricsClientGone(rfbClientPtr cl)
+{
+    struct rfbMetricsTotals *totals = cl->screen->metricsTotals;
+    rfbStats stats;
+
+    if (!totals)
+	return;
+    rfbGetStats(cl, &stats);
+    /* nothing of the memory is left */
+    stats.memoryBytes = 0;
+    LOCK(totals->mutex);
+    metricsAddStats(&totals->gone, &stats);
+    UNLOCK(totals->mutex);
+}
+
+void
+rfbMetricsFree(rfbScreenInfoPtr rfbScreen)
+{
+    if (!rfbScreen->metricsTotals)
+	return;
+    TINI_MUTEX(rfbScreen->metricsTotals->mutex);
+    free(rfbScreen->metricsTotals);
+    rfbScreen->metricsTotals = NULL;
+}
+
+static void
+metricsPrintf(httpMetricsText *m, const char *format, ...)
+{
+    va_list args;
+    char *text;
+    int n;
+
+    while (m->text) {
+	va_start(args, format);
+	n = vsnprintf(m->text + m->len, m->size - m->len, format, args);
+	va_end(args);
+	if (n < 0)
+	    return;
+	if (m->len + n < m->size) {
+	    m->len += n;
+	    return;
+	}
+	m->size = (m->len + n + 1) * 2;
+	text = realloc(m->text, m->size);
+	if (!text)
+	    free(m->text);
+	m->text = text;
+    }
+}
+
+static void
+metricsFamily(httpMetricsText *m, const char *name, const char *type,
+	      const char *help)
+{
+    metricsPrintf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+metricsPerEncoding(httpMetricsText *m, httpMetricsClient *clients, int n,
+		   const char *name, int what)
+{
+    char encBuf[64];
+    rfbEncodingStats *e;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < clients[i].stats.nEncodings; j++) {
+	    e = &clients[i].stats.encodings[j];
+	    metricsPrintf(m, "%s{%s,encoding=\"%s\"} ", name, clients[i].labels,
+			  encodingName(e->encoding, encBuf, sizeof(encBuf)));
+	    if (what == 0)
+		metricsPrintf(m, "%llu\n", (unsigned long long)e->rects);
+	    else if (what == 1)
+		metricsPrintf(m, "%llu\n", (unsigned long long)e->bytes);
+	    else
+		metricsPrintf(m, "%.6f\n", e->encodeTimeUs / 1e6);
+	}
+    }
+}
+
+/* the counters of a client at the moment */
+static void
+metricsGetClient(rfbClientPtr client, httpMetricsClient *c, uint32_t now)
+{
+    uint32_t first;
+
+    rfbGetStats(client, &c->stats);
+    LOCK(client->updateMutex);
+    first = client->firstDamageTime;
+    UNLOCK(client->updateMutex);
+    c->pendingTime = first ? now - first : 0;
+    LOCK(client->statsMutex);
+    c->rtt = client->fenceRTT;
+    UNLOCK(client->statsMutex);
+    c->queued = -1;
+#ifdef TIOCOUTQ
+    if (ioctl(client->sock, TIOCOUTQ, &c->queued) < 0)
+	c->queued = -1;
+#endif
+}
+
+static void
+httpSendMetrics(rfbScreenInfoPtr rfbScreen)
+{
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr client;
+    httpMetricsText m;
+    httpMetricsClient *clients = NULL, *c, *more, all;
+    uint32_t now;
+    uint64_t count;
+    int n = 0, size = 0, connected, port = rfbScreen->port, i, j;
+    rfbBool perClient = rfbScreen->httpMetricsPerClient;
+    char header[128];
+
+    now = rfbGetMonotonicTimeMs();
+    iterator = rfbGetClientIterator(rfbScreen);
+    while ((client = rfbClientIteratorNext(iterator))) {
+	if (n == size) {
+	    size = size ? size * 2 : 8;
+	    more = realloc(clients, size * sizeof(*clients));
+	    if (!more)
+		break;
+	    clients = more;
+	}
+	c = &clients[n++];
+	metricsGetClient(client, c, now);
+	snprintf(c->labels, sizeof(c->labels), "port=\"%d\",host=\"%s\",id=\"%d\"",
+		 port, client->host ? client->host : "", (int)client->sock);
+    }
+    rfbReleaseClientIterator(iterator);
+    connected = n;
+
+    if (!perClient) {
+	/* one series for all, those gone included */
+	memset(&all, 0, sizeof(all));
+	snprintf(all.labels, sizeof(all.labels), "port=\"%d\"", port);
+	all.rtt = -1;
+	all.queued = -1;
+	if (rfbScreen->metricsTotals) {
+	    LOCK(rfbScreen->metricsTotals->mutex);
+	    all.stats = rfbScreen->metricsTotals->gone;
+	    UNLOCK(rfbScreen->metricsTotals->mutex);
+	}
+	for (i = 0; i < n; i++) {
+	    metricsAddStats(&all.stats, &clients[i].stats);
+	    if (clients[i].rtt > all.rtt)
+		all.rtt = clients[i].rtt;
+	    if (clients[i].pendingTime > all.pendingTime)
+		all.pendingTime = clients[i].pendingTime;
+	    if (clients[i].queued >= 0)
+		all.queued = (all.queued < 0 ? 0 : all.queued) + clients[i].queued;
+	}
+	free(clients);
+	clients = &all;
+	n = 1;
+    }
+
+    m.len = 0;
+    m.size = 4096 + n * 2048;
+    m.text = malloc(m.size);
+
+    metricsFamily(&m, "vnc_clients", "gauge", "Connected clients.");
+    metricsPrintf(&m, "vnc_clients{port=\"%d\"} %d\n", port, connected);
+
+    metricsFamily(&m, "vnc_client_updates_total", "counter",
+		  "Framebuffer updates sent.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_updates_total{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.updates);
+
+    metricsFamily(&m, "vnc_client_dropped_updates_total", "counter",
+		  "Updates sent after the screen changed again while they waited.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_dropped_updates_total{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.droppedUpdates);
+
+    metricsFamily(&m, "vnc_client_tile_cache_hits_total", "counter",
+		  "Tiles redrawn from what the client kept.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_tile_cache_hits_total{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.tileCacheHits);
+
+    metricsFamily(&m, "vnc_client_tile_cache_misses_total", "counter",
+		  "Tiles the client could have kept but did not have.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_tile_cache_misses_total{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.tileCacheMisses);
+
+    metricsFamily(&m, "vnc_client_sent_bytes_total", "counter",
+		  "Bytes sent, messages included.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_sent_bytes_total{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.bytesSent);
+
+    metricsFamily(&m, "vnc_client_received_bytes_total", "counter",
+		  "Bytes received.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_received_bytes_total{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.bytesRcvd);
+
+    metricsFamily(&m, "vnc_client_encoding_rects_total", "counter",
+		  "Rectangles sent per encoding.");
+    metricsPerEncoding(&m, clients, n, "vnc_client_encoding_rects_total", 0);
+    metricsFamily(&m, "vnc_client_encoding_bytes_total", "counter",
+		  "Bytes of rectangles sent per encoding.");
+    metricsPerEncoding(&m, clients, n, "vnc_client_encoding_bytes_total", 1);
+    metricsFamily(&m, "vnc_client_encode_seconds_total", "counter",
+		  "Time spent encoding and sending rectangles per encoding.");
+    metricsPerEncoding(&m, clients, n, "vnc_client_encode_seconds_total", 2);
+
+    metricsFamily(&m, "vnc_client_update_latency_seconds", "histogram",
+		  "Time from the first damage of an update to its last byte written.");
+    for (i = 0; i < n; i++) {
+	count = 0;
+	for (j = 0; j < rfbStatBuckets; j++) {
+	    count += clients[i].stats.latencyHistogram[j];
+	    if (j < rfbStatBuckets - 1)
+		metricsPrintf(&m, "vnc_client_update_latency_seconds_bucket{%s,le=\"%g\"} %llu\n",
+			      clients[i].labels, (double)(2 << j) / 1e6,
+			      (unsigned long long)count);
+	}
+	metricsPrintf(&m, "vnc_client_update_latency_seconds_bucket{%s,le=\"+Inf\"} %llu\n",
+		      clients[i].labels, (unsigned long long)count);
+	metricsPrintf(&m, "vnc_client_update_latency_seconds_sum{%s} %.3f\n",
+		      clients[i].labels, clients[i].stats.latencyMs / 1e3);
+	metricsPrintf(&m, "vnc_client_update_latency_seconds_count{%s} %llu\n",
+		      clients[i].labels, (unsigned long long)count);
+    }
+
+    metricsFamily(&m, "vnc_client_pending_damage_seconds", "gauge",
+		  "Age of the oldest damage not sent yet, 0 if there is none.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_pending_damage_seconds{%s} %.3f\n",
+		      clients[i].labels, clients[i].pendingTime / 1e3);
+
+    metricsFamily(&m, "vnc_client_send_queue_bytes", "gauge",
+		  "Bytes written but not yet acknowledged by the client.");
+    for (i = 0; i < n; i++)
+	if (clients[i].queued >= 0)
+	    metricsPrintf(&m, "vnc_client_send_queue_bytes{%s} %d\n",
+			  clients[i].labels, clients[i].queued);
+
+    metricsFamily(&m, "vnc_client_memory_bytes", "gauge",
+		  "Estimated memory taken by the client, mostly encoder state.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_memory_bytes{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.memoryBytes);
+
+    metricsFamily(&m, "vnc_client_memory_reclaims_total", "counter",
+		  "Encoder state freed because the client was idle.");
+    for (i = 0; i < n; i++)
+	metricsPrintf(&m, "vnc_client_memory_reclaims_total{%s} %llu\n", clients[i].labels,
+		      (unsigned long long)clients[i].stats.memoryReclaims);
+
+    metricsFamily(&m, "vnc_client_rtt_seconds", "gauge",
+		  "Last round trip time measured with a Fence, the longest of all clients.");
+    for (i = 0; i < n; i++)
+	if (clients[i].rtt >= 0)
+	    metricsPrintf(&m, "vnc_client_rtt_seconds{%s} %.3f\n",
+			  clients[i].labels, clients[i].rtt / 1e3);
+
+    if (perClient)
+	free(clients);
+
+    if (!m.text) {
+	rfbErr("httpd: out of memory for /metrics\n");
+	return;
+    }
+    snprintf(header, sizeof(header), "Content-Type: text/plain; version=0.0.4\r\n"
+	     "Content-Length: %lu\r\n\r\n", (unsigned long)m.len);
+    if (rfbWriteExact(&cl, OK_STR, strlen(OK_STR)) > 0 &&
+	rfbWriteExact(&cl, header, strlen(header)) > 0)
+	rfbWriteExact(&cl, m.text, m.len);
+    free(m.text);
+}
+
+
 static rfbBool
 compareAndSkip(char **ptr, const char *str)
 {
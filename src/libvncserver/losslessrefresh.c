@@ -0,0 +1,221 @@
+/*
+ * losslessrefresh.c - send again losslessly what was sent as JPEG.
+ *
+ * With Tight and JPEG a moving picture is cheap, but text sent while it
+ * changed keeps its artefacts for as long as it is left alone. So every
+ * rectangle sent as JPEG is remembered in lossyRegion, and what the client
+ * is sent afterwards, as pixels or by CopyRect, updates it. Once a part of
+ * it was not sent again for losslessRefreshDelay milliseconds, it is added
+ * to the next update as lossless Tight, at most LOSSLESS_REFRESH_PIXELS of
+ * it per update and behind the damage, so that refreshing a whole screen
+ * does not hold up what is changing meanwhile.
+ *
+ * Instead of a time stamp per area, the time is cut into ticks of the
+ * delay: lossyRecentRegion collects what was sent lossy since the last
+ * tick, and at a tick everything else becomes lossyStaticRegion. An area is
+ * thus refreshed between one and two delays after it was last sent.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+/* refreshed at most per update */
+#define LOSSLESS_REFRESH_PIXELS (256 * 256)
+
+void rfbLosslessRefreshMark(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    sraRegionPtr region;
+
+    if (cl->screen->losslessRefreshDelay <= 0 || cl->screen != cl->scaledScreen)
+        return;
+
+    region = sraRgnCreateRect(x, y, x + w, y + h);
+    LOCK(cl->updateMutex);
+    if (cl->lossyRegion == NULL) {
+        cl->lossyRegion = sraRgnCreate();
+        cl->lossyRecentRegion = sraRgnCreate();
+        cl->lossyStaticRegion = sraRgnCreate();
+    }
+    if (sraRgnEmpty(cl->lossyRegion))
+        cl->lossyTickTime = rfbGetMonotonicTimeMs();
+    sraRgnOr(cl->lossyRegion, region);
+    sraRgnOr(cl->lossyRecentRegion, region);
+    sraRgnSubtract(cl->lossyStaticRegion, region);
+    UNLOCK(cl->updateMutex);
+    sraRgnDestroy(region);
+}
+
+rfbBool rfbLosslessRefreshIsLossy(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    sraRegionPtr region;
+    rfbBool lossy = FALSE;
+
+    LOCK(cl->updateMutex);
+    if (cl->lossyRegion != NULL) {
+        region = sraRgnCreateRect(x, y, x + w, y + h);
+        lossy = sraRgnAnd(region, cl->lossyRegion);
+        sraRgnDestroy(region);
+    }
+    UNLOCK(cl->updateMutex);
+    return lossy;
+}
+
+/*
+ * Accounts for an update about to be sent: the pixel data in updateRegion
+ * replaces what was lossy there, and the CopyRects in copyRegion move it.
+ * Copied areas start their delay anew.
+ */
+
+void rfbLosslessRefreshSent(rfbClientPtr cl, sraRegionPtr updateRegion,
+                            sraRegionPtr copyRegion, int dx, int dy)
+{
+    sraRegionPtr moved;
+
+    LOCK(cl->updateMutex);
+    if (cl->lossyRegion == NULL || sraRgnEmpty(cl->lossyRegion)) {
+        UNLOCK(cl->updateMutex);
+        return;
+    }
+
+    if (!sraRgnEmpty(copyRegion)) {
+        moved = sraRgnCreateRgn(cl->lossyRegion);
+        sraRgnOffset(moved, dx, dy);
+        sraRgnAnd(moved, copyRegion);
+        sraRgnSubtract(cl->lossyRegion, copyRegion);
+        sraRgnSubtract(cl->lossyRecentRegion, copyRegion);
+        sraRgnSubtract(cl->lossyStaticRegion, copyRegion);
+        sraRgnOr(cl->lossyRegion, moved);
+        sraRgnOr(cl->lossyRecentRegion, moved);
+        sraRgnDestroy(moved);
+    }
+
+    sraRgnSubtract(cl->lossyRegion, updateRegion);
+    sraRgnSubtract(cl->lossyRecentRegion, updateRegion);
+    sraRgnSubtract(cl->lossyStaticRegion, updateRegion);
+    UNLOCK(cl->updateMutex);
+}
+
+/* what can be refreshed now, NULL if nothing */
+static sraRegionPtr dueRegion(rfbClientPtr cl)
+{
+    sraRegionPtr due;
+
+    if (sraRgnEmpty(cl->lossyStaticRegion))
+        return NULL;
+    due = sraRgnCreateRgn(cl->lossyStaticRegion);
+    /* what is going to be sent anyway is not refreshed */
+    sraRgnSubtract(due, cl->modifiedRegion);
+    sraRgnSubtract(due, cl->copyRegion);
+    if (!sraRgnAnd(due, cl->requestedRegion)) {
+        sraRgnDestroy(due);
+        return NULL;
+    }
+    return due;
+}
+
+/*
+ * Call with cl->updateMutex held. Returns 0 if a refresh is due, the
+ * milliseconds until the next tick if there are lossy areas which are not
+ * due yet, or -1 if there is nothing to refresh.
+ */
+
+int rfbLosslessRefreshTimeLocked(rfbClientPtr cl, uint32_t now)
+{
+    int delay = cl->screen->losslessRefreshDelay;
+    uint32_t sinceTick;
+    sraRegionPtr due;
+
+    if (delay <= 0 || cl->lossyRegion == NULL || sraRgnEmpty(cl->lossyRegion) ||
+        cl->screen != cl->scaledScreen)
+        return -1;
+
+    sinceTick = now - cl->lossyTickTime;
+    if (sinceTick >= (uint32_t)delay) {
+        sraRgnMakeEmpty(cl->lossyStaticRegion);
+        sraRgnOr(cl->lossyStaticRegion, cl->lossyRegion);
+        sraRgnSubtract(cl->lossyStaticRegion, cl->lossyRecentRegion);
+        sraRgnMakeEmpty(cl->lossyRecentRegion);
+        cl->lossyTickTime = now;
+        sinceTick = 0;
+    }
+
+    if ((due = dueRegion(cl)) != NULL) {
+        sraRgnDestroy(due);
+        return 0;
+    }
+    return delay - (int)sinceTick;
+}
+
+/*
+ * Call with cl->updateMutex held, before the requestedRegion is consumed.
+ * Returns the part of the due areas the update is to refresh, outside of
+ * updateRegion, or NULL if there is none. It is no longer counted as lossy.
+ */
+
+sraRegionPtr rfbLosslessRefreshTakeLocked(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+    sraRegionPtr due, taken, region;
+    sraRectangleIterator *i;
+    sraRect rect;
+    long budget = LOSSLESS_REFRESH_PIXELS;
+    int rows;
+
+    if (rfbLosslessRefreshTimeLocked(cl, rfbGetMonotonicTimeMs()) != 0)
+        return NULL;
+    if ((due = dueRegion(cl)) == NULL)
+        return NULL;
+    sraRgnSubtract(due, updateRegion);
+
+    taken = sraRgnCreate();
+    i = sraRgnGetIterator(due);
+    while (budget > 0 && sraRgnIteratorNext(i, &rect)) {
+        rows = rect.y2 - rect.y1;
+        if ((long)(rect.x2 - rect.x1) * rows > budget) {
+            rows = (int)(budget / (rect.x2 - rect.x1));
+            if (rows == 0)
+                rows = 1;
+        }
+        region = sraRgnCreateRect(rect.x1, rect.y1, rect.x2, rect.y1 + rows);
+        sraRgnOr(taken, region);
+        sraRgnDestroy(region);
+        budget -= (long)(rect.x2 - rect.x1) * rows;
+    }
+    sraRgnReleaseIterator(i);
+    sraRgnDestroy(due);
+
+    if (sraRgnEmpty(taken)) {
+        sraRgnDestroy(taken);
+        return NULL;
+    }
+    sraRgnSubtract(cl->lossyRegion, taken);
+    sraRgnSubtract(cl->lossyStaticRegion, taken);
+    return taken;
+}
+
+void rfbLosslessRefreshFree(rfbClientPtr cl)
+{
+    if (cl->lossyRegion == NULL)
+        return;
+    sraRgnDestroy(cl->lossyRegion);
+    sraRgnDestroy(cl->lossyRecentRegion);
+    sraRgnDestroy(cl->lossyStaticRegion);
+    cl->lossyRegion = cl->lossyRecentRegion = cl->lossyStaticRegion = NULL;
+}
@@ -277,14 +277,139 @@ void rfbLogPerror(const char *str)
 #endif
 }
 
+/*
+ * Update coalescing: instead of always waiting deferUpdateTime before
+ * sending, a pending update is sent right away if it is small and the
+ * client has not been sent anything recently, and is otherwise only held
+ * back while more damage keeps coming in, but never longer than
+ * deferUpdateTime after the first damage.
+ */
+
+uint64_t rfbGetMonotonicTimeUs(void)
+{
+#ifdef WIN32
+   static LARGE_INTEGER frequency;
+   LARGE_INTEGER counter;
+   if(frequency.QuadPart == 0)
+      QueryPerformanceFrequency(&frequency);
+   QueryPerformanceCounter(&counter);
+   return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000
+      + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#else
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+#endif
+}
+
+uint32_t rfbGetMonotonicTimeMs(void)
+{
+   uint32_t ms = (uint32_t)(rfbGetMonotonicTimeUs() / 1000);
+   /* 0 means "no damage pending" in the client's timestamps */
+   return ms ? ms : 1;
+}
+
+/* call with cl->updateMutex held */
+static void rfbNoteDamage(rfbClientPtr cl)
+{
+   uint32_t now = rfbGetMonotonicTimeMs();
+   if(cl->firstDamageTime == 0)
+      cl->firstDamageTime = now;
+   else
+      cl->damageSuperseded = TRUE;
+   cl->lastDamageTime = now;
+}
+
+static rfbBool rfbRegionAreaAtMost(sraRegionPtr region, unsigned long limit)
+{
+   sraRectangleIterator* i;
+   sraRect rect;
+   unsigned long area = 0;
+
+   i = sraRgnGetIterator(region);
+   while(area <= limit && sraRgnIteratorNext(i, &rect))
+      area += (unsigned long)(rect.x2-rect.x1)*(rect.y2-rect.y1);
+   sraRgnReleaseIterator(i);
+
+   return area <= limit;
+}
+
+/* call with cl->updateMutex held and an update pending */
+static int rfbCoalesceTimeLocked(rfbClientPtr cl, uint32_t now)
+{
+   rfbScreenInfoPtr screen = cl->screen;
+   uint32_t sinceFirst, sinceLast;
+   int wait, quietWait;
+
+   /* cursor-only updates and left-overs of the last update are never held back */
+   if(screen->deferUpdateTime <= 0 || cl->firstDamageTime == 0)
+      return 0;
+
+   sinceFirst = now - cl->firstDamageTime;
+   if(sinceFirst >= (uint32_t)screen->deferUpdateTime)
+      return 0;
+
+   if((cl->lastUpdateSentTime == 0 ||
+       now - cl->lastUpdateSentTime >= (uint32_t)screen->deferUpdateTime) &&
+      screen->deferSmallUpdateArea > 0 &&
+      rfbRegionAreaAtMost(cl->modifiedRegion, screen->deferSmallUpdateArea) &&
+      rfbRegionAreaAtMost(cl->copyRegion, screen->deferSmallUpdateArea))
+      return 0;
+
+   sinceLast = now - cl->lastDamageTime;
+   if(sinceLast >= (uint32_t)screen->deferQuietTime)
+      return 0;
+
+   wait = screen->deferUpdateTime - (int)sinceFirst;
+   quietWait = screen->deferQuietTime - (int)sinceLast;
+   return quietWait < wait ? quietWait : wait;
+}
+
+/* call with cl->updateMutex held and an update pending */
+static int rfbClientTimeToSendLocked(rfbClientPtr cl, uint32_t now)
+{
+   int wait = rfbCoalesceTimeLocked(cl, now);
+
+   /* the scheduler only has a say once the update is due */
+   return wait > 0 ? wait : rfbScheduleTimeLocked(cl, now);
+}
+
+int rfbClientTimeToSend(rfbClientPtr cl)
+{
+   int result = -1;
+
+   LOCK(cl->updateMutex);
+   rfbDamageJournalCatchUp(cl);
+   if (cl->sock != RFB_INVALID_SOCKET && !cl->onHold &&
+         !sraRgnEmpty(cl->requestedRegion)) {
+      if (FB_UPDATE_PENDING(cl))
+         result = rfbClientTimeToSendLocked(cl, rfbGetMonotonicTimeMs());
+      else
+         result = rfbLosslessRefreshTimeLocked(cl, rfbGetMonotonicTimeMs());
+   }
+   UNLOCK(cl->updateMutex);
+
+   return result;
+}
+
+void rfbScaledScreenUpdateRegion(rfbScreenInfoPtr screen, sraRegionPtr region);
 void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy)
 {  
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
 
+   /* scaled copies are not copied within, they are scaled again */
+   rfbScaledScreenUpdateRegion(rfbScreen,copyRegion);
+
    iterator=rfbGetClientIterator(rfbScreen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
+     /* the copy is applied on top of the damage marked so far */
+     rfbDamageJournalCatchUp(cl);
      if(cl->useCopyRect) {
        sraRegionPtr modifiedRegionBackup;
        if(!sraRgnEmpty(cl->copyRegion)) {
@@ -318,7 +443,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
        sraRgnOr(cl->modifiedRegion,modifiedRegionBackup);
        sraRgnDestroy(modifiedRegionBackup);
 
-       if(!cl->enableCursorShapeUpdates) {
+       if(!cl->enableCursorShapeUpdates && cl->screen->cursor) {
           /*
            * n.b. (dx, dy) is the vector pointing in the direction the
            * copyrect displacement will take place.  copyRegion is the
@@ -359,6 +484,7 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
      } else {
        sraRgnOr(cl->modifiedRegion,copyRegion);
      }
+     rfbNoteDamage(cl);
      TSIGNAL(cl->updateCond);
      UNLOCK(cl->updateMutex);
    }
@@ -411,21 +537,13 @@ void rfbScheduleCopyRect(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2,int
 
 void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
-   rfbClientIteratorPtr iterator;
-   rfbClientPtr cl;
-
-   iterator=rfbGetClientIterator(screen);
-   while((cl=rfbClientIteratorNext(iterator))) {
-     LOCK(cl->updateMutex);
-     sraRgnOr(cl->modifiedRegion,modRegion);
-     TSIGNAL(cl->updateCond);
-     UNLOCK(cl->updateMutex);
-   }
+   /* note the damage in the scaled copies */
+   rfbScaledScreenUpdateRegion(screen,modRegion);
 
-   rfbReleaseClientIterator(iterator);
+   /* the clients pick it up when they build their next update */
+   rfbDamageJournalAdd(screen,modRegion);
 }
 
-void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
 void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
 {
    sraRegionPtr region;
@@ -441,9 +559,6 @@ void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
    if(y2>screen->height) y2=screen->height;
    if(y1==y2) return;
 
-   /* update scaled copies for this rectangle */
-   rfbScaledScreenUpdate(screen,x1,y1,x2,y2);
-
    region = sraRgnCreateRect(x1,y1,x2,y2);
    rfbMarkRegionAsModified(screen,region);
    sraRgnDestroy(region);
@@ -451,16 +566,47 @@ void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
 
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
 
+/* wait at most ms milliseconds for updateCond, with updateMutex held */
+static void
+timedWaitForUpdate(rfbClientPtr cl, int ms)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    struct timespec deadline;
+#if defined(LIBVNCSERVER_HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+    /* updateCond runs on the monotonic clock, see initUpdateCond() */
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#else
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec;
+    deadline.tv_nsec = now.tv_usec * 1000;
+#endif
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&cl->updateCond, &cl->updateMutex, &deadline);
+#else
+    SleepConditionVariableCS(&cl->updateCond, &cl->updateMutex, ms);
+#endif
+}
+
 static THREAD_ROUTINE_RETURN_TYPE
 clientOutput(void *data)
 {
     rfbClientPtr cl = (rfbClientPtr)data;
     rfbBool haveUpdate;
     sraRegion* updateRegion;
+    int refreshTime, reclaimTime;
+    rfbBool reclaim;
 
     while (1) {
         haveUpdate = false;
         while (!haveUpdate) {
+		reclaim = FALSE;
 		if (cl->sock == RFB_INVALID_SOCKET || cl->state == RFB_SHUTDOWN) {
 			/* Client has disconnected. */
 			return THREAD_ROUTINE_RETURN_VALUE;
@@ -472,7 +618,9 @@ clientOutput(void *data)
 		}
 
 		LOCK(cl->updateMutex);
+		rfbDamageJournalCatchUp(cl);
 
+		refreshTime = -1;
 		if (sraRgnEmpty(cl->requestedRegion)) {
 			; /* always require a FB Update Request (otherwise can crash.) */
 		} else {
@@ -482,18 +630,49 @@ clientOutput(void *data)
 				haveUpdate   = sraRgnAnd(updateRegion,cl->requestedRegion);
 				sraRgnDestroy(updateRegion);
 			}
+			if(!haveUpdate) {
+				refreshTime = rfbLosslessRefreshTimeLocked(cl, rfbGetMonotonicTimeMs());
+				haveUpdate = refreshTime == 0;
+			}
 		}
 
 		if (!haveUpdate) {
-			WAIT(cl->updateCond, cl->updateMutex);
+			/* new damage or a request wakes us up, or the
+			   time to refresh what was sent lossy, or to free
+			   the encoder memory once the client is idle */
+			reclaimTime = rfbReclaimTime(cl, rfbGetMonotonicTimeMs());
+			if (reclaimTime == 0)
+				reclaim = TRUE;
+			else if (rfbDamageJournalSleep(cl)) {
+				if (reclaimTime > 0 && (refreshTime <= 0 || reclaimTime < refreshTime))
+					refreshTime = reclaimTime;
+				if (refreshTime > 0)
+					timedWaitForUpdate(cl, refreshTime);
+				else
+					WAIT(cl->updateCond, cl->updateMutex);
+				rfbDamageJournalWakeUp(cl);
+			}
+		} else if (refreshTime == 0) {
+			; /* a refresh only, nothing to coalesce */
+		} else {
+			/* To save bandwidth, the update may be held back a
+			   little while for more updates to come along; new
+			   damage wakes us up to reconsider. */
+			int timeToSend = rfbClientTimeToSendLocked(cl, rfbGetMonotonicTimeMs());
+			if (timeToSend > 0) {
+				timedWaitForUpdate(cl, timeToSend);
+				haveUpdate = false;
+			}
 		}
 
 		UNLOCK(cl->updateMutex);
+
+		if (reclaim) {
+			LOCK(cl->sendMutex);
+			rfbReclaimEncoderMemory(cl);
+			UNLOCK(cl->sendMutex);
+		}
         }
-        
-        /* OK, now, to save bandwidth, wait a little while for more
-           updates to come along. */
-	THREAD_SLEEP_MS(cl->screen->deferUpdateTime);
 
         /* Now, get the region we're going to update, and remove
            it from cl->modifiedRegion _before_ we send the update.
@@ -506,7 +685,9 @@ clientOutput(void *data)
         /* Now actually send the update. */
 	rfbIncrClientRef(cl);
         LOCK(cl->sendMutex);
+        rfbScheduleUpdateStart(cl);
         rfbSendFramebufferUpdate(cl, updateRegion);
+        rfbScheduleUpdateDone(cl);
         UNLOCK(cl->sendMutex);
 	rfbDecrClientRef(cl);
 
@@ -604,10 +785,7 @@ clientInput(void *data)
     UNLOCK(cl->updateMutex);
     THREAD_JOIN(output_thread);
 
-    /* Close client sock */
-    rfbCloseSocket(cl->sock);
-    cl->sock = RFB_INVALID_SOCKET;
-
+    /* closes the socket, too */
     rfbClientConnectionGone(cl);
 
     return THREAD_ROUTINE_RETURN_VALUE;
@@ -678,6 +856,9 @@ listenerRun(void *data)
 	if (cl && !cl->onHold )
 	  rfbStartOnHoldClient(cl);
 
+	/* free the clients gone while iterators could still reach them */
+	rfbReclaimClientSnapshots(screen);
+
         /* handle HTTP  */
         rfbHttpCheckFds(screen);
     }
@@ -971,6 +1152,9 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->httpListenSock=RFB_INVALID_SOCKET;
    screen->httpListen6Sock=RFB_INVALID_SOCKET;
    screen->httpSock=RFB_INVALID_SOCKET;
+   screen->httpMetrics=FALSE;
+   screen->httpMetricsPerClient=FALSE;
+   screen->metricsTotals=NULL;
 
    screen->desktopName = "LibVNCServer";
    screen->alwaysShared = FALSE;
@@ -993,7 +1177,24 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->listenInterface = htonl(INADDR_ANY);
 
    screen->deferUpdateTime=5;
+   screen->deferQuietTime=2;
+   screen->deferSmallUpdateArea=64*64;
+   screen->adaptiveQuality=FALSE;
+   screen->adaptiveTargetLatency=100;
+   screen->adaptiveMinQuality=30;
+   screen->contentAwareEncoding=FALSE;
+   screen->encoderThreads=0;
+   screen->parallelRectEncoding=FALSE;
    screen->maxRectsPerUpdate=50;
+   screen->tileCacheSize=16<<20;
+   screen->losslessRefreshDelay=0;
+   screen->focusSize=0;
+   screen->focusSplit=FALSE;
+   screen->fairScheduling=FALSE;
+   screen->maxFps=0;
+   screen->maxBandwidth=0;
+   screen->scheduleVirtualTime=0;
+   screen->reclaimIdleTime=30000;
 
    screen->handleEventsEagerly = FALSE;
 
@@ -1029,6 +1230,7 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->dontConvertRichCursorToXCursor = FALSE;
    screen->cursor = &myCursor;
    INIT_MUTEX(screen->cursorMutex);
+   INIT_MUTEX(screen->scheduleMutex);
 
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
    screen->backgroundLoop = FALSE;
@@ -1057,6 +1259,8 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    /* initialize client list and iterator mutex */
    rfbClientListInit(screen);
 
+   rfbDamageJournalInit(screen);
+
    return(screen);
 }
 
@@ -1078,12 +1282,12 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
   rfbClientIteratorPtr iterator;
   rfbClientPtr cl;
 
-  /* Lock out client reads. */
-  iterator = rfbGetClientIterator(screen);
+  /* Lock out client reads. The same clients are unlocked below, whether
+     they are closed meanwhile or not. */
+  iterator = rfbGetClientIteratorWithClosed(screen);
   while ((cl = rfbClientIteratorNext(iterator))) {
       LOCK(cl->sendMutex);
   }
-  rfbReleaseClientIterator(iterator);
 
   /* Prevent cursor drawing into framebuffer */
   LOCK(screen->cursorMutex);
@@ -1108,6 +1312,7 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
   }
 
   screen->frameBuffer = framebuffer;
+  rfbDamageJournalResize(screen);
 
   /* Adjust pointer position if necessary */
 
@@ -1117,8 +1322,11 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
     screen->cursorY = height - 1;
 
   /* For each client: */
-  iterator = rfbGetClientIterator(screen);
   while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+    if (cl->sock == RFB_INVALID_SOCKET) {
+      UNLOCK(cl->sendMutex);
+      continue;
+    }
 
     /* Re-install color translation tables if necessary */
 
@@ -1137,6 +1345,8 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 
     if (cl->useNewFBSize)
       cl->newFBSizePending = TRUE;
+    if (format_changed)
+      cl->tileCacheReset = TRUE;
 
     TSIGNAL(cl->updateCond);
     UNLOCK(cl->updateMutex);
@@ -1162,11 +1372,17 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
     currentCl=nextCl;
   }
   rfbReleaseClientIterator(i);
+  rfbClientListFree(screen);
+  rfbMetricsFree(screen);
+
+  rfbWorkerPoolStop(screen);
+  rfbDamageJournalFree(screen);
     
 #define FREE_SCREEN_MEMBER(member) free(screen->member)
   FREE_SCREEN_MEMBER(colourMap.data.bytes);
   FREE_SCREEN_MEMBER(underCursorBuffer);
   TINI_MUTEX(screen->cursorMutex);
+  TINI_MUTEX(screen->scheduleMutex);
 
   if(screen->cursor != &myCursor)
       rfbFreeCursor(screen->cursor);
@@ -1180,6 +1396,8 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
       ptr = screen->scaledScreenNext;
       screen->scaledScreenNext = ptr->scaledScreenNext;
       free(ptr->frameBuffer);
+      sraRgnDestroy(ptr->scaledScreenDamage);
+      TINI_MUTEX(ptr->scaledScreenMutex);
       free(ptr);
   }
 
@@ -1191,6 +1409,7 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 {
   rfbInitSockets(screen);
   rfbHttpInitSockets(screen);
+  rfbWorkerPoolStart(screen);
 #ifndef WIN32
   if(screen->ignoreSIGPIPE)
     signal(SIGPIPE,SIG_IGN);
@@ -1269,8 +1488,6 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
   rfbClientIteratorPtr i;
   rfbClientPtr cl,clPrev;
   rfbBool result=FALSE;
-  extern rfbClientIteratorPtr
-    rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
 
   if(usec<0)
     usec=screen->deferUpdateTime*1000;
@@ -1290,6 +1507,7 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
     }
   }
   rfbReleaseClientIterator(i);
+  rfbReclaimClientSnapshots(screen);
 
   return result;
 }
@@ -1297,31 +1515,46 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
 rfbBool
 rfbUpdateClient(rfbClientPtr cl)
 {
-  struct timeval tv;
   rfbBool result=FALSE;
-  rfbScreenInfoPtr screen = cl->screen;
+
+  LOCK(cl->updateMutex);
+  rfbDamageJournalCatchUp(cl);
+  UNLOCK(cl->updateMutex);
 
   if (cl->sock != RFB_INVALID_SOCKET && !cl->onHold && FB_UPDATE_PENDING(cl) &&
         !sraRgnEmpty(cl->requestedRegion)) {
+      int timeToSend;
       result=TRUE;
-      if(screen->deferUpdateTime == 0) {
+      LOCK(cl->updateMutex);
+      timeToSend = rfbClientTimeToSendLocked(cl, rfbGetMonotonicTimeMs());
+      UNLOCK(cl->updateMutex);
+      if(timeToSend == 0) {
+          rfbScheduleUpdateStart(cl);
           rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
-      } else if(cl->startDeferring.tv_usec == 0) {
-        gettimeofday(&cl->startDeferring,NULL);
-        if(cl->startDeferring.tv_usec == 0)
-          cl->startDeferring.tv_usec++;
-      } else {
-        gettimeofday(&tv,NULL);
-        if(tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
-           || ((tv.tv_sec-cl->startDeferring.tv_sec)*1000
-               +(tv.tv_usec-cl->startDeferring.tv_usec)/1000)
-             > screen->deferUpdateTime) {
-          cl->startDeferring.tv_usec = 0;
+          rfbScheduleUpdateDone(cl);
+      }
+    } else if (cl->sock != RFB_INVALID_SOCKET && !cl->onHold &&
+        !sraRgnEmpty(cl->requestedRegion)) {
+      /* only areas sent lossy may be due to be refreshed */
+      int refreshTime;
+      LOCK(cl->updateMutex);
+      refreshTime = rfbLosslessRefreshTimeLocked(cl, rfbGetMonotonicTimeMs());
+      UNLOCK(cl->updateMutex);
+      if(refreshTime == 0) {
+          result=TRUE;
+          rfbScheduleUpdateStart(cl);
           rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
-        }
+          rfbScheduleUpdateDone(cl);
       }
     }
 
+    if (!result && cl->sock != RFB_INVALID_SOCKET &&
+        rfbReclaimTime(cl, rfbGetMonotonicTimeMs()) == 0) {
+      LOCK(cl->sendMutex);
+      rfbReclaimEncoderMemory(cl);
+      UNLOCK(cl->sendMutex);
+    }
+
     if (!cl->viewOnly && cl->lastPtrX >= 0) {
       if(cl->startPtrDeferring.tv_usec == 0) {
         gettimeofday(&cl->startPtrDeferring,NULL);
@@ -0,0 +1,392 @@
+/*
+ * parallelrects.c - encode the rectangles of an update on the encoder
+ * threads.
+ *
+ * Raw, RRE, CoRRE, Hextile and Ultra keep no state from one rectangle to
+ * the next, so an update made of these only can be encoded in any order.
+ * Its rectangles are cut into bands of rows, every band is encoded on a
+ * private copy of the client whose rfbSendUpdateBuf() appends to a buffer
+ * of the band's own instead of writing to the socket, and the buffers are
+ * sent in order once all bands are done.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+#include "scale.h"
+
+/* updates smaller than this are encoded on the output thread */
+#define PARALLEL_MIN_PIXELS (128 * 128)
+/* bands are at least this big, and there are about this many per slot */
+#define PARALLEL_MIN_BAND_PIXELS (64 * 64)
+#define PARALLEL_BANDS_PER_SLOT 4
+
+typedef struct {
+    int x, y, w, h;
+    int encoding;
+    rfbBool ok;
+    rfbUpdateCapture out;
+} rfbParallelRect;
+
+typedef struct {
+    int nSlots;
+    rfbClientPtr *shadows;  /* one copy of the client per slot */
+    int nRects, maxRects;
+    rfbParallelRect *rects;
+} rfbParallelRects;
+
+static rfbBool rfbEncodingIsStateless(int encoding)
+{
+    switch (encoding) {
+    case -1:
+    case rfbEncodingRaw:
+    case rfbEncodingRRE:
+    case rfbEncodingCoRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* bands of these encodings should start on a multiple of this many rows */
+static int rfbBandUnit(rfbClientPtr cl, int encoding, int w)
+{
+    switch (encoding) {
+    case rfbEncodingCoRRE:
+        return cl->correMaxHeight;
+    case rfbEncodingUltra:
+        return ULTRA_MAX_SIZE(w) / w;
+    }
+    return 16;
+}
+
+static rfbParallelRects *rfbGetParallelRects(rfbClientPtr cl)
+{
+    rfbParallelRects *p = (rfbParallelRects *)cl->parallelRects;
+    int nSlots = rfbWorkerCount(cl->screen) + 1;
+
+    if (p && p->nSlots == nSlots)
+        return p;
+    rfbFreeParallelRects(cl);
+
+    p = (rfbParallelRects *)calloc(1, sizeof(rfbParallelRects));
+    if (!p)
+        return NULL;
+    p->shadows = (rfbClientPtr *)calloc(nSlots, sizeof(rfbClientPtr));
+    if (!p->shadows) {
+        free(p);
+        return NULL;
+    }
+    p->nSlots = nSlots;
+    cl->parallelRects = p;
+    return p;
+}
+
+static rfbParallelRect *rfbAddParallelRect(rfbParallelRects *p)
+{
+    if (p->nRects == p->maxRects) {
+        int max = p->maxRects ? p->maxRects * 2 : 64;
+        rfbParallelRect *rects = (rfbParallelRect *)
+            realloc(p->rects, max * sizeof(rfbParallelRect));
+        if (!rects)
+            return NULL;
+        memset(rects + p->maxRects, 0,
+               (max - p->maxRects) * sizeof(rfbParallelRect));
+        p->rects = rects;
+        p->maxRects = max;
+    }
+    return &p->rects[p->nRects++];
+}
+
+/*
+ * Decide whether the update, given as its rectangles in the order they are
+ * to be sent, can be encoded on the encoder threads and cut it into bands
+ * if so. Returns the number of rectangles the update will
+ * consist of, or 0 if it is to be sent the usual way.
+ */
+
+int rfbPrepareParallelRects(rfbClientPtr cl, const sraRect *rects, int nRects,
+                            const int *rectEncodings)
+{
+    rfbParallelRects *p;
+    int nRect, nCoded = 0, bandPixels;
+    uint64_t area = 0;
+
+    if (!cl->screen->parallelRectEncoding || rfbWorkerCount(cl->screen) == 0)
+        return 0;
+
+    for (nRect = 0; nRect < nRects; nRect++) {
+        int encoding = rectEncodings ? rectEncodings[nRect] : cl->preferredEncoding;
+        if (!rfbEncodingIsStateless(encoding))
+            return 0;
+        area += (uint64_t)(rects[nRect].x2 - rects[nRect].x1) *
+                (rects[nRect].y2 - rects[nRect].y1);
+    }
+    if (area < PARALLEL_MIN_PIXELS || !(p = rfbGetParallelRects(cl)))
+        return 0;
+
+    bandPixels = (int)(area / (p->nSlots * PARALLEL_BANDS_PER_SLOT));
+    if (bandPixels < PARALLEL_MIN_BAND_PIXELS)
+        bandPixels = PARALLEL_MIN_BAND_PIXELS;
+
+    p->nRects = 0;
+    for (nRect = 0; nRect < nRects; nRect++) {
+        int encoding = rectEncodings ? rectEncodings[nRect] : cl->preferredEncoding;
+        int x = rects[nRect].x1, y = rects[nRect].y1;
+        int w = rects[nRect].x2 - x, h = rects[nRect].y2 - y;
+        int lines, unit, band;
+
+        if (cl->screen != cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h,
+                                "rfbPrepareParallelRects");
+        if (w <= 0 || h <= 0)
+            continue;
+
+        unit = rfbBandUnit(cl, encoding, w);
+        lines = (bandPixels + w - 1) / w;
+        lines = (lines + unit - 1) / unit * unit;
+
+        for (band = 0; band < h; band += lines) {
+            rfbParallelRect *r = rfbAddParallelRect(p);
+            if (!r)
+                return 0;
+            r->x = x;
+            r->y = y + band;
+            r->w = w;
+            r->h = h - band < lines ? h - band : lines;
+            r->encoding = encoding;
+            nCoded += rfbNumCodedRects(cl, encoding, r->x, r->y, r->w, r->h);
+        }
+    }
+
+    return nCoded;
+}
+
+/*
+ * Make the slot's copy of the client current. The copy is not a clone of
+ * the client: it starts out zeroed and keeps its own encoder buffers, LZO
+ * state and statistics, and only what Raw, RRE, CoRRE, Hextile, Ultra and
+ * rfbSendUpdateBuf() read is taken from the client:
+ *
+ *   screen, scaledScreen        the framebuffer to encode from
+ *   format, translateFn,
+ *   translateLookupTable        the client's pixel format
+ *   correMaxWidth/Height        the CoRRE subrectangle size
+ *
+ * Everything else, the socket, locks, regions and the state of the other
+ * encoders in particular, is left alone so that the output thread keeps it
+ * to itself. Keep the list in step when these encoders read more.
+ */
+
+static rfbBool rfbSyncShadow(rfbParallelRects *p, int slot, rfbClientPtr cl)
+{
+    rfbClientPtr shadow = p->shadows[slot];
+
+    if (!shadow) {
+        shadow = (rfbClientPtr)calloc(1, sizeof(rfbClientRec));
+        if (!shadow)
+            return FALSE;
+        shadow->sock = RFB_INVALID_SOCKET;
+        INIT_MUTEX(shadow->statsMutex);
+        p->shadows[slot] = shadow;
+    }
+
+    shadow->screen = cl->screen;
+    shadow->scaledScreen = cl->scaledScreen;
+    shadow->format = cl->format;
+    shadow->translateFn = cl->translateFn;
+    shadow->translateLookupTable = cl->translateLookupTable;
+    shadow->correMaxWidth = cl->correMaxWidth;
+    shadow->correMaxHeight = cl->correMaxHeight;
+    shadow->ublen = 0;
+    return TRUE;
+}
+
+static void rfbMergeShadowStats(rfbClientPtr cl, rfbClientPtr shadow)
+{
+    rfbStatMergeSlots(cl, shadow);
+    rfbResetStats(shadow);
+}
+
+static void rfbEncodeParallelRect(void *data, int index, int slot)
+{
+    rfbParallelRects *p = (rfbParallelRects *)data;
+    rfbParallelRect *r = &p->rects[index];
+    rfbClientPtr cl = p->shadows[slot];
+    rfbBool ok = FALSE;
+    uint64_t start = rfbGetMonotonicTimeUs();
+
+    r->out.len = 0;
+    cl->updateCapture = &r->out;
+    cl->ublen = 0;
+
+    switch (r->encoding) {
+    case -1:
+    case rfbEncodingRaw:
+        ok = rfbSendRectEncodingRaw(cl, r->x, r->y, r->w, r->h);
+        break;
+    case rfbEncodingRRE:
+        ok = rfbSendRectEncodingRRE(cl, r->x, r->y, r->w, r->h);
+        break;
+    case rfbEncodingCoRRE:
+        ok = rfbSendRectEncodingCoRRE(cl, r->x, r->y, r->w, r->h);
+        break;
+    case rfbEncodingHextile:
+        ok = rfbSendRectEncodingHextile(cl, r->x, r->y, r->w, r->h);
+        break;
+    case rfbEncodingUltra:
+        ok = rfbSendRectEncodingUltra(cl, r->x, r->y, r->w, r->h);
+        break;
+    }
+
+    r->ok = ok && rfbCaptureUpdateBuf(cl);
+    cl->updateCapture = NULL;
+    rfbStatRecordEncodeTime(cl, r->encoding, rfbGetMonotonicTimeUs() - start);
+}
+
+/*
+ * Encode the bands set up by rfbPrepareParallelRects() and append them to
+ * the client's output in order.
+ */
+
+rfbBool rfbSendParallelRects(rfbClientPtr cl)
+{
+    rfbParallelRects *p = (rfbParallelRects *)cl->parallelRects;
+    rfbBool result = TRUE;
+    int slot, n, i;
+
+    for (slot = 0; slot < p->nSlots; slot++)
+        if (!rfbSyncShadow(p, slot, cl)) {
+            rfbLogPerror("rfbSendParallelRects: malloc");
+            return FALSE;
+        }
+
+    rfbWorkersRun(cl->screen, rfbEncodeParallelRect, p, p->nRects);
+
+    for (slot = 0; slot < p->nSlots; slot++)
+        rfbMergeShadowStats(cl, p->shadows[slot]);
+
+    for (n = 0; n < p->nRects && result; n++) {
+        rfbParallelRect *r = &p->rects[n];
+
+        if (!r->ok) {
+            result = FALSE;
+            break;
+        }
+        for (i = 0; i < r->out.len;) {
+            int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+
+            if (bytesToCopy > r->out.len - i)
+                bytesToCopy = r->out.len - i;
+            memcpy(cl->updateBuf + cl->ublen, r->out.buf + i, bytesToCopy);
+            cl->ublen += bytesToCopy;
+            i += bytesToCopy;
+
+            if (cl->ublen == UPDATE_BUF_SIZE && !rfbSendUpdateBuf(cl)) {
+                result = FALSE;
+                break;
+            }
+        }
+    }
+
+    return result;
+}
+
+/*
+ * rfbSendUpdateBuf() of a client copy encoding a band: keep the bytes.
+ */
+
+rfbBool rfbCaptureUpdateBuf(rfbClientPtr cl)
+{
+    rfbUpdateCapture *c = cl->updateCapture;
+
+    if (c->len + cl->ublen > c->size) {
+        int size = c->size ? c->size : UPDATE_BUF_SIZE;
+        char *buf;
+
+        while (size < c->len + cl->ublen)
+            size *= 2;
+        buf = (char *)realloc(c->buf, size);
+        if (!buf) {
+            rfbLogPerror("rfbCaptureUpdateBuf: realloc");
+            return FALSE;
+        }
+        c->buf = buf;
+        c->size = size;
+    }
+    memcpy(c->buf + c->len, cl->updateBuf, cl->ublen);
+    c->len += cl->ublen;
+    cl->ublen = 0;
+    return TRUE;
+}
+
+void rfbFreeParallelRects(rfbClientPtr cl)
+{
+    rfbParallelRects *p = (rfbParallelRects *)cl->parallelRects;
+    int i;
+
+    if (!p)
+        return;
+    for (i = 0; i < p->nSlots; i++) {
+        rfbClientPtr shadow = p->shadows[i];
+        if (!shadow)
+            continue;
+        free(shadow->beforeEncBuf);
+        free(shadow->afterEncBuf);
+        if (shadow->compStreamInitedLZO)
+            free(shadow->lzoWrkMem);
+        rfbResetStats(shadow);
+        TINI_MUTEX(shadow->statsMutex);
+        free(shadow);
+    }
+    for (i = 0; i < p->maxRects; i++)
+        free(p->rects[i].out.buf);
+    free(p->rects);
+    free(p->shadows);
+    free(p);
+    cl->parallelRects = NULL;
+}
+
+size_t rfbParallelRectsMemoryUsage(rfbClientPtr cl)
+{
+    rfbParallelRects *p = (rfbParallelRects *)cl->parallelRects;
+    size_t size;
+    int i;
+
+    if (!p)
+        return 0;
+    size = sizeof(rfbParallelRects) + p->nSlots * sizeof(rfbClientPtr) +
+        p->maxRects * sizeof(rfbParallelRect);
+    for (i = 0; i < p->nSlots; i++) {
+        rfbClientPtr shadow = p->shadows[i];
+        if (!shadow)
+            continue;
+        /* the rest of the copy belongs to the client */
+        size += sizeof(rfbClientRec) + rfbUltraMemoryUsage(shadow);
+        if (shadow->beforeEncBuf)
+            size += shadow->beforeEncBufSize;
+        if (shadow->afterEncBuf)
+            size += shadow->afterEncBufSize;
+    }
+    for (i = 0; i < p->maxRects; i++)
+        size += p->rects[i].out.size;
+    return size;
+}
@@ -1,6 +1,8 @@
 #ifndef RFB_PRIVATE_H
 #define RFB_PRIVATE_H
 
+#include <rfb/rfbregion.h>
+
 /* from cursor.c */
 
 void rfbShowCursor(rfbClientPtr cl);
@@ -10,16 +12,140 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 /* from main.c */
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
+uint64_t rfbGetMonotonicTimeUs(void);
+
+/* from adaptive.c */
+
+void rfbAdaptiveReset(rfbClientPtr cl);
+void rfbAdaptiveUpdateStart(rfbClientPtr cl);
+void rfbAdaptiveUpdateDone(rfbClientPtr cl);
+
+/* from classify.c */
+
+#define RFB_RECT_UNKNOWN 0
+#define RFB_RECT_SOLID   1
+#define RFB_RECT_PALETTE 2
+#define RFB_RECT_TEXT    3
+#define RFB_RECT_PHOTO   4
+
+int rfbClassifyRect(rfbScreenInfoPtr screen, int x, int y, int w, int h);
+
+/* from damage.c */
+
+/* damage reaches the clients rounded up to tiles of this size */
+#define RFB_DAMAGE_TILE 16
+
+void rfbDamageJournalInit(rfbScreenInfoPtr screen);
+void rfbDamageJournalFree(rfbScreenInfoPtr screen);
+void rfbDamageJournalResize(rfbScreenInfoPtr screen);
+uint64_t rfbDamageJournalGeneration(rfbScreenInfoPtr screen);
+void rfbDamageJournalAdd(rfbScreenInfoPtr screen, sraRegionPtr region);
+/* these are called with cl->updateMutex held */
+void rfbDamageJournalCatchUp(rfbClientPtr cl);
+rfbBool rfbDamageJournalSleep(rfbClientPtr cl);
+void rfbDamageJournalWakeUp(rfbClientPtr cl);
+
+/* from workers.c */
+
+/* index runs from 0 to count-1, slot from 0 to rfbWorkerCount(), and no
+   two pieces running at the same time share a slot */
+typedef void (*rfbWorkerProc)(void *data, int index, int slot);
+
+void rfbWorkerPoolStart(rfbScreenInfoPtr screen);
+void rfbWorkerPoolStop(rfbScreenInfoPtr screen);
+int rfbWorkerCount(rfbScreenInfoPtr screen);
+void rfbWorkersRun(rfbScreenInfoPtr screen, rfbWorkerProc proc,
+                   void *data, int count);
+
+/* from parallelrects.c */
+
+typedef struct rfbUpdateCapture {
+    char *buf;
+    int len, size;
+} rfbUpdateCapture;
+
+int rfbPrepareParallelRects(rfbClientPtr cl, const sraRect *rects, int nRects,
+                            const int *rectEncodings);
+rfbBool rfbSendParallelRects(rfbClientPtr cl);
+rfbBool rfbCaptureUpdateBuf(rfbClientPtr cl);
+void rfbFreeParallelRects(rfbClientPtr cl);
+size_t rfbParallelRectsMemoryUsage(rfbClientPtr cl);
+
+/* from httpd.c */
+
+void rfbMetricsClientGone(rfbClientPtr cl);
+void rfbMetricsFree(rfbScreenInfoPtr rfbScreen);
+
+/* from rfbserver.c */
+
+void rfbClientListFree(rfbScreenInfoPtr rfbScreen);
+void rfbReclaimClientSnapshots(rfbScreenInfoPtr screen);
+/* also returns the clients that are closed and not gone yet */
+rfbClientIteratorPtr rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
+
+int rfbNumCodedRects(rfbClientPtr cl, int encoding, int x, int y, int w, int h);
+
+/* from stats.c */
+
+void rfbStatMergeSlots(rfbClientPtr cl, rfbClientPtr from);
+char *encodingName(uint32_t type, char *buf, int len);
+
+/* from tilecache.c */
+
+int rfbTileCacheLookUp(rfbClientPtr cl, sraRegionPtr updateRegion);
+rfbBool rfbTileCacheSendRefs(rfbClientPtr cl);
+rfbBool rfbTileCacheSendStores(rfbClientPtr cl);
+void rfbTileCacheFree(rfbClientPtr cl);
+size_t rfbTileCacheMemoryUsage(rfbClientPtr cl);
+
+/* from simplify.c */
+
+void rfbSimplifyUpdateRegion(rfbClientPtr cl, sraRegionPtr region, int maxRects);
+
+/* from focus.c */
+
+sraRect *rfbFocusOrderRects(rfbClientPtr cl, sraRegionPtr region, int *nRects);
+void rfbFocusSplitLocked(rfbClientPtr cl, sraRegionPtr updateRegion);
+
+/* from schedule.c */
+
+int rfbScheduleTimeLocked(rfbClientPtr cl, uint32_t now);
+void rfbScheduleUpdateStart(rfbClientPtr cl);
+void rfbScheduleUpdateDone(rfbClientPtr cl);
+void rfbScheduleCharge(rfbClientPtr cl, int len);
+
+/* from losslessrefresh.c */
+
+void rfbLosslessRefreshMark(rfbClientPtr cl, int x, int y, int w, int h);
+rfbBool rfbLosslessRefreshIsLossy(rfbClientPtr cl, int x, int y, int w, int h);
+void rfbLosslessRefreshSent(rfbClientPtr cl, sraRegionPtr updateRegion,
+                            sraRegionPtr copyRegion, int dx, int dy);
+int rfbLosslessRefreshTimeLocked(rfbClientPtr cl, uint32_t now);
+sraRegionPtr rfbLosslessRefreshTakeLocked(rfbClientPtr cl, sraRegionPtr updateRegion);
+void rfbLosslessRefreshFree(rfbClientPtr cl);
+
+/* from reclaim.c */
+
+/* what deflateInit2() allocates, as zconf.h puts it */
+#define rfbDeflateMemoryUsage(windowBits, memLevel) \
+    (((size_t)1 << ((windowBits) + 2)) + ((size_t)1 << ((memLevel) + 9)))
+
+int rfbReclaimTime(rfbClientPtr cl, uint32_t now);
+void rfbReclaimEncoderMemory(rfbClientPtr cl);
 
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 extern void rfbFreeTightData(rfbClientPtr cl);
+extern void rfbReclaimTightData(rfbClientPtr cl);
+extern size_t rfbTightMemoryUsage(rfbClientPtr cl);
 #endif
 
 /* from zrle.c */
 void rfbFreeZrleData(rfbClientPtr cl);
+void rfbReclaimZrleData(rfbClientPtr cl);
+size_t rfbZrleMemoryUsage(rfbClientPtr cl);
 
 #endif
 
@@ -27,6 +153,7 @@ void rfbFreeZrleData(rfbClientPtr cl);
 /* from ultra.c */
 
 extern void rfbFreeUltraData(rfbClientPtr cl);
+extern size_t rfbUltraMemoryUsage(rfbClientPtr cl);
 
 #endif
 
@@ -0,0 +1,106 @@
+/*
+ * reclaim.c - give back the encoder memory of idle clients.
+ *
+ * Every client keeps the state of the encoders it was sent updates with:
+ * zlib streams of a few hundred KB each, buffers as big as the largest
+ * rectangle so far and copies of itself for the encoder threads. With many
+ * clients watching a screen that hardly changes, that is most of the
+ * memory of the server. Once a client was sent no update for
+ * reclaimIdleTime milliseconds, all of it that can be created again is
+ * freed. The zlib streams of Tight go too, the client is told to reset
+ * them with the next Tight rectangle. Those of Zlib and ZRLE cannot be
+ * restarted under the protocol, so only their buffers are given back. What
+ * the client keeps track of, the tile cache and the areas waiting for a
+ * lossless refresh, is kept, and so is updateBuf, which is part of the
+ * client itself.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+size_t rfbClientMemoryUsage(rfbClientPtr cl)
+{
+    size_t size = sizeof(rfbClientRec);
+
+    if (cl->beforeEncBuf)
+        size += cl->beforeEncBufSize;
+    if (cl->afterEncBuf)
+        size += cl->afterEncBufSize;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    if (cl->compStreamInited)
+        size += rfbDeflateMemoryUsage(MAX_WBITS, MAX_MEM_LEVEL);
+    size += rfbZrleMemoryUsage(cl);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    size += rfbTightMemoryUsage(cl);
+#endif
+#endif
+    size += rfbUltraMemoryUsage(cl);
+    size += rfbParallelRectsMemoryUsage(cl);
+    size += rfbTileCacheMemoryUsage(cl);
+    return size;
+}
+
+/*
+ * Call from the thread sending the client's updates. Returns the
+ * milliseconds until its encoder memory is due to be freed, 0 if it is due
+ * now, or -1 if there is nothing to wait for.
+ */
+
+int rfbReclaimTime(rfbClientPtr cl, uint32_t now)
+{
+    uint32_t since;
+
+    if (cl->screen->reclaimIdleTime <= 0 || cl->lastUpdateSentTime == 0 ||
+        cl->reclaimTime == cl->lastUpdateSentTime)
+        return -1;
+    since = now - cl->lastUpdateSentTime;
+    if (since >= (uint32_t)cl->screen->reclaimIdleTime)
+        return 0;
+    return (int)((uint32_t)cl->screen->reclaimIdleTime - since);
+}
+
+/* call with cl->sendMutex held, between updates */
+
+void rfbReclaimEncoderMemory(rfbClientPtr cl)
+{
+    size_t memoryUsage;
+
+    free(cl->beforeEncBuf);
+    cl->beforeEncBuf = NULL;
+    cl->beforeEncBufSize = 0;
+    free(cl->afterEncBuf);
+    cl->afterEncBuf = NULL;
+    cl->afterEncBufSize = 0;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    rfbReclaimZrleData(cl);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    rfbReclaimTightData(cl);
+#endif
+#endif
+    rfbFreeUltraData(cl);
+    rfbFreeParallelRects(cl);
+
+    cl->reclaimTime = cl->lastUpdateSentTime;
+    memoryUsage = rfbClientMemoryUsage(cl);
+    LOCK(cl->statsMutex);
+    cl->memoryReclaims++;
+    cl->memoryUsage = memoryUsage;
+    UNLOCK(cl->statsMutex);
+}
@@ -118,6 +118,7 @@ static const int tight2turbo_subsamp[10] = {
 static void rfbProcessClientProtocolVersion(rfbClientPtr cl);
 static void rfbProcessClientNormalMessage(rfbClientPtr cl);
 static void rfbProcessClientInitMessage(rfbClientPtr cl);
+static rfbBool SendUpdateData(rfbClientPtr cl, const char *buf, int len);
 
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
 void rfbIncrClientRef(rfbClientPtr cl)
@@ -144,12 +145,144 @@ void rfbDecrClientRef(rfbClientPtr cl) {}
 static MUTEX(rfbClientListMutex);
 #endif
 
+/*
+ * The iterators do not walk the client list itself, which is only touched
+ * by connects and disconnects under rfbClientListMutex, but an immutable
+ * array of its clients that is published anew on every change. Readers
+ * take no lock: they announce themselves in one of two counters, picked by
+ * the parity of the epoch, and read the array that is published at that
+ * point.
+ *
+ * The array a change replaces is retired, together with the client that
+ * went away if any, and freed once the epoch moved on twice: the epoch only
+ * moves on while nobody is reading in the parity of its predecessor, so
+ * after two steps no reader from before the change is left.
+ *
+ * Releasing an iterator frees nothing, its caller may hold any lock of the
+ * clients. The retired snapshots are reclaimed by rfbClientConnectionGone()
+ * and from the event loop, with no client lock held.
+ */
+
+#if defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+#define ATOMIC_GET(v)        InterlockedCompareExchange(&(v),0,0)
+#define ATOMIC_SET(v,x)      InterlockedExchange(&(v),(x))
+#define ATOMIC_ADD(v,x)      InterlockedExchangeAdd(&(v),(x))
+#define ATOMIC_GET_PTR(p)    InterlockedCompareExchangePointer((PVOID volatile *)&(p),NULL,NULL)
+#define ATOMIC_SET_PTR(p,x)  InterlockedExchangePointer((PVOID volatile *)&(p),(x))
+#elif defined(__GNUC__)
+#define ATOMIC_GET(v)        __atomic_load_n(&(v),__ATOMIC_SEQ_CST)
+#define ATOMIC_SET(v,x)      __atomic_store_n(&(v),(x),__ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(v,x)      __atomic_add_fetch(&(v),(x),__ATOMIC_SEQ_CST)
+#define ATOMIC_GET_PTR(p)    __atomic_load_n(&(p),__ATOMIC_SEQ_CST)
+#define ATOMIC_SET_PTR(p,x)  __atomic_store_n(&(p),(x),__ATOMIC_SEQ_CST)
+#else
+/* only good without threads */
+#define ATOMIC_GET(v)        (v)
+#define ATOMIC_SET(v,x)      ((v)=(x))
+#define ATOMIC_ADD(v,x)      ((v)+=(x))
+#define ATOMIC_GET_PTR(p)    (p)
+#define ATOMIC_SET_PTR(p,x)  ((p)=(x))
+#endif
+
+typedef struct rfbClientSnapshot {
+  struct rfbClientSnapshot *retiredNext;
+  long retiredEpoch;
+  rfbClientPtr gone;        /* freed along with the snapshot */
+  int count;
+  rfbClientPtr clients[1];
+} rfbClientSnapshot;
+
 struct rfbClientIterator {
-  rfbClientPtr next;
   rfbScreenInfoPtr screen;
+  rfbClientSnapshot *snapshot;
+  long epoch;
+  int index;                /* of the client returned last */
   rfbBool closedToo;
 };
 
+static void rfbFreeClient(rfbClientPtr cl);
+
+/* publishes the clients on the list and retires the previous snapshot,
+   with gone to be freed when it is. Called with rfbClientListMutex held. */
+static void
+rfbPublishClientList(rfbScreenInfoPtr screen, rfbClientPtr gone)
+{
+  rfbClientSnapshot *s, *old;
+  rfbClientPtr cl;
+  int n = 0;
+
+  for(cl = screen->clientHead; cl; cl = cl->next)
+    n++;
+  s = (rfbClientSnapshot *)malloc(sizeof(rfbClientSnapshot) +
+                                  n * sizeof(rfbClientPtr));
+  if(s) {
+    s->retiredNext = NULL;
+    s->gone = NULL;
+    s->count = 0;
+    for(cl = screen->clientHead; cl; cl = cl->next)
+      s->clients[s->count++] = cl;
+  } else
+    rfbErr("rfbPublishClientList: out of memory, clients are not iterated until the next change\n");
+
+  old = screen->clientSnapshot;
+  ATOMIC_SET_PTR(screen->clientSnapshot, s);
+
+  /* the previous snapshot failed as well, but readers may still hold an
+     older one with the client in it */
+  if(!old && gone)
+    old = (rfbClientSnapshot *)calloc(1, sizeof(rfbClientSnapshot));
+  if(!old) {
+    if(gone)
+      rfbErr("rfbPublishClientList: out of memory, leaking client %s\n", gone->host);
+    return;
+  }
+  old->gone = gone;
+  old->retiredEpoch = ATOMIC_GET(screen->clientListEpoch);
+  old->retiredNext = screen->retiredClientSnapshots;
+  ATOMIC_SET_PTR(screen->retiredClientSnapshots, old);
+}
+
+/* frees the retired snapshots no reader can hold any more, and the
+   clients gone with them. Call with no lock of any client held. */
+void
+rfbReclaimClientSnapshots(rfbScreenInfoPtr screen)
+{
+  rfbClientSnapshot *s, *next, *keep = NULL, *done = NULL;
+  long epoch;
+  int step;
+
+  if(!ATOMIC_GET_PTR(screen->retiredClientSnapshots))
+    return;
+
+  LOCK(rfbClientListMutex);
+  epoch = ATOMIC_GET(screen->clientListEpoch);
+  for(step = 0; step < 2 && screen->retiredClientSnapshots; step++) {
+    if(ATOMIC_GET(screen->clientListReaders[(epoch + 1) & 1]) != 0)
+      break;
+    ATOMIC_SET(screen->clientListEpoch, ++epoch);
+  }
+  for(s = screen->retiredClientSnapshots; s; s = next) {
+    next = s->retiredNext;
+    if(epoch - s->retiredEpoch >= 2) {
+      s->retiredNext = done;
+      done = s;
+    } else {
+      s->retiredNext = keep;
+      keep = s;
+    }
+  }
+  ATOMIC_SET_PTR(screen->retiredClientSnapshots, keep);
+  UNLOCK(rfbClientListMutex);
+
+  /* outside the lock, tearing a client down takes its mutexes */
+  for(s = done; s; s = next) {
+    next = s->retiredNext;
+    if(s->gone)
+      rfbFreeClient(s->gone);
+    free(s);
+  }
+}
+
 void
 rfbClientListInit(rfbScreenInfoPtr rfbScreen)
 {
@@ -160,80 +293,108 @@ rfbClientListInit(rfbScreenInfoPtr rfbScreen)
 	exit(1);
     }
     rfbScreen->clientHead = NULL;
+    rfbScreen->clientSnapshot = NULL;
+    rfbScreen->retiredClientSnapshots = NULL;
+    rfbScreen->clientListEpoch = 0;
+    rfbScreen->clientListReaders[0] = rfbScreen->clientListReaders[1] = 0;
     INIT_MUTEX(rfbClientListMutex);
 }
 
-rfbClientIteratorPtr
-rfbGetClientIterator(rfbScreenInfoPtr rfbScreen)
+/* frees the snapshots and the clients still waiting for their readers,
+   when the screen goes away and there are no readers left */
+void
+rfbClientListFree(rfbScreenInfoPtr rfbScreen)
+{
+  rfbClientSnapshot *s, *next;
+
+  for(s = rfbScreen->retiredClientSnapshots; s; s = next) {
+    next = s->retiredNext;
+    if(s->gone)
+      rfbFreeClient(s->gone);
+    free(s);
+  }
+  rfbScreen->retiredClientSnapshots = NULL;
+  free(rfbScreen->clientSnapshot);
+  rfbScreen->clientSnapshot = NULL;
+}
+
+static rfbClientIteratorPtr
+rfbNewClientIterator(rfbScreenInfoPtr rfbScreen, rfbBool closedToo)
 {
   rfbClientIteratorPtr i =
     (rfbClientIteratorPtr)malloc(sizeof(struct rfbClientIterator));
-  if(i) {
-    i->next = NULL;
-    i->screen = rfbScreen;
-    i->closedToo = FALSE;
+  long epoch;
+
+  if(!i)
+    return NULL;
+  i->screen = rfbScreen;
+  i->index = -1;
+  i->closedToo = closedToo;
+
+  /* register in the current epoch; if it moved on in between, the
+     reclaimer may not have seen us */
+  for(;;) {
+    epoch = ATOMIC_GET(rfbScreen->clientListEpoch);
+    ATOMIC_ADD(rfbScreen->clientListReaders[epoch & 1], 1);
+    if(ATOMIC_GET(rfbScreen->clientListEpoch) == epoch)
+      break;
+    ATOMIC_ADD(rfbScreen->clientListReaders[epoch & 1], -1);
   }
+  i->epoch = epoch;
+  i->snapshot = (rfbClientSnapshot *)ATOMIC_GET_PTR(rfbScreen->clientSnapshot);
   return i;
 }
 
+rfbClientIteratorPtr
+rfbGetClientIterator(rfbScreenInfoPtr rfbScreen)
+{
+  return rfbNewClientIterator(rfbScreen, FALSE);
+}
+
 rfbClientIteratorPtr
 rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen)
 {
-  rfbClientIteratorPtr i =
-    (rfbClientIteratorPtr)malloc(sizeof(struct rfbClientIterator));
-  if(i) {
-    i->next = NULL;
-    i->screen = rfbScreen;
-    i->closedToo = TRUE;
-  }
-  return i;
+  return rfbNewClientIterator(rfbScreen, TRUE);
 }
 
 rfbClientPtr
 rfbClientIteratorHead(rfbClientIteratorPtr i)
 {
-#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
-  if(i->next != 0) {
-    rfbDecrClientRef(i->next);
-    rfbIncrClientRef(i->screen->clientHead);
-  }
-#endif
-  LOCK(rfbClientListMutex);
-  i->next = i->screen->clientHead;
-  UNLOCK(rfbClientListMutex);
-  return i->next;
+  i->index = -1;
+  return rfbClientIteratorNext(i);
 }
 
 rfbClientPtr
 rfbClientIteratorNext(rfbClientIteratorPtr i)
 {
+  rfbClientSnapshot *s;
+
   if (!i)
     return NULL;
-  if(i->next == 0) {
-    LOCK(rfbClientListMutex);
-    i->next = i->screen->clientHead;
-    UNLOCK(rfbClientListMutex);
-  } else {
-    rfbClientPtr cl = i->next;
-    i->next = i->next->next;
-    rfbDecrClientRef(cl);
-  }
+  s = i->snapshot;
+  if(!s)
+    return NULL;
 
+  i->index++;
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
-    if(!i->closedToo)
-      while(i->next && i->next->sock<0)
-        i->next = i->next->next;
-    if(i->next)
-      rfbIncrClientRef(i->next);
+  if(!i->closedToo)
+    while(i->index < s->count && s->clients[i->index]->sock<0)
+      i->index++;
 #endif
-
-    return i->next;
+  if(i->index >= s->count) {
+    /* start over on the next call */
+    i->index = -1;
+    return NULL;
+  }
+  return s->clients[i->index];
 }
 
 void
 rfbReleaseClientIterator(rfbClientIteratorPtr iterator)
 {
-  if(iterator && iterator->next) rfbDecrClientRef(iterator->next);
+  if(!iterator)
+    return;
+  ATOMIC_ADD(iterator->screen->clientListReaders[iterator->epoch & 1], -1);
   free(iterator);
 }
 
@@ -293,6 +454,26 @@ rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_)
         rfbLog("rfbSetProtocolVersion(%d,%d) set to invalid values\n", major_, minor_);
 }
 
+#if defined(LIBVNCSERVER_HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+/*
+ * The output thread waits on updateCond with a deadline, which must not move
+ * when the wall clock is set.
+ */
+
+static void
+initUpdateCond(rfbClientPtr cl)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cl->updateCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+#else
+#define initUpdateCond(cl) INIT_COND((cl)->updateCond)
+#endif
+
 /*
  * rfbNewClient is called when a new connection has been made by whatever
  * means.
@@ -326,6 +507,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
     cl->scaledScreen = rfbScreen;
     cl->scaledScreen->scaledScreenRefCount++;
 
+    INIT_MUTEX(cl->statsMutex);
     rfbResetStats(cl);
 
     cl->clientData = NULL;
@@ -396,28 +578,18 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
    
       cl->modifiedRegion =
 	sraRgnCreateRect(0,0,rfbScreen->width,rfbScreen->height);
+      cl->damageGeneration = rfbDamageJournalGeneration(rfbScreen);
 
       INIT_MUTEX(cl->updateMutex);
-      INIT_COND(cl->updateCond);
+      initUpdateCond(cl);
 
       cl->requestedRegion = sraRgnCreate();
+      cl->continuousUpdatesRegion = sraRgnCreate();
 
       cl->format = cl->screen->serverFormat;
       cl->translateFn = rfbTranslateNone;
       cl->translateLookupTable = NULL;
 
-      LOCK(rfbClientListMutex);
-#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
-      cl->refCount = 0;
-#endif
-      cl->next = rfbScreen->clientHead;
-      cl->prev = NULL;
-      if (rfbScreen->clientHead)
-        rfbScreen->clientHead->prev = cl;
-
-      rfbScreen->clientHead = cl;
-      UNLOCK(rfbClientListMutex);
-
 #if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
       cl->tightQualityLevel = -1;
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
@@ -448,6 +620,12 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->useExtDesktopSize = FALSE;
       cl->requestedDesktopSizeChange = 0;
       cl->lastDesktopSizeChangeError = 0;
+      cl->enableFence = FALSE;
+      cl->enableContinuousUpdates = FALSE;
+      cl->continuousUpdates = FALSE;
+      cl->fenceProbePending = FALSE;
+      cl->fenceRTT = -1;
+      cl->fenceMinRTT = -1;
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
       cl->compStreamInited = FALSE;
@@ -465,12 +643,40 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->extensions = NULL;
 
       cl->lastPtrX = -1;
+      cl->focusX = cl->focusY = -1;
+
+      cl->scheduleWeight = 1;
+      cl->maxFps = rfbScreen->maxFps;
+      cl->maxBandwidth = rfbScreen->maxBandwidth;
+      cl->memoryUsage = rfbClientMemoryUsage(cl);
 
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
       cl->pipe_notify_client_thread[0] = -1;
       cl->pipe_notify_client_thread[1] = -1;
 #endif
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+      cl->enableExtendedClipboard = FALSE;
+      cl->extClipboardUserCap = 0x1B000007; /* text, rtf, html, request, notify, provide */
+      cl->extClipboardMaxUnsolicitedSize = 20 * (1 << 20); /* 20 MiB */
+      cl->extClipboardData = NULL;
+      cl->extClipboardDataSize = 0;
+#endif
+
+      /* iterators see the client from here on, set it up before */
+      LOCK(rfbClientListMutex);
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+      cl->refCount = 0;
+#endif
+      cl->next = rfbScreen->clientHead;
+      cl->prev = NULL;
+      if (rfbScreen->clientHead)
+        rfbScreen->clientHead->prev = cl;
+
+      rfbScreen->clientHead = cl;
+      rfbPublishClientList(rfbScreen, NULL);
+      UNLOCK(rfbClientListMutex);
+
 #ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
       /*
@@ -485,14 +691,6 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 #endif
 #endif
 
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-      cl->enableExtendedClipboard = FALSE;
-      cl->extClipboardUserCap = 0x1B000007; /* text, rtf, html, request, notify, provide */
-      cl->extClipboardMaxUnsolicitedSize = 20 * (1 << 20); /* 20 MiB */
-      cl->extClipboardData = NULL;
-      cl->extClipboardDataSize = 0;
-#endif
-
       sprintf(pv,rfbProtocolVersionFormat,rfbScreen->protocolMajorVersion, 
               rfbScreen->protocolMinorVersion);
 
@@ -552,9 +750,7 @@ rfbNewUDPClient(rfbScreenInfoPtr rfbScreen)
 void
 rfbClientConnectionGone(rfbClientPtr cl)
 {
-#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
-    int i;
-#endif
+    rfbScreenInfoPtr screen = cl->screen;
 
     LOCK(rfbClientListMutex);
 
@@ -580,12 +776,51 @@ rfbClientConnectionGone(rfbClientPtr cl)
     }
 #endif
 
-    if(cl->sock != RFB_INVALID_SOCKET)
-	rfbCloseSocket(cl->sock);
+    if(cl->sock != RFB_INVALID_SOCKET) {
+       rfbSocket sock = cl->sock;
+
+       FD_CLR(sock,&(cl->screen->allFds));
+       /* iterators may still reach cl: nobody may write to the socket
+          number once it can be reused */
+       LOCK(cl->sendMutex);
+       cl->sock = RFB_INVALID_SOCKET;
+       UNLOCK(cl->sendMutex);
+       rfbCloseSocket(sock);
+    }
 
     if (cl->scaledScreen!=NULL)
         cl->scaledScreen->scaledScreenRefCount--;
 
+    cl->clientGoneHook(cl);
+
+    rfbLog("Client %s gone\n",cl->host);
+
+    if (cl->screen->pointerClient == cl)
+        cl->screen->pointerClient = NULL;
+
+    rfbPrintStats(cl);
+    rfbMetricsClientGone(cl);
+
+    /* the memory stays until no iterator can reach cl any more, which
+       may be right away: cl is not to be touched after this */
+    LOCK(rfbClientListMutex);
+    rfbPublishClientList(screen, cl);
+    UNLOCK(rfbClientListMutex);
+    rfbReclaimClientSnapshots(screen);
+}
+
+/*
+ * rfbFreeClient releases what is left of a client after
+ * rfbClientConnectionGone, once the iterators are done with it.
+ */
+
+static void
+rfbFreeClient(rfbClientPtr cl)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+    int i;
+#endif
+
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     rfbFreeZrleData(cl);
 
@@ -595,17 +830,14 @@ rfbClientConnectionGone(rfbClientPtr cl)
 #endif
 
     rfbFreeUltraData(cl);
+    rfbFreeParallelRects(cl);
+    rfbTileCacheFree(cl);
+    rfbLosslessRefreshFree(cl);
 
     /* free buffers holding pixel data before and after encoding */
     free(cl->beforeEncBuf);
     free(cl->afterEncBuf);
 
-    if(cl->sock != RFB_INVALID_SOCKET)
-       FD_CLR(cl->sock,&(cl->screen->allFds));
-
-    cl->clientGoneHook(cl);
-
-    rfbLog("Client %s gone\n",cl->host);
     free(cl->host);
 	
     if (cl->wsctx != NULL){
@@ -629,12 +861,10 @@ rfbClientConnectionGone(rfbClientPtr cl)
 #endif
 #endif
 
-    if (cl->screen->pointerClient == cl)
-        cl->screen->pointerClient = NULL;
-
     sraRgnDestroy(cl->modifiedRegion);
     sraRgnDestroy(cl->requestedRegion);
     sraRgnDestroy(cl->copyRegion);
+    sraRgnDestroy(cl->continuousUpdatesRegion);
 
     free(cl->translateLookupTable);
 
@@ -657,8 +887,8 @@ rfbClientConnectionGone(rfbClientPtr cl)
     }
 #endif
 
-    rfbPrintStats(cl);
     rfbResetStats(cl);
+    TINI_MUTEX(cl->statsMutex);
 
     free(cl);
 }
@@ -1007,6 +1237,10 @@ rfbSendSupportedMessages(rfbClientPtr cl)
     rfbSetBit(msgs.server2client, rfbResizeFrameBuffer);
     rfbSetBit(msgs.server2client, rfbPalmVNCReSizeFrameBuffer);
     rfbSetBit(msgs.client2server, rfbSetDesktopSize);
+    rfbSetBit(msgs.client2server, rfbEnableContinuousUpdates);
+    rfbSetBit(msgs.client2server, rfbFence);
+    rfbSetBit(msgs.server2client, rfbEndOfContinuousUpdates);
+    rfbSetBit(msgs.server2client, rfbFence);
 
     if (cl->screen->xvpHook) {
         rfbSetBit(msgs.client2server, rfbXvp);
@@ -1064,6 +1298,8 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 	rfbEncodingSupportedMessages,
 	rfbEncodingSupportedEncodings,
 	rfbEncodingServerIdentity,
+	rfbEncodingTileCacheStore,
+	rfbEncodingTileCacheRef,
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     rfbEncodingExtendedClipboard,
 #endif
@@ -1191,6 +1427,100 @@ rfbSendXvp(rfbClientPtr cl, uint8_t version, uint8_t code)
 }
 
 
+/*
+ * Fence and ContinuousUpdates.
+ */
+
+static int
+rfbFillFenceMsg(char *buf, uint32_t flags, uint8_t length, const char *data)
+{
+    rfbFenceMsg f;
+
+    memset((char *)&f, 0, sizeof(f));
+    f.type = rfbFence;
+    f.flags = Swap32IfLE(flags);
+    f.length = length;
+
+    memcpy(buf, (char *)&f, sz_rfbFenceMsg);
+    memcpy(buf + sz_rfbFenceMsg, data, length);
+
+    return sz_rfbFenceMsg + length;
+}
+
+static rfbBool
+rfbSendFence(rfbClientPtr cl, uint32_t flags, uint8_t length, const char *data)
+{
+    char buf[sz_rfbFenceMsg + rfbFenceMaxPayload];
+    int len = rfbFillFenceMsg(buf, flags, length, data);
+
+    LOCK(cl->sendMutex);
+    if (rfbWriteExact(cl, buf, len) < 0) {
+      rfbLogPerror("rfbSendFence: write");
+      rfbCloseClient(cl);
+      UNLOCK(cl->sendMutex);
+      return FALSE;
+    }
+    UNLOCK(cl->sendMutex);
+
+    rfbStatRecordMessageSent(cl, rfbFence, len, len);
+
+    return TRUE;
+}
+
+/*
+ * The payload of our own Fence requests is the monotonic time they were
+ * sent at, so the answer tells the round trip time. Since they block
+ * before, the time includes the client processing all updates sent so far.
+ */
+
+static rfbBool
+rfbSendFenceProbe(rfbClientPtr cl)
+{
+    char buf[sz_rfbFenceMsg + sizeof(uint32_t)];
+    uint32_t now;
+    int len;
+
+    LOCK(cl->sendMutex);
+    now = rfbGetMonotonicTimeMs();
+    len = rfbFillFenceMsg(buf, rfbFenceFlagRequest | rfbFenceFlagBlockBefore,
+                          sizeof(now), (char *)&now);
+    if (rfbWriteExact(cl, buf, len) < 0) {
+      rfbLogPerror("rfbSendFenceProbe: write");
+      rfbCloseClient(cl);
+      UNLOCK(cl->sendMutex);
+      return FALSE;
+    }
+    cl->fenceProbePending = TRUE;
+    UNLOCK(cl->sendMutex);
+
+    rfbStatRecordMessageSent(cl, rfbFence, len, len);
+
+    return TRUE;
+}
+
+static rfbBool
+rfbSendEndOfContinuousUpdates(rfbClientPtr cl)
+{
+    rfbEndOfContinuousUpdatesMsg eocu;
+
+    eocu.type = rfbEndOfContinuousUpdates;
+
+    LOCK(cl->sendMutex);
+    if (rfbWriteExact(cl, (char *)&eocu, sz_rfbEndOfContinuousUpdatesMsg) < 0) {
+      rfbLogPerror("rfbSendEndOfContinuousUpdates: write");
+      rfbCloseClient(cl);
+      UNLOCK(cl->sendMutex);
+      return FALSE;
+    }
+    UNLOCK(cl->sendMutex);
+
+    rfbStatRecordMessageSent(cl, rfbEndOfContinuousUpdates,
+        sz_rfbEndOfContinuousUpdatesMsg, sz_rfbEndOfContinuousUpdatesMsg);
+
+    return TRUE;
+}
+
+
 rfbBool rfbSendTextChatMessage(rfbClientPtr cl, uint32_t length, char *buffer)
 {
     rfbTextChatMsg tc;
@@ -2267,6 +2597,11 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	cl->readyForSetColourMapEntries = TRUE;
         cl->screen->setTranslateFunction(cl);
 
+        /* the tiles the client keeps are in the old format */
+        LOCK(cl->updateMutex);
+        cl->tileCacheReset = TRUE;
+        UNLOCK(cl->updateMutex);
+
         rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbSetPixelFormatMsg, sz_rfbSetPixelFormatMsg);
 
         return;
@@ -2297,6 +2632,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
      */
     case rfbSetEncodings:
     {
+        uint32_t tileCacheSize = 0;
 
         if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
                            sz_rfbSetEncodingsMsg - 1)) <= 0) {
@@ -2319,6 +2655,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
         /* Reset all flags to defaults (allows us to switch between PointerPos and Server Drawn Cursors) */
         cl->preferredEncoding=-1;
+        cl->advertisedEncodings      = 0;
         cl->useCopyRect              = FALSE;
         cl->useNewFBSize             = FALSE;
         cl->useExtDesktopSize        = FALSE;
@@ -2339,6 +2676,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
         cl->turboQualityLevel        = -1;
 #endif
 #endif
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+        /* or the adaptive ceiling would keep the level it was lowered to */
+        cl->zlibCompressLevel        = 5;
+#endif
 
 
         for (i = 0; i < msg.se.nEncodings; i++) {
@@ -2374,6 +2715,8 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
             /* The first supported encoding is the 'preferred' encoding */
                 if (cl->preferredEncoding == -1)
                     cl->preferredEncoding = enc;
+                if (enc < 32)
+                    cl->advertisedEncodings |= (uint32_t)1 << enc;
 
 
                 break;
@@ -2458,6 +2801,26 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
                   cl->enableServerIdentity = TRUE;
                 }
                 break;
+            case rfbEncodingFence:
+                if (!cl->enableFence) {
+                  rfbLog("Enabling Fence protocol extension for client "
+                          "%s\n", cl->host);
+                  cl->enableFence = TRUE;
+                  /* tells the client we support fences, too */
+                  if (!rfbSendFenceProbe(cl))
+                    return;
+                }
+                break;
+            case rfbEncodingContinuousUpdates:
+                if (!cl->enableContinuousUpdates) {
+                  rfbLog("Enabling ContinuousUpdates protocol extension for client "
+                          "%s\n", cl->host);
+                  cl->enableContinuousUpdates = TRUE;
+                  /* tells the client we support continuous updates */
+                  if (!rfbSendEndOfContinuousUpdates(cl))
+                    return;
+                }
+                break;
             case rfbEncodingXvp:
                 if (cl->screen->xvpHook) {
                   rfbLog("Enabling Xvp protocol extension for client "
@@ -2484,6 +2847,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
                 break;
 #endif
             default:
+		if ( enc >= (uint32_t)rfbEncodingTileCache0 &&
+		     enc <= (uint32_t)rfbEncodingTileCache15 ) {
+		    tileCacheSize = (uint32_t)1 << (enc & 0x0F);
+		} else
 #if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
 		if ( enc >= (uint32_t)rfbEncodingCompressLevel0 &&
 		     enc <= (uint32_t)rfbEncodingCompressLevel9 ) {
@@ -2567,6 +2934,17 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+        LOCK(cl->updateMutex);
+        if (tileCacheSize != cl->tileCacheClientSize) {
+            if (tileCacheSize > 0)
+                rfbLog("Enabling TileCache protocol extension with %u MiB for "
+                       "client %s\n", tileCacheSize, cl->host);
+            cl->tileCacheClientSize = tileCacheSize;
+        }
+        UNLOCK(cl->updateMutex);
+
+        rfbAdaptiveReset(cl);
+
         if (cl->preferredEncoding == -1) {
             if (lastPreferredEncoding==-1) {
                 cl->preferredEncoding = rfbEncodingRaw;
@@ -2673,6 +3051,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbKeyEventMsg, sz_rfbKeyEventMsg);
 
 	if(!cl->viewOnly) {
+	    cl->lastInputTime = rfbGetMonotonicTimeMs();
 	    cl->screen->kbdAddEvent(msg.ke.down, (rfbKeySym)Swap32IfLE(msg.ke.key), cl);
 	}
 
@@ -2700,6 +3079,9 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	    cl->screen->pointerClient = cl;
 
 	if(!cl->viewOnly) {
+	    cl->focusX = ScaleX(cl->scaledScreen, cl->screen, Swap16IfLE(msg.pe.x));
+	    cl->focusY = ScaleY(cl->scaledScreen, cl->screen, Swap16IfLE(msg.pe.y));
+	    cl->lastInputTime = rfbGetMonotonicTimeMs();
 	    if (msg.pe.buttonMask != cl->lastPtrButtons ||
 		    cl->screen->deferPtrUpdateTime == 0) {
 		cl->screen->ptrAddEvent(msg.pe.buttonMask,
@@ -3016,6 +3398,109 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
       }
       return;
 
+    case rfbEnableContinuousUpdates:
+    {
+        sraRegionPtr tmpRegion;
+
+        if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+            sz_rfbEnableContinuousUpdatesMsg - 1)) <= 0) {
+            if (n != 0)
+              rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbEnableContinuousUpdatesMsg,
+                                 sz_rfbEnableContinuousUpdatesMsg);
+
+        if (!cl->enableContinuousUpdates) {
+            rfbLog("Ignoring EnableContinuousUpdates from client that did not announce support\n");
+            return;
+        }
+
+        if (!msg.ecu.enable) {
+            LOCK(cl->updateMutex);
+            cl->continuousUpdates = FALSE;
+            sraRgnMakeEmpty(cl->continuousUpdatesRegion);
+            UNLOCK(cl->updateMutex);
+            rfbSendEndOfContinuousUpdates(cl);
+            return;
+        }
+
+        if (!rectSwapIfLEAndClip(&msg.ecu.x,&msg.ecu.y,&msg.ecu.w,&msg.ecu.h,cl)) {
+            rfbLog("Warning, ignoring EnableContinuousUpdates: %dXx%dY-%dWx%dH\n",
+                   msg.ecu.x, msg.ecu.y, msg.ecu.w, msg.ecu.h);
+            return;
+        }
+
+        tmpRegion = sraRgnCreateRect(msg.ecu.x, msg.ecu.y,
+                                     msg.ecu.x+msg.ecu.w, msg.ecu.y+msg.ecu.h);
+        LOCK(cl->updateMutex);
+        cl->continuousUpdates = TRUE;
+        sraRgnMakeEmpty(cl->continuousUpdatesRegion);
+        sraRgnOr(cl->continuousUpdatesRegion,tmpRegion);
+        sraRgnOr(cl->requestedRegion,tmpRegion);
+        TSIGNAL(cl->updateCond);
+        UNLOCK(cl->updateMutex);
+        sraRgnDestroy(tmpRegion);
+        return;
+    }
+
+    case rfbFence:
+    {
+        char payload[rfbFenceMaxPayload];
+        uint32_t flags;
+
+        if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
+            sz_rfbFenceMsg - 1)) <= 0) {
+            if (n != 0)
+              rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+
+        if (msg.f.length > rfbFenceMaxPayload) {
+            rfbLog("Fence payload too large (%d bytes)\n", msg.f.length);
+            rfbCloseClient(cl);
+            return;
+        }
+
+        if (msg.f.length > 0 &&
+            (n = rfbReadExact(cl, payload, msg.f.length)) <= 0) {
+            if (n != 0)
+              rfbLogPerror("rfbProcessClientNormalMessage: read");
+            rfbCloseClient(cl);
+            return;
+        }
+        rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbFenceMsg + msg.f.length,
+                                 sz_rfbFenceMsg + msg.f.length);
+
+        flags = Swap32IfLE(msg.f.flags);
+
+        if (flags & rfbFenceFlagRequest) {
+            /* Messages are processed in order and the answer is queued
+               behind any update in progress, which satisfies BlockBefore
+               and BlockAfter. SyncNext is not supported. */
+            rfbSendFence(cl, flags & rfbFenceFlagsSupported & ~rfbFenceFlagRequest,
+                         msg.f.length, payload);
+            return;
+        }
+
+        /* answer to our probe, which the output thread may send meanwhile */
+        LOCK(cl->sendMutex);
+        if (cl->fenceProbePending && msg.f.length == sizeof(uint32_t)) {
+            uint32_t sent;
+            memcpy((char *)&sent, payload, sizeof(sent));
+            LOCK(cl->statsMutex);
+            cl->fenceRTT = (int)(rfbGetMonotonicTimeMs() - sent);
+            UNLOCK(cl->statsMutex);
+            if (cl->fenceMinRTT < 0 || cl->fenceRTT < cl->fenceMinRTT)
+                cl->fenceMinRTT = cl->fenceRTT;
+            cl->fenceProbePending = FALSE;
+        }
+        UNLOCK(cl->sendMutex);
+        return;
+    }
+
     case rfbSetDesktopSize:
 
         if ((n = rfbReadExact(cl, ((char *)&msg) + 1,
@@ -3110,6 +3595,122 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+/*
+ * rfbNumCodedRects - how many rectangles the given encoding turns one
+ * rectangle of the update region into. 0 means the number is not known in
+ * advance and the update has to be terminated by a LastRect marker.
+ */
+
+int
+rfbNumCodedRects(rfbClientPtr cl, int encoding, int x, int y, int w, int h)
+{
+    switch (encoding) {
+    case rfbEncodingCoRRE:
+        return ((w-1)/cl->correMaxWidth+1) * ((h-1)/cl->correMaxHeight+1);
+    case rfbEncodingUltra:
+        return (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        return (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    case rfbEncodingTight:
+        return rfbNumCodedRectsTight(cl, x, y, w, h);
+#endif
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
+    case rfbEncodingTightPng:
+        return rfbNumCodedRectsTight(cl, x, y, w, h);
+#endif
+    }
+    return 1;
+}
+
+static rfbBool
+rfbEncodingSplitsRects(int encoding)
+{
+    switch (encoding) {
+    /* CoRRE splits the screen into smaller squares */
+    case rfbEncodingCoRRE:
+    /* Ultra encoding splits rectangles up into smaller chunks */
+    case rfbEncodingUltra:
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    /* Zlib encoding splits rectangles up into smaller chunks */
+    case rfbEncodingZlib:
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    /* Tight encoding counts the rectangles differently */
+    case rfbEncodingTight:
+#endif
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    case rfbEncodingTightPng:
+#endif
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * rfbChooseRectEncoding - pick the encoding for one rectangle of an update
+ * from the encodings the client advertised: Tight for solid areas and,
+ * if the client asked for JPEG, for photos; ZRLE for text and other
+ * sharp-edged content which JPEG would blur. Only clients preferring one
+ * of the compressing encodings are switched around.
+ */
+
+static int
+rfbChooseRectEncoding(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    int preferred = cl->preferredEncoding;
+    rfbBool zrle, tight, tightJpeg = FALSE;
+
+    switch (preferred) {
+    case rfbEncodingHextile:
+    case rfbEncodingZlib:
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+    case rfbEncodingTight:
+        break;
+    default:
+        return preferred;
+    }
+
+    /* only encodings this server supports make it into the mask */
+    zrle = (cl->advertisedEncodings & (1 << rfbEncodingZRLE)) != 0;
+    tight = (cl->advertisedEncodings & (1 << rfbEncodingTight)) != 0;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    tightJpeg = tight && cl->turboQualityLevel != -1;
+#endif
+    if (!zrle && !tight)
+        return preferred;
+
+    switch (rfbClassifyRect(cl->scaledScreen, x, y, w, h)) {
+    case RFB_RECT_SOLID:
+        /* Tight sends a solid rectangle as a single pixel */
+        if (tight)
+            return rfbEncodingTight;
+        break;
+    case RFB_RECT_PALETTE:
+        if (preferred == rfbEncodingHextile || preferred == rfbEncodingZlib) {
+            if (zrle)
+                return rfbEncodingZRLE;
+            if (tight)
+                return rfbEncodingTight;
+        }
+        break;
+    case RFB_RECT_TEXT:
+        /* ZYWRLE clients asked for lossy wavelets, leave them alone */
+        if (zrle && preferred != rfbEncodingZYWRLE)
+            return rfbEncodingZRLE;
+        break;
+    case RFB_RECT_PHOTO:
+        if (tightJpeg)
+            return rfbEncodingTight;
+        break;
+    }
+    return preferred;
+}
+
+
 /*
  * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
  * the RFB client.
@@ -3121,10 +3722,11 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
                          sraRegionPtr givenUpdateRegion)
 {
     sraRectangleIterator* i=NULL;
-    sraRect rect;
-    int nUpdateRegionRects;
+    sraRect rect, *rects = NULL;
+    int nUpdateRegionRects, nRects, nRect, nParallelRects, nTileCacheRects;
+    int *rectEncodings = NULL;
     rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
-    sraRegionPtr updateRegion,updateCopyRegion,tmpRegion;
+    sraRegionPtr updateRegion,updateCopyRegion,tmpRegion,refreshRegion;
     int dx, dy;
     rfbBool sendCursorShape = FALSE;
     rfbBool sendCursorPos = FALSE;
@@ -3133,11 +3735,17 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
     rfbBool result = TRUE;
+    uint32_t damageTime = 0;
+    uint64_t encodeStart;
+    size_t memoryUsage;
+    int encoding;
     
 
     if(cl->screen->displayHook)
       cl->screen->displayHook(cl);
 
+    rfbAdaptiveUpdateStart(cl);
+
     /*
      * If framebuffer size was changed and the client supports NewFBSize
      * encoding, just send NewFBSize marker and return.
@@ -3236,6 +3844,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     }
 
     LOCK(cl->updateMutex);
+    rfbDamageJournalCatchUp(cl);
 
     /*
      * The modifiedRegion may overlap the destination copyRegion.  We remove
@@ -3272,10 +3881,20 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 		    y=0;
 	    cl->progressiveSliceY=y;
     }
+    rfbFocusSplitLocked(cl, updateRegion);
 
     sraRgnOr(updateRegion,cl->copyRegion);
-    if(!sraRgnAnd(updateRegion,cl->requestedRegion) &&
-       sraRgnEmpty(updateRegion) &&
+    sraRgnAnd(updateRegion,cl->requestedRegion);
+
+    /*
+     * Areas sent lossy a while ago are refreshed along with the update.
+     */
+    refreshRegion = NULL;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    refreshRegion = rfbLosslessRefreshTakeLocked(cl, updateRegion);
+#endif
+
+    if(sraRgnEmpty(updateRegion) && refreshRegion == NULL &&
        (cl->enableCursorShapeUpdates ||
 	(cl->cursorX == cl->screen->cursorX && cl->cursorY == cl->screen->cursorY)) &&
        !sendCursorShape && !sendCursorPos && !sendKeyboardLedState &&
@@ -3328,6 +3947,21 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      sraRgnMakeEmpty(cl->copyRegion);
      cl->copyDX = 0;
      cl->copyDY = 0;
+
+     /* with continuous updates, the next update is implicitly requested */
+     if (cl->continuousUpdates)
+       sraRgnOr(cl->requestedRegion,cl->continuousUpdatesRegion);
+
+     /* restart the coalescing timer unless damage outside the
+        requestedRegion is left over, which is then due right away */
+     damageTime = cl->firstDamageTime;
+     cl->lastUpdateSentTime = rfbGetMonotonicTimeMs();
+     if (cl->damageSuperseded) {
+       cl->droppedUpdates++;
+       cl->damageSuperseded = FALSE;
+     }
+     if (sraRgnEmpty(cl->modifiedRegion))
+       cl->firstDamageTime = 0;
    
      UNLOCK(cl->updateMutex);
    
@@ -3348,89 +3982,86 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      */
     
     rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
-    if (cl->preferredEncoding == rfbEncodingCoRRE) {
-        nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-	    int rectsPerRow, rows;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
-	    rows = (h-1)/cl->correMaxHeight+1;
-	    nUpdateRegionRects += rectsPerRow*rows;
-        }
-	sraRgnReleaseIterator(i); i=NULL;
-    } else if (cl->preferredEncoding == rfbEncodingUltra) {
-        nUpdateRegionRects = 0;
-        
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-            nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
-          }
-        sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-    } else if (cl->preferredEncoding == rfbEncodingZlib) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-    } else if (cl->preferredEncoding == rfbEncodingTight) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
+
+    /*
+     * Rectangles are merged where that is cheaper than their overhead.
+     * Encodings that split rectangles count them differently, for the
+     * others they are also merged down to maxRectsPerUpdate.
+     */
+    rfbSimplifyUpdateRegion(cl, updateRegion,
+			    rfbEncodingSplitsRects(cl->preferredEncoding) ?
+			    0 : cl->screen->maxRectsPerUpdate);
+
+    /*
+     * A scaled framebuffer is only brought up to date where it is sent.
+     */
+    if (cl->screen != cl->scaledScreen) {
+	tmpRegion = sraRgnCreateRgn(updateRegion);
+	sraRgnOr(tmpRegion, updateCopyRegion);
+	rfbScaledScreenRefresh(cl, tmpRegion);
+	sraRgnDestroy(tmpRegion);
+    }
+
+    rfbLosslessRefreshSent(cl, updateRegion, updateCopyRegion, dx, dy);
+
+    /*
+     * Tiles the client keeps are not encoded again.
+     */
+    nTileCacheRects = rfbTileCacheLookUp(cl, updateRegion);
+
+    /*
+     * What is near the client's pointer goes first.
+     */
+    rects = rfbFocusOrderRects(cl, updateRegion, &nRects);
+    if (nRects < 0) {
+	rfbLogPerror("rfbSendFramebufferUpdate: malloc");
+	goto updateFailed;
+    }
+
+    /*
+     * Choose the encoding of every rectangle before counting them, the
+     * choice must not change between counting and sending.
+     */
+    nUpdateRegionRects = 0;
+    if (cl->screen->contentAwareEncoding) {
+	if (nRects > 0 &&
+	    (rectEncodings = (int *)malloc(nRects * sizeof(int))) == NULL) {
+	    rfbLogPerror("rfbSendFramebufferUpdate: malloc");
+	    goto updateFailed;
 	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
-#endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
-    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
+    }
+    for(nRect = 0; nRect < nRects; nRect++){
+        int x = rects[nRect].x1;
+        int y = rects[nRect].y1;
+        int w = rects[nRect].x2 - x;
+        int h = rects[nRect].y2 - y;
+        int encoding = cl->preferredEncoding, n;
+        /* We need to count the number of rects in the scaled screen */
+        if (cl->screen!=cl->scaledScreen)
+            rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
+        if (rectEncodings)
+            encoding = rectEncodings[nRect] = rfbChooseRectEncoding(cl, x, y, w, h);
+        if (nUpdateRegionRects == 0xFFFF)
+            continue;
+        n = rfbNumCodedRects(cl, encoding, x, y, w, h);
+        if (n == 0) {
+            nUpdateRegionRects = 0xFFFF;
+            if (!rectEncodings)
+                break;
+            continue;
+        }
+        nUpdateRegionRects += n;
+    }
+
+    nParallelRects = rfbPrepareParallelRects(cl, rects, nRects, rectEncodings);
+    if (nParallelRects > 0)
+        nUpdateRegionRects = nParallelRects;
+
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    if (refreshRegion != NULL && nUpdateRegionRects != 0xFFFF) {
+	for(i = sraRgnGetIterator(refreshRegion); sraRgnIteratorNext(i,&rect); ){
+	    int n = rfbNumCodedRectsTight(cl, rect.x1, rect.y1,
+	                                  rect.x2 - rect.x1, rect.y2 - rect.y1);
 	    if (n == 0) {
 		nUpdateRegionRects = 0xFFFF;
 		break;
@@ -3438,38 +4069,13 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	    nUpdateRegionRects += n;
 	}
 	sraRgnReleaseIterator(i); i=NULL;
-#endif
-    } else {
-        nUpdateRegionRects = sraRgnCountRects(updateRegion);
     }
+#endif
 
     fu->type = rfbFramebufferUpdate;
     if (nUpdateRegionRects != 0xFFFF) {
-	if(cl->screen->maxRectsPerUpdate>0
-	   /* CoRRE splits the screen into smaller squares */
-	   && cl->preferredEncoding != rfbEncodingCoRRE
-	   /* Ultra encoding splits rectangles up into smaller chunks */
-           && cl->preferredEncoding != rfbEncodingUltra
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-	   /* Zlib encoding splits rectangles up into smaller chunks */
-	   && cl->preferredEncoding != rfbEncodingZlib
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-	   /* Tight encoding counts the rectangles differently */
-	   && cl->preferredEncoding != rfbEncodingTight
-#endif
-#endif
-#ifdef LIBVNCSERVER_HAVE_LIBPNG
-	   /* Tight encoding counts the rectangles differently */
-	   && cl->preferredEncoding != rfbEncodingTightPng
-#endif
-	   && nUpdateRegionRects>cl->screen->maxRectsPerUpdate) {
-	    sraRegion* newUpdateRegion = sraRgnBBox(updateRegion);
-	    sraRgnDestroy(updateRegion);
-	    updateRegion = newUpdateRegion;
-	    nUpdateRegionRects = sraRgnCountRects(updateRegion);
-	}
 	fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
-					   nUpdateRegionRects +
+					   nUpdateRegionRects + nTileCacheRects +
 					   !!sendCursorShape + !!sendCursorPos + !!sendKeyboardLedState +
 					   !!sendSupportedMessages + !!sendSupportedEncodings + !!sendServerIdentity));
     } else {
@@ -3508,21 +4114,33 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
    }
 
     if (!sraRgnEmpty(updateCopyRegion)) {
+	encodeStart = rfbGetMonotonicTimeUs();
 	if (!rfbSendCopyRegion(cl,updateCopyRegion,dx,dy))
 	        goto updateFailed;
+	rfbStatRecordEncodeTime(cl, rfbEncodingCopyRect,
+	                        rfbGetMonotonicTimeUs() - encodeStart);
     }
 
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-        int x = rect.x1;
-        int y = rect.y1;
-        int w = rect.x2 - x;
-        int h = rect.y2 - y;
+    if (!rfbTileCacheSendRefs(cl))
+        goto updateFailed;
+
+    if (nParallelRects > 0) {
+        if (!rfbSendParallelRects(cl))
+            goto updateFailed;
+    } else
+    for(nRect = 0; nRect < nRects; nRect++){
+        int x = rects[nRect].x1;
+        int y = rects[nRect].y1;
+        int w = rects[nRect].x2 - x;
+        int h = rects[nRect].y2 - y;
 
         /* We need to count the number of rects in the scaled screen */
         if (cl->screen!=cl->scaledScreen)
             rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
 
-        switch (cl->preferredEncoding) {
+        encoding = rectEncodings ? rectEncodings[nRect] : cl->preferredEncoding;
+        encodeStart = rfbGetMonotonicTimeUs();
+        switch (encoding) {
 	case -1:
         case rfbEncodingRaw:
             if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
@@ -3568,19 +4186,58 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 #endif
 #endif
         }
+        rfbStatRecordEncodeTime(cl, encoding, rfbGetMonotonicTimeUs() - encodeStart);
     }
-    if (i) {
-        sraRgnReleaseIterator(i);
-        i = NULL;
+
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    if (refreshRegion != NULL) {
+	encodeStart = rfbGetMonotonicTimeUs();
+	for(i = sraRgnGetIterator(refreshRegion); sraRgnIteratorNext(i,&rect); ){
+	    if (!rfbSendRectEncodingTightLossless(cl, rect.x1, rect.y1,
+	                                          rect.x2 - rect.x1, rect.y2 - rect.y1))
+		goto updateFailed;
+	}
+	sraRgnReleaseIterator(i); i=NULL;
+	rfbStatRecordEncodeTime(cl, cl->tightEncoding, rfbGetMonotonicTimeUs() - encodeStart);
     }
+#endif
+
+    if (!rfbTileCacheSendStores(cl))
+        goto updateFailed;
 
     if ( nUpdateRegionRects == 0xFFFF &&
 	 !rfbSendLastRectMarker(cl) )
 	    goto updateFailed;
 
+    /*
+     * Measure the round trip time behind this update, one probe at a time.
+     * The output is serialised by the caller, so the probe goes through
+     * updateBuf instead of rfbSendFence().
+     */
+    if (cl->enableFence && !cl->fenceProbePending) {
+        uint32_t now = rfbGetMonotonicTimeMs();
+        if (cl->ublen + sz_rfbFenceMsg + sizeof(now) > UPDATE_BUF_SIZE &&
+            !rfbSendUpdateBuf(cl))
+            goto updateFailed;
+        cl->ublen += rfbFillFenceMsg(&cl->updateBuf[cl->ublen],
+                                     rfbFenceFlagRequest | rfbFenceFlagBlockBefore,
+                                     sizeof(now), (char *)&now);
+        cl->fenceProbePending = TRUE;
+        rfbStatRecordMessageSent(cl, rfbFence, sz_rfbFenceMsg + sizeof(now),
+                                 sz_rfbFenceMsg + sizeof(now));
+    }
+
     if (!rfbSendUpdateBuf(cl)) {
 updateFailed:
 	result = FALSE;
+    } else {
+	rfbAdaptiveUpdateDone(cl);
+	if (damageTime != 0)
+	    rfbStatRecordUpdateLatency(cl, rfbGetMonotonicTimeMs() - damageTime);
+	memoryUsage = rfbClientMemoryUsage(cl);
+	LOCK(cl->statsMutex);
+	cl->memoryUsage = memoryUsage;
+	UNLOCK(cl->statsMutex);
     }
 
     if (!cl->enableCursorShapeUpdates) {
@@ -3589,8 +4246,12 @@ updateFailed:
 
     if(i)
         sraRgnReleaseIterator(i);
+    free(rects);
+    free(rectEncodings);
     sraRgnDestroy(updateRegion);
     sraRgnDestroy(updateCopyRegion);
+    if (refreshRegion)
+	sraRgnDestroy(refreshRegion);
 
     if(cl->screen->displayFinishedHook)
       cl->screen->displayFinishedHook(cl, result);
@@ -3696,6 +4357,14 @@ rfbSendRectEncodingRaw(rfbClientPtr cl,
     rfbStatRecordEncodingSent(cl, rfbEncodingRaw, sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h,
         sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h);
 
+    /* Whole framebuffer lines in the client's format go out as they are. */
+    if (cl->translateFn == rfbTranslateNone && !cl->updateCapture &&
+        cl->scaledScreen->paddedWidthInBytes == bytesPerLine) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+        return SendUpdateData(cl, fbptr, bytesPerLine * h);
+    }
+
     nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
 
     while (TRUE) {
@@ -3906,16 +4575,48 @@ rfbSendExtDesktopSize(rfbClientPtr cl,
 rfbBool
 rfbSendUpdateBuf(rfbClientPtr cl)
 {
+    if (cl->updateCapture)
+        return rfbCaptureUpdateBuf(cl);
+
+    if (!SendUpdateData(cl, cl->updateBuf, cl->ublen))
+        return FALSE;
+
+    cl->ublen = 0;
+    return TRUE;
+}
+
+/*
+ * Write update data that is not in updateBuf, which has to be empty.
+ */
+
+static rfbBool
+SendUpdateData(rfbClientPtr cl, const char *buf, int len)
+{
+    uint64_t start = 0, elapsed;
+
     if(cl->sock<0)
       return FALSE;
 
-    if (rfbWriteExact(cl, cl->updateBuf, cl->ublen) < 0) {
+    rfbScheduleCharge(cl, len);
+
+    if (cl->adaptiveUpdateStart || cl->scheduleUpdateStart)
+        start = rfbGetMonotonicTimeUs();
+
+    if (rfbWriteExact(cl, buf, len) < 0) {
         rfbLogPerror("rfbSendUpdateBuf: write");
         rfbCloseClient(cl);
         return FALSE;
     }
 
-    cl->ublen = 0;
+    if (start) {
+        elapsed = rfbGetMonotonicTimeUs() - start;
+        if (cl->adaptiveUpdateStart) {
+            cl->adaptiveWriteTime += elapsed;
+            cl->adaptiveBytes += len;
+        }
+        cl->scheduleWriteTime += elapsed;
+    }
+
     return TRUE;
 }
 
@@ -3968,6 +4669,12 @@ rfbSendSetColourMapEntries(rfbClientPtr cl,
     len += nColours * 3 * 2;
 
     LOCK(cl->sendMutex);
+    if (cl->sock == RFB_INVALID_SOCKET) {
+        /* gone meanwhile, but still reachable by the caller's iterator */
+        if (wbuf != buf) free(wbuf);
+        UNLOCK(cl->sendMutex);
+        return FALSE;
+    }
     if (rfbWriteExact(cl, wbuf, len) < 0) {
 	rfbLogPerror("rfbSendSetColourMapEntries: write");
 	rfbCloseClient(cl);
@@ -3997,7 +4704,9 @@ rfbSendBell(rfbScreenInfoPtr rfbScreen)
     while((cl=rfbClientIteratorNext(i))) {
 	b.type = rfbBell;
         LOCK(cl->sendMutex);
-	if (rfbWriteExact(cl, (char *)&b, sz_rfbBellMsg) < 0) {
+	/* the socket may have been closed since the iterator checked */
+	if (cl->sock != RFB_INVALID_SOCKET &&
+	    rfbWriteExact(cl, (char *)&b, sz_rfbBellMsg) < 0) {
 	    rfbLogPerror("rfbSendBell: write");
 	    rfbCloseClient(cl);
 	}
@@ -4026,6 +4735,11 @@ rfbSendServerCutText(rfbScreenInfoPtr rfbScreen,char *str, int len)
         sct.type = rfbServerCutText;
         sct.length = Swap32IfLE(len);
         LOCK(cl->sendMutex);
+        /* the socket may have been closed since the iterator checked */
+        if (cl->sock == RFB_INVALID_SOCKET) {
+            UNLOCK(cl->sendMutex);
+            continue;
+        }
         if (rfbWriteExact(cl, (char *)&sct,
                        sz_rfbServerCutTextMsg) < 0) {
             rfbLogPerror("rfbSendServerCutText: write");
@@ -4057,6 +4771,11 @@ rfbSendServerCutTextUTF8(rfbScreenInfoPtr rfbScreen,char *str, int len, char *fa
     while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
         sct.type = rfbServerCutText;
         LOCK(cl->sendMutex);
+        /* the socket may have been closed since the iterator checked */
+        if (cl->sock == RFB_INVALID_SOCKET) {
+            UNLOCK(cl->sendMutex);
+            continue;
+        }
         if (cl->enableExtendedClipboard) {
             sct.length = Swap32IfLE(len);
             if (cl->extClipboardData != NULL) {
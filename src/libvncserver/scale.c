@@ -32,6 +32,7 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "simd.h"
 
 #ifdef LIBVNCSERVER_HAVE_FCNTL_H
 #include <fcntl.h>
@@ -132,12 +133,168 @@ void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int
     if (*y+*h > to->height) *h=to->height - *y;
 }
 
+/* scaling is split into bands of rows of at least this many source pixels,
+   which the encoder threads work on */
+#define SCALE_BAND_PIXELS (64 * 1024)
+
+typedef struct {
+    rfbScreenInfoPtr screen, ptr;
+    unsigned char *srcptr, *dstptr;
+    int w1, h1, areaX, areaY, bandRows;
+    /* for 32 bpp with a byte per channel: the column sums of each slot,
+       the bits of the channels, and 2^32 / (areaX * areaY) rounded up */
+    uint16_t *sums;
+    int sumsPerSlot;
+    uint32_t channelMask;
+    uint64_t reciprocal;
+} rfbScaleJob;
+
+/*
+ * With a byte per channel and at most 257 source pixels per destination
+ * pixel, the totals of all four bytes fit into 16 bits each, so the sums
+ * of the columns are added up four bytes at a time, and the division is
+ * exact as a multiplication with the reciprocal.
+ */
+static void
+scaleRowBytes(rfbScaleJob *job, int y, uint16_t *sums)
+{
+    int x, k, c, stride = job->screen->paddedWidthInBytes;
+    unsigned char *dstptr = job->dstptr + y * job->ptr->paddedWidthInBytes;
+    const uint16_t *s = sums;
+    uint64_t total, v;
+    uint16_t channels[4];
+    uint8_t average[4];
+    uint32_t pixel_value;
+
+    rfbSimd->sumRows(job->srcptr + y * job->areaY * stride, stride,
+                     job->areaY, sums, job->w1 * job->areaX * 4);
+
+    for (x = 0; x < job->w1; x++) {
+        total = 0;
+        for (k = 0; k < job->areaX; k++, s += 4) {
+            memcpy(&v, s, sizeof(v));
+            total += v;
+        }
+        memcpy(channels, &total, sizeof(total));
+        for (c = 0; c < 4; c++)
+            average[c] = (uint8_t)((channels[c] * job->reciprocal) >> 32);
+        memcpy(&pixel_value, average, sizeof(pixel_value));
+        pixel_value &= job->channelMask;
+        memcpy(dstptr + x * 4, &pixel_value, sizeof(pixel_value));
+    }
+}
+
+static void
+scaleRowBlend(rfbScaleJob *job, int y)
+{
+    rfbScreenInfoPtr screen = job->screen;
+    int x, w, v, z, bytesPerPixel = screen->bitsPerPixel / 8;
+    int area2 = job->areaX * job->areaY;
+    unsigned char *srcptr = job->srcptr +
+        y * job->areaY * screen->paddedWidthInBytes;
+    unsigned char *dstptr = job->dstptr + y * job->ptr->paddedWidthInBytes;
+    unsigned char *srcptr2;
+    unsigned long pixel_value, red, green, blue;
+    unsigned int redShift = screen->serverFormat.redShift;
+    unsigned int greenShift = screen->serverFormat.greenShift;
+    unsigned int blueShift = screen->serverFormat.blueShift;
+    unsigned long redMax = screen->serverFormat.redMax;
+    unsigned long greenMax = screen->serverFormat.greenMax;
+    unsigned long blueMax = screen->serverFormat.blueMax;
+
+    for (x = 0; x < job->w1; x++) {
+        red = green = blue = 0;
+        /* Get the totals for rgb from the source grid... */
+        for (w = 0; w < job->areaX; w++) {
+            for (v = 0; v < job->areaY; v++) {
+                srcptr2 = &srcptr[(((x * job->areaX) + w) * bytesPerPixel) +
+                                  (v * screen->paddedWidthInBytes)];
+                pixel_value = 0;
+
+                switch (bytesPerPixel) {
+                case 4: pixel_value = *((unsigned int *)srcptr2);   break;
+                case 2: pixel_value = *((unsigned short *)srcptr2); break;
+                case 1: pixel_value = *((unsigned char *)srcptr2);  break;
+                default:
+                    /* fixme: endianness problem? */
+                    for (z = 0; z < bytesPerPixel; z++)
+                        pixel_value += ((unsigned long)srcptr2[z] << (8 * z));
+                    break;
+                }
+
+                red += ((pixel_value >> redShift) & redMax);
+                green += ((pixel_value >> greenShift) & greenMax);
+                blue += ((pixel_value >> blueShift) & blueMax);
+            }
+        }
+        /* We now have a total for all of the colors, find the average! */
+        red /= area2;
+        green /= area2;
+        blue /= area2;
+        /* Stuff the new value back into memory */
+        pixel_value = ((red & redMax) << redShift) | ((green & greenMax) << greenShift) | ((blue & blueMax) << blueShift);
+
+        switch (bytesPerPixel) {
+        case 4: *((unsigned int *)dstptr)   = (unsigned int)   pixel_value; break;
+        case 2: *((unsigned short *)dstptr) = (unsigned short) pixel_value; break;
+        case 1: *((unsigned char *)dstptr)  = (unsigned char)  pixel_value; break;
+        default:
+            /* fixme: endianness problem? */
+            for (z = 0; z < bytesPerPixel; z++)
+                dstptr[z]=(pixel_value >> (8 * z)) & 0xff;
+            break;
+        }
+        dstptr += bytesPerPixel;
+    }
+}
+
+/* Not truecolour, so we can't blend. Just use the top-left pixel instead */
+static void
+scaleRowPick(rfbScaleJob *job, int y)
+{
+    int x, bytesPerPixel = job->screen->bitsPerPixel / 8;
+    unsigned char *srcptr = job->srcptr +
+        y * job->areaY * job->screen->paddedWidthInBytes;
+    unsigned char *dstptr = job->dstptr + y * job->ptr->paddedWidthInBytes;
+
+    for (x = 0; x < job->w1; x++)
+        memcpy(dstptr + x * bytesPerPixel,
+               srcptr + x * job->areaX * bytesPerPixel, bytesPerPixel);
+}
+
+static void
+scaleBand(void *data, int index, int slot)
+{
+    rfbScaleJob *job = (rfbScaleJob *)data;
+    int y = index * job->bandRows, end = y + job->bandRows;
+
+    if (end > job->h1)
+        end = job->h1;
+    for (; y < end; y++) {
+        if (job->sums)
+            scaleRowBytes(job, y, job->sums + slot * job->sumsPerSlot);
+        else if (job->screen->serverFormat.trueColour)
+            scaleRowBlend(job, y);
+        else
+            scaleRowPick(job, y);
+    }
+}
+
+/* a byte per channel, so that the bytes of a pixel can be averaged alike */
+static rfbBool
+hasByteChannels(rfbPixelFormat *format)
+{
+    return format->bitsPerPixel == 32 && format->trueColour &&
+        format->redMax == 255 && format->greenMax == 255 &&
+        format->blueMax == 255 && format->redShift % 8 == 0 &&
+        format->greenShift % 8 == 0 && format->blueShift % 8 == 0;
+}
+
 void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0)
 {
-    int x,y,w,v,z;
     int x1, y1, w1, h1;
-    int bitsPerPixel, bytesPerPixel, bytesPerLine, areaX, areaY, area2;
-    unsigned char *srcptr, *dstptr;
+    int bytesPerPixel, area2, sourcePixels, nBands;
+    rfbScaleJob job;
 
     /* Nothing to do!!! */
     if (screen==ptr) return;
@@ -153,18 +310,11 @@ void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, in
     w0 = ScaleX(ptr, screen, w1);
     h0 = ScaleY(ptr, screen, h1);
 
-    bitsPerPixel = screen->bitsPerPixel;
-    bytesPerPixel = bitsPerPixel / 8;
-    bytesPerLine = w1 * bytesPerPixel;
-    srcptr = (unsigned char *)(screen->frameBuffer +
-     (y0 * screen->paddedWidthInBytes + x0 * bytesPerPixel));
-    dstptr = (unsigned char *)(ptr->frameBuffer +
-     ( y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
+    bytesPerPixel = screen->bitsPerPixel / 8;
     /* The area of the source framebuffer for each destination pixel */
-    areaX = ScaleX(ptr,screen,1);
-    areaY = ScaleY(ptr,screen,1);
-    area2 = areaX*areaY;
-
+    job.areaX = ScaleX(ptr,screen,1);
+    job.areaY = ScaleY(ptr,screen,1);
+    area2 = job.areaX*job.areaY;
 
     /* Ensure that we do not go out of bounds */
     if ((x1+w1) > (ptr->width))
@@ -177,91 +327,57 @@ void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, in
     }
     /*
      * rfbLog("rfbScaledScreenUpdateRect(%dXx%dY-%dWx%dH  ->  %dXx%dY-%dWx%dH <%dx%d>) {%dWx%dH -> %dWx%dH} 0x%p\n",
-     *    x0, y0, w0, h0, x1, y1, w1, h1, areaX, areaY,
+     *    x0, y0, w0, h0, x1, y1, w1, h1, job.areaX, job.areaY,
      *    screen->width, screen->height, ptr->width, ptr->height, ptr->frameBuffer);
      */
+    if (w1 <= 0 || h1 <= 0 || area2 <= 0) return;
+
+    job.screen = screen;
+    job.ptr = ptr;
+    job.w1 = w1;
+    job.h1 = h1;
+    if (screen->serverFormat.trueColour) {
+        job.srcptr = (unsigned char *)(screen->frameBuffer +
+          (y0 * screen->paddedWidthInBytes + x0 * bytesPerPixel));
+        job.dstptr = (unsigned char *)(ptr->frameBuffer +
+          (y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
+    } else {
+        /* the top-left pixels are taken from multiples of the area */
+        job.srcptr = (unsigned char *)(screen->frameBuffer +
+          (y1 * job.areaY * screen->paddedWidthInBytes +
+           x1 * job.areaX * bytesPerPixel));
+        job.dstptr = (unsigned char *)(ptr->frameBuffer +
+          (y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
+    }
 
-    if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
-      unsigned char *srcptr2;
-      unsigned long pixel_value, red, green, blue;
-      unsigned int redShift = screen->serverFormat.redShift;
-      unsigned int greenShift = screen->serverFormat.greenShift;
-      unsigned int blueShift = screen->serverFormat.blueShift;
-      unsigned long redMax = screen->serverFormat.redMax;
-      unsigned long greenMax = screen->serverFormat.greenMax;
-      unsigned long blueMax = screen->serverFormat.blueMax;
-
-     /* for each *destination* pixel... */
-     for (y = 0; y < h1; y++) {
-       for (x = 0; x < w1; x++) {
-         red = green = blue = 0;
-         /* Get the totals for rgb from the source grid... */
-         for (w = 0; w < areaX; w++) {
-           for (v = 0; v < areaY; v++) {
-             srcptr2 = &srcptr[(((x * areaX) + w) * bytesPerPixel) +
-                               (v * screen->paddedWidthInBytes)];
-             pixel_value = 0;
-
-
-             switch (bytesPerPixel) {
-             case 4: pixel_value = *((unsigned int *)srcptr2);   break;
-             case 2: pixel_value = *((unsigned short *)srcptr2); break;
-             case 1: pixel_value = *((unsigned char *)srcptr2);  break;
-             default:
-               /* fixme: endianness problem? */
-               for (z = 0; z < bytesPerPixel; z++)
-                 pixel_value += ((unsigned long)srcptr2[z] << (8 * z));
-                break;
-              }
-              /*
-              srcptr2 += bytesPerPixel;
-              */
-
-            red += ((pixel_value >> redShift) & redMax);
-            green += ((pixel_value >> greenShift) & greenMax);
-            blue += ((pixel_value >> blueShift) & blueMax);
-
-           }
-         }
-         /* We now have a total for all of the colors, find the average! */
-         red /= area2;
-         green /= area2;
-         blue /= area2;
-          /* Stuff the new value back into memory */
-         pixel_value = ((red & redMax) << redShift) | ((green & greenMax) << greenShift) | ((blue & blueMax) << blueShift);
-
-         switch (bytesPerPixel) {
-         case 4: *((unsigned int *)dstptr)   = (unsigned int)   pixel_value; break;
-         case 2: *((unsigned short *)dstptr) = (unsigned short) pixel_value; break;
-         case 1: *((unsigned char *)dstptr)  = (unsigned char)  pixel_value; break;
-         default:
-           /* fixme: endianness problem? */
-           for (z = 0; z < bytesPerPixel; z++)
-             dstptr[z]=(pixel_value >> (8 * z)) & 0xff;
-            break;
-          }
-          dstptr += bytesPerPixel;
-       }
-       srcptr += (screen->paddedWidthInBytes * areaY);
-       dstptr += (ptr->paddedWidthInBytes - bytesPerLine);
-     }
-   } else
-   { /* Not truecolour, so we can't blend. Just use the top-left pixel instead */
-     for (y = y1; y < (y1+h1); y++) {
-       for (x = x1; x < (x1+w1); x++)
-         memcpy (&ptr->frameBuffer[(y *ptr->paddedWidthInBytes) + (x * bytesPerPixel)],
-                 &screen->frameBuffer[(y * areaY * screen->paddedWidthInBytes) + (x *areaX * bytesPerPixel)], bytesPerPixel);
-     }
-  }
+    job.sums = NULL;
+    if (hasByteChannels(&screen->serverFormat) && area2 <= 257) {
+        job.sumsPerSlot = w1 * job.areaX * 4;
+        job.sums = (uint16_t *)malloc((rfbWorkerCount(screen) + 1) *
+                                      job.sumsPerSlot * sizeof(uint16_t));
+        job.channelMask =
+            (255U << screen->serverFormat.redShift) |
+            (255U << screen->serverFormat.greenShift) |
+            (255U << screen->serverFormat.blueShift);
+        job.reciprocal = ((uint64_t)1 << 32) / area2 + 1;
+    }
+
+    /* large updates are scaled by the encoder threads, too */
+    sourcePixels = w1 * area2;
+    job.bandRows = (SCALE_BAND_PIXELS + sourcePixels - 1) / sourcePixels;
+    nBands = (h1 + job.bandRows - 1) / job.bandRows;
+    rfbWorkersRun(screen, scaleBand, &job, nBands);
+
+    free(job.sums);
 }
 
-void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
+/*
+ * Damage is only noted here. The scaled copies are updated when an update
+ * is sent to one of their clients, see rfbScaledScreenRefresh().
+ */
+void rfbScaledScreenUpdateRegion(rfbScreenInfoPtr screen, sraRegionPtr region)
 {
-    /* ok, now the task is to update each and every scaled version of the framebuffer
-     * and we only have to do this for this specific changed rectangle!
-     */
     rfbScreenInfoPtr ptr;
-    int count=0;
 
     /* We don't point to cl->screen as it is the original */
     for (ptr=screen->scaledScreenNext;ptr!=NULL;ptr=ptr->scaledScreenNext)
@@ -269,12 +385,54 @@ void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int
         /* Only update if it has active clients... */
         if (ptr->scaledScreenRefCount>0)
         {
-          rfbScaledScreenUpdateRect(screen, ptr, x1, y1, x2-x1, y2-y1);
-          count++;
+          LOCK(ptr->scaledScreenMutex);
+          sraRgnOr(ptr->scaledScreenDamage, region);
+          UNLOCK(ptr->scaledScreenMutex);
         }
     }
 }
 
+void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
+{
+    sraRegionPtr region;
+
+    if (screen->scaledScreenNext == NULL)
+        return;
+    region = sraRgnCreateRect(x1, y1, x2, y2);
+    rfbScaledScreenUpdateRegion(screen, region);
+    sraRgnDestroy(region);
+}
+
+/*
+ * Bring the client's scaled framebuffer up to date where it is about to be
+ * sent, region being in coordinates of the original. Clients sharing the
+ * scaled copy wait for each other here.
+ */
+void rfbScaledScreenRefresh(rfbClientPtr cl, sraRegionPtr region)
+{
+    rfbScreenInfoPtr ptr = cl->scaledScreen;
+    sraRegionPtr todo;
+    sraRectangleIterator *i;
+    sraRect rect;
+
+    if (ptr == cl->screen)
+        return;
+
+    LOCK(ptr->scaledScreenMutex);
+    todo = sraRgnCreateRgn(ptr->scaledScreenDamage);
+    sraRgnAnd(todo, region);
+    if (!sraRgnEmpty(todo)) {
+        sraRgnSubtract(ptr->scaledScreenDamage, todo);
+        i = sraRgnGetIterator(todo);
+        while (sraRgnIteratorNext(i, &rect))
+            rfbScaledScreenUpdateRect(cl->screen, ptr, rect.x1, rect.y1,
+                                      rect.x2 - rect.x1, rect.y2 - rect.y1);
+        sraRgnReleaseIterator(i);
+    }
+    UNLOCK(ptr->scaledScreenMutex);
+    sraRgnDestroy(todo);
+}
+
 /* Create a new scaled version of the framebuffer */
 rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
 {
@@ -315,8 +473,10 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
         ptr->frameBuffer = malloc(ptr->sizeInBytes);
         if (ptr->frameBuffer!=NULL)
         {
-            /* Reset to a known condition: scale the entire framebuffer */
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+            /* Reset to a known condition: scale the entire framebuffer
+               when it is first sent */
+            ptr->scaledScreenDamage = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+            INIT_MUTEX(ptr->scaledScreenMutex);
             /* Now, insert into the chain */
             LOCK(cl->updateMutex);
             ptr->scaledScreenNext = cl->screen->scaledScreenNext;
@@ -360,9 +520,15 @@ void rfbScalingSetup(rfbClientPtr cl, int width, int height)
     /* Now, there is a new screen available (if ptr is not NULL) */
     if (ptr!=NULL)
     {
-        /* Update it! */
-        if (ptr->scaledScreenRefCount<1)
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+        /* Update it! Unused copies are not kept up to date */
+        if (ptr!=cl->screen && ptr->scaledScreenRefCount<1)
+        {
+            sraRegionPtr all = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+            LOCK(ptr->scaledScreenMutex);
+            sraRgnOr(ptr->scaledScreenDamage, all);
+            UNLOCK(ptr->scaledScreenMutex);
+            sraRgnDestroy(all);
+        }
         /*
          * rfbLog("Taking one from %dx%d-%d and adding it to %dx%d-%d\n",
          *    cl->scaledScreen->width, cl->scaledScreen->height,
@@ -4,6 +4,8 @@ int ScaleY(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int y);
 void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int *y, int *w, int *h, const char *function);
 void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0);
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
+void rfbScaledScreenUpdateRegion(rfbScreenInfoPtr screen, sraRegionPtr region);
+void rfbScaledScreenRefresh(rfbClientPtr cl, sraRegionPtr region);
 rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height);
 rfbScreenInfoPtr rfbScalingFind(rfbClientPtr cl, int width, int height);
 void rfbScalingSetup(rfbClientPtr cl, int width, int height);
@@ -0,0 +1,233 @@
+/*
+ * schedule.c - share the server among its clients.
+ *
+ * Without limits every client is sent updates as fast as it asks for them,
+ * so a few fast viewers can take the encoders away from everybody else.
+ * Each client may be capped to maxFps updates and maxBandwidth bytes per
+ * second; the latter is a token bucket holding SCHEDULE_BURST_MS worth of
+ * data. The writes of an update take their bytes from it and may run it
+ * into debt, and the next update waits until the debt is paid off. The
+ * wait is not spent encoding, so it is not charged to the client, and no
+ * lock is held meanwhile that the client's other messages need.
+ *
+ * With fairScheduling, the time spent encoding is shared by weight, start
+ * time fair queuing style: every client's virtual time advances by its
+ * encoding time divided by its scheduleWeight, and a client that is due is
+ * held back while another due client is more than SCHEDULE_SLICE_US of
+ * virtual time behind, at most for SCHEDULE_MAX_WAIT_MS. A client which
+ * sent input recently counts SCHEDULE_INTERACTIVE_WEIGHT times its weight,
+ * and one that had nothing to send starts again level with the others
+ * instead of catching up on the time it was idle.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+/* the token bucket holds this much of a client's bandwidth */
+#define SCHEDULE_BURST_MS 50
+/* virtual time a client may be ahead of the others, in us */
+#define SCHEDULE_SLICE_US 10000
+#define SCHEDULE_MAX_WAIT_MS 200
+#define SCHEDULE_RECHECK_MS 5
+/* input this recent makes the client count as interacting */
+#define SCHEDULE_INTERACTIVE_MS 1000
+#define SCHEDULE_INTERACTIVE_WEIGHT 4
+
+static int weight(rfbClientPtr cl)
+{
+    int w = cl->scheduleWeight > 0 ? cl->scheduleWeight : 1;
+
+    if (cl->lastInputTime != 0 &&
+        rfbGetMonotonicTimeMs() - cl->lastInputTime <= SCHEDULE_INTERACTIVE_MS)
+        w *= SCHEDULE_INTERACTIVE_WEIGHT;
+    return w;
+}
+
+/* call with the screen's scheduleMutex held */
+static void refill(rfbClientPtr cl, uint64_t now)
+{
+    int64_t burst = (int64_t)cl->maxBandwidth * SCHEDULE_BURST_MS / 1000;
+    int64_t add;
+
+    if (cl->tokenBucketTime == 0 || cl->tokenBucketTime > now) {
+        cl->tokenBucket = burst;
+        cl->tokenBucketTime = now;
+        return;
+    }
+    add = (int64_t)((now - cl->tokenBucketTime) * cl->maxBandwidth / 1000000);
+    /* only the time that made whole bytes is used up */
+    cl->tokenBucketTime += (uint64_t)add * 1000000 / cl->maxBandwidth;
+    cl->tokenBucket += add;
+    if (cl->tokenBucket >= burst) {
+        cl->tokenBucket = burst;
+        cl->tokenBucketTime = now;
+    }
+}
+
+/*
+ * Call with the screen's scheduleMutex held and the client due. Returns 0
+ * if it is its turn, or the milliseconds after which to ask again.
+ */
+
+static int fairShareWait(rfbClientPtr cl, rfbClientIteratorPtr i, uint32_t now)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbClientPtr other;
+    uint64_t least = 0;
+    rfbBool behind = FALSE;
+
+    if (cl->scheduleReadyTime == 0) {
+        cl->scheduleReadyTime = now;
+        /* no credit for the time it had nothing to send */
+        if (cl->scheduleVirtualTime < screen->scheduleVirtualTime)
+            cl->scheduleVirtualTime = screen->scheduleVirtualTime;
+    }
+
+    if (now - cl->scheduleReadyTime < SCHEDULE_MAX_WAIT_MS) {
+        while ((other = rfbClientIteratorNext(i)) != NULL) {
+            if (other == cl || other->scheduleReadyTime == 0 ||
+                now - other->scheduleReadyTime > 2 * SCHEDULE_MAX_WAIT_MS)
+                continue;
+            if (!behind || other->scheduleVirtualTime < least)
+                least = other->scheduleVirtualTime;
+            behind = TRUE;
+        }
+        if (behind && cl->scheduleVirtualTime > least + SCHEDULE_SLICE_US)
+            return SCHEDULE_RECHECK_MS;
+    }
+
+    if (screen->scheduleVirtualTime < cl->scheduleVirtualTime)
+        screen->scheduleVirtualTime = cl->scheduleVirtualTime;
+    return 0;
+}
+
+/*
+ * Call with cl->updateMutex held, once an update is due otherwise. Returns
+ * 0 if it may be sent now, or the milliseconds to hold it back.
+ */
+
+int rfbScheduleTimeLocked(rfbClientPtr cl, uint32_t now)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbClientIteratorPtr i = NULL;
+    uint32_t interval, since;
+    int wait = 0, bucketWait;
+
+    if (cl->maxFps > 0 && cl->lastUpdateSentTime != 0) {
+        interval = 1000 / cl->maxFps;
+        since = now - cl->lastUpdateSentTime;
+        if (since < interval)
+            wait = (int)(interval - since);
+    }
+
+    if (screen->fairScheduling)
+        i = rfbGetClientIterator(screen);
+
+    LOCK(screen->scheduleMutex);
+    if (cl->maxBandwidth > 0) {
+        refill(cl, rfbGetMonotonicTimeUs());
+        if (cl->tokenBucket < 0) {
+            bucketWait = (int)((-cl->tokenBucket * 1000 + cl->maxBandwidth - 1)
+                               / cl->maxBandwidth);
+            if (bucketWait > wait)
+                wait = bucketWait;
+        }
+    }
+    if (wait > 0)
+        cl->scheduleReadyTime = 0;
+    else if (i)
+        wait = fairShareWait(cl, i, now);
+    UNLOCK(screen->scheduleMutex);
+
+    if (i)
+        rfbReleaseClientIterator(i);
+    return wait;
+}
+
+void rfbScheduleUpdateStart(rfbClientPtr cl)
+{
+    cl->scheduleUpdateStart = rfbGetMonotonicTimeUs();
+    cl->scheduleWriteTime = 0;
+}
+
+/*
+ * Called after every update, sent or not. Charges the time spent on it,
+ * apart from the writes, to the client's virtual time.
+ */
+
+void rfbScheduleUpdateDone(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbClientIteratorPtr i;
+    rfbClientPtr other;
+    uint64_t total;
+    rfbBool waiting;
+
+    if (cl->scheduleUpdateStart == 0)
+        return;
+    total = rfbGetMonotonicTimeUs() - cl->scheduleUpdateStart;
+    cl->scheduleUpdateStart = 0;
+    if (total > cl->scheduleWriteTime)
+        total -= cl->scheduleWriteTime;
+    else
+        total = 0;
+
+    LOCK(screen->scheduleMutex);
+    if (screen->fairScheduling)
+        cl->scheduleVirtualTime += total / weight(cl);
+    cl->scheduleReadyTime = 0;
+    UNLOCK(screen->scheduleMutex);
+
+    if (!screen->fairScheduling)
+        return;
+    /* those held back for this one need not wait for their next look */
+    i = rfbGetClientIterator(screen);
+    while ((other = rfbClientIteratorNext(i)) != NULL) {
+        if (other == cl)
+            continue;
+        /* not held under it, updateMutex comes before scheduleMutex */
+        LOCK(screen->scheduleMutex);
+        waiting = other->scheduleReadyTime != 0;
+        UNLOCK(screen->scheduleMutex);
+        if (!waiting)
+            continue;
+        LOCK(other->updateMutex);
+        TSIGNAL(other->updateCond);
+        UNLOCK(other->updateMutex);
+    }
+    rfbReleaseClientIterator(i);
+}
+
+/*
+ * Called before len bytes of an update are written. Takes them from the
+ * token bucket; rfbScheduleTimeLocked() holds the next update back until
+ * they are covered.
+ */
+
+void rfbScheduleCharge(rfbClientPtr cl, int len)
+{
+    if (cl->maxBandwidth <= 0)
+        return;
+
+    LOCK(cl->screen->scheduleMutex);
+    refill(cl, rfbGetMonotonicTimeUs());
+    cl->tokenBucket -= len;
+    UNLOCK(cl->screen->scheduleMutex);
+}
@@ -0,0 +1,788 @@
+/*
+ * simd.c - vectorised pixel scanning kernels with scalar fallbacks.
+ *
+ * The kernels find the end of runs of one or two colours, which is what
+ * the solid area detection and palette analysis of the Tight encoder spend
+ * their time on, translate 32 bpp true colour pixels to the common client
+ * formats without table lookups, and add up rows of pixels for the box
+ * filter of the scaled framebuffers. SSE2 and AVX2 versions are built with
+ * GCC and Clang on x86 and picked at runtime according to what the CPU
+ * supports, NEON is used on 64-bit ARM. Everything else gets the plain C
+ * versions, which define the results the vector versions have to match
+ * bit for bit.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+
+#define DEFINE_SCALAR_KERNELS(bpp)                                          \
+                                                                            \
+static int                                                                  \
+run##bpp##Scalar(const uint##bpp##_t *p, int n, uint##bpp##_t c,            \
+                 uint##bpp##_t mask)                                        \
+{                                                                           \
+    int i;                                                                  \
+                                                                            \
+    for (i = 0; i < n && (uint##bpp##_t)(p[i] & mask) == c; i++);           \
+    return i;                                                               \
+}                                                                           \
+                                                                            \
+static int                                                                  \
+run2_##bpp##Scalar(const uint##bpp##_t *p, int n, uint##bpp##_t c0,         \
+                   uint##bpp##_t c1, uint##bpp##_t mask, int *n0)           \
+{                                                                           \
+    int i, k = 0;                                                           \
+                                                                            \
+    for (i = 0; i < n; i++) {                                               \
+        uint##bpp##_t v = p[i] & mask;                                      \
+        if (v == c0)                                                        \
+            k++;                                                            \
+        else if (v != c1)                                                   \
+            break;                                                          \
+    }                                                                       \
+    *n0 = k;                                                                \
+    return i;                                                               \
+}
+
+DEFINE_SCALAR_KERNELS(8)
+DEFINE_SCALAR_KERNELS(16)
+DEFINE_SCALAR_KERNELS(32)
+
+/* (v * outMax + 127) / 255, as rfbInitTrueColourRGBTables computes it */
+
+static uint32_t
+translatePixel(const rfbSimdTranslation *t, uint32_t p)
+{
+    uint32_t o = 0, v;
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        v = (p >> t->inShift[c]) & 0xff;
+        o |= ((v * t->outMax[c] + 127) / 255) << t->outShift[c];
+    }
+    return o;
+}
+
+/* 24 bpp pixels are the low three bytes of the value in host byte order */
+
+static void
+put24(const rfbSimdTranslation *t, uint8_t *op, uint32_t o)
+{
+    if (!rfbEndianTest != !t->swap) {
+        op[0] = (uint8_t)(o >> 16);
+        op[1] = (uint8_t)(o >> 8);
+        op[2] = (uint8_t)o;
+    } else {
+        op[0] = (uint8_t)o;
+        op[1] = (uint8_t)(o >> 8);
+        op[2] = (uint8_t)(o >> 16);
+    }
+}
+
+static void
+translate32to8Scalar(const rfbSimdTranslation *t, const uint32_t *ip,
+                     uint8_t *op, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        op[i] = (uint8_t)translatePixel(t, ip[i]);
+}
+
+static void
+translate32to16Scalar(const rfbSimdTranslation *t, const uint32_t *ip,
+                      uint16_t *op, int n)
+{
+    uint32_t o;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        o = translatePixel(t, ip[i]);
+        op[i] = (uint16_t)(t->swap ? Swap16(o) : o);
+    }
+}
+
+static void
+translate32to24Scalar(const rfbSimdTranslation *t, const uint32_t *ip,
+                      uint8_t *op, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        put24(t, op + 3 * i, translatePixel(t, ip[i]));
+}
+
+static void
+translate32to32Scalar(const rfbSimdTranslation *t, const uint32_t *ip,
+                      uint32_t *op, int n)
+{
+    uint32_t o;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        o = translatePixel(t, ip[i]);
+        op[i] = t->swap ? Swap32(o) : o;
+    }
+}
+
+static void
+sumRowsScalar(const uint8_t *p, int stride, int rows, uint16_t *sum, int n)
+{
+    int i, r;
+
+    for (i = 0; i < n; i++)
+        sum[i] = p[i];
+    for (r = 1; r < rows; r++) {
+        p += stride;
+        for (i = 0; i < n; i++)
+            sum[i] += p[i];
+    }
+}
+
+static const rfbSimdKernels scalarKernels = {
+    RFB_SIMD_NONE,
+    run8Scalar, run16Scalar, run32Scalar,
+    run2_8Scalar, run2_16Scalar, run2_32Scalar,
+    translate32to8Scalar, translate32to16Scalar,
+    translate32to24Scalar, translate32to32Scalar,
+    sumRowsScalar
+};
+
+
+#ifdef SIMD_X86
+
+/*
+ * The comparisons set all bytes of a lane alike, so the byte mask from
+ * movemask gives the first differing lane and the number of matching
+ * lanes in units of bpp/8 bits.
+ */
+
+#define DEFINE_X86_KERNELS(bpp, isa, target, vec, bits, all, load, vand, vor, \
+                           set1, cmpeq, movemask, cast)                     \
+                                                                            \
+static target int                                                           \
+run##bpp##isa(const uint##bpp##_t *p, int n, uint##bpp##_t c,               \
+              uint##bpp##_t mask)                                           \
+{                                                                           \
+    const int lanes = bits / bpp;                                           \
+    vec vc = set1((cast)c), vm = set1((cast)mask);                          \
+    int i;                                                                  \
+                                                                            \
+    for (i = 0; i + lanes <= n; i += lanes) {                               \
+        vec v = vand(load((const vec *)(p + i)), vm);                       \
+        unsigned int eq = (unsigned int)movemask(cmpeq(v, vc));             \
+        if (eq != all)                                                      \
+            return i + __builtin_ctz(~eq) / (bpp / 8);                      \
+    }                                                                       \
+    return i + run##bpp##Scalar(p + i, n - i, c, mask);                     \
+}                                                                           \
+                                                                            \
+static target int                                                           \
+run2_##bpp##isa(const uint##bpp##_t *p, int n, uint##bpp##_t c0,            \
+                uint##bpp##_t c1, uint##bpp##_t mask, int *n0)              \
+{                                                                           \
+    const int lanes = bits / bpp;                                           \
+    vec vc0 = set1((cast)c0), vc1 = set1((cast)c1), vm = set1((cast)mask);  \
+    int i, k = 0, rest;                                                     \
+                                                                            \
+    for (i = 0; i + lanes <= n; i += lanes) {                               \
+        vec v = vand(load((const vec *)(p + i)), vm);                       \
+        vec eq0 = cmpeq(v, vc0);                                            \
+        unsigned int in = (unsigned int)movemask(vor(eq0, cmpeq(v, vc1)));  \
+        unsigned int is0 = (unsigned int)movemask(eq0);                     \
+        if (in != all) {                                                    \
+            int end = __builtin_ctz(~in);                                   \
+            k += __builtin_popcount(is0 & ((1U << end) - 1)) / (bpp / 8);   \
+            *n0 = k;                                                        \
+            return i + end / (bpp / 8);                                     \
+        }                                                                   \
+        k += __builtin_popcount(is0) / (bpp / 8);                           \
+    }                                                                       \
+    i += run2_##bpp##Scalar(p + i, n - i, c0, c1, mask, &rest);             \
+    *n0 = k + rest;                                                         \
+    return i;                                                               \
+}
+
+DEFINE_X86_KERNELS(8, Sse2, SSE2_TARGET, __m128i, 128, 0xFFFFU,
+                   _mm_loadu_si128, _mm_and_si128, _mm_or_si128,
+                   _mm_set1_epi8, _mm_cmpeq_epi8, _mm_movemask_epi8, char)
+DEFINE_X86_KERNELS(16, Sse2, SSE2_TARGET, __m128i, 128, 0xFFFFU,
+                   _mm_loadu_si128, _mm_and_si128, _mm_or_si128,
+                   _mm_set1_epi16, _mm_cmpeq_epi16, _mm_movemask_epi8, short)
+DEFINE_X86_KERNELS(32, Sse2, SSE2_TARGET, __m128i, 128, 0xFFFFU,
+                   _mm_loadu_si128, _mm_and_si128, _mm_or_si128,
+                   _mm_set1_epi32, _mm_cmpeq_epi32, _mm_movemask_epi8, int)
+
+DEFINE_X86_KERNELS(8, Avx2, AVX2_TARGET, __m256i, 256, 0xFFFFFFFFU,
+                   _mm256_loadu_si256, _mm256_and_si256, _mm256_or_si256,
+                   _mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_movemask_epi8, char)
+DEFINE_X86_KERNELS(16, Avx2, AVX2_TARGET, __m256i, 256, 0xFFFFFFFFU,
+                   _mm256_loadu_si256, _mm256_and_si256, _mm256_or_si256,
+                   _mm256_set1_epi16, _mm256_cmpeq_epi16, _mm256_movemask_epi8, short)
+DEFINE_X86_KERNELS(32, Avx2, AVX2_TARGET, __m256i, 256, 0xFFFFFFFFU,
+                   _mm256_loadu_si256, _mm256_and_si256, _mm256_or_si256,
+                   _mm256_set1_epi32, _mm256_cmpeq_epi32, _mm256_movemask_epi8, int)
+
+/*
+ * The translation works on 32 bit lanes. A channel times outMax fits in
+ * the low 16 bits of a lane, so a 16 bit multiply does, and the division
+ * by 255 is (x + (x >> 8) + 1) >> 8, which is exact for x < 65535. The
+ * results are narrowed with signed saturating packs, which keep them as
+ * they are since they fit the output size. AVX2 packs within each 128 bit
+ * half, fix16 and fix8 put the pixels back in order.
+ */
+
+#define DEFINE_X86_TRANSLATE(isa, target, vec, pfx, si, fix16, fix8)        \
+                                                                            \
+typedef struct {                                                            \
+    __m128i inShift[3], outShift[3];                                        \
+    vec outMax[3], byte, round, one;                                        \
+} translation##isa;                                                         \
+                                                                            \
+static target void                                                          \
+prepare##isa(translation##isa *k, const rfbSimdTranslation *t)              \
+{                                                                           \
+    int c;                                                                  \
+                                                                            \
+    for (c = 0; c < 3; c++) {                                               \
+        k->inShift[c] = _mm_cvtsi32_si128(t->inShift[c]);                   \
+        k->outShift[c] = _mm_cvtsi32_si128(t->outShift[c]);                 \
+        k->outMax[c] = pfx##_set1_epi32(t->outMax[c]);                      \
+    }                                                                       \
+    k->byte = pfx##_set1_epi32(0xff);                                       \
+    k->round = pfx##_set1_epi32(127);                                       \
+    k->one = pfx##_set1_epi32(1);                                           \
+}                                                                           \
+                                                                            \
+static __inline__ target vec                                                \
+translate##isa(const translation##isa *k, vec p)                            \
+{                                                                           \
+    vec o = pfx##_setzero_##si(), v;                                        \
+    int c;                                                                  \
+                                                                            \
+    for (c = 0; c < 3; c++) {                                               \
+        v = pfx##_and_##si(pfx##_srl_epi32(p, k->inShift[c]), k->byte);     \
+        v = pfx##_add_epi32(pfx##_mullo_epi16(v, k->outMax[c]), k->round);  \
+        v = pfx##_srli_epi32(pfx##_add_epi32(pfx##_add_epi32(v,             \
+                                 pfx##_srli_epi32(v, 8)), k->one), 8);      \
+        o = pfx##_or_##si(o, pfx##_sll_epi32(v, k->outShift[c]));           \
+    }                                                                       \
+    return o;                                                               \
+}                                                                           \
+                                                                            \
+static __inline__ target vec                                                \
+narrow16##isa(const rfbSimdTranslation *t, vec o)                           \
+{                                                                           \
+    if (t->swap)                                                            \
+        o = pfx##_or_##si(pfx##_and_##si(pfx##_slli_epi32(o, 8),            \
+                                         pfx##_set1_epi32(0xff00)),         \
+                          pfx##_srli_epi32(o, 8));                          \
+    return pfx##_srai_epi32(pfx##_slli_epi32(o, 16), 16);                   \
+}                                                                           \
+                                                                            \
+static target void                                                          \
+translate32to8##isa(const rfbSimdTranslation *t, const uint32_t *ip,        \
+                    uint8_t *op, int n)                                     \
+{                                                                           \
+    const int lanes = sizeof(vec) / 4;                                      \
+    translation##isa k;                                                     \
+    const vec *v;                                                           \
+    vec lo, hi;                                                             \
+    int i;                                                                  \
+                                                                            \
+    prepare##isa(&k, t);                                                    \
+    for (i = 0; i + 4 * lanes <= n; i += 4 * lanes) {                       \
+        v = (const vec *)(ip + i);                                          \
+        lo = pfx##_packs_epi32(translate##isa(&k, pfx##_loadu_##si(v)),     \
+                               translate##isa(&k, pfx##_loadu_##si(v + 1)));\
+        hi = pfx##_packs_epi32(translate##isa(&k, pfx##_loadu_##si(v + 2)), \
+                               translate##isa(&k, pfx##_loadu_##si(v + 3)));\
+        pfx##_storeu_##si((vec *)(op + i),                                  \
+                          fix8(pfx##_packus_epi16(lo, hi)));                \
+    }                                                                       \
+    translate32to8Scalar(t, ip + i, op + i, n - i);                         \
+}                                                                           \
+                                                                            \
+static target void                                                          \
+translate32to16##isa(const rfbSimdTranslation *t, const uint32_t *ip,       \
+                     uint16_t *op, int n)                                   \
+{                                                                           \
+    const int lanes = sizeof(vec) / 4;                                      \
+    translation##isa k;                                                     \
+    const vec *v;                                                           \
+    int i;                                                                  \
+                                                                            \
+    prepare##isa(&k, t);                                                    \
+    for (i = 0; i + 2 * lanes <= n; i += 2 * lanes) {                       \
+        v = (const vec *)(ip + i);                                          \
+        pfx##_storeu_##si((vec *)(op + i), fix16(pfx##_packs_epi32(         \
+            narrow16##isa(t, translate##isa(&k, pfx##_loadu_##si(v))),      \
+            narrow16##isa(t, translate##isa(&k, pfx##_loadu_##si(v + 1))))));\
+    }                                                                       \
+    translate32to16Scalar(t, ip + i, op + i, n - i);                        \
+}                                                                           \
+                                                                            \
+static target void                                                          \
+translate32to24##isa(const rfbSimdTranslation *t, const uint32_t *ip,       \
+                     uint8_t *op, int n)                                    \
+{                                                                           \
+    const int lanes = sizeof(vec) / 4;                                      \
+    translation##isa k;                                                     \
+    uint32_t o[sizeof(vec) / 4];                                            \
+    int i, j;                                                               \
+                                                                            \
+    prepare##isa(&k, t);                                                    \
+    for (i = 0; i + lanes <= n; i += lanes) {                               \
+        pfx##_storeu_##si((vec *)o, translate##isa(&k,                      \
+                              pfx##_loadu_##si((const vec *)(ip + i))));    \
+        for (j = 0; j < lanes; j++)                                         \
+            put24(t, op + 3 * (i + j), o[j]);                               \
+    }                                                                       \
+    translate32to24Scalar(t, ip + i, op + 3 * i, n - i);                    \
+}                                                                           \
+                                                                            \
+static target void                                                          \
+translate32to32##isa(const rfbSimdTranslation *t, const uint32_t *ip,       \
+                     uint32_t *op, int n)                                   \
+{                                                                           \
+    const int lanes = sizeof(vec) / 4;                                      \
+    translation##isa k;                                                     \
+    vec o, m = pfx##_set1_epi32(0xff00);                                    \
+    int i;                                                                  \
+                                                                            \
+    prepare##isa(&k, t);                                                    \
+    for (i = 0; i + lanes <= n; i += lanes) {                               \
+        o = translate##isa(&k, pfx##_loadu_##si((const vec *)(ip + i)));    \
+        if (t->swap)                                                        \
+            o = pfx##_or_##si(                                              \
+                pfx##_or_##si(pfx##_slli_epi32(o, 24),                      \
+                              pfx##_srli_epi32(o, 24)),                     \
+                pfx##_or_##si(pfx##_slli_epi32(pfx##_and_##si(o, m), 8),    \
+                              pfx##_and_##si(pfx##_srli_epi32(o, 8), m)));  \
+        pfx##_storeu_##si((vec *)(op + i), o);                              \
+    }                                                                       \
+    translate32to32Scalar(t, ip + i, op + i, n - i);                        \
+}
+
+#define SSE2_FIX(x) (x)
+#define AVX2_FIX16(x) _mm256_permute4x64_epi64(x, 0xd8)
+#define AVX2_FIX8(x) \
+    _mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7))
+
+DEFINE_X86_TRANSLATE(Sse2, SSE2_TARGET, __m128i, _mm, si128,
+                     SSE2_FIX, SSE2_FIX)
+DEFINE_X86_TRANSLATE(Avx2, AVX2_TARGET, __m256i, _mm256, si256,
+                     AVX2_FIX16, AVX2_FIX8)
+
+/* the columns are summed up in registers, one block of bytes at a time */
+
+static SSE2_TARGET void
+sumRowsSse2(const uint8_t *p, int stride, int rows, uint16_t *sum, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v, lo, hi;
+    const uint8_t *q;
+    int i, r;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        lo = hi = zero;
+        for (r = 0, q = p + i; r < rows; r++, q += stride) {
+            v = _mm_loadu_si128((const __m128i *)q);
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+        }
+        _mm_storeu_si128((__m128i *)(sum + i), lo);
+        _mm_storeu_si128((__m128i *)(sum + i + 8), hi);
+    }
+    sumRowsScalar(p + i, stride, rows, sum + i, n - i);
+}
+
+static AVX2_TARGET void
+sumRowsAvx2(const uint8_t *p, int stride, int rows, uint16_t *sum, int n)
+{
+    __m256i lo, hi;
+    const uint8_t *q;
+    int i, r;
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        lo = hi = _mm256_setzero_si256();
+        for (r = 0, q = p + i; r < rows; r++, q += stride) {
+            lo = _mm256_add_epi16(lo, _mm256_cvtepu8_epi16(
+                         _mm_loadu_si128((const __m128i *)q)));
+            hi = _mm256_add_epi16(hi, _mm256_cvtepu8_epi16(
+                         _mm_loadu_si128((const __m128i *)(q + 16))));
+        }
+        _mm256_storeu_si256((__m256i *)(sum + i), lo);
+        _mm256_storeu_si256((__m256i *)(sum + i + 16), hi);
+    }
+    sumRowsSse2(p + i, stride, rows, sum + i, n - i);
+}
+
+static const rfbSimdKernels sse2Kernels = {
+    RFB_SIMD_SSE2,
+    run8Sse2, run16Sse2, run32Sse2,
+    run2_8Sse2, run2_16Sse2, run2_32Sse2,
+    translate32to8Sse2, translate32to16Sse2,
+    translate32to24Sse2, translate32to32Sse2,
+    sumRowsSse2
+};
+
+static const rfbSimdKernels avx2Kernels = {
+    RFB_SIMD_AVX2,
+    run8Avx2, run16Avx2, run32Avx2,
+    run2_8Avx2, run2_16Avx2, run2_32Avx2,
+    translate32to8Avx2, translate32to16Avx2,
+    translate32to24Avx2, translate32to32Avx2,
+    sumRowsAvx2
+};
+
+#endif /* SIMD_X86 */
+
+
+#ifdef SIMD_NEON
+
+/*
+ * NEON has no movemask, so a vector that does not match entirely is left
+ * to the scalar code, which finds the exact position.
+ */
+
+#define DEFINE_NEON_KERNELS(bpp, vec, lanes)                                \
+                                                                            \
+static int                                                                  \
+run##bpp##Neon(const uint##bpp##_t *p, int n, uint##bpp##_t c,              \
+               uint##bpp##_t mask)                                          \
+{                                                                           \
+    vec vc = vdupq_n_u##bpp(c), vm = vdupq_n_u##bpp(mask);                  \
+    int i;                                                                  \
+                                                                            \
+    for (i = 0; i + lanes <= n; i += lanes) {                               \
+        vec v = vandq_u##bpp(vld1q_u##bpp(p + i), vm);                      \
+        if (vminvq_u##bpp(vceqq_u##bpp(v, vc)) == 0)                        \
+            break;                                                          \
+    }                                                                       \
+    return i + run##bpp##Scalar(p + i, n - i, c, mask);                     \
+}                                                                           \
+                                                                            \
+static int                                                                  \
+run2_##bpp##Neon(const uint##bpp##_t *p, int n, uint##bpp##_t c0,           \
+                 uint##bpp##_t c1, uint##bpp##_t mask, int *n0)             \
+{                                                                           \
+    vec vc0 = vdupq_n_u##bpp(c0), vc1 = vdupq_n_u##bpp(c1);                 \
+    vec vm = vdupq_n_u##bpp(mask);                                          \
+    int i, k = 0, rest;                                                     \
+                                                                            \
+    for (i = 0; i + lanes <= n; i += lanes) {                               \
+        vec v = vandq_u##bpp(vld1q_u##bpp(p + i), vm);                      \
+        vec eq0 = vceqq_u##bpp(v, vc0);                                     \
+        if (vminvq_u##bpp(vorrq_u##bpp(eq0, vceqq_u##bpp(v, vc1))) == 0)    \
+            break;                                                          \
+        k += vaddvq_u##bpp(vshrq_n_u##bpp(eq0, bpp - 1));                   \
+    }                                                                       \
+    i += run2_##bpp##Scalar(p + i, n - i, c0, c1, mask, &rest);             \
+    *n0 = k + rest;                                                         \
+    return i;                                                               \
+}
+
+DEFINE_NEON_KERNELS(8, uint8x16_t, 16)
+DEFINE_NEON_KERNELS(16, uint16x8_t, 8)
+DEFINE_NEON_KERNELS(32, uint32x4_t, 4)
+
+static uint32x4_t
+translateNeon(const rfbSimdTranslation *t, uint32x4_t p)
+{
+    uint32x4_t o = vdupq_n_u32(0), v;
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        v = vandq_u32(vshlq_u32(p, vdupq_n_s32(-t->inShift[c])),
+                      vdupq_n_u32(0xff));
+        v = vaddq_u32(vmulq_n_u32(v, (uint32_t)t->outMax[c]),
+                      vdupq_n_u32(127));
+        v = vshrq_n_u32(vaddq_u32(vaddq_u32(v, vshrq_n_u32(v, 8)),
+                                  vdupq_n_u32(1)), 8);
+        o = vorrq_u32(o, vshlq_u32(v, vdupq_n_s32(t->outShift[c])));
+    }
+    return o;
+}
+
+static void
+translate32to8Neon(const rfbSimdTranslation *t, const uint32_t *ip,
+                   uint8_t *op, int n)
+{
+    uint16x8_t lo, hi;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        lo = vcombine_u16(vmovn_u32(translateNeon(t, vld1q_u32(ip + i))),
+                          vmovn_u32(translateNeon(t, vld1q_u32(ip + i + 4))));
+        hi = vcombine_u16(
+            vmovn_u32(translateNeon(t, vld1q_u32(ip + i + 8))),
+            vmovn_u32(translateNeon(t, vld1q_u32(ip + i + 12))));
+        vst1q_u8(op + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+    }
+    translate32to8Scalar(t, ip + i, op + i, n - i);
+}
+
+static void
+translate32to16Neon(const rfbSimdTranslation *t, const uint32_t *ip,
+                    uint16_t *op, int n)
+{
+    uint16x8_t o;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        o = vcombine_u16(vmovn_u32(translateNeon(t, vld1q_u32(ip + i))),
+                         vmovn_u32(translateNeon(t, vld1q_u32(ip + i + 4))));
+        if (t->swap)
+            o = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(o)));
+        vst1q_u16(op + i, o);
+    }
+    translate32to16Scalar(t, ip + i, op + i, n - i);
+}
+
+static void
+translate32to24Neon(const rfbSimdTranslation *t, const uint32_t *ip,
+                    uint8_t *op, int n)
+{
+    uint32_t o[4];
+    int i, j;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        vst1q_u32(o, translateNeon(t, vld1q_u32(ip + i)));
+        for (j = 0; j < 4; j++)
+            put24(t, op + 3 * (i + j), o[j]);
+    }
+    translate32to24Scalar(t, ip + i, op + 3 * i, n - i);
+}
+
+static void
+translate32to32Neon(const rfbSimdTranslation *t, const uint32_t *ip,
+                    uint32_t *op, int n)
+{
+    uint32x4_t o;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        o = translateNeon(t, vld1q_u32(ip + i));
+        if (t->swap)
+            o = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(o)));
+        vst1q_u32(op + i, o);
+    }
+    translate32to32Scalar(t, ip + i, op + i, n - i);
+}
+
+static void
+sumRowsNeon(const uint8_t *p, int stride, int rows, uint16_t *sum, int n)
+{
+    uint16x8_t lo, hi;
+    uint8x16_t v;
+    const uint8_t *q;
+    int i, r;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        lo = hi = vdupq_n_u16(0);
+        for (r = 0, q = p + i; r < rows; r++, q += stride) {
+            v = vld1q_u8(q);
+            lo = vaddw_u8(lo, vget_low_u8(v));
+            hi = vaddw_high_u8(hi, v);
+        }
+        vst1q_u16(sum + i, lo);
+        vst1q_u16(sum + i + 8, hi);
+    }
+    sumRowsScalar(p + i, stride, rows, sum + i, n - i);
+}
+
+static const rfbSimdKernels neonKernels = {
+    RFB_SIMD_NEON,
+    run8Neon, run16Neon, run32Neon,
+    run2_8Neon, run2_16Neon, run2_32Neon,
+    translate32to8Neon, translate32to16Neon,
+    translate32to24Neon, translate32to32Neon,
+    sumRowsNeon
+};
+
+#endif /* SIMD_NEON */
+
+
+static const rfbSimdKernels *kernelsFor(int level)
+{
+    switch (level) {
+    case RFB_SIMD_NONE:
+        return &scalarKernels;
+#ifdef SIMD_X86
+    case RFB_SIMD_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2") ? &sse2Kernels : NULL;
+    case RFB_SIMD_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &avx2Kernels : NULL;
+#endif
+#ifdef SIMD_NEON
+    case RFB_SIMD_NEON:
+        return &neonKernels;
+#endif
+    }
+    return NULL;
+}
+
+static const rfbSimdKernels *bestKernels(void)
+{
+    static const int preferred[] = {
+        RFB_SIMD_AVX2, RFB_SIMD_NEON, RFB_SIMD_SSE2, RFB_SIMD_NONE
+    };
+    const rfbSimdKernels *k = NULL;
+    int i;
+
+    for (i = 0; k == NULL; i++)
+        k = kernelsFor(preferred[i]);
+    return k;
+}
+
+/*
+ * Until the first call the kernels point to these, which pick the best
+ * set and forward the call. Several threads racing here all store the same
+ * pointer.
+ */
+
+static int run8Detect(const uint8_t *p, int n, uint8_t c, uint8_t mask)
+{
+    rfbSimd = bestKernels();
+    return rfbSimd->run8(p, n, c, mask);
+}
+
+static int run16Detect(const uint16_t *p, int n, uint16_t c, uint16_t mask)
+{
+    rfbSimd = bestKernels();
+    return rfbSimd->run16(p, n, c, mask);
+}
+
+static int run32Detect(const uint32_t *p, int n, uint32_t c, uint32_t mask)
+{
+    rfbSimd = bestKernels();
+    return rfbSimd->run32(p, n, c, mask);
+}
+
+static int run2_8Detect(const uint8_t *p, int n, uint8_t c0, uint8_t c1,
+                        uint8_t mask, int *n0)
+{
+    rfbSimd = bestKernels();
+    return rfbSimd->run2_8(p, n, c0, c1, mask, n0);
+}
+
+static int run2_16Detect(const uint16_t *p, int n, uint16_t c0, uint16_t c1,
+                         uint16_t mask, int *n0)
+{
+    rfbSimd = bestKernels();
+    return rfbSimd->run2_16(p, n, c0, c1, mask, n0);
+}
+
+static int run2_32Detect(const uint32_t *p, int n, uint32_t c0, uint32_t c1,
+                         uint32_t mask, int *n0)
+{
+    rfbSimd = bestKernels();
+    return rfbSimd->run2_32(p, n, c0, c1, mask, n0);
+}
+
+static void translate32to8Detect(const rfbSimdTranslation *t,
+                                 const uint32_t *ip, uint8_t *op, int n)
+{
+    rfbSimd = bestKernels();
+    rfbSimd->translate32to8(t, ip, op, n);
+}
+
+static void translate32to16Detect(const rfbSimdTranslation *t,
+                                  const uint32_t *ip, uint16_t *op, int n)
+{
+    rfbSimd = bestKernels();
+    rfbSimd->translate32to16(t, ip, op, n);
+}
+
+static void translate32to24Detect(const rfbSimdTranslation *t,
+                                  const uint32_t *ip, uint8_t *op, int n)
+{
+    rfbSimd = bestKernels();
+    rfbSimd->translate32to24(t, ip, op, n);
+}
+
+static void translate32to32Detect(const rfbSimdTranslation *t,
+                                  const uint32_t *ip, uint32_t *op, int n)
+{
+    rfbSimd = bestKernels();
+    rfbSimd->translate32to32(t, ip, op, n);
+}
+
+static void sumRowsDetect(const uint8_t *p, int stride, int rows,
+                          uint16_t *sum, int n)
+{
+    rfbSimd = bestKernels();
+    rfbSimd->sumRows(p, stride, rows, sum, n);
+}
+
+static const rfbSimdKernels detectKernels = {
+    -1,
+    run8Detect, run16Detect, run32Detect,
+    run2_8Detect, run2_16Detect, run2_32Detect,
+    translate32to8Detect, translate32to16Detect,
+    translate32to24Detect, translate32to32Detect,
+    sumRowsDetect
+};
+
+const rfbSimdKernels *rfbSimd = &detectKernels;
+
+int rfbSimdSetLevel(int level)
+{
+    const rfbSimdKernels *k = kernelsFor(level);
+
+    if (k)
+        rfbSimd = k;
+    else if (rfbSimd == &detectKernels)
+        rfbSimd = bestKernels();
+    return rfbSimd->level;
+}
+
+int rfbSimdLevel(void)
+{
+    if (rfbSimd == &detectKernels)
+        rfbSimd = bestKernels();
+    return rfbSimd->level;
+}
+
+const char *rfbSimdLevelName(int level)
+{
+    switch (level) {
+    case RFB_SIMD_NONE: return "scalar";
+    case RFB_SIMD_SSE2: return "SSE2";
+    case RFB_SIMD_AVX2: return "AVX2";
+    case RFB_SIMD_NEON: return "NEON";
+    }
+    return "unknown";
+}
@@ -0,0 +1,90 @@
+/*
+ * simd.h - vectorised pixel scanning, translation and scaling kernels with
+ * scalar fallbacks.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_SIMD_H
+#define RFB_SIMD_H
+
+#include <rfb/rfb.h>
+
+/* instruction sets the kernels come in */
+#define RFB_SIMD_NONE 0
+#define RFB_SIMD_SSE2 1
+#define RFB_SIMD_AVX2 2
+#define RFB_SIMD_NEON 3
+
+/*
+ * runN(p, n, c, mask) returns how many of the first n pixels at p satisfy
+ * (pixel & mask) == c.
+ *
+ * run2N(p, n, c0, c1, mask, &n0) returns how many of the first n pixels
+ * are c0 or c1 after masking, and stores how many of those are c0 in n0.
+ *
+ * translate32toN(t, ip, op, n) converts n true colour pixels with 8 bit
+ * channels to the client format described by t, with the same rounding as
+ * the translation tables.
+ *
+ * sumRows(p, stride, rows, sum, n) adds up the bytes p[i + r * stride] of
+ * the given rows for every i below n, for the box filter of the scaled
+ * framebuffers. rows must not exceed 257, so that the sums fit.
+ */
+
+typedef struct {
+    int inShift[3];     /* red, green and blue of the 32 bpp input */
+    int outMax[3];      /* at most 255 */
+    int outShift[3];
+    int swap;           /* output byte order differs from the input's */
+} rfbSimdTranslation;
+
+typedef struct {
+    int level;
+    int (*run8)(const uint8_t *p, int n, uint8_t c, uint8_t mask);
+    int (*run16)(const uint16_t *p, int n, uint16_t c, uint16_t mask);
+    int (*run32)(const uint32_t *p, int n, uint32_t c, uint32_t mask);
+    int (*run2_8)(const uint8_t *p, int n, uint8_t c0, uint8_t c1,
+                  uint8_t mask, int *n0);
+    int (*run2_16)(const uint16_t *p, int n, uint16_t c0, uint16_t c1,
+                   uint16_t mask, int *n0);
+    int (*run2_32)(const uint32_t *p, int n, uint32_t c0, uint32_t c1,
+                   uint32_t mask, int *n0);
+    void (*translate32to8)(const rfbSimdTranslation *t, const uint32_t *ip,
+                           uint8_t *op, int n);
+    void (*translate32to16)(const rfbSimdTranslation *t, const uint32_t *ip,
+                            uint16_t *op, int n);
+    void (*translate32to24)(const rfbSimdTranslation *t, const uint32_t *ip,
+                            uint8_t *op, int n);
+    void (*translate32to32)(const rfbSimdTranslation *t, const uint32_t *ip,
+                            uint32_t *op, int n);
+    void (*sumRows)(const uint8_t *p, int stride, int rows, uint16_t *sum,
+                    int n);
+} rfbSimdKernels;
+
+/* the best kernels the CPU supports, picked on first use */
+extern const rfbSimdKernels *rfbSimd;
+
+/* switch to the kernels of the given instruction set if the CPU has it,
+   for tests and benchmarks. Returns the level in use afterwards. */
+int rfbSimdSetLevel(int level);
+/* the level of the best kernels, picking them if that has not happened */
+int rfbSimdLevel(void);
+const char *rfbSimdLevelName(int level);
+
+#endif
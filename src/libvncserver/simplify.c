@@ -0,0 +1,309 @@
+/*
+ * simplify.c - merge the rectangles of an update where that is cheaper.
+ *
+ * Every rectangle of an update costs a header and, for the compressing
+ * encodings, a length field and a flush of the compressor, whereas merging
+ * two rectangles into their bounding box costs the pixels in between which
+ * did not change. These are estimated at the compression ratio the client's
+ * preferred encoding achieved so far. The pair of neighbours for which
+ * merging saves the most is merged first, as long as it saves anything,
+ * and beyond that as long as the update has more than maxRectsPerUpdate
+ * rectangles. So a diagonal line of small changes becomes a handful of
+ * rectangles along it instead of the whole screen.
+ *
+ * Candidates are only looked for among the next SIMPLIFY_NEIGHBOURS
+ * rectangles in the order of their top edges, which keeps the search near
+ * linear and the merges local.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#define SIMPLIFY_NEIGHBOURS 8
+/*
+ * A region is stored in bands, so boxes side by side which do not line up
+ * are cut into more rectangles again
+ */
+#define SIMPLIFY_PASSES 4
+/* compression ratio assumed until this much was sent with an encoding */
+#define SIMPLIFY_MIN_RAW_BYTES (64 * 1024)
+#define SIMPLIFY_DEFAULT_RATIO 0.25
+
+typedef struct {
+    sraRect box;
+    int prev, next;     /* alive boxes, ordered by y1 */
+    int version;        /* bumped when merged, outdates its pairs */
+    rfbBool alive;
+} rfbSimplifyBox;
+
+typedef struct {
+    double saving;
+    int a, b;
+    int versionA, versionB;
+} rfbSimplifyPair;
+
+typedef struct {
+    rfbSimplifyBox *boxes;
+    rfbSimplifyPair *heap;  /* greatest saving first */
+    int nHeap, maxHeap;
+    double overhead;        /* bytes per rectangle */
+    double bytesPerPixel;   /* of pixels added by merging */
+} rfbSimplify;
+
+/* bytes a rectangle costs besides its pixels */
+static double rectOverhead(int encoding)
+{
+    switch (encoding) {
+    case rfbEncodingZlib:
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+    case rfbEncodingUltra:
+        /* length field and the flush of the compressor */
+        return sz_rfbFramebufferUpdateRectHeader + 4 + 6;
+    case rfbEncodingTight:
+    case rfbEncodingTightPng:
+        return sz_rfbFramebufferUpdateRectHeader + 3 + 6;
+    case rfbEncodingRRE:
+    case rfbEncodingCoRRE:
+        return sz_rfbFramebufferUpdateRectHeader + sz_rfbRREHeader + 4;
+    }
+    return sz_rfbFramebufferUpdateRectHeader;
+}
+
+static double bytesPerPixel(rfbClientPtr cl)
+{
+    rfbStatList *stats = rfbStatLookupEncoding(cl, cl->preferredEncoding);
+    double ratio = SIMPLIFY_DEFAULT_RATIO;
+
+    if (cl->preferredEncoding == rfbEncodingRaw)
+        ratio = 1;
+    else if (stats && stats->bytesSentIfRaw >= SIMPLIFY_MIN_RAW_BYTES)
+        ratio = (double)stats->bytesSent / stats->bytesSentIfRaw;
+    return ratio * (cl->format.bitsPerPixel / 8);
+}
+
+static double area(const sraRect *r)
+{
+    return (double)(r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static void boundingBox(const sraRect *a, const sraRect *b, sraRect *box)
+{
+    box->x1 = a->x1 < b->x1 ? a->x1 : b->x1;
+    box->y1 = a->y1 < b->y1 ? a->y1 : b->y1;
+    box->x2 = a->x2 > b->x2 ? a->x2 : b->x2;
+    box->y2 = a->y2 > b->y2 ? a->y2 : b->y2;
+}
+
+/* bytes saved by sending a and b as their bounding box */
+static double saving(rfbSimplify *s, const sraRect *a, const sraRect *b)
+{
+    sraRect box, overlap;
+    double added;
+
+    boundingBox(a, b, &box);
+    added = area(&box) - area(a) - area(b);
+    overlap.x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+    overlap.y1 = a->y1 > b->y1 ? a->y1 : b->y1;
+    overlap.x2 = a->x2 < b->x2 ? a->x2 : b->x2;
+    overlap.y2 = a->y2 < b->y2 ? a->y2 : b->y2;
+    if (overlap.x1 < overlap.x2 && overlap.y1 < overlap.y2)
+        added += area(&overlap);
+    return s->overhead - added * s->bytesPerPixel;
+}
+
+static void swapPairs(rfbSimplifyPair *heap, int i, int j)
+{
+    rfbSimplifyPair t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+}
+
+static rfbBool pushPair(rfbSimplify *s, int a, int b)
+{
+    rfbSimplifyPair *pair;
+    int i;
+
+    if (s->nHeap == s->maxHeap) {
+        int max = s->maxHeap ? s->maxHeap * 2 : 256;
+        rfbSimplifyPair *heap = (rfbSimplifyPair *)
+            realloc(s->heap, max * sizeof(rfbSimplifyPair));
+        if (!heap)
+            return FALSE;
+        s->heap = heap;
+        s->maxHeap = max;
+    }
+    i = s->nHeap++;
+    pair = &s->heap[i];
+    pair->a = a;
+    pair->b = b;
+    pair->versionA = s->boxes[a].version;
+    pair->versionB = s->boxes[b].version;
+    pair->saving = saving(s, &s->boxes[a].box, &s->boxes[b].box);
+    while (i > 0 && s->heap[(i - 1) / 2].saving < s->heap[i].saving) {
+        swapPairs(s->heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    return TRUE;
+}
+
+static void popPair(rfbSimplify *s)
+{
+    int i = 0, child;
+
+    s->heap[0] = s->heap[--s->nHeap];
+    while ((child = 2 * i + 1) < s->nHeap) {
+        if (child + 1 < s->nHeap && s->heap[child + 1].saving > s->heap[child].saving)
+            child++;
+        if (s->heap[i].saving >= s->heap[child].saving)
+            break;
+        swapPairs(s->heap, i, child);
+        i = child;
+    }
+}
+
+/* pairs box a with its neighbours on both sides */
+static rfbBool pushNeighbours(rfbSimplify *s, int a)
+{
+    int b, n;
+
+    for (b = s->boxes[a].next, n = 0; b >= 0 && n < SIMPLIFY_NEIGHBOURS;
+         b = s->boxes[b].next, n++)
+        if (!pushPair(s, a, b))
+            return FALSE;
+    for (b = s->boxes[a].prev, n = 0; b >= 0 && n < SIMPLIFY_NEIGHBOURS;
+         b = s->boxes[b].prev, n++)
+        if (!pushPair(s, b, a))
+            return FALSE;
+    return TRUE;
+}
+
+/* one pass, returns FALSE if memory ran out */
+static rfbBool simplifyPass(rfbSimplify *s, sraRegionPtr region, int maxRects)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    rfbSimplifyPair pair;
+    int n, nAlive, a, b;
+
+    n = (int)sraRgnCountRects(region);
+    s->boxes = (rfbSimplifyBox *)malloc(n * sizeof(rfbSimplifyBox));
+    if (!s->boxes)
+        return FALSE;
+    s->nHeap = 0;
+
+    /* the iterator goes top to bottom */
+    i = sraRgnGetIterator(region);
+    for (a = 0; sraRgnIteratorNext(i, &rect); a++) {
+        s->boxes[a].box = rect;
+        s->boxes[a].prev = a - 1;
+        s->boxes[a].next = a + 1 < n ? a + 1 : -1;
+        s->boxes[a].version = 0;
+        s->boxes[a].alive = TRUE;
+    }
+    sraRgnReleaseIterator(i);
+
+    for (a = 0; a < n; a++)
+        for (b = a + 1; b < n && b <= a + SIMPLIFY_NEIGHBOURS; b++)
+            if (!pushPair(s, a, b))
+                goto failed;
+
+    nAlive = n;
+    while (s->nHeap > 0) {
+        pair = s->heap[0];
+        if (pair.saving <= 0 && (maxRects <= 0 || nAlive <= maxRects))
+            break;
+        popPair(s);
+        if (!s->boxes[pair.a].alive || !s->boxes[pair.b].alive ||
+            s->boxes[pair.a].version != pair.versionA ||
+            s->boxes[pair.b].version != pair.versionB)
+            continue;
+
+        /* a comes first, so the box keeps its place in the order */
+        boundingBox(&s->boxes[pair.a].box, &s->boxes[pair.b].box, &s->boxes[pair.a].box);
+        s->boxes[pair.a].version++;
+        s->boxes[pair.b].alive = FALSE;
+        if (s->boxes[pair.b].prev >= 0)
+            s->boxes[s->boxes[pair.b].prev].next = s->boxes[pair.b].next;
+        if (s->boxes[pair.b].next >= 0)
+            s->boxes[s->boxes[pair.b].next].prev = s->boxes[pair.b].prev;
+        nAlive--;
+        if (!pushNeighbours(s, pair.a))
+            goto failed;
+    }
+
+    sraRgnMakeEmpty(region);
+    for (a = 0; a < n; a++) {
+        if (s->boxes[a].alive) {
+            sraRegionPtr box = sraRgnCreateRect(s->boxes[a].box.x1, s->boxes[a].box.y1,
+                                                s->boxes[a].box.x2, s->boxes[a].box.y2);
+            sraRgnOr(region, box);
+            sraRgnDestroy(box);
+        }
+    }
+    free(s->boxes);
+    s->boxes = NULL;
+    return TRUE;
+
+failed:
+    free(s->boxes);
+    s->boxes = NULL;
+    return FALSE;
+}
+
+/*
+ * Merges rectangles of region where that saves bytes, and until it has no
+ * more than maxRects rectangles if maxRects is positive. Falls back to the
+ * bounding box if that cannot be achieved.
+ */
+
+void rfbSimplifyUpdateRegion(rfbClientPtr cl, sraRegionPtr region, int maxRects)
+{
+    rfbSimplify s;
+    sraRegionPtr bbox;
+    int pass, target, n;
+
+    if (sraRgnCountRects(region) < 2)
+        return;
+
+    memset(&s, 0, sizeof(s));
+    s.overhead = rectOverhead(cl->preferredEncoding);
+    s.bytesPerPixel = bytesPerPixel(cl);
+
+    for (pass = 0, target = maxRects; pass < SIMPLIFY_PASSES; pass++) {
+        if (!simplifyPass(&s, region, target))
+            break;
+        if (maxRects <= 0 || (n = (int)sraRgnCountRects(region)) <= maxRects)
+            break;
+        /* aim lower by as much as the boxes were cut up */
+        target = target * maxRects / n;
+        if (target < 1)
+            target = 1;
+    }
+    free(s.heap);
+
+    if (maxRects > 0 && (int)sraRgnCountRects(region) > maxRects) {
+        bbox = sraRgnBBox(region);
+        sraRgnMakeEmpty(region);
+        sraRgnOr(region, bbox);
+        sraRgnDestroy(bbox);
+    }
+}
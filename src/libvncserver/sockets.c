@@ -862,6 +862,12 @@ rfbWriteExact(rfbClientPtr cl,
     int totalTimeWaited = 0;
     const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
 
+    /* gone, and the socket number may belong to somebody else by now */
+    if (sock == RFB_INVALID_SOCKET) {
+        errno = EBADF;
+        return -1;
+    }
+
 #undef DEBUG_WRITE_EXACT
 #ifdef DEBUG_WRITE_EXACT
     rfbLog("WriteExact %d bytes\n",len);
@@ -898,6 +904,7 @@ rfbWriteExact(rfbClientPtr cl,
     while (len > 0) {
         if(sock == RFB_INVALID_SOCKET) {
             errno = EBADF;
+            UNLOCK(cl->outputMutex);
             return -1;
         }
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
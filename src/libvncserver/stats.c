@@ -40,6 +40,65 @@ void  rfbStatRecordMessageRcvd(rfbClientPtr cl, uint32_t type, int byteCount, in
 void rfbResetStats(rfbClientPtr cl);
 void rfbPrintStats(rfbClientPtr cl);
 
+/*
+ * The statistics of a client are written by the threads sending to and
+ * receiving from it, and read by whoever asks for them, so they are kept
+ * under the client's statsMutex. It is taken last, after any other lock
+ * of the client.
+ *
+ * The rectangle encodings also get a slot each, which keeps their
+ * statEncList entry at hand and what is only collected for them.
+ */
+
+struct rfbStatSlots {
+    rfbStatList *encodings[rfbStatEncodings];
+    uint64_t encodeTimeUs[rfbStatEncodings];
+    uint64_t encodeTimeHistogram[rfbStatEncodings][rfbStatBuckets];
+    uint64_t updates;
+    uint64_t latencyMs;
+    uint64_t latencyHistogram[rfbStatBuckets];
+};
+
+static int rfbStatSlot(uint32_t type)
+{
+    switch (type) {
+    case (uint32_t)-1:
+    case rfbEncodingRaw:      return 0;
+    case rfbEncodingCopyRect: return 1;
+    case rfbEncodingRRE:      return 2;
+    case rfbEncodingCoRRE:    return 3;
+    case rfbEncodingHextile:  return 4;
+    case rfbEncodingZlib:     return 5;
+    case rfbEncodingTight:    return 6;
+    case rfbEncodingTightPng: return 7;
+    case rfbEncodingZlibHex:  return 8;
+    case rfbEncodingUltra:    return 9;
+    /* rfbSendRectEncodingZRLE() counts ZYWRLE rectangles as ZRLE */
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:   return 10;
+    case rfbEncodingUltraZip: return 11;
+    default:                  return -1;
+    }
+}
+
+static int rfbStatBucket(uint64_t us)
+{
+    int bucket = 0;
+
+    while (us >= 2 && bucket < rfbStatBuckets - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static struct rfbStatSlots *rfbStatGetSlots(rfbClientPtr cl)
+{
+    if (cl->statSlots == NULL)
+        cl->statSlots = (struct rfbStatSlots *)calloc(1, sizeof(struct rfbStatSlots));
+    return cl->statSlots;
+}
+
 
 
 
@@ -55,6 +114,8 @@ char *messageNameServer2Client(uint32_t type, char *buf, int len) {
     case rfbTextChat:                 snprintf(buf, len, "TextChat"); break;
     case rfbPalmVNCReSizeFrameBuffer: snprintf(buf, len, "PalmVNCReSize"); break;
     case rfbXvp:                      snprintf(buf, len, "XvpServerMessage"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
+    case rfbEndOfContinuousUpdates:   snprintf(buf, len, "EndOfContinuousUpdates"); break;
     default:
         snprintf(buf, len, "svr2cli-0x%08X", 0xFF);
     }
@@ -79,6 +140,8 @@ char *messageNameClient2Server(uint32_t type, char *buf, int len) {
     case rfbPalmVNCSetScaleFactor:    snprintf(buf, len, "PalmVNCSetScale"); break;
     case rfbXvp:                      snprintf(buf, len, "XvpClientMessage"); break;
     case rfbSetDesktopSize:           snprintf(buf, len, "SetDesktopSize"); break;
+    case rfbFence:                    snprintf(buf, len, "Fence"); break;
+    case rfbEnableContinuousUpdates:  snprintf(buf, len, "EnableContinuousUpdates"); break;
     default:
         snprintf(buf, len, "cli2svr-0x%08X", type);
 
@@ -124,10 +187,14 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingLastRect:           snprintf(buf, len, "LastRect");    break;
     case rfbEncodingNewFBSize:          snprintf(buf, len, "NewFBSize");   break;
     case rfbEncodingExtDesktopSize:     snprintf(buf, len, "ExtendedDesktopSize"); break;
+    case rfbEncodingFence:              snprintf(buf, len, "Fence");       break;
+    case rfbEncodingContinuousUpdates:  snprintf(buf, len, "ContinuousUpdates"); break;
     case rfbEncodingKeyboardLedState:   snprintf(buf, len, "LedState");    break;
     case rfbEncodingSupportedMessages:  snprintf(buf, len, "SupportedMessage");  break;
     case rfbEncodingSupportedEncodings: snprintf(buf, len, "SupportedEncoding"); break;
     case rfbEncodingServerIdentity:     snprintf(buf, len, "ServerIdentify");    break;
+    case rfbEncodingTileCacheStore:     snprintf(buf, len, "TileCacheStore");    break;
+    case rfbEncodingTileCacheRef:       snprintf(buf, len, "TileCacheRef");      break;
 
     /* The following lookups do not report in stats */
     case rfbEncodingCompressLevel0: snprintf(buf, len, "CompressLevel0");  break;
@@ -164,32 +231,43 @@ char *encodingName(uint32_t type, char *buf, int len) {
 
 
 
-rfbStatList *rfbStatLookupEncoding(rfbClientPtr cl, uint32_t type)
+/* call with cl->statsMutex held */
+static rfbStatList *lookupEncoding(rfbClientPtr cl, uint32_t type)
 {
     rfbStatList *ptr;
-    if (cl==NULL) return NULL;
+    struct rfbStatSlots *slots = NULL;
+    int slot;
+    slot = rfbStatSlot(type);
+    if (slot>=0 && (slots = rfbStatGetSlots(cl))!=NULL &&
+        slots->encodings[slot]!=NULL && slots->encodings[slot]->type==type)
+        return slots->encodings[slot];
     for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
     {
-        if (ptr->type==type) return ptr;
+        if (ptr->type==type) break;
     }
-    /* Well, we are here... need to *CREATE* an entry */
-    ptr = (rfbStatList *)malloc(sizeof(rfbStatList));
-    if (ptr!=NULL)
+    if (ptr==NULL)
     {
-        memset((char *)ptr, 0, sizeof(rfbStatList));
-        ptr->type = type;
-        /* add to the top of the list */
-        ptr->Next = cl->statEncList;
-        cl->statEncList = ptr;
+        /* Well, we are here... need to *CREATE* an entry */
+        ptr = (rfbStatList *)malloc(sizeof(rfbStatList));
+        if (ptr!=NULL)
+        {
+            memset((char *)ptr, 0, sizeof(rfbStatList));
+            ptr->type = type;
+            /* add to the top of the list */
+            ptr->Next = cl->statEncList;
+            cl->statEncList = ptr;
+        }
     }
+    if (slots!=NULL)
+        slots->encodings[slot] = ptr;
     return ptr;
 }
 
 
-rfbStatList *rfbStatLookupMessage(rfbClientPtr cl, uint32_t type)
+/* call with cl->statsMutex held */
+static rfbStatList *lookupMessage(rfbClientPtr cl, uint32_t type)
 {
     rfbStatList *ptr;
-    if (cl==NULL) return NULL;
     for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
     {
         if (ptr->type==type) return ptr;
@@ -207,13 +285,36 @@ rfbStatList *rfbStatLookupMessage(rfbClientPtr cl, uint32_t type)
     return ptr;
 }
 
+rfbStatList *rfbStatLookupEncoding(rfbClientPtr cl, uint32_t type)
+{
+    rfbStatList *ptr;
+    if (cl==NULL) return NULL;
+    LOCK(cl->statsMutex);
+    ptr = lookupEncoding(cl, type);
+    UNLOCK(cl->statsMutex);
+    return ptr;
+}
+
+rfbStatList *rfbStatLookupMessage(rfbClientPtr cl, uint32_t type)
+{
+    rfbStatList *ptr;
+    if (cl==NULL) return NULL;
+    LOCK(cl->statsMutex);
+    ptr = lookupMessage(cl, type);
+    UNLOCK(cl->statsMutex);
+    return ptr;
+}
+
 void rfbStatRecordEncodingSentAdd(rfbClientPtr cl, uint32_t type, int byteCount) /* Specifically for tight encoding */
 {
     rfbStatList *ptr;
 
-    ptr = rfbStatLookupEncoding(cl, type);
+    if (cl==NULL) return;
+    LOCK(cl->statsMutex);
+    ptr = lookupEncoding(cl, type);
     if (ptr!=NULL)
         ptr->bytesSent      += byteCount;
+    UNLOCK(cl->statsMutex);
 }
 
 
@@ -221,135 +322,301 @@ void  rfbStatRecordEncodingSent(rfbClientPtr cl, uint32_t type, int byteCount, i
 {
     rfbStatList *ptr;
 
-    ptr = rfbStatLookupEncoding(cl, type);
+    if (cl==NULL) return;
+    LOCK(cl->statsMutex);
+    ptr = lookupEncoding(cl, type);
     if (ptr!=NULL)
     {
         ptr->sentCount++;
         ptr->bytesSent      += byteCount;
         ptr->bytesSentIfRaw += byteIfRaw;
     }
+    UNLOCK(cl->statsMutex);
 }
 
 void  rfbStatRecordEncodingRcvd(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw)
 {
     rfbStatList *ptr;
 
-    ptr = rfbStatLookupEncoding(cl, type);
+    if (cl==NULL) return;
+    LOCK(cl->statsMutex);
+    ptr = lookupEncoding(cl, type);
     if (ptr!=NULL)
     {
         ptr->rcvdCount++;
         ptr->bytesRcvd      += byteCount;
         ptr->bytesRcvdIfRaw += byteIfRaw;
     }
+    UNLOCK(cl->statsMutex);
 }
 
 void  rfbStatRecordMessageSent(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw)
 {
     rfbStatList *ptr;
 
-    ptr = rfbStatLookupMessage(cl, type);
+    if (cl==NULL) return;
+    LOCK(cl->statsMutex);
+    ptr = lookupMessage(cl, type);
     if (ptr!=NULL)
     {
         ptr->sentCount++;
         ptr->bytesSent      += byteCount;
         ptr->bytesSentIfRaw += byteIfRaw;
     }
+    UNLOCK(cl->statsMutex);
 }
 
 void  rfbStatRecordMessageRcvd(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw)
 {
     rfbStatList *ptr;
 
-    ptr = rfbStatLookupMessage(cl, type);
+    if (cl==NULL) return;
+    LOCK(cl->statsMutex);
+    ptr = lookupMessage(cl, type);
     if (ptr!=NULL)
     {
         ptr->rcvdCount++;
         ptr->bytesRcvd      += byteCount;
         ptr->bytesRcvdIfRaw += byteIfRaw;
     }
+    UNLOCK(cl->statsMutex);
+}
+
+void rfbStatRecordAdaptiveChange(rfbClientPtr cl, const char *reason)
+{
+    if (cl==NULL) return;
+    cl->adaptiveChanges++;
+    rfbLog("Adaptive quality for client %s: quality %d, compression -%d, "
+           "latency %dms, bandwidth %uKB/s (%s)\n", cl->host,
+           cl->adaptiveQuality, cl->adaptiveCompressReduction,
+           cl->adaptiveLatency, cl->adaptiveBandwidth / 1024, reason);
+}
+
+
+void rfbStatRecordEncodeTime(rfbClientPtr cl, uint32_t type, uint64_t us)
+{
+    struct rfbStatSlots *slots;
+    int slot = rfbStatSlot(type);
+
+    if (cl==NULL || slot<0)
+        return;
+    LOCK(cl->statsMutex);
+    if ((slots = rfbStatGetSlots(cl))!=NULL) {
+        slots->encodeTimeUs[slot] += us;
+        slots->encodeTimeHistogram[slot][rfbStatBucket(us)]++;
+    }
+    UNLOCK(cl->statsMutex);
+}
+
+void rfbStatRecordUpdateLatency(rfbClientPtr cl, uint32_t ms)
+{
+    struct rfbStatSlots *slots;
+
+    if (cl==NULL)
+        return;
+    LOCK(cl->statsMutex);
+    if ((slots = rfbStatGetSlots(cl))!=NULL) {
+        slots->updates++;
+        slots->latencyMs += ms;
+        slots->latencyHistogram[rfbStatBucket((uint64_t)ms * 1000)]++;
+    }
+    UNLOCK(cl->statsMutex);
+}
+
+/* adds the rectangles, bytes and encode times an encoder thread counted
+   in its copy of the client to the client's own. The copy is the encoder
+   thread's alone, and not locked. */
+void rfbStatMergeSlots(rfbClientPtr cl, rfbClientPtr from)
+{
+    rfbStatList *ptr, *to;
+    struct rfbStatSlots *slots;
+    int i, j;
+
+    LOCK(cl->statsMutex);
+    for (ptr = from->statEncList; ptr!=NULL; ptr=ptr->Next) {
+        to = lookupEncoding(cl, ptr->type);
+        if (to!=NULL) {
+            to->sentCount += ptr->sentCount;
+            to->bytesSent += ptr->bytesSent;
+            to->bytesSentIfRaw += ptr->bytesSentIfRaw;
+        }
+    }
+    if (from->statSlots!=NULL && (slots = rfbStatGetSlots(cl))!=NULL) {
+        for (i = 0; i < rfbStatEncodings; i++) {
+            slots->encodeTimeUs[i] += from->statSlots->encodeTimeUs[i];
+            for (j = 0; j < rfbStatBuckets; j++)
+                slots->encodeTimeHistogram[i][j] += from->statSlots->encodeTimeHistogram[i][j];
+        }
+    }
+    UNLOCK(cl->statsMutex);
+}
+
+void rfbGetStats(rfbClientPtr cl, rfbStats *stats)
+{
+    rfbStatList *ptr;
+    struct rfbStatSlots *slots;
+    int slot;
+
+    memset(stats, 0, sizeof(*stats));
+    if (cl==NULL) return;
+
+    LOCK(cl->updateMutex);
+    stats->droppedUpdates = cl->droppedUpdates;
+    UNLOCK(cl->updateMutex);
+
+    LOCK(cl->statsMutex);
+    slots = cl->statSlots;
+
+    for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next) {
+        stats->bytesSent += ptr->bytesSent;
+        stats->bytesSentIfRaw += ptr->bytesSentIfRaw;
+        stats->bytesRcvd += ptr->bytesRcvd;
+    }
+    for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next) {
+        stats->bytesSent += ptr->bytesSent;
+        stats->bytesSentIfRaw += ptr->bytesSentIfRaw;
+        stats->bytesRcvd += ptr->bytesRcvd;
+
+        slot = rfbStatSlot(ptr->type);
+        if (slot>=0 && ptr->sentCount>0 && stats->nEncodings<rfbStatEncodings) {
+            rfbEncodingStats *e = &stats->encodings[stats->nEncodings++];
+            e->encoding = ptr->type;
+            e->rects = ptr->sentCount;
+            e->bytes = ptr->bytesSent;
+            e->bytesIfRaw = ptr->bytesSentIfRaw;
+            if (slots!=NULL) {
+                e->encodeTimeUs = slots->encodeTimeUs[slot];
+                memcpy(e->encodeTimeHistogram, slots->encodeTimeHistogram[slot],
+                       sizeof(e->encodeTimeHistogram));
+            }
+        }
+    }
+    stats->tileCacheHits = cl->tileCacheHits;
+    stats->tileCacheMisses = cl->tileCacheMisses;
+    stats->memoryBytes = cl->memoryUsage;
+    stats->memoryReclaims = cl->memoryReclaims;
+    if (slots!=NULL) {
+        stats->updates = slots->updates;
+        stats->latencyMs = slots->latencyMs;
+        memcpy(stats->latencyHistogram, slots->latencyHistogram,
+               sizeof(stats->latencyHistogram));
+    }
+    UNLOCK(cl->statsMutex);
 }
 
 
-int rfbStatGetSentBytes(rfbClientPtr cl)
+uint64_t rfbStatGetSentBytes(rfbClientPtr cl)
 {
     rfbStatList *ptr=NULL;
-    int bytes=0;
+    uint64_t bytes=0;
     if (cl==NULL) return 0;
+    LOCK(cl->statsMutex);
     for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesSent;
     for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesSent;
+    UNLOCK(cl->statsMutex);
     return bytes;
 }
 
-int rfbStatGetSentBytesIfRaw(rfbClientPtr cl)
+uint64_t rfbStatGetSentBytesIfRaw(rfbClientPtr cl)
 {
     rfbStatList *ptr=NULL;
-    int bytes=0;
+    uint64_t bytes=0;
     if (cl==NULL) return 0;
+    LOCK(cl->statsMutex);
     for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesSentIfRaw;
     for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesSentIfRaw;
+    UNLOCK(cl->statsMutex);
     return bytes;
 }
 
-int rfbStatGetRcvdBytes(rfbClientPtr cl)
+uint64_t rfbStatGetRcvdBytes(rfbClientPtr cl)
 {
     rfbStatList *ptr=NULL;
-    int bytes=0;
+    uint64_t bytes=0;
     if (cl==NULL) return 0;
+    LOCK(cl->statsMutex);
     for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesRcvd;
     for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesRcvd;
+    UNLOCK(cl->statsMutex);
     return bytes;
 }
 
-int rfbStatGetRcvdBytesIfRaw(rfbClientPtr cl)
+uint64_t rfbStatGetRcvdBytesIfRaw(rfbClientPtr cl)
 {
     rfbStatList *ptr=NULL;
-    int bytes=0;
+    uint64_t bytes=0;
     if (cl==NULL) return 0;
+    LOCK(cl->statsMutex);
     for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesRcvdIfRaw;
     for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
         bytes += ptr->bytesRcvdIfRaw;
+    UNLOCK(cl->statsMutex);
     return bytes;
 }
 
-int rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type)
+uint64_t rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type)
 {
   rfbStatList *ptr=NULL;
+  uint64_t count=0;
     if (cl==NULL) return 0;
+  LOCK(cl->statsMutex);
   for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->sentCount;
-  return 0;
+      if (ptr->type==type) {
+          count = ptr->sentCount;
+          break;
+      }
+  UNLOCK(cl->statsMutex);
+  return count;
 }
-int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type)
+uint64_t rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type)
 {
   rfbStatList *ptr=NULL;
+  uint64_t count=0;
     if (cl==NULL) return 0;
+  LOCK(cl->statsMutex);
   for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->rcvdCount;
-  return 0;
+      if (ptr->type==type) {
+          count = ptr->rcvdCount;
+          break;
+      }
+  UNLOCK(cl->statsMutex);
+  return count;
 }
 
-int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type)
+uint64_t rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type)
 {
   rfbStatList *ptr=NULL;
+  uint64_t count=0;
     if (cl==NULL) return 0;
+  LOCK(cl->statsMutex);
   for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->sentCount;
-  return 0;
+      if (ptr->type==type) {
+          count = ptr->sentCount;
+          break;
+      }
+  UNLOCK(cl->statsMutex);
+  return count;
 }
-int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type)
+uint64_t rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type)
 {
   rfbStatList *ptr=NULL;
+  uint64_t count=0;
     if (cl==NULL) return 0;
+  LOCK(cl->statsMutex);
   for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
-      if (ptr->type==type) return ptr->rcvdCount;
-  return 0;
+      if (ptr->type==type) {
+          count = ptr->rcvdCount;
+          break;
+      }
+  UNLOCK(cl->statsMutex);
+  return count;
 }
 
 
@@ -359,6 +626,7 @@ void rfbResetStats(rfbClientPtr cl)
 {
     rfbStatList *ptr;
     if (cl==NULL) return;
+    LOCK(cl->statsMutex);
     while (cl->statEncList!=NULL)
     {
         ptr = cl->statEncList;
@@ -371,6 +639,9 @@ void rfbResetStats(rfbClientPtr cl)
         cl->statMsgList = ptr->Next;
         free(ptr);
     }
+    free(cl->statSlots);
+    cl->statSlots = NULL;
+    UNLOCK(cl->statsMutex);
 }
 
 
@@ -379,16 +650,18 @@ void rfbPrintStats(rfbClientPtr cl)
     rfbStatList *ptr=NULL;
     char encBuf[64];
     double savings=0.0;
-    int    totalRects=0;
+    uint64_t totalRects=0;
     double totalBytes=0.0;
     double totalBytesIfRaw=0.0;
 
     char *name=NULL;
-    int bytes=0;
-    int bytesIfRaw=0;
-    int count=0;
+    uint64_t bytes=0;
+    uint64_t bytesIfRaw=0;
+    uint64_t count=0;
+    int slot;
 
     if (cl==NULL) return;
+    LOCK(cl->statsMutex);
     
     rfbLog("%-21.21s  %-6.6s   %9.9s/%9.9s (%6.6s)\n", "Statistics", "events", "Transmit","RawEquiv","saved");
     for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
@@ -402,8 +675,9 @@ void rfbPrintStats(rfbClientPtr cl)
         if (bytesIfRaw>0.0)
             savings = 100.0 - (((double)bytes / (double)bytesIfRaw) * 100.0);
         if ((bytes>0) || (count>0) || (bytesIfRaw>0))
-            rfbLog(" %-20.20s: %6d | %9d/%9d (%5.1f%%)\n",
-	        name, count, bytes, bytesIfRaw, savings);
+            rfbLog(" %-20.20s: %6llu | %9llu/%9llu (%5.1f%%)\n",
+	        name, (unsigned long long)count, (unsigned long long)bytes,
+	        (unsigned long long)bytesIfRaw, savings);
         totalRects += count;
         totalBytes += bytes;
         totalBytesIfRaw += bytesIfRaw;
@@ -420,8 +694,9 @@ void rfbPrintStats(rfbClientPtr cl)
         if (bytesIfRaw>0.0)
             savings = 100.0 - (((double)bytes / (double)bytesIfRaw) * 100.0);
         if ((bytes>0) || (count>0) || (bytesIfRaw>0))
-            rfbLog(" %-20.20s: %6d | %9d/%9d (%5.1f%%)\n",
-	        name, count, bytes, bytesIfRaw, savings);
+            rfbLog(" %-20.20s: %6llu | %9llu/%9llu (%5.1f%%)\n",
+	        name, (unsigned long long)count, (unsigned long long)bytes,
+	        (unsigned long long)bytesIfRaw, savings);
         totalRects += count;
         totalBytes += bytes;
         totalBytesIfRaw += bytesIfRaw;
@@ -429,10 +704,10 @@ void rfbPrintStats(rfbClientPtr cl)
     savings=0.0;
     if (totalBytesIfRaw>0.0)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
-    rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
-            "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
+    rfbLog(" %-20.20s: %6llu | %9.0f/%9.0f (%5.1f%%)\n",
+            "TOTALS", (unsigned long long)totalRects, totalBytes,totalBytesIfRaw, savings);
 
-    totalRects=0.0;
+    totalRects=0;
     totalBytes=0.0;
     totalBytesIfRaw=0.0;
 
@@ -448,8 +723,9 @@ void rfbPrintStats(rfbClientPtr cl)
         if (bytesIfRaw>0.0)
             savings = 100.0 - (((double)bytes / (double)bytesIfRaw) * 100.0);
         if ((bytes>0) || (count>0) || (bytesIfRaw>0))
-            rfbLog(" %-20.20s: %6d | %9d/%9d (%5.1f%%)\n",
-	        name, count, bytes, bytesIfRaw, savings);
+            rfbLog(" %-20.20s: %6llu | %9llu/%9llu (%5.1f%%)\n",
+	        name, (unsigned long long)count, (unsigned long long)bytes,
+	        (unsigned long long)bytesIfRaw, savings);
         totalRects += count;
         totalBytes += bytes;
         totalBytesIfRaw += bytesIfRaw;
@@ -465,8 +741,9 @@ void rfbPrintStats(rfbClientPtr cl)
         if (bytesIfRaw>0.0)
             savings = 100.0 - (((double)bytes / (double)bytesIfRaw) * 100.0);
         if ((bytes>0) || (count>0) || (bytesIfRaw>0))
-            rfbLog(" %-20.20s: %6d | %9d/%9d (%5.1f%%)\n",
-	        name, count, bytes, bytesIfRaw, savings);
+            rfbLog(" %-20.20s: %6llu | %9llu/%9llu (%5.1f%%)\n",
+	        name, (unsigned long long)count, (unsigned long long)bytes,
+	        (unsigned long long)bytesIfRaw, savings);
         totalRects += count;
         totalBytes += bytes;
         totalBytesIfRaw += bytesIfRaw;
@@ -474,8 +751,35 @@ void rfbPrintStats(rfbClientPtr cl)
     savings=0.0;
     if (totalBytesIfRaw>0.0)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
-    rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
-            "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
-      
+    rfbLog(" %-20.20s: %6llu | %9.0f/%9.0f (%5.1f%%)\n",
+            "TOTALS", (unsigned long long)totalRects, totalBytes,totalBytesIfRaw, savings);
+
+    if (cl->statSlots!=NULL) {
+        rfbLog("%-21.21s  %-6.6s   %9.9s %9.9s\n", "Encode time", "rects", "total ms", "us/rect");
+        for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
+        {
+            slot = rfbStatSlot(ptr->type);
+            if (slot<0 || ptr->sentCount==0)
+                continue;
+            rfbLog(" %-20.20s: %6llu | %9.1f %9.1f\n",
+                encodingName(ptr->type, encBuf, sizeof(encBuf)),
+                (unsigned long long)ptr->sentCount,
+                cl->statSlots->encodeTimeUs[slot] / 1000.0,
+                (double)cl->statSlots->encodeTimeUs[slot] / ptr->sentCount);
+        }
+    }
+
+    if (cl->tileCacheHits + cl->tileCacheMisses > 0)
+        rfbLog("Tile cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+               (unsigned long long)cl->tileCacheHits,
+               (unsigned long long)cl->tileCacheMisses,
+               100.0 * cl->tileCacheHits / (cl->tileCacheHits + cl->tileCacheMisses));
+
+    if (cl->adaptiveChanges > 0)
+        rfbLog("Adaptive quality: %u changes, ended at quality %d, "
+               "compression -%d, latency %dms\n", cl->adaptiveChanges,
+               cl->adaptiveQuality, cl->adaptiveCompressReduction,
+               cl->adaptiveLatency);
+    UNLOCK(cl->statsMutex);
 } 
 
@@ -37,6 +37,7 @@
 
 #include <rfb/rfb.h>
 #include "private.h"
+#include "simd.h"
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 #include <png.h>
@@ -120,8 +121,12 @@ typedef struct PALETTE_s {
     uint32_t monoForeground;
 } PALETTE, *palettePtr;
 
+static void FreeQueue(rfbClientPtr cl);
+
 void rfbFreeTightData (rfbClientPtr cl)
 {
+    FreeQueue(cl);
+
     if (cl->tightTJ) {
         tjDestroy(cl->tightTJ);
 		/* Set freed resource handle to 0! */
@@ -129,6 +134,26 @@ void rfbFreeTightData (rfbClientPtr cl)
 	}
 }
 
+/*
+ * Frees the encoder state of an idle client. The zlib streams are ended,
+ * and the client is told to reset them with the next Tight rectangle,
+ * before any of them is used again.
+ */
+
+void rfbReclaimTightData(rfbClientPtr cl)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (cl->zsActive[i]) {
+            deflateEnd(&cl->zsStruct[i]);
+            cl->zsActive[i] = FALSE;
+            cl->tightResetStreams |= 1 << i;
+        }
+    }
+    rfbFreeTightData(cl);
+}
+
 
 /* Prototypes for static functions. */
 
@@ -150,18 +175,29 @@ static rfbBool CheckSolidTile32  (rfbClientPtr cl, int x, int y, int w, int h,
 
 static rfbBool SendRectSimple    (rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool SendSubrect       (rfbClientPtr cl, int x, int y, int w, int h);
+static void AnalyseSubrect       (rfbClientPtr cl, palettePtr palette, char *buf,
+                                  int x, int y, int w, int h);
+static rfbBool SendAnalysedSubrect (rfbClientPtr cl, palettePtr palette,
+                                    int x, int y, int w, int h);
+
+static rfbBool QueueSubrect      (rfbClientPtr cl, int x, int y, int w, int h);
+static rfbBool QueueSolidRect    (rfbClientPtr cl, int x, int y, int w, int h,
+                                  char *fbptr);
+static rfbBool FlushQueue        (rfbClientPtr cl);
+static void DropQueue            (rfbClientPtr cl);
 
 static rfbBool SendSolidRect     (rfbClientPtr cl);
 static rfbBool SendMonoRect      (rfbClientPtr cl, int x, int y, int w, int h, uint32_t monoForeground, uint32_t monoBackground);
 static rfbBool SendIndexedRect   (palettePtr palette, rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool SendFullColorRect (rfbClientPtr cl, int x, int y, int w, int h);
 
+static char ControlByte (rfbClientPtr cl, int compCtl);
 static rfbBool CompressData (rfbClientPtr cl, int streamId, int dataLen,
                              int zlibLevel, int zlibStrategy);
 
-static void FillPalette8 (palettePtr palette, rfbClientPtr cl, int count);
-static void FillPalette16 (palettePtr palette, rfbClientPtr cl, int count);
-static void FillPalette32 (palettePtr palette, rfbClientPtr cl, int count);
+static void FillPalette8 (palettePtr palette, char *buf, int count);
+static void FillPalette16 (palettePtr palette, char *buf, int count);
+static void FillPalette32 (palettePtr palette, char *buf, int count);
 static void FastFillPalette16 (palettePtr palette, rfbClientPtr cl, uint16_t *data, int w,
                                int pitch, int h);
 static void FastFillPalette32 (palettePtr palette, rfbClientPtr cl, uint32_t *data, int w,
@@ -172,6 +208,8 @@ static int PaletteInsert (palettePtr palette, uint32_t rgb, int numPixels, int b
 
 static void Pack24 (rfbClientPtr cl, char *buf, rfbPixelFormat *fmt,
                     int count);
+static void Pack24Rect (rfbClientPtr cl, char *dst, char *src, int pitch,
+                        int w, int h, rfbPixelFormat *fmt);
 
 static void EncodeIndexedRect16 (palettePtr palette, uint8_t *buf, int count);
 static void EncodeIndexedRect32 (palettePtr palette, uint8_t *buf, int count);
@@ -182,6 +220,10 @@ static void EncodeMonoRect32 (uint8_t *buf, int w, int h, uint32_t monoBackgroun
 
 static rfbBool SendJpegRect (rfbClientPtr cl, int x, int y, int w, int h,
                              int quality);
+static rfbBool CompressJpeg (rfbClientPtr cl, tjhandle tj, int x, int y,
+                             int w, int h, int quality, unsigned char *outbuf,
+                             unsigned long *size);
+static rfbBool SendJpegData (rfbClientPtr cl, char *buf, int len);
 static void PrepareRowForImg(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
 static void PrepareRowForImg24(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
 static void PrepareRowForImg16(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
@@ -228,7 +270,38 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
                          int h)
 {
     cl->tightEncoding = rfbEncodingTight;
-    return SendRectEncodingTight(cl, x, y, w, h);
+    if (!SendRectEncodingTight(cl, x, y, w, h)) {
+        DropQueue(cl);
+        return FALSE;
+    }
+    return FlushQueue(cl);
+}
+
+/*
+ * Send a rectangle with the Tight flavour used last, but without JPEG, to
+ * replace what was sent lossy before. See losslessrefresh.c.
+ */
+
+rfbBool
+rfbSendRectEncodingTightLossless(rfbClientPtr cl,
+                                 int x,
+                                 int y,
+                                 int w,
+                                 int h)
+{
+    int qualityLevel = cl->turboQualityLevel;
+    int compressLevel = cl->tightCompressLevel;
+    rfbBool result;
+
+    cl->turboQualityLevel = -1;
+    result = SendRectEncodingTight(cl, x, y, w, h);
+    if (!result)
+        DropQueue(cl);
+    else
+        result = FlushQueue(cl);
+    cl->turboQualityLevel = qualityLevel;
+    cl->tightCompressLevel = compressLevel;
+    return result;
 }
 
 rfbBool
@@ -239,7 +312,11 @@ rfbSendRectEncodingTightPng(rfbClientPtr cl,
                          int h)
 {
     cl->tightEncoding = rfbEncodingTightPng;
-    return SendRectEncodingTight(cl, x, y, w, h);
+    if (!SendRectEncodingTight(cl, x, y, w, h)) {
+        DropQueue(cl);
+        return FALSE;
+    }
+    return FlushQueue(cl);
 }
 
 
@@ -383,19 +460,24 @@ SendRectEncodingTight(rfbClientPtr cl,
 
                 /* Send solid-color rectangle. */
 
-                if (!rfbSendTightHeader(cl, x_best, y_best, w_best, h_best))
-                    return FALSE;
-
                 fbptr = (cl->scaledScreen->frameBuffer +
                          (cl->scaledScreen->paddedWidthInBytes * y_best) +
                          (x_best * (cl->scaledScreen->bitsPerPixel / 8)));
 
-                (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                                   &cl->format, fbptr, cl->beforeEncBuf,
-                                   cl->scaledScreen->paddedWidthInBytes, 1, 1);
+                if (rfbWorkerCount(cl->screen) > 0) {
+                    if (!QueueSolidRect(cl, x_best, y_best, w_best, h_best, fbptr))
+                        return FALSE;
+                } else {
+                    if (!rfbSendTightHeader(cl, x_best, y_best, w_best, h_best))
+                        return FALSE;
 
-                if (!SendSolidRect(cl))
-                    return FALSE;
+                    (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+                                       &cl->format, fbptr, cl->beforeEncBuf,
+                                       cl->scaledScreen->paddedWidthInBytes, 1, 1);
+
+                    if (!SendSolidRect(cl))
+                        return FALSE;
+                }
 
                 /* Send remaining rectangles (at right and bottom). */
 
@@ -541,7 +623,7 @@ CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,              \
 {                                                                             \
     uint##bpp##_t *fbptr;                                                     \
     uint##bpp##_t colorValue;                                                 \
-    int dx, dy;                                                               \
+    int dy;                                                                   \
                                                                               \
     fbptr = (uint##bpp##_t *)&cl->scaledScreen->frameBuffer                   \
         [y * cl->scaledScreen->paddedWidthInBytes + x * (bpp/8)];             \
@@ -551,10 +633,8 @@ CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,              \
         return FALSE;                                                         \
                                                                               \
     for (dy = 0; dy < h; dy++) {                                              \
-        for (dx = 0; dx < w; dx++) {                                          \
-            if (colorValue != fbptr[dx])                                      \
-                return FALSE;                                                 \
-        }                                                                     \
+        if (rfbSimd->run##bpp(fbptr, w, colorValue, (uint##bpp##_t)~0) < w)   \
+            return FALSE;                                                     \
         fbptr = (uint##bpp##_t *)((uint8_t *)fbptr                            \
                  + cl->scaledScreen->paddedWidthInBytes);                     \
     }                                                                         \
@@ -635,9 +715,10 @@ SendSubrect(rfbClientPtr cl,
             int w,
             int h)
 {
-    char *fbptr;
     PALETTE palette;
-    rfbBool success = FALSE;
+
+    if (rfbWorkerCount(cl->screen) > 0)
+        return QueueSubrect(cl, x, y, w, h);
 
     /* Send pending data if there is more than 128 bytes. */
     if (cl->ublen > 128) {
@@ -648,19 +729,45 @@ SendSubrect(rfbClientPtr cl,
     if (!rfbSendTightHeader(cl, x, y, w, h))
         return FALSE;
 
+    if (cl->turboSubsampLevel == TJ_GRAYSCALE && cl->turboQualityLevel != -1)
+        return SendJpegRect(cl, x, y, w, h, cl->turboQualityLevel);
+
+    AnalyseSubrect(cl, &palette, cl->beforeEncBuf, x, y, w, h);
+
+    if (palette.numColors == 0 && cl->turboQualityLevel != -1)
+        return SendJpegRect(cl, x, y, w, h, cl->turboQualityLevel);
+
+    return SendAnalysedSubrect(cl, &palette, x, y, w, h);
+}
+
+/*
+ * Count the colours of a subrectangle and translate it into buf. Only
+ * reads the framebuffer and the client's settings, so it is safe to run
+ * on an encoder thread. buf is left alone for true colour rectangles that
+ * will be sent as JPEG straight from the framebuffer.
+ */
+
+static void
+AnalyseSubrect(rfbClientPtr cl,
+               palettePtr palette,
+               char *buf,
+               int x,
+               int y,
+               int w,
+               int h)
+{
+    char *fbptr;
+
     fbptr = (cl->scaledScreen->frameBuffer
              + (cl->scaledScreen->paddedWidthInBytes * y)
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
-    if (cl->turboSubsampLevel == TJ_GRAYSCALE && cl->turboQualityLevel != -1)
-        return SendJpegRect(cl, x, y, w, h, cl->turboQualityLevel);
-
-    palette.maxColors = w * h / tightConf[cl->tightCompressLevel].idxMaxColorsDivisor;
+    palette->maxColors = w * h / tightConf[cl->tightCompressLevel].idxMaxColorsDivisor;
     if(cl->turboQualityLevel != -1)
-        palette.maxColors = tightConf[cl->tightCompressLevel].palMaxColorsWithJPEG;
-    if ( palette.maxColors < 2 &&
+        palette->maxColors = tightConf[cl->tightCompressLevel].palMaxColorsWithJPEG;
+    if ( palette->maxColors < 2 &&
          w * h >= tightConf[cl->tightCompressLevel].monoMinRectSize ) {
-        palette.maxColors = 2;
+        palette->maxColors = 2;
     }
 
     if (cl->format.bitsPerPixel == cl->screen->serverFormat.bitsPerPixel &&
@@ -673,46 +780,64 @@ SendSubrect(rfbClientPtr cl,
            with JPEG, since it is unnecessary */
         switch (cl->format.bitsPerPixel) {
         case 16:
-            FastFillPalette16(&palette, cl, (uint16_t *)fbptr, w,
+            FastFillPalette16(palette, cl, (uint16_t *)fbptr, w,
                               cl->scaledScreen->paddedWidthInBytes / 2, h);
             break;
         default:
-            FastFillPalette32(&palette, cl, (uint32_t *)fbptr, w,
+            FastFillPalette32(palette, cl, (uint32_t *)fbptr, w,
                               cl->scaledScreen->paddedWidthInBytes / 4, h);
         }
 
-        if(palette.numColors != 0 || cl->turboQualityLevel == -1) {
+        /* Untranslated true colour is packed by SendFullColorRect() as it
+           reads the framebuffer */
+        if (palette->numColors == 0 && cl->tightUsePixelFormat24 &&
+            cl->translateFn == rfbTranslateNone)
+            return;
+
+        if(palette->numColors != 0 || cl->turboQualityLevel == -1) {
             (*cl->translateFn)(cl->translateLookupTable,
                                &cl->screen->serverFormat, &cl->format, fbptr,
-                               cl->beforeEncBuf,
+                               buf,
                                cl->scaledScreen->paddedWidthInBytes, w, h);
         }
     }
     else {
         (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                           &cl->format, fbptr, cl->beforeEncBuf,
+                           &cl->format, fbptr, buf,
                            cl->scaledScreen->paddedWidthInBytes, w, h);
 
         switch (cl->format.bitsPerPixel) {
         case 8:
-            FillPalette8(&palette, cl, w * h);
+            FillPalette8(palette, buf, w * h);
             break;
         case 16:
-            FillPalette16(&palette, cl, w * h);
+            FillPalette16(palette, buf, w * h);
             break;
         default:
-            FillPalette32(&palette, cl, w * h);
+            FillPalette32(palette, buf, w * h);
         }
     }
+}
+
+/*
+ * Send a non-JPEG subrectangle analysed by AnalyseSubrect(), with its
+ * pixels in cl->beforeEncBuf.
+ */
 
-    switch (palette.numColors) {
+static rfbBool
+SendAnalysedSubrect(rfbClientPtr cl,
+                    palettePtr palette,
+                    int x,
+                    int y,
+                    int w,
+                    int h)
+{
+    rfbBool success = FALSE;
+
+    switch (palette->numColors) {
     case 0:
         /* Truecolor image */
-        if (cl->turboQualityLevel != -1) {
-            success = SendJpegRect(cl, x, y, w, h, cl->turboQualityLevel);
-        } else {
-            success = SendFullColorRect(cl, x, y, w, h);
-        }
+        success = SendFullColorRect(cl, x, y, w, h);
         break;
     case 1:
         /* Solid rectangle */
@@ -720,15 +845,276 @@ SendSubrect(rfbClientPtr cl,
         break;
     case 2:
         /* Two-color rectangle */
-        success = SendMonoRect(cl, x, y, w, h, palette.monoForeground, palette.monoBackground);
+        success = SendMonoRect(cl, x, y, w, h, palette->monoForeground, palette->monoBackground);
         break;
     default:
         /* Up to 256 different colors */
-        success = SendIndexedRect(&palette, cl, x, y, w, h);
+        success = SendIndexedRect(palette, cl, x, y, w, h);
+    }
+    return success;
+}
+
+/*
+ * Encoding on the worker pool. With encoder threads, subrectangles are
+ * queued instead of being sent at once. When the queue is full, or the
+ * rectangle passed to rfbSendRectEncodingTight() is done, the queued
+ * subrectangles are analysed, translated and, where JPEG applies,
+ * compressed in parallel. The results are then sent in order from the
+ * output thread, which also does all zlib compression, so that every zlib
+ * stream sees its data in the order the client decodes it.
+ */
+
+#define TIGHT_JOBS_PER_THREAD 2
+
+typedef struct TIGHT_JOB_s {
+    int x, y, w, h;
+    rfbBool solid;              /* solid area, its pixel is in buf already */
+    rfbBool failed;
+    PALETTE palette;
+    char *buf;                  /* translated pixels */
+    int bufSize;
+    unsigned char *jpegBuf;
+    unsigned long jpegBufSize;
+    unsigned long jpegLen;      /* 0 if not sent as JPEG */
+} TIGHT_JOB;
+
+typedef struct TIGHT_QUEUE_s {
+    rfbClientPtr cl;
+    TIGHT_JOB *jobs;
+    int count, size;
+    tjhandle *tj;               /* one per worker slot */
+    int nTJ;
+} TIGHT_QUEUE;
+
+static TIGHT_QUEUE *
+GetQueue(rfbClientPtr cl)
+{
+    TIGHT_QUEUE *q = (TIGHT_QUEUE *)cl->tightQueue;
+    int slots = rfbWorkerCount(cl->screen) + 1;
+
+    if (q)
+        return q;
+
+    q = (TIGHT_QUEUE *)calloc(1, sizeof(TIGHT_QUEUE));
+    if (!q)
+        return NULL;
+    q->size = slots * TIGHT_JOBS_PER_THREAD;
+    q->jobs = (TIGHT_JOB *)calloc(q->size, sizeof(TIGHT_JOB));
+    q->tj = (tjhandle *)calloc(slots, sizeof(tjhandle));
+    if (!q->jobs || !q->tj) {
+        free(q->jobs);
+        free(q->tj);
+        free(q);
+        return NULL;
+    }
+    q->nTJ = slots;
+    q->cl = cl;
+    cl->tightQueue = q;
+    return q;
+}
+
+static void
+FreeQueue(rfbClientPtr cl)
+{
+    TIGHT_QUEUE *q = (TIGHT_QUEUE *)cl->tightQueue;
+    int i;
+
+    if (!q)
+        return;
+    for (i = 0; i < q->size; i++) {
+        free(q->jobs[i].buf);
+        free(q->jobs[i].jpegBuf);
+    }
+    for (i = 0; i < q->nTJ; i++)
+        if (q->tj[i])
+            tjDestroy(q->tj[i]);
+    free(q->jobs);
+    free(q->tj);
+    free(q);
+    cl->tightQueue = NULL;
+}
+
+static void
+DropQueue(rfbClientPtr cl)
+{
+    if (cl->tightQueue)
+        ((TIGHT_QUEUE *)cl->tightQueue)->count = 0;
+}
+
+size_t
+rfbTightMemoryUsage(rfbClientPtr cl)
+{
+    TIGHT_QUEUE *q = (TIGHT_QUEUE *)cl->tightQueue;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < 4; i++)
+        if (cl->zsActive[i])
+            size += rfbDeflateMemoryUsage(MAX_WBITS, MAX_MEM_LEVEL);
+    if (q) {
+        size += sizeof(TIGHT_QUEUE) + q->size * sizeof(TIGHT_JOB) +
+            q->nTJ * sizeof(tjhandle);
+        for (i = 0; i < q->size; i++)
+            size += q->jobs[i].bufSize + q->jobs[i].jpegBufSize;
+    }
+    return size;
+}
+
+static TIGHT_JOB *
+NewJob(rfbClientPtr cl, int x, int y, int w, int h, int bufSize)
+{
+    TIGHT_QUEUE *q = GetQueue(cl);
+    TIGHT_JOB *job;
+
+    if (!q) {
+        rfbLog("SendRectEncodingTight: failed to allocate memory\n");
+        return NULL;
+    }
+    if (q->count == q->size && !FlushQueue(cl))
+        return NULL;
+
+    job = &q->jobs[q->count];
+    if (job->bufSize < bufSize) {
+        char *buf = (char *)realloc(job->buf, bufSize);
+        if (!buf) {
+            rfbLog("SendRectEncodingTight: failed to allocate memory\n");
+            return NULL;
+        }
+        job->buf = buf;
+        job->bufSize = bufSize;
+    }
+    job->x = x;
+    job->y = y;
+    job->w = w;
+    job->h = h;
+    job->solid = FALSE;
+    job->failed = FALSE;
+    job->jpegLen = 0;
+    q->count++;
+    return job;
+}
+
+static rfbBool
+QueueSubrect(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    return NewJob(cl, x, y, w, h, w * h * (cl->format.bitsPerPixel / 8)) != NULL;
+}
+
+static rfbBool
+QueueSolidRect(rfbClientPtr cl, int x, int y, int w, int h, char *fbptr)
+{
+    TIGHT_JOB *job = NewJob(cl, x, y, w, h, 4);
+
+    if (!job)
+        return FALSE;
+    job->solid = TRUE;
+    (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+                       &cl->format, fbptr, job->buf,
+                       cl->scaledScreen->paddedWidthInBytes, 1, 1);
+    return TRUE;
+}
+
+/* Runs on the worker pool. */
+
+static void
+AnalyseJob(void *data, int index, int slot)
+{
+    TIGHT_QUEUE *q = (TIGHT_QUEUE *)data;
+    TIGHT_JOB *job = &q->jobs[index];
+    rfbClientPtr cl = q->cl;
+    rfbBool jpeg = cl->turboQualityLevel != -1 &&
+                   cl->screen->serverFormat.bitsPerPixel != 8;
+    unsigned long size;
+
+    if (job->solid)
+        return;
+
+    if (!jpeg || cl->turboSubsampLevel != TJ_GRAYSCALE) {
+        AnalyseSubrect(cl, &job->palette, job->buf,
+                       job->x, job->y, job->w, job->h);
+        jpeg = jpeg && job->palette.numColors == 0;
+    }
+    if (!jpeg)
+        return;
+
+    if (!q->tj[slot] && (q->tj[slot] = tjInitCompress()) == NULL) {
+        rfbLog("JPEG Error: %s\n", tjGetErrorStr());
+        job->failed = TRUE;
+        return;
+    }
+
+    size = TJBUFSIZE(job->w, job->h);
+    if (job->jpegBufSize < size) {
+        unsigned char *buf = (unsigned char *)realloc(job->jpegBuf, size);
+        if (!buf) {
+            rfbLog("SendJpegRect: failed to allocate memory\n");
+            job->failed = TRUE;
+            return;
+        }
+        job->jpegBuf = buf;
+        job->jpegBufSize = size;
+    }
+
+    if (!CompressJpeg(cl, q->tj[slot], job->x, job->y, job->w, job->h,
+                      cl->turboQualityLevel, job->jpegBuf, &job->jpegLen))
+        job->failed = TRUE;
+}
+
+static rfbBool
+SendJob(rfbClientPtr cl, TIGHT_JOB *job)
+{
+    char *beforeEncBuf;
+    rfbBool success;
+
+    if (job->failed)
+        return FALSE;
+
+    /* Send pending data if there is more than 128 bytes. */
+    if (!job->solid && cl->ublen > 128) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
     }
+
+    if (!rfbSendTightHeader(cl, job->x, job->y, job->w, job->h))
+        return FALSE;
+
+    if (job->jpegLen > 0) {
+        rfbLosslessRefreshMark(cl, job->x, job->y, job->w, job->h);
+        return SendJpegData(cl, (char *)job->jpegBuf, (int)job->jpegLen);
+    }
+
+    /* the subencodings work on cl->beforeEncBuf, lend them the job's */
+    beforeEncBuf = cl->beforeEncBuf;
+    cl->beforeEncBuf = job->buf;
+    if (job->solid)
+        success = SendSolidRect(cl);
+    else
+        success = SendAnalysedSubrect(cl, &job->palette,
+                                      job->x, job->y, job->w, job->h);
+    cl->beforeEncBuf = beforeEncBuf;
+
     return success;
 }
 
+static rfbBool
+FlushQueue(rfbClientPtr cl)
+{
+    TIGHT_QUEUE *q = (TIGHT_QUEUE *)cl->tightQueue;
+    int i, count;
+
+    if (!q || q->count == 0)
+        return TRUE;
+
+    count = q->count;
+    q->count = 0;
+    rfbWorkersRun(cl->screen, AnalyseJob, q, count);
+
+    for (i = 0; i < count; i++)
+        if (!SendJob(cl, &q->jobs[i]))
+            return FALSE;
+    return TRUE;
+}
+
 rfbBool
 rfbSendTightHeader(rfbClientPtr cl,
                 int x,
@@ -781,7 +1167,7 @@ SendSolidRect(rfbClientPtr cl)
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
+    cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightFill << 4);
     memcpy (&cl->updateBuf[cl->ublen], cl->beforeEncBuf, len);
     cl->ublen += len;
 
@@ -823,9 +1209,10 @@ SendMonoRect(rfbClientPtr cl,
     if (tightConf[cl->tightCompressLevel].monoZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+            ControlByte(cl, (rfbTightNoZlib | rfbTightExplicitFilter) << 4);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+        cl->updateBuf[cl->ublen++] =
+            ControlByte(cl, (streamId | rfbTightExplicitFilter) << 4);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
     cl->updateBuf[cl->ublen++] = 1;
 
@@ -900,9 +1287,10 @@ SendIndexedRect(palettePtr palette,
     if (tightConf[cl->tightCompressLevel].idxZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
         cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+            ControlByte(cl, (rfbTightNoZlib | rfbTightExplicitFilter) << 4);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
+        cl->updateBuf[cl->ublen++] =
+            ControlByte(cl, (streamId | rfbTightExplicitFilter) << 4);
     cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
     cl->updateBuf[cl->ublen++] = (char)(palette->numColors - 1);
 
@@ -975,13 +1363,20 @@ SendFullColorRect(rfbClientPtr cl,
 
     if (tightConf[cl->tightCompressLevel].rawZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
-        cl->updateBuf[cl->ublen++] = (char)(rfbTightNoZlib << 4);
+        cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightNoZlib << 4);
     else
-        cl->updateBuf[cl->ublen++] = 0x00;  /* stream id = 0, no flushing, no filter */
+        cl->updateBuf[cl->ublen++] = ControlByte(cl, 0x00);  /* stream id = 0, no flushing, no filter */
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
     if (cl->tightUsePixelFormat24) {
-        Pack24(cl, cl->beforeEncBuf, &cl->format, w * h);
+        if (cl->translateFn == rfbTranslateNone)
+            Pack24Rect(cl, cl->beforeEncBuf,
+                       cl->scaledScreen->frameBuffer
+                       + cl->scaledScreen->paddedWidthInBytes * y + x * 4,
+                       cl->scaledScreen->paddedWidthInBytes, w, h,
+                       &cl->format);
+        else
+            Pack24(cl, cl->beforeEncBuf, &cl->format, w * h);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
@@ -991,6 +1386,20 @@ SendFullColorRect(rfbClientPtr cl,
                         Z_DEFAULT_STRATEGY);
 }
 
+/*
+ * Adds the resets of the zlib streams freed by rfbReclaimTightData() to the
+ * compression control byte of the next rectangle.
+ */
+
+static char
+ControlByte(rfbClientPtr cl,
+            int compCtl)
+{
+    compCtl |= cl->tightResetStreams;
+    cl->tightResetStreams = 0;
+    return (char)compCtl;
+}
+
 static rfbBool
 CompressData(rfbClientPtr cl,
              int streamId,
@@ -1093,16 +1502,16 @@ rfbBool rfbSendCompressedDataTight(rfbClientPtr cl, char *buf,
  */
 
 static void
-FillPalette8(palettePtr palette, rfbClientPtr cl, int count)
+FillPalette8(palettePtr palette, char *buf, int count)
 {
-    uint8_t *data = (uint8_t *)cl->beforeEncBuf;
+    uint8_t *data = (uint8_t *)buf;
     uint8_t c0, c1;
-    int i, n0, n1;
+    int i, n0, n1, m, k;
 
     palette->numColors = 0;
 
     c0 = data[0];
-    for (i = 1; i < count && data[i] == c0; i++);
+    i = 1 + rfbSimd->run8(data + 1, count - 1, c0, 0xFF);
     if (i == count) {
         palette->numColors = 1;
         return;                 /* Solid rectangle */
@@ -1114,14 +1523,10 @@ FillPalette8(palettePtr palette, rfbClientPtr cl, int count)
     n0 = i;
     c1 = data[i];
     n1 = 0;
-    for (i++; i < count; i++) {
-        if (data[i] == c0) {
-            n0++;
-        } else if (data[i] == c1) {
-            n1++;
-        } else
-            break;
-    }
+    m = rfbSimd->run2_8(data + i + 1, count - i - 1, c0, c1, 0xFF, &k);
+    n0 += k;
+    n1 += m - k;
+    i += 1 + m;
     if (i == count) {
         if (n0 > n1) {
             palette->monoBackground = (uint32_t)c0;
@@ -1138,13 +1543,13 @@ FillPalette8(palettePtr palette, rfbClientPtr cl, int count)
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(palettePtr palette,  rfbClientPtr cl, int count) {     \
-    uint##bpp##_t *data = (uint##bpp##_t *)cl->beforeEncBuf;            \
+FillPalette##bpp(palettePtr palette, char *buf, int count) {           \
+    uint##bpp##_t *data = (uint##bpp##_t *)buf;                         \
     uint##bpp##_t c0, c1, ci;                                           \
-    int i, n0, n1, ni;                                                  \
+    int i, n0, n1, ni, m, k;                                            \
                                                                         \
     c0 = data[0];                                                       \
-    for (i = 1; i < count && data[i] == c0; i++);                       \
+    i = 1 + rfbSimd->run##bpp(data + 1, count - 1, c0, (uint##bpp##_t)~0); \
     if (i >= count) {                                                   \
         palette->numColors = 1;   /* Solid rectangle */                 \
         return;                                                         \
@@ -1158,15 +1563,11 @@ FillPalette##bpp(palettePtr palette,  rfbClientPtr cl, int count) {     \
     n0 = i;                                                             \
     c1 = data[i];                                                       \
     n1 = 0;                                                             \
-    for (i++; i < count; i++) {                                         \
-        ci = data[i];                                                   \
-        if (ci == c0) {                                                 \
-            n0++;                                                       \
-        } else if (ci == c1) {                                          \
-            n1++;                                                       \
-        } else                                                          \
-            break;                                                      \
-    }                                                                   \
+    m = rfbSimd->run2_##bpp(data + i + 1, count - i - 1, c0, c1,        \
+                            (uint##bpp##_t)~0, &k);                     \
+    n0 += k;                                                            \
+    n1 += m - k;                                                        \
+    i += 1 + m;                                                         \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
             palette->monoBackground = (uint32_t)c0;                     \
@@ -1183,10 +1584,14 @@ FillPalette##bpp(palettePtr palette,  rfbClientPtr cl, int count) {     \
     PaletteInsert (palette, c0, (uint32_t)n0, bpp);                     \
     PaletteInsert (palette, c1, (uint32_t)n1, bpp);                     \
                                                                         \
+    ci = data[i];                                                       \
     ni = 1;                                                             \
     for (i++; i < count; i++) {                                         \
         if (data[i] == ci) {                                            \
-            ni++;                                                       \
+            m = rfbSimd->run##bpp(data + i, count - i, ci,              \
+                                  (uint##bpp##_t)~0);                   \
+            ni += m;                                                    \
+            i += m - 1;                                                 \
         } else {                                                        \
             if (!PaletteInsert (palette, ci, (uint32_t)ni, bpp))        \
                 return;                                                 \
@@ -1206,8 +1611,8 @@ static void                                                             \
 FastFillPalette##bpp(palettePtr palette, rfbClientPtr cl, uint##bpp##_t *data, int w, \
                      int pitch, int h)                                  \
 {                                                                       \
-    uint##bpp##_t c0, c1, ci, mask, c0t, c1t, cit;                      \
-    int i, j, i2 = 0, j2, n0, n1, ni;                                   \
+    uint##bpp##_t c0, c1, ci = 0, mask, c0t, c1t, cit;                  \
+    int i, j, i2 = 0, j2, n0, n1, ni, m, k;                             \
                                                                         \
     if (cl->translateFn != rfbTranslateNone) {                          \
         mask = cl->screen->serverFormat.redMax                          \
@@ -1220,12 +1625,10 @@ FastFillPalette##bpp(palettePtr palette, rfbClientPtr cl, uint##bpp##_t *data, i
                                                                         \
     c0 = data[0] & mask;                                                \
     for (j = 0; j < h; j++) {                                           \
-        for (i = 0; i < w; i++) {                                       \
-            if ((data[j * pitch + i] & mask) != c0)                     \
-                goto done;                                              \
-        }                                                               \
+        i = rfbSimd->run##bpp(&data[j * pitch], w, c0, mask);           \
+        if (i < w)                                                      \
+            break;                                                      \
     }                                                                   \
-    done:                                                               \
     if (j >= h) {                                                       \
         palette->numColors = 1;   /* Solid rectangle */                 \
         return;                                                         \
@@ -1240,18 +1643,17 @@ FastFillPalette##bpp(palettePtr palette, rfbClientPtr cl, uint##bpp##_t *data, i
     n1 = 0;                                                             \
     i++;  if (i >= w) {i = 0;  j++;}                                    \
     for (j2 = j; j2 < h; j2++) {                                        \
-        for (i2 = i; i2 < w; i2++) {                                    \
+        m = rfbSimd->run2_##bpp(&data[j2 * pitch + i], w - i, c0, c1,   \
+                                mask, &k);                              \
+        n0 += k;                                                        \
+        n1 += m - k;                                                    \
+        i2 = i + m;                                                     \
+        if (i2 < w) {                                                   \
             ci = data[j2 * pitch + i2] & mask;                          \
-            if (ci == c0) {                                             \
-                n0++;                                                   \
-            } else if (ci == c1) {                                      \
-                n1++;                                                   \
-            } else                                                      \
-                goto done2;                                             \
+            break;                                                      \
         }                                                               \
         i = 0;                                                          \
     }                                                                   \
-    done2:                                                              \
     (*cl->translateFn)(cl->translateLookupTable,                        \
                        &cl->screen->serverFormat, &cl->format,          \
                        (char *)&c0, (char *)&c0t, bpp/8, 1, 1);         \
@@ -1279,7 +1681,10 @@ FastFillPalette##bpp(palettePtr palette, rfbClientPtr cl, uint##bpp##_t *data, i
     for (j = j2; j < h; j++) {                                          \
         for (i = i2; i < w; i++) {                                      \
             if ((data[j * pitch + i] & mask) == ci) {                   \
-                ni++;                                                   \
+                m = rfbSimd->run##bpp(&data[j * pitch + i], w - i, ci,  \
+                                      mask);                            \
+                ni += m;                                                \
+                i += m - 1;                                             \
             } else {                                                    \
                 (*cl->translateFn)(cl->translateLookupTable,            \
                                    &cl->screen->serverFormat,           \
@@ -1397,12 +1802,27 @@ static void Pack24(rfbClientPtr cl,
                    char *buf,
                    rfbPixelFormat *fmt,
                    int count)
+{
+    Pack24Rect(cl, buf, buf, count * 4, count, 1, fmt);
+}
+
+/*
+ * Pack h lines of w pixels, pitch bytes apart, into dst. dst may be src,
+ * since the packed pixels never overtake the ones still to read.
+ */
+
+static void Pack24Rect(rfbClientPtr cl,
+                       char *dst,
+                       char *src,
+                       int pitch,
+                       int w,
+                       int h,
+                       rfbPixelFormat *fmt)
 {
     uint32_t *buf32;
     uint32_t pix;
     int r_shift, g_shift, b_shift;
-
-    buf32 = (uint32_t *)buf;
+    int count;
 
     if (!cl->screen->serverFormat.bigEndian == !fmt->bigEndian) {
         r_shift = fmt->redShift;
@@ -1414,11 +1834,14 @@ static void Pack24(rfbClientPtr cl,
         b_shift = 24 - fmt->blueShift;
     }
 
-    while (count--) {
-        pix = *buf32++;
-        *buf++ = (char)(pix >> r_shift);
-        *buf++ = (char)(pix >> g_shift);
-        *buf++ = (char)(pix >> b_shift);
+    for (; h > 0; h--, src += pitch) {
+        buf32 = (uint32_t *)src;
+        for (count = w; count > 0; count--) {
+            pix = *buf32++;
+            *dst++ = (char)(pix >> r_shift);
+            *dst++ = (char)(pix >> g_shift);
+            *dst++ = (char)(pix >> b_shift);
+        }
     }
 }
 
@@ -1524,20 +1947,11 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
 static rfbBool
 SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
 {
-    unsigned char *srcbuf;
-    int ps = cl->screen->serverFormat.bitsPerPixel / 8;
-    int subsamp = subsampLevel2tjsubsamp[cl->turboSubsampLevel];
     unsigned long size = 0;
-    int flags = 0, pitch;
-    unsigned char *tmpbuf = NULL;
 
     if (cl->screen->serverFormat.bitsPerPixel == 8)
         return SendFullColorRect(cl, x, y, w, h);
 
-    if (ps < 2) {
-        rfbLog("Error: JPEG requires 16-bit, 24-bit, or 32-bit pixel format.\n");
-        return 0;
-    }
     if (!cl->tightTJ) {
         if ((cl->tightTJ = tjInitCompress()) == NULL) {
             rfbLog("JPEG Error: %s\n", tjGetErrorStr());
@@ -1561,13 +1975,45 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
         cl->afterEncBufSize = TJBUFSIZE(w, h);
     }
 
+    if (!CompressJpeg(cl, cl->tightTJ, x, y, w, h, quality,
+                      (unsigned char *)cl->afterEncBuf, &size))
+        return FALSE;
+
+    rfbLosslessRefreshMark(cl, x, y, w, h);
+
+    return SendJpegData(cl, cl->afterEncBuf, (int)size);
+}
+
+/*
+ * Compress a rectangle of the framebuffer into outbuf, which must hold at
+ * least TJBUFSIZE(w, h) bytes. Safe to call from an encoder thread as long
+ * as every thread uses its own tj handle.
+ */
+
+static rfbBool
+CompressJpeg(rfbClientPtr cl, tjhandle tj, int x, int y, int w, int h,
+             int quality, unsigned char *outbuf, unsigned long *size)
+{
+    unsigned char *srcbuf;
+    int ps = cl->screen->serverFormat.bitsPerPixel / 8;
+    int subsamp = subsampLevel2tjsubsamp[cl->turboSubsampLevel];
+    int flags = 0, pitch;
+    unsigned char *tmpbuf = NULL;
+
+    if (ps < 2) {
+        rfbLog("Error: JPEG requires 16-bit, 24-bit, or 32-bit pixel format.\n");
+        return 0;
+    }
+
     if (ps == 2) {
         uint16_t *srcptr, pix;
         unsigned char *dst;
         int inRed, inGreen, inBlue, i, j;
 
-        if((tmpbuf = (unsigned char *)malloc((size_t)w * h * 3)) == NULL)
+        if((tmpbuf = (unsigned char *)malloc((size_t)w * h * 3)) == NULL) {
             rfbLog("Memory allocation failure!\n");
+            return 0;
+        }
         srcptr = (uint16_t *)&cl->scaledScreen->frameBuffer
             [y * cl->scaledScreen->paddedWidthInBytes + x * ps];
         dst = tmpbuf;
@@ -1611,8 +2057,8 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
             [y * pitch + x * ps];
     }
 
-    if (tjCompress(cl->tightTJ, srcbuf, w, pitch, h, ps, (unsigned char *)cl->afterEncBuf,
-                   &size, subsamp, quality, flags) == -1) {
+    if (tjCompress(tj, srcbuf, w, pitch, h, ps, outbuf,
+                   size, subsamp, quality, flags) == -1) {
         rfbLog("JPEG Error: %s\n", tjGetErrorStr());
         if (tmpbuf) {
             free(tmpbuf);
@@ -1626,15 +2072,21 @@ SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
         tmpbuf = NULL;
     }
 
+    return TRUE;
+}
+
+static rfbBool
+SendJpegData(rfbClientPtr cl, char *buf, int len)
+{
     if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
         if (!rfbSendUpdateBuf(cl))
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
+    cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightJpeg << 4);
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
-    return rfbSendCompressedDataTight(cl, cl->afterEncBuf, (int)size);
+    return rfbSendCompressedDataTight(cl, buf, len);
 }
 
 static void
@@ -1868,7 +2320,7 @@ static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightPng << 4);
+    cl->updateBuf[cl->ublen++] = ControlByte(cl, rfbTightPng << 4);
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
     /* rfbLog("<< SendPngRect\n"); */
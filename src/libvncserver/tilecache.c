@@ -0,0 +1,473 @@
+/*
+ * tilecache.c - let clients redraw tiles they were sent before.
+ *
+ * The screen is cut into a grid of rfbTileCacheTileSize square tiles. A tile
+ * an update covers completely, unless it is of a single colour, is looked
+ * up by a hash of its pixels. If a tile with the same hash was stored by the
+ * client earlier, it gets a TileCacheRef naming the slot instead of the
+ * pixels. Otherwise the tile is encoded as usual and a TileCacheStore at the
+ * end of the update makes the client keep what it now shows there.
+ *
+ * The server only remembers the hash of every slot and which one was used
+ * least recently, the client keeps the pixels: as many slots as the smaller
+ * of the screen's tileCacheSize and the size the client offered allow. With
+ * a lossy encoding, the client is sent back the same approximation it was
+ * shown the first time, and the tile is refreshed like any lossy area.
+ *
+ * References go out before any pixel data and stores after all of it, so a
+ * slot can be reused within an update. A tile stored by an update is not
+ * referenced by the same update, and a tile drawn into while it was encoded
+ * is forgotten again, as the client may not have seen what was hashed.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#define TILE rfbTileCacheTileSize
+
+typedef struct {
+    uint64_t hash;
+    int prev, next;     /* most recently used first, -1 terminated */
+    int chain;          /* next slot in the same hash bucket */
+    rfbBool used;       /* the client keeps a tile with this hash */
+    rfbBool pending;    /* stored by the update being sent */
+    rfbBool lossy;      /* the client stored it as JPEG, see losslessrefresh.c */
+} rfbTileCacheSlot;
+
+typedef struct {
+    int x, y, w, h;
+    int slot;
+} rfbTileCacheTile;
+
+struct rfbTileCache {
+    int nSlots;
+    rfbTileCacheSlot *slots;
+    int *buckets;
+    int bucketMask;
+    int head, tail;
+    /* the update being sent */
+    rfbTileCacheTile *refs, *stores;
+    int nRefs, nStores, maxTiles;
+};
+
+#define HASH_PRIME1 ((uint64_t)0x9E3779B97F4A7C15ULL)
+#define HASH_PRIME2 ((uint64_t)0xC2B2AE3D27D4EB4FULL)
+
+static uint64_t hashMix(uint64_t hash, uint64_t value)
+{
+    hash ^= value * HASH_PRIME1;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * HASH_PRIME2;
+}
+
+/*
+ * Hashes the tile at x,y of the framebuffer, unless it is of a single
+ * colour: such tiles are encoded in a few bytes anyway.
+ */
+
+static rfbBool hashTile(rfbScreenInfoPtr screen, int x, int y, int w, int h,
+                        uint64_t *hash)
+{
+    int bpp = screen->bitsPerPixel / 8;
+    int rowBytes = w * bpp, stride = screen->paddedWidthInBytes;
+    const char *first = screen->frameBuffer + y * stride + x * bpp;
+    const char *row;
+    uint64_t value, sum;
+    rfbBool solid = TRUE;
+    int i, j;
+
+    for (i = bpp; solid && i < rowBytes; i += bpp)
+        solid = memcmp(first, first + i, bpp) == 0;
+    for (j = 1, row = first + stride; solid && j < h; j++, row += stride)
+        solid = memcmp(first, row, rowBytes) == 0;
+    if (solid)
+        return FALSE;
+
+    sum = hashMix(0, ((uint64_t)w << 16) | (uint64_t)h);
+    for (j = 0, row = first; j < h; j++, row += stride) {
+        for (i = 0; i + 8 <= rowBytes; i += 8) {
+            memcpy(&value, row + i, 8);
+            sum = hashMix(sum, value);
+        }
+        if (i < rowBytes) {
+            value = 0;
+            memcpy(&value, row + i, rowBytes - i);
+            sum = hashMix(sum, value);
+        }
+    }
+    *hash = sum ^ (sum >> 29);
+    return TRUE;
+}
+
+static int bucketOf(struct rfbTileCache *cache, uint64_t hash)
+{
+    return (int)(hash ^ (hash >> 32)) & cache->bucketMask;
+}
+
+static int findSlot(struct rfbTileCache *cache, uint64_t hash)
+{
+    int s;
+
+    for (s = cache->buckets[bucketOf(cache, hash)]; s >= 0; s = cache->slots[s].chain)
+        if (cache->slots[s].hash == hash)
+            return s;
+    return -1;
+}
+
+static void forgetSlot(struct rfbTileCache *cache, int s)
+{
+    int *link = &cache->buckets[bucketOf(cache, cache->slots[s].hash)];
+
+    if (!cache->slots[s].used)
+        return;
+    while (*link != s)
+        link = &cache->slots[*link].chain;
+    *link = cache->slots[s].chain;
+    cache->slots[s].used = FALSE;
+}
+
+static void unlinkSlot(struct rfbTileCache *cache, int s)
+{
+    rfbTileCacheSlot *slot = &cache->slots[s];
+
+    if (slot->prev >= 0)
+        cache->slots[slot->prev].next = slot->next;
+    else
+        cache->head = slot->next;
+    if (slot->next >= 0)
+        cache->slots[slot->next].prev = slot->prev;
+    else
+        cache->tail = slot->prev;
+}
+
+static void moveToFront(struct rfbTileCache *cache, int s)
+{
+    if (cache->head == s)
+        return;
+    unlinkSlot(cache, s);
+    cache->slots[s].prev = -1;
+    cache->slots[s].next = cache->head;
+    cache->slots[cache->head].prev = s;
+    cache->head = s;
+}
+
+static void moveToBack(struct rfbTileCache *cache, int s)
+{
+    if (cache->tail == s)
+        return;
+    unlinkSlot(cache, s);
+    cache->slots[s].next = -1;
+    cache->slots[s].prev = cache->tail;
+    cache->slots[cache->tail].next = s;
+    cache->tail = s;
+}
+
+static struct rfbTileCache *newTileCache(int nSlots)
+{
+    struct rfbTileCache *cache;
+    int nBuckets = 1, s;
+
+    while (nBuckets < nSlots)
+        nBuckets <<= 1;
+    cache = (struct rfbTileCache *)calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+    cache->slots = (rfbTileCacheSlot *)calloc(nSlots, sizeof(rfbTileCacheSlot));
+    cache->buckets = (int *)malloc(nBuckets * sizeof(int));
+    if (cache->slots == NULL || cache->buckets == NULL) {
+        free(cache->slots);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+    cache->nSlots = nSlots;
+    cache->bucketMask = nBuckets - 1;
+    for (s = 0; s < nBuckets; s++)
+        cache->buckets[s] = -1;
+    for (s = 0; s < nSlots; s++) {
+        cache->slots[s].prev = s - 1;
+        cache->slots[s].next = s + 1 < nSlots ? s + 1 : -1;
+    }
+    cache->head = 0;
+    cache->tail = nSlots - 1;
+    return cache;
+}
+
+void rfbTileCacheFree(rfbClientPtr cl)
+{
+    struct rfbTileCache *cache = cl->tileCache;
+
+    if (cache == NULL)
+        return;
+    free(cache->slots);
+    free(cache->buckets);
+    free(cache->refs);
+    free(cache->stores);
+    free(cache);
+    cl->tileCache = NULL;
+}
+
+size_t rfbTileCacheMemoryUsage(rfbClientPtr cl)
+{
+    struct rfbTileCache *cache = cl->tileCache;
+
+    if (cache == NULL)
+        return 0;
+    return sizeof(*cache) + cache->nSlots * sizeof(rfbTileCacheSlot) +
+           (cache->bucketMask + 1) * sizeof(int) +
+           2 * cache->maxTiles * sizeof(rfbTileCacheTile);
+}
+
+static rfbBool growTiles(struct rfbTileCache *cache)
+{
+    int size = cache->maxTiles ? cache->maxTiles * 2 : 64;
+    rfbTileCacheTile *refs, *stores;
+
+    refs = (rfbTileCacheTile *)realloc(cache->refs, size * sizeof(rfbTileCacheTile));
+    if (refs == NULL)
+        return FALSE;
+    cache->refs = refs;
+    stores = (rfbTileCacheTile *)realloc(cache->stores, size * sizeof(rfbTileCacheTile));
+    if (stores == NULL)
+        return FALSE;
+    cache->stores = stores;
+    cache->maxTiles = size;
+    return TRUE;
+}
+
+/* the number of tiles from the i-th on that follow each other in a row */
+static int runLength(rfbTileCacheTile *tiles, int i, int n)
+{
+    int len = 1;
+
+    while (i + len < n && tiles[i + len].y == tiles[i].y &&
+           tiles[i + len].x == tiles[i + len - 1].x + tiles[i + len - 1].w)
+        len++;
+    return len;
+}
+
+static int countRuns(rfbTileCacheTile *tiles, int n)
+{
+    int i, runs = 0;
+
+    for (i = 0; i < n; i += runLength(tiles, i, n))
+        runs++;
+    return runs;
+}
+
+/*
+ * Looks up the tiles updateRegion covers. Those the client keeps are taken
+ * out of updateRegion, to be sent by rfbTileCacheSendRefs(), those it can
+ * keep are sent by rfbTileCacheSendStores(). Returns how many rectangles
+ * both are going to send, one per run of tiles in a row.
+ */
+
+int rfbTileCacheLookUp(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    struct rfbTileCache *cache = cl->tileCache;
+    sraRegionPtr region, hits;
+    sraRect bbox;
+    rfbTileCacheTile *tile;
+    uint64_t hash, budget, nHits = 0, nMisses = 0;
+    uint32_t offered;
+    rfbBool reset, covered;
+    int nSlots = 0, x, y, w, h, s;
+
+    LOCK(cl->updateMutex);
+    offered = cl->tileCacheClientSize;
+    reset = cl->tileCacheReset;
+    cl->tileCacheReset = FALSE;
+    UNLOCK(cl->updateMutex);
+
+    if (offered > 0 && screen->tileCacheSize > 0 && screen == cl->scaledScreen &&
+        cl->format.trueColour && screen->serverFormat.trueColour) {
+        budget = (uint64_t)offered << 20;
+        if (budget > (uint64_t)screen->tileCacheSize)
+            budget = screen->tileCacheSize;
+        nSlots = (int)(budget / (TILE * TILE * (cl->format.bitsPerPixel / 8)));
+    }
+    if (cache != NULL && (reset || cache->nSlots != nSlots)) {
+        rfbTileCacheFree(cl);
+        cache = NULL;
+    }
+    if (nSlots == 0)
+        return 0;
+    if (cache == NULL && (cache = cl->tileCache = newTileCache(nSlots)) == NULL)
+        return 0;
+
+    /* left over if the last update failed */
+    for (s = 0; s < cache->nStores; s++)
+        cache->slots[cache->stores[s].slot].pending = FALSE;
+    cache->nRefs = cache->nStores = 0;
+
+    region = sraRgnBBox(updateRegion);
+    covered = sraRgnPopRect(region, &bbox, 0);
+    sraRgnDestroy(region);
+    if (!covered)
+        return 0;
+
+    hits = sraRgnCreate();
+    for (y = bbox.y1 / TILE * TILE; y < bbox.y2; y += TILE) {
+        h = screen->height - y < TILE ? screen->height - y : TILE;
+        for (x = bbox.x1 / TILE * TILE; x < bbox.x2; x += TILE) {
+            w = screen->width - x < TILE ? screen->width - x : TILE;
+
+            region = sraRgnCreateRect(x, y, x + w, y + h);
+            sraRgnSubtract(region, updateRegion);
+            covered = sraRgnEmpty(region);
+            sraRgnDestroy(region);
+            if (!covered || !hashTile(screen, x, y, w, h, &hash))
+                continue;
+            if ((cache->nRefs == cache->maxTiles || cache->nStores == cache->maxTiles) &&
+                !growTiles(cache))
+                break;
+
+            s = findSlot(cache, hash);
+            if (s >= 0) {
+                /* not there before this update's stores */
+                if (cache->slots[s].pending)
+                    continue;
+                moveToFront(cache, s);
+                if (cache->slots[s].lossy)
+                    rfbLosslessRefreshMark(cl, x, y, w, h);
+                tile = &cache->refs[cache->nRefs++];
+                region = sraRgnCreateRect(x, y, x + w, y + h);
+                sraRgnOr(hits, region);
+                sraRgnDestroy(region);
+                nHits++;
+            } else {
+                nMisses++;
+                s = cache->tail;
+                /* every slot is stored by this update already */
+                if (cache->slots[s].pending)
+                    continue;
+                forgetSlot(cache, s);
+                cache->slots[s].hash = hash;
+                cache->slots[s].used = TRUE;
+                cache->slots[s].pending = TRUE;
+                cache->slots[s].chain = cache->buckets[bucketOf(cache, hash)];
+                cache->buckets[bucketOf(cache, hash)] = s;
+                moveToFront(cache, s);
+                tile = &cache->stores[cache->nStores++];
+            }
+            tile->x = x;
+            tile->y = y;
+            tile->w = w;
+            tile->h = h;
+            tile->slot = s;
+        }
+    }
+    sraRgnSubtract(updateRegion, hits);
+    sraRgnDestroy(hits);
+
+    LOCK(cl->statsMutex);
+    cl->tileCacheHits += nHits;
+    cl->tileCacheMisses += nMisses;
+    UNLOCK(cl->statsMutex);
+
+    return countRuns(cache->refs, cache->nRefs) +
+           countRuns(cache->stores, cache->nStores);
+}
+
+/* a rectangle per run of tiles, followed by their slots */
+static rfbBool sendTiles(rfbClientPtr cl, rfbTileCacheTile *tiles, int n,
+                         uint32_t encoding)
+{
+    rfbFramebufferUpdateRectHeader rect;
+    rfbTileCacheMsg tc;
+    int i, j, len, w, size;
+
+    for (i = 0; i < n; i += len) {
+        len = runLength(tiles, i, n);
+        w = tiles[i + len - 1].x + tiles[i + len - 1].w - tiles[i].x;
+        size = sz_rfbFramebufferUpdateRectHeader + len * sz_rfbTileCacheMsg;
+        if (cl->ublen + size > UPDATE_BUF_SIZE) {
+            if (!rfbSendUpdateBuf(cl))
+                return FALSE;
+        }
+
+        rect.r.x = Swap16IfLE(tiles[i].x);
+        rect.r.y = Swap16IfLE(tiles[i].y);
+        rect.r.w = Swap16IfLE(w);
+        rect.r.h = Swap16IfLE(tiles[i].h);
+        rect.encoding = Swap32IfLE(encoding);
+        memcpy(&cl->updateBuf[cl->ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
+        cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+        for (j = i; j < i + len; j++) {
+            tc.slot = Swap32IfLE((uint32_t)tiles[j].slot);
+            memcpy(&cl->updateBuf[cl->ublen], (char *)&tc, sz_rfbTileCacheMsg);
+            cl->ublen += sz_rfbTileCacheMsg;
+        }
+
+        rfbStatRecordEncodingSent(cl, encoding, size,
+            encoding == rfbEncodingTileCacheRef ?
+                w * tiles[i].h * (cl->format.bitsPerPixel / 8) : size);
+    }
+    return TRUE;
+}
+
+rfbBool rfbTileCacheSendRefs(rfbClientPtr cl)
+{
+    struct rfbTileCache *cache = cl->tileCache;
+
+    if (cache == NULL)
+        return TRUE;
+    return sendTiles(cl, cache->refs, cache->nRefs, rfbEncodingTileCacheRef);
+}
+
+rfbBool rfbTileCacheSendStores(rfbClientPtr cl)
+{
+    struct rfbTileCache *cache = cl->tileCache;
+    sraRegionPtr changed, region;
+    rfbTileCacheTile *tile;
+    int i;
+
+    if (cache == NULL || cache->nStores == 0)
+        return TRUE;
+
+    LOCK(cl->updateMutex);
+    rfbDamageJournalCatchUp(cl);
+    changed = sraRgnCreateRgn(cl->modifiedRegion);
+    sraRgnOr(changed, cl->copyRegion);
+    UNLOCK(cl->updateMutex);
+
+    for (i = 0; i < cache->nStores; i++) {
+        tile = &cache->stores[i];
+        cache->slots[tile->slot].pending = FALSE;
+        cache->slots[tile->slot].lossy =
+            rfbLosslessRefreshIsLossy(cl, tile->x, tile->y, tile->w, tile->h);
+        region = sraRgnCreateRect(tile->x, tile->y, tile->x + tile->w, tile->y + tile->h);
+        sraRgnAnd(region, changed);
+        if (!sraRgnEmpty(region)) {
+            forgetSlot(cache, tile->slot);
+            moveToBack(cache, tile->slot);
+        }
+        sraRgnDestroy(region);
+    }
+    sraRgnDestroy(changed);
+
+    if (!sendTiles(cl, cache->stores, cache->nStores, rfbEncodingTileCacheStore))
+        return FALSE;
+    cache->nStores = 0;
+    return TRUE;
+}
@@ -25,6 +25,7 @@
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
+#include "simd.h"
 
 static void PrintPixelFormat(rfbPixelFormat *pf);
 static rfbBool rfbSetClientColourMapBGR233(rfbClientPtr cl);
@@ -216,6 +217,99 @@ static rfbTranslateFnType rfbTranslateWithRGBTablesFns[COUNT_OFFSETS][COUNT_OFFS
 };
 
 
+/*
+ * 32 bpp true colour with 8 bit channels, which is what most servers have,
+ * is translated with the vector kernels of simd.c instead of tables. The
+ * "table" then holds the rfbSimdTranslation the kernels work from.
+ */
+
+#define DEFINE_SIMD_TRANSLATE(OUT, OUT_T)                                   \
+static void                                                                 \
+rfbTranslateWithSimd32to##OUT (char *table, rfbPixelFormat *in,             \
+                               rfbPixelFormat *out,                         \
+                               char *iptr, char *optr,                      \
+                               int bytesBetweenInputLines,                  \
+                               int width, int height)                       \
+{                                                                           \
+    const rfbSimdTranslation *t = (const rfbSimdTranslation *)table;        \
+                                                                            \
+    while (height > 0) {                                                    \
+        rfbSimd->translate32to##OUT(t, (uint32_t *)iptr, (OUT_T *)optr,     \
+                                    width);                                 \
+        iptr += bytesBetweenInputLines;                                     \
+        optr += width * (OUT / 8);                                          \
+        height--;                                                           \
+    }                                                                       \
+}
+
+DEFINE_SIMD_TRANSLATE(8, uint8_t)
+DEFINE_SIMD_TRANSLATE(16, uint16_t)
+#ifdef LIBVNCSERVER_ALLOW24BPP
+DEFINE_SIMD_TRANSLATE(24, uint8_t)
+#endif
+DEFINE_SIMD_TRANSLATE(32, uint32_t)
+
+static rfbTranslateFnType rfbTranslateWithSimdFns[COUNT_OFFSETS] = {
+    rfbTranslateWithSimd32to8,
+    rfbTranslateWithSimd32to16,
+#ifdef LIBVNCSERVER_ALLOW24BPP
+    rfbTranslateWithSimd32to24,
+#endif
+    rfbTranslateWithSimd32to32
+};
+
+static rfbBool
+rfbCanTranslateWithSimd(rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    int outMax[3], outShift[3], i, bits;
+
+    if (rfbSimdLevel() == RFB_SIMD_NONE ||
+        in->bitsPerPixel != 32 || !in->trueColour || !out->trueColour ||
+        in->redMax != 255 || in->greenMax != 255 || in->blueMax != 255 ||
+        in->redShift > 24 || in->greenShift > 24 || in->blueShift > 24)
+        return FALSE;
+
+    outMax[0] = out->redMax;   outShift[0] = out->redShift;
+    outMax[1] = out->greenMax; outShift[1] = out->greenShift;
+    outMax[2] = out->blueMax;  outShift[2] = out->blueShift;
+
+    /* every channel has to fit the output pixel */
+    for (i = 0; i < 3; i++) {
+        if (outMax[i] > 255)
+            return FALSE;
+        for (bits = 0; (outMax[i] >> bits) != 0; bits++);
+        if (outShift[i] + bits > out->bitsPerPixel)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static rfbBool
+rfbInitSimdTranslation(char **table, rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    rfbSimdTranslation *t;
+
+    if (*table) free(*table);
+    *table = (char *)malloc(sizeof(rfbSimdTranslation));
+    if (!*table) {
+        rfbLogPerror("rfbInitSimdTranslation: malloc");
+        return FALSE;
+    }
+    t = (rfbSimdTranslation *)*table;
+
+    t->inShift[0] = in->redShift;
+    t->inShift[1] = in->greenShift;
+    t->inShift[2] = in->blueShift;
+    t->outMax[0] = out->redMax;
+    t->outMax[1] = out->greenMax;
+    t->outMax[2] = out->blueMax;
+    t->outShift[0] = out->redShift;
+    t->outShift[1] = out->greenShift;
+    t->outShift[2] = out->blueShift;
+    t->swap = (out->bitsPerPixel != 8 && out->bigEndian != in->bigEndian);
+    return TRUE;
+}
+
 
 /*
  * rfbTranslateNone is used when no translation is required.
@@ -315,6 +409,18 @@ rfbSetTranslateFunction(rfbClientPtr cl)
         return TRUE;
     }
 
+    if (rfbCanTranslateWithSimd(&cl->screen->serverFormat, &cl->format) &&
+        rfbInitSimdTranslation(&cl->translateLookupTable,
+                               &cl->screen->serverFormat, &cl->format)) {
+
+        /* computed with vector kernels, or with the tables below if their
+           parameters could not be allocated */
+
+        cl->translateFn = rfbTranslateWithSimdFns
+                              [BPP2OFFSET(cl->format.bitsPerPixel)];
+        return TRUE;
+    }
+
     if ((cl->screen->serverFormat.bitsPerPixel < 16) ||
         ((!cl->screen->serverFormat.trueColour || !rfbEconomicTranslate) &&
 	   (cl->screen->serverFormat.bitsPerPixel == 16))) {
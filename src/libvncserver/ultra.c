@@ -38,6 +38,10 @@ void rfbFreeUltraData(rfbClientPtr cl) {
   }
 }
 
+size_t rfbUltraMemoryUsage(rfbClientPtr cl) {
+  return cl->compStreamInitedLZO ? sizeof(lzo_align_t) * MAX_WRKMEM : 0;
+}
+
 
 static rfbBool
 rfbSendOneRectEncodingUltra(rfbClientPtr cl,
@@ -0,0 +1,250 @@
+/*
+ * workers.c - a pool of encoder threads shared by the clients of a screen.
+ *
+ * Encoders split an update into independent pieces of work and hand them
+ * to rfbWorkersRun(), which returns once all pieces are done. The calling
+ * thread works on its own batch, too, so a batch always completes even if
+ * all workers are busy with other clients, and without a pool (no thread
+ * support, or screen->encoderThreads == 0) everything simply runs on the
+ * caller.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+/* more threads than this do not pay off for a single update */
+#define MAX_ENCODER_THREADS 64
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+
+typedef struct rfbWorkerBatch {
+    struct rfbWorkerBatch *next;
+    rfbWorkerProc proc;
+    void *data;
+    int count;
+    int nextIndex;      /* next piece to hand out */
+    int running;        /* pieces handed out but not finished yet */
+} rfbWorkerBatch;
+
+struct rfbWorkerPool {
+    MUTEX(mutex);
+    COND(workAvailable);
+    COND(batchDone);
+    rfbWorkerBatch *queue;
+    rfbBool shutdown;
+    int nThreads;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    pthread_t threads[MAX_ENCODER_THREADS];
+#else
+    uintptr_t threads[MAX_ENCODER_THREADS];
+#endif
+};
+
+typedef struct {
+    struct rfbWorkerPool *pool;
+    int slot;
+} rfbWorkerArg;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+#define BROADCAST(cond) pthread_cond_broadcast(&(cond))
+#else
+#define BROADCAST(cond) WakeAllConditionVariable(&(cond))
+#endif
+
+/*
+ * Hand out one piece of the batch, run it and account for it. Called and
+ * returns with the pool mutex held.
+ */
+
+static void runOne(struct rfbWorkerPool *pool, rfbWorkerBatch *batch, int slot)
+{
+    int index = batch->nextIndex++;
+    rfbWorkerBatch **b;
+
+    batch->running++;
+    if (batch->nextIndex == batch->count) {
+        /* nothing left to hand out, take it off the queue */
+        for (b = &pool->queue; *b; b = &(*b)->next)
+            if (*b == batch) {
+                *b = batch->next;
+                break;
+            }
+    }
+
+    UNLOCK(pool->mutex);
+    batch->proc(batch->data, index, slot);
+    LOCK(pool->mutex);
+
+    if (--batch->running == 0 && batch->nextIndex == batch->count)
+        BROADCAST(pool->batchDone);
+}
+
+static THREAD_ROUTINE_RETURN_TYPE
+workerRun(void *data)
+{
+    rfbWorkerArg *arg = (rfbWorkerArg *)data;
+    struct rfbWorkerPool *pool = arg->pool;
+    int slot = arg->slot;
+
+    free(arg);
+
+    LOCK(pool->mutex);
+    while (!pool->shutdown) {
+        if (pool->queue)
+            runOne(pool, pool->queue, slot);
+        else
+            WAIT(pool->workAvailable, pool->mutex);
+    }
+    UNLOCK(pool->mutex);
+
+    return THREAD_ROUTINE_RETURN_VALUE;
+}
+
+#endif
+
+void rfbWorkerPoolStart(rfbScreenInfoPtr screen)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    struct rfbWorkerPool *pool;
+    int i, n = screen->encoderThreads;
+
+    if (n <= 0 || screen->workerPool)
+        return;
+    if (n > MAX_ENCODER_THREADS)
+        n = MAX_ENCODER_THREADS;
+
+    pool = (struct rfbWorkerPool *)calloc(1, sizeof(struct rfbWorkerPool));
+    if (!pool) {
+        rfbLogPerror("rfbWorkerPoolStart: calloc");
+        return;
+    }
+    INIT_MUTEX(pool->mutex);
+    INIT_COND(pool->workAvailable);
+    INIT_COND(pool->batchDone);
+
+    for (i = 0; i < n; i++) {
+        rfbWorkerArg *arg = (rfbWorkerArg *)malloc(sizeof(rfbWorkerArg));
+        if (!arg)
+            break;
+        arg->pool = pool;
+        arg->slot = i;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+        if (pthread_create(&pool->threads[i], NULL, workerRun, arg) != 0) {
+            free(arg);
+            break;
+        }
+#else
+        pool->threads[i] = _beginthread(workerRun, 0, arg);
+        if (pool->threads[i] == (uintptr_t)-1) {
+            free(arg);
+            break;
+        }
+#endif
+        pool->nThreads++;
+    }
+
+    if (pool->nThreads == 0) {
+        rfbLog("rfbWorkerPoolStart: could not start any encoder threads\n");
+        TINI_COND(pool->batchDone);
+        TINI_COND(pool->workAvailable);
+        TINI_MUTEX(pool->mutex);
+        free(pool);
+        return;
+    }
+
+    rfbLog("Started %d encoder threads\n", pool->nThreads);
+    screen->workerPool = pool;
+#endif
+}
+
+void rfbWorkerPoolStop(rfbScreenInfoPtr screen)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    struct rfbWorkerPool *pool = screen->workerPool;
+    int i;
+
+    if (!pool)
+        return;
+
+    LOCK(pool->mutex);
+    pool->shutdown = TRUE;
+    BROADCAST(pool->workAvailable);
+    UNLOCK(pool->mutex);
+
+    for (i = 0; i < pool->nThreads; i++)
+        THREAD_JOIN(pool->threads[i]);
+
+    TINI_COND(pool->batchDone);
+    TINI_COND(pool->workAvailable);
+    TINI_MUTEX(pool->mutex);
+    free(pool);
+    screen->workerPool = NULL;
+#endif
+}
+
+int rfbWorkerCount(rfbScreenInfoPtr screen)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    if (screen->workerPool)
+        return screen->workerPool->nThreads;
+#endif
+    return 0;
+}
+
+void rfbWorkersRun(rfbScreenInfoPtr screen, rfbWorkerProc proc,
+                   void *data, int count)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    struct rfbWorkerPool *pool = screen->workerPool;
+    rfbWorkerBatch batch, **b;
+    int i;
+
+    if (pool && count > 1) {
+        batch.next = NULL;
+        batch.proc = proc;
+        batch.data = data;
+        batch.count = count;
+        batch.nextIndex = 0;
+        batch.running = 0;
+
+        LOCK(pool->mutex);
+        for (b = &pool->queue; *b; b = &(*b)->next)
+            ;
+        *b = &batch;
+        BROADCAST(pool->workAvailable);
+
+        /* the caller uses the slot after the workers' */
+        while (batch.nextIndex < batch.count)
+            runOne(pool, &batch, pool->nThreads);
+        while (batch.running > 0)
+            WAIT(pool->batchDone, pool->mutex);
+        UNLOCK(pool->mutex);
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+        proc(data, i, pool ? pool->nThreads : 0);
+#else
+    int i;
+
+    for (i = 0; i < count; i++)
+        proc(data, i, 0);
+#endif
+}
@@ -57,6 +57,7 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     int deflateResult;
     int previousOut;
     int i;
+    rfbBool identity;
     char *fbptr = (cl->scaledScreen->frameBuffer + (cl->scaledScreen->paddedWidthInBytes * y)
     	   + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
@@ -129,11 +130,14 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     }
 
     /* 
-     * Convert pixel data to client format.
+     * Convert pixel data to client format. If there is nothing to convert,
+     * the framebuffer lines are deflated where they are, see below.
      */
-    (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-               &cl->format, fbptr, cl->beforeEncBuf,
-		       cl->scaledScreen->paddedWidthInBytes, w, h);
+    identity = (cl->translateFn == rfbTranslateNone);
+    if (!identity)
+        (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+                   &cl->format, fbptr, cl->beforeEncBuf,
+		           cl->scaledScreen->paddedWidthInBytes, w, h);
 
     cl->compStream.next_in = ( Bytef * )cl->beforeEncBuf;
     cl->compStream.avail_in = w * h * (cl->format.bitsPerPixel / 8);
@@ -165,7 +169,20 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     previousOut = cl->compStream.total_out;
 
     /* Perform the compression here. */
-    deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
+    if (identity) {
+        int bytesPerLine = w * (cl->format.bitsPerPixel / 8);
+        int stride = cl->scaledScreen->paddedWidthInBytes;
+        int lines = (stride == bytesPerLine) ? h : 1;
+
+        deflateResult = Z_OK;
+        for (i = 0; i < h && deflateResult == Z_OK; i += lines) {
+            cl->compStream.next_in = ( Bytef * )(fbptr + i * stride);
+            cl->compStream.avail_in = lines * bytesPerLine;
+            deflateResult = deflate( &(cl->compStream),
+                                     i + lines < h ? Z_NO_FLUSH : Z_SYNC_FLUSH );
+        }
+    } else
+        deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
 
     /* Find the total size of the resulting compressed data. */
     cl->afterEncBufLen = cl->compStream.total_out - previousOut;
@@ -27,6 +27,8 @@
 #include "rfb/rfb.h"
 #include "private.h"
 #include "zrleoutstream.h"
+#include "zrlepalettehelper.h"
+#include "simd.h"
 
 
 #define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                                \
@@ -38,8 +40,175 @@
                      &cl->format, fbptr, (char*)buf,                       \
                      cl->scaledScreen->paddedWidthInBytes, tw, th); }
 
+/*
+ * When the client has the server's pixel format, solid tiles are found and
+ * sent straight from the framebuffer, without getting them into a buffer.
+ */
+
+static char *zrleSolidPixel(rfbClientPtr cl, int tx, int ty, int tw, int th)
+{
+  int stride = cl->scaledScreen->paddedWidthInBytes, j, n = tw;
+  char *fbptr = (cl->scaledScreen->frameBuffer + (stride * ty)
+                 + (tx * (cl->scaledScreen->bitsPerPixel / 8)));
+  char *row = fbptr;
+
+  if (cl->translateFn != rfbTranslateNone)
+    return NULL;
+
+  for (j = 0; j < th && n == tw; j++, row += stride) {
+    switch (cl->format.bitsPerPixel) {
+    case 8:
+      n = rfbSimd->run8((uint8_t *)row, tw, *(uint8_t *)fbptr, 0xff);
+      break;
+    case 16:
+      n = rfbSimd->run16((uint16_t *)row, tw, *(uint16_t *)fbptr, 0xffff);
+      break;
+    default:
+      n = rfbSimd->run32((uint32_t *)row, tw, *(uint32_t *)fbptr, 0xffffffff);
+    }
+  }
+  return n == tw ? fbptr : NULL;
+}
+
+#define GET_SOLID_PIXEL(tx,ty,tw,th) zrleSolidPixel(cl,tx,ty,tw,th)
+
 #define EXTRA_ARGS , rfbClientPtr cl
 
+/*
+ * With encoder threads, the tiles of a rectangle are translated, analysed
+ * and packed on the workers, each into a buffer of its own. The buffers are
+ * then fed into the zlib stream in tile order, so the client gets the same
+ * bytes as if the tiles had been encoded one after the other.
+ */
+
+#define ZRLE_TILES_PER_THREAD 8
+
+typedef struct {
+  char *buf;    /* one tile in the client's format, plus one pixel */
+  zrlePaletteHelper paletteHelper;
+  int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+} zrleSlot;
+
+typedef struct {
+  int x, y, w, h;
+  zrleOutStream *os;
+} zrleTile;
+
+typedef struct {
+  rfbClientPtr cl;
+  int nSlots;
+  zrleSlot *slots;
+  int nTiles;
+  zrleTile *tiles;
+} zrleTileJobs;
+
+static void zrleFreeTileJobs(zrleTileJobs *jobs)
+{
+  int i;
+
+  if (jobs->slots)
+    for (i = 0; i < jobs->nSlots; i++)
+      free(jobs->slots[i].buf);
+  if (jobs->tiles)
+    for (i = 0; i < jobs->nTiles; i++)
+      if (jobs->tiles[i].os)
+        zrleOutStreamFree(jobs->tiles[i].os);
+  free(jobs->slots);
+  free(jobs->tiles);
+  free(jobs);
+}
+
+static zrleTileJobs *zrleGetTileJobs(rfbClientPtr cl)
+{
+  zrleTileJobs *jobs = (zrleTileJobs *)cl->zrleTileJobs;
+  int nSlots = rfbWorkerCount(cl->screen) + 1, i;
+
+  if (jobs && jobs->nSlots == nSlots)
+    return jobs;
+  if (jobs)
+    zrleFreeTileJobs(jobs);
+  cl->zrleTileJobs = NULL;
+
+  jobs = (zrleTileJobs *)calloc(1, sizeof(zrleTileJobs));
+  if (!jobs)
+    return NULL;
+  jobs->cl = cl;
+  jobs->nSlots = nSlots;
+  jobs->nTiles = nSlots * ZRLE_TILES_PER_THREAD;
+  jobs->slots = (zrleSlot *)calloc(jobs->nSlots, sizeof(zrleSlot));
+  jobs->tiles = (zrleTile *)calloc(jobs->nTiles, sizeof(zrleTile));
+  if (!jobs->slots || !jobs->tiles)
+    goto fail;
+  for (i = 0; i < jobs->nSlots; i++)
+    if (!(jobs->slots[i].buf = (char *)malloc(rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4)))
+      goto fail;
+  for (i = 0; i < jobs->nTiles; i++)
+    if (!(jobs->tiles[i].os = zrleOutStreamNewBuffer()))
+      goto fail;
+
+  cl->zrleTileJobs = jobs;
+  return jobs;
+
+fail:
+  rfbLog("zrleGetTileJobs: out of memory, encoding ZRLE tiles serially\n");
+  zrleFreeTileJobs(jobs);
+  return NULL;
+}
+
+static void zrleRunTiles(zrleTileJobs *jobs, int n, zrleOutStream *os,
+                         rfbWorkerProc proc)
+{
+  int i;
+
+  rfbWorkersRun(jobs->cl->screen, proc, jobs, n);
+  for (i = 0; i < n; i++) {
+    if (jobs->tiles[i].os->failed) {
+      os->failed = TRUE;
+      continue;
+    }
+    zrleOutStreamWriteBytes(os, jobs->tiles[i].os->in.start,
+                            ZRLE_BUFFER_LENGTH(&jobs->tiles[i].os->in));
+  }
+}
+
+static rfbBool zrleEncodeParallel(rfbClientPtr cl, int x, int y, int w, int h,
+                                  zrleOutStream *os, rfbWorkerProc proc)
+{
+  zrleTileJobs *jobs;
+  int tx, ty, n = 0;
+
+  if (rfbWorkerCount(cl->screen) == 0 ||
+      w * h <= rfbZRLETileWidth * rfbZRLETileHeight)
+    return FALSE;
+  if (!(jobs = zrleGetTileJobs(cl)))
+    return FALSE;
+
+  for (ty = y; ty < y+h; ty += rfbZRLETileHeight) {
+    int th = rfbZRLETileHeight;
+    if (th > y+h-ty) th = y+h-ty;
+    for (tx = x; tx < x+w; tx += rfbZRLETileWidth) {
+      zrleTile *tile = &jobs->tiles[n++];
+      int tw = rfbZRLETileWidth;
+      if (tw > x+w-tx) tw = x+w-tx;
+
+      tile->x = tx;
+      tile->y = ty;
+      tile->w = tw;
+      tile->h = th;
+      if (n == jobs->nTiles) {
+        zrleRunTiles(jobs, n, os, proc);
+        n = 0;
+      }
+    }
+  }
+  if (n > 0)
+    zrleRunTiles(jobs, n, os, proc);
+
+  return TRUE;
+}
+
+#define ZRLE_PARALLEL zrleEncodeParallel
+
 #define ENDIAN_LITTLE 0
 #define ENDIAN_BIG 1
 #define ENDIAN_NO 2
@@ -130,6 +299,8 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   if (!cl->zrleData)
     cl->zrleData = zrleOutStreamNew();
   zos = cl->zrleData;
+  if (!zos || !zrleBeforeBuf)
+    return FALSE;
   zos->in.ptr = zos->in.start;
   zos->out.ptr = zos->out.start;
 
@@ -187,6 +358,12 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
     break;
   }
 
+  /* the stream is out of step with the client's now, give up on it */
+  if (zos->failed) {
+    rfbLog("rfbSendRectEncodingZRLE: out of memory\n");
+    return FALSE;
+  }
+
   rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader + ZRLE_BUFFER_LENGTH(&zos->out),
       + w * (cl->format.bitsPerPixel / 8) * h);
 
@@ -201,7 +378,7 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   rect.r.y = Swap16IfLE(y);
   rect.r.w = Swap16IfLE(w);
   rect.r.h = Swap16IfLE(h);
-  rect.encoding = Swap32IfLE(cl->preferredEncoding);
+  rect.encoding = Swap32IfLE(cl->zywrleLevel ? rfbEncodingZYWRLE : rfbEncodingZRLE);
 
   memcpy(cl->updateBuf+cl->ublen, (char *)&rect,
          sz_rfbFramebufferUpdateRectHeader);
@@ -253,5 +430,48 @@ void rfbFreeZrleData(rfbClientPtr cl)
 		free(cl->paletteHelper);
 	}
 	cl->paletteHelper = NULL;
+
+	if (cl->zrleTileJobs) {
+		zrleFreeTileJobs((zrleTileJobs *)cl->zrleTileJobs);
+	}
+	cl->zrleTileJobs = NULL;
+}
+
+/*
+ * Frees what rfbFreeZrleData() does, apart from the zlib stream, which the
+ * client decodes on with and which only gives back its buffers.
+ */
+
+void rfbReclaimZrleData(rfbClientPtr cl)
+{
+	zrleOutStream *zos = (zrleOutStream *)cl->zrleData;
+
+	cl->zrleData = NULL;
+	rfbFreeZrleData(cl);
+	cl->zrleData = zos;
+	if (zos)
+		zrleOutStreamShrink(zos);
+}
+
+size_t rfbZrleMemoryUsage(rfbClientPtr cl)
+{
+	zrleTileJobs *jobs = (zrleTileJobs *)cl->zrleTileJobs;
+	size_t size = 0;
+	int i;
+
+	if (cl->zrleData)
+		size += zrleOutStreamMemoryUsage((zrleOutStream *)cl->zrleData);
+	if (cl->zrleBeforeBuf)
+		size += rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4;
+	if (cl->paletteHelper)
+		size += sizeof(zrlePaletteHelper);
+	if (jobs) {
+		size += sizeof(zrleTileJobs) + jobs->nTiles * sizeof(zrleTile) +
+			jobs->nSlots * (sizeof(zrleSlot) + rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4);
+		for (i = 0; i < jobs->nTiles; i++)
+			if (jobs->tiles[i].os)
+				size += zrleOutStreamMemoryUsage(jobs->tiles[i].os);
+	}
+	return size;
 }
 
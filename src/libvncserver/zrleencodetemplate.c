@@ -29,6 +29,15 @@
  * Note that the buf argument to ZRLE_ENCODE needs to be at least one pixel
  * bigger than the largest tile of pixel data, since the ZRLE encoding
  * algorithm writes to the position one past the end of the pixel data.
+ *
+ * If GET_SOLID_PIXEL is defined, it is asked for a pointer to the pixel of
+ * a tile that it knows to be of one colour, in which case the tile is not
+ * got into the buffer. It returns NULL for other tiles.
+ *
+ * If ZRLE_PARALLEL is defined, it names a function that encodes the tiles
+ * on the screen's encoder threads, given the per-tile worker procedure
+ * ZRLE_ENCODE_JOB defined below. It returns FALSE if it could not, and
+ * the tiles are encoded one after the other instead.
  */
 
 #include "zrleoutstream.h"
@@ -62,18 +71,21 @@
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,CPIXEL)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,CPIXEL,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,CPIXEL,END_FIX)
+#define ZRLE_ENCODE_JOB __RFB_CONCAT3E(zrleEncodeJob,CPIXEL,END_FIX)
 #define BPPOUT 24
 #elif BPP==15
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,16)
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,16)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ENCODE_JOB __RFB_CONCAT3E(zrleEncodeJob,BPP,END_FIX)
 #define BPPOUT 16
 #else
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,BPP)
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,BPP)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ENCODE_JOB __RFB_CONCAT3E(zrleEncodeJob,BPP,END_FIX)
 #define BPPOUT BPP
 #endif
 
@@ -94,19 +106,65 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
 #include "zywrletemplate.c"
 #endif
 
+#ifdef ZRLE_PARALLEL
+static void ZRLE_ENCODE_JOB (void *data, int index, int slot)
+{
+  zrleTileJobs *jobs = (zrleTileJobs *)data;
+  zrleTile *tile = &jobs->tiles[index];
+  zrleSlot *s = &jobs->slots[slot];
+  rfbClientPtr cl = jobs->cl;
+#ifdef GET_SOLID_PIXEL
+  PIXEL_T *solid;
+#endif
+
+  tile->os->in.ptr = tile->os->in.start;
+  tile->os->failed = FALSE;
+#ifdef GET_SOLID_PIXEL
+  solid = (PIXEL_T *)GET_SOLID_PIXEL(tile->x,tile->y,tile->w,tile->h);
+  if (solid) {
+    zrleOutStreamWriteU8(tile->os, 1);
+    zrleOutStreamWRITE_PIXEL(tile->os, *solid);
+    return;
+  }
+#endif
+  GET_IMAGE_INTO_BUF(tile->x,tile->y,tile->w,tile->h,s->buf);
+  ZRLE_ENCODE_TILE((PIXEL_T*)s->buf, tile->w, tile->h, tile->os,
+		  cl->zywrleLevel, s->zywrleBuf, &s->paletteHelper);
+}
+#endif
+
 static void ZRLE_ENCODE (int x, int y, int w, int h,
 		  zrleOutStream* os, void* buf
                   EXTRA_ARGS
                   )
 {
   int ty;
+
+#ifdef ZRLE_PARALLEL
+  if (ZRLE_PARALLEL(cl, x, y, w, h, os, ZRLE_ENCODE_JOB)) {
+    zrleOutStreamFlush(os);
+    return;
+  }
+#endif
   for (ty = y; ty < y+h; ty += rfbZRLETileHeight) {
     int tx, th = rfbZRLETileHeight;
     if (th > y+h-ty) th = y+h-ty;
     for (tx = x; tx < x+w; tx += rfbZRLETileWidth) {
       int tw = rfbZRLETileWidth;
+#ifdef GET_SOLID_PIXEL
+      PIXEL_T *solid;
+#endif
       if (tw > x+w-tx) tw = x+w-tx;
 
+#ifdef GET_SOLID_PIXEL
+      solid = (PIXEL_T *)GET_SOLID_PIXEL(tx,ty,tw,th);
+      if (solid) {
+        zrleOutStreamWriteU8(os, 1);
+        zrleOutStreamWRITE_PIXEL(os, *solid);
+        continue;
+      }
+#endif
+
       GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
 
       if (cl->paletteHelper == NULL) {
@@ -312,5 +370,6 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 #undef zrleOutStreamWRITE_PIXEL
 #undef ZRLE_ENCODE
 #undef ZRLE_ENCODE_TILE
+#undef ZRLE_ENCODE_JOB
 #undef ZYWRLE_ENCODE_TILE
 #undef BPPOUT
@@ -19,6 +19,7 @@
  */
 
 #include "zrleoutstream.h"
+#include "private.h"
 #include <stdlib.h>
 
 #define ZRLE_IN_BUFFER_SIZE  16384
@@ -92,20 +93,89 @@ zrleOutStream *zrleOutStreamNew(void)
     free(os);
     return NULL;
   }
+  os->deflate = TRUE;
+  os->failed = FALSE;
+
+  return os;
+}
+
+/*
+ * A stream that collects the bytes written to it in its input buffer
+ * instead of compressing them, for encoding tiles on other threads. The
+ * buffer grows as needed and is never flushed.
+ */
+
+zrleOutStream *zrleOutStreamNewBuffer(void)
+{
+  zrleOutStream *os;
+
+  os = calloc(1, sizeof(zrleOutStream));
+  if (os == NULL)
+    return NULL;
+
+  if (!zrleBufferAlloc(&os->in, ZRLE_IN_BUFFER_SIZE)) {
+    free(os);
+    return NULL;
+  }
+  os->deflate = FALSE;
 
   return os;
 }
 
 void zrleOutStreamFree (zrleOutStream *os)
 {
-  deflateEnd(&os->zs);
+  if (os->deflate)
+    deflateEnd(&os->zs);
   zrleBufferFree(&os->in);
   zrleBufferFree(&os->out);
   free(os);
 }
 
+/*
+ * Gives back what the buffers grew beyond their initial sizes, dropping
+ * their contents. The state of the compressor is kept.
+ */
+
+static void zrleBufferShrink(zrleBuffer *buffer, int size)
+{
+  void *new_buffer;
+
+  buffer->ptr = buffer->start;
+  if (buffer->end - buffer->start <= size)
+    return;
+
+  new_buffer = realloc(buffer->start, size);
+  if (!new_buffer)
+    return;
+
+  buffer->ptr = buffer->start = new_buffer;
+  buffer->end = buffer->start + size;
+}
+
+void zrleOutStreamShrink(zrleOutStream *os)
+{
+  zrleBufferShrink(&os->in, ZRLE_IN_BUFFER_SIZE);
+  if (os->deflate)
+    zrleBufferShrink(&os->out, ZRLE_OUT_BUFFER_SIZE);
+}
+
+size_t zrleOutStreamMemoryUsage(zrleOutStream *os)
+{
+  size_t size = sizeof(zrleOutStream);
+
+  size += os->in.end - os->in.start;
+  size += os->out.end - os->out.start;
+  /* deflateInit() uses the default memLevel of 8 */
+  if (os->deflate)
+    size += rfbDeflateMemoryUsage(MAX_WBITS, 8);
+  return size;
+}
+
 rfbBool zrleOutStreamFlush(zrleOutStream *os)
 {
+  if (os->failed)
+    return FALSE;
+
   os->zs.next_in = os->in.start;
   os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
   
@@ -120,6 +190,7 @@ rfbBool zrleOutStreamFlush(zrleOutStream *os)
       if (os->out.ptr >= os->out.end &&
 	  !zrleBufferGrow(&os->out, os->out.end - os->out.start)) {
 	rfbLog("zrleOutStreamFlush: failed to grow output buffer\n");
+	os->failed = TRUE;
 	return FALSE;
       }
 
@@ -133,6 +204,7 @@ rfbBool zrleOutStreamFlush(zrleOutStream *os)
 
       if ((ret = deflate(&os->zs, Z_SYNC_FLUSH)) != Z_OK) {
 	rfbLog("zrleOutStreamFlush: deflate failed with error code %d\n", ret);
+	os->failed = TRUE;
 	return FALSE;
       }
 
@@ -150,6 +222,11 @@ rfbBool zrleOutStreamFlush(zrleOutStream *os)
   return TRUE;
 }
 
+/*
+ * Makes room for up to size bytes and returns how many fit, 0 if none do
+ * because memory ran out or deflate failed; os->failed is set then.
+ */
+
 static int zrleOutStreamOverrun(zrleOutStream *os,
 				int            size)
 {
@@ -157,6 +234,19 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
   rfbLog("zrleOutStreamOverrun\n");
 #endif
 
+  if (!os->deflate) {
+    int grow = os->in.end - os->in.start;
+
+    if (grow < size)
+      grow = size;
+    if (!zrleBufferGrow(&os->in, grow)) {
+      rfbLog("zrleOutStreamOverrun: failed to grow input buffer\n");
+      os->failed = TRUE;
+      return 0;
+    }
+    return size;
+  }
+
   while (os->in.end - os->in.ptr < size && os->in.ptr > os->in.start) {
     os->zs.next_in = os->in.start;
     os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
@@ -167,7 +257,8 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
       if (os->out.ptr >= os->out.end &&
 	  !zrleBufferGrow(&os->out, os->out.end - os->out.start)) {
 	rfbLog("zrleOutStreamOverrun: failed to grow output buffer\n");
-	return FALSE;
+	os->failed = TRUE;
+	return 0;
       }
 
       os->zs.next_out = os->out.ptr;
@@ -180,6 +271,7 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
 
       if ((ret = deflate(&os->zs, 0)) != Z_OK) {
 	rfbLog("zrleOutStreamOverrun: deflate failed with error code %d\n", ret);
+	os->failed = TRUE;
 	return 0;
       }
 
@@ -226,6 +318,8 @@ void zrleOutStreamWriteBytes(zrleOutStream *os,
   const zrle_U8* dataEnd = data + length;
   while (data < dataEnd) {
     int n = zrleOutStreamCheck(os, dataEnd - data);
+    if (n <= 0)
+      return;
     memcpy(os->in.ptr, data, n);
     os->in.ptr += n;
     data += n;
@@ -234,26 +328,30 @@ void zrleOutStreamWriteBytes(zrleOutStream *os,
 
 void zrleOutStreamWriteU8(zrleOutStream *os, zrle_U8 u)
 {
-  zrleOutStreamCheck(os, 1);
+  if (zrleOutStreamCheck(os, 1) < 1)
+    return;
   *os->in.ptr++ = u;
 }
 
 void zrleOutStreamWriteOpaque8(zrleOutStream *os, zrle_U8 u)
 {
-  zrleOutStreamCheck(os, 1);
+  if (zrleOutStreamCheck(os, 1) < 1)
+    return;
   *os->in.ptr++ = u;
 }
 
 void zrleOutStreamWriteOpaque16 (zrleOutStream *os, zrle_U16 u)
 {
-  zrleOutStreamCheck(os, 2);
+  if (zrleOutStreamCheck(os, 2) < 2)
+    return;
   *os->in.ptr++ = ((zrle_U8*)&u)[0];
   *os->in.ptr++ = ((zrle_U8*)&u)[1];
 }
 
 void zrleOutStreamWriteOpaque32 (zrleOutStream *os, zrle_U32 u)
 {
-  zrleOutStreamCheck(os, 4);
+  if (zrleOutStreamCheck(os, 4) < 4)
+    return;
   *os->in.ptr++ = ((zrle_U8*)&u)[0];
   *os->in.ptr++ = ((zrle_U8*)&u)[1];
   *os->in.ptr++ = ((zrle_U8*)&u)[2];
@@ -262,7 +360,8 @@ void zrleOutStreamWriteOpaque32 (zrleOutStream *os, zrle_U32 u)
 
 void zrleOutStreamWriteOpaque24A(zrleOutStream *os, zrle_U32 u)
 {
-  zrleOutStreamCheck(os, 3);
+  if (zrleOutStreamCheck(os, 3) < 3)
+    return;
   *os->in.ptr++ = ((zrle_U8*)&u)[0];
   *os->in.ptr++ = ((zrle_U8*)&u)[1];
   *os->in.ptr++ = ((zrle_U8*)&u)[2];
@@ -270,7 +369,8 @@ void zrleOutStreamWriteOpaque24A(zrleOutStream *os, zrle_U32 u)
 
 void zrleOutStreamWriteOpaque24B(zrleOutStream *os, zrle_U32 u)
 {
-  zrleOutStreamCheck(os, 3);
+  if (zrleOutStreamCheck(os, 3) < 3)
+    return;
   *os->in.ptr++ = ((zrle_U8*)&u)[1];
   *os->in.ptr++ = ((zrle_U8*)&u)[2];
   *os->in.ptr++ = ((zrle_U8*)&u)[3];
@@ -36,12 +36,18 @@ typedef struct {
   zrleBuffer out;
 
   z_stream   zs;
+  rfbBool    deflate;   /* FALSE for a plain buffer that only grows */
+  rfbBool    failed;    /* a buffer could not grow or deflate failed, what
+                           was written since is incomplete */
 } zrleOutStream;
 
 #define ZRLE_BUFFER_LENGTH(b) ((b)->ptr - (b)->start)
 
 zrleOutStream *zrleOutStreamNew           (void);
+zrleOutStream *zrleOutStreamNewBuffer     (void);
 void           zrleOutStreamFree          (zrleOutStream *os);
+void           zrleOutStreamShrink        (zrleOutStream *os);
+size_t         zrleOutStreamMemoryUsage   (zrleOutStream *os);
 rfbBool        zrleOutStreamFlush         (zrleOutStream *os);
 void           zrleOutStreamWriteBytes    (zrleOutStream *os,
 					   const zrle_U8 *data,
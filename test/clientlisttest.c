@@ -0,0 +1,174 @@
+/*
+ * Connects and disconnects clients in a loop while other threads iterate
+ * over the client list: ringing the bell, sending cut text, marking damage
+ * and reading the statistics, the way applications do. Every client that
+ * goes away leaves a socket number behind that is handed out again right
+ * away, to sentinel socket pairs; nothing the server sends may reach them.
+ *
+ * Meant to be run under ThreadSanitizer and AddressSanitizer as well.
+ *
+ * Usage: clientlisttest [server options] [-rounds n]
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <rfb/rfb.h>
+
+#define WIDTH 64
+#define HEIGHT 64
+#define ITERATORS 3
+#define SENTINELS 4
+
+static rfbScreenInfoPtr server;
+static pthread_mutex_t stopMutex = PTHREAD_MUTEX_INITIALIZER;
+static int stop = 0;
+static int failed = 0;
+
+static int stopped(void)
+{
+	int s;
+
+	pthread_mutex_lock(&stopMutex);
+	s = stop;
+	pthread_mutex_unlock(&stopMutex);
+	return s;
+}
+
+static void *iterate(void *data)
+{
+	long n = (long)data;
+	rfbClientIteratorPtr i;
+	rfbClientPtr cl;
+	rfbStats stats;
+	int k = 0;
+
+	while (!stopped()) {
+		switch ((n + k++) % 4) {
+		case 0:
+			rfbSendBell(server);
+			break;
+		case 1:
+			rfbSendServerCutText(server, "cut", 3);
+			break;
+		case 2:
+			rfbMarkRectAsModified(server, 0, 0, WIDTH, HEIGHT);
+			break;
+		case 3:
+			i = rfbGetClientIterator(server);
+			while ((cl = rfbClientIteratorNext(i)))
+				rfbGetStats(cl, &stats);
+			rfbReleaseClientIterator(i);
+			break;
+		}
+		usleep(100);
+	}
+	return NULL;
+}
+
+/* the client's end of a connection: says hello, reads whatever comes for
+   a while and hangs up */
+static void *peer(void *data)
+{
+	int *args = (int *)data, sock = args[0];
+	char buf[4096];
+	int t;
+
+	if (write(sock, "RFB 003.008\n", 12) < 0)
+		perror("peer: write");
+	for (t = 0; t < args[1]; t += 100) {
+		while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+			;
+		usleep(100);
+	}
+	close(sock);
+	return NULL;
+}
+
+/* the sentinels must not have received anything */
+static void checkSentinels(int *sentinels, int n)
+{
+	char c;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (sentinels[i] < 0)
+			continue;
+		if (recv(sentinels[i], &c, 1, MSG_DONTWAIT) > 0) {
+			fprintf(stderr, "data sent to a reused socket number %d\n",
+				sentinels[i]);
+			failed++;
+		}
+		close(sentinels[i]);
+		sentinels[i] = -1;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t iterators[ITERATORS], peerThread;
+	int sentinels[SENTINELS];
+	int rounds = 300, i, j, sv[2], args[2];
+	rfbClientPtr cl;
+
+	for (i = 1; i < argc - 1; i++)
+		if (!strcmp(argv[i], "-rounds"))
+			rounds = atoi(argv[i + 1]);
+
+	server = rfbGetScreen(&argc, argv, WIDTH, HEIGHT, 8, 3, 4);
+	if (!server)
+		return 1;
+	server->frameBuffer = (char *)calloc(WIDTH * HEIGHT, 4);
+	server->port = server->ipv6port = -1;
+	server->autoPort = FALSE;
+	server->httpPort = server->http6Port = -1;
+	rfbInitServer(server);
+	rfbRunEventLoop(server, -1, TRUE);
+
+	for (i = 0; i < SENTINELS; i++)
+		sentinels[i] = -1;
+	for (i = 0; i < ITERATORS; i++)
+		pthread_create(&iterators[i], NULL, iterate, (void *)(long)i);
+
+	for (i = 0; i < rounds; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		/* sometimes hanging up while the client is still being set up */
+		args[0] = sv[1];
+		args[1] = i % 7 * 300;
+		pthread_create(&peerThread, NULL, peer, args);
+		cl = rfbNewClient(server, sv[0]);
+		if (cl && !cl->onHold)
+			rfbStartOnHoldClient(cl);
+		checkSentinels(sentinels, SENTINELS);
+		pthread_join(peerThread, NULL);
+
+		/* the server notices, closes its end and frees the client */
+		usleep(i % 5 * 100);
+		for (j = 0; j + 1 < SENTINELS; j += 2)
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sentinels + j) < 0)
+				sentinels[j] = sentinels[j + 1] = -1;
+	}
+
+	pthread_mutex_lock(&stopMutex);
+	stop = 1;
+	pthread_mutex_unlock(&stopMutex);
+	for (i = 0; i < ITERATORS; i++)
+		pthread_join(iterators[i], NULL);
+	usleep(100000);
+	checkSentinels(sentinels, SENTINELS);
+
+	rfbShutdownServer(server, TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+
+	printf("clientlisttest: %d rounds, %d failed\n", rounds, failed);
+	return failed ? 1 : 0;
+}
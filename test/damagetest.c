@@ -0,0 +1,164 @@
+/*
+ * Checks the damage journal: clients pick up the damage marked since they
+ * last caught up, rounded up to whole tiles and clipped to the screen,
+ * also when they are further behind than the journal keeps the time of
+ * the first damage for, and tiles damaged long ago are not picked up
+ * again. The stamps are 64 bits wide, so they cannot wrap around in a
+ * test.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#define WIDTH 100
+#define HEIGHT 70
+
+static int failed = 0;
+
+static rfbClientPtr newClient(rfbScreenInfoPtr screen)
+{
+	rfbClientPtr cl = (rfbClientPtr)calloc(1, sizeof(rfbClientRec));
+
+	cl->screen = screen;
+	cl->modifiedRegion = sraRgnCreate();
+	cl->damageGeneration = rfbDamageJournalGeneration(screen);
+	return cl;
+}
+
+static void freeClient(rfbClientPtr cl)
+{
+	sraRgnDestroy(cl->modifiedRegion);
+	free(cl);
+}
+
+/* catch up and compare what the client picked up with the expected
+   rectangles, then start over with an empty region */
+static void expect(const char *what, rfbClientPtr cl, int n, const int *rects)
+{
+	sraRegionPtr expected = sraRgnCreate(), rect, diff;
+	int i;
+
+	rfbDamageJournalCatchUp(cl);
+	for (i = 0; i < n; i++) {
+		rect = sraRgnCreateRect(rects[4 * i], rects[4 * i + 1],
+					rects[4 * i + 2], rects[4 * i + 3]);
+		sraRgnOr(expected, rect);
+		sraRgnDestroy(rect);
+	}
+
+	diff = sraRgnCreateRgn(expected);
+	sraRgnSubtract(diff, cl->modifiedRegion);
+	if (!sraRgnEmpty(diff)) {
+		fprintf(stderr, "%s: damage missing\n", what);
+		failed++;
+	}
+	sraRgnDestroy(diff);
+	diff = sraRgnCreateRgn(cl->modifiedRegion);
+	sraRgnSubtract(diff, expected);
+	if (!sraRgnEmpty(diff)) {
+		fprintf(stderr, "%s: too much damage\n", what);
+		failed++;
+	}
+	sraRgnDestroy(diff);
+	sraRgnDestroy(expected);
+
+	sraRgnMakeEmpty(cl->modifiedRegion);
+}
+
+int main(int argc, char **argv)
+{
+	static const int rounded[] = { 16, 0, 32, 16,  80, 64, 100, 70 };
+	static const int caughtUp[] = { 32, 32, 64, 64 };
+	static const int later[] = {
+		16, 0, 32, 16,  80, 64, 100, 70,  32, 32, 64, 64
+	};
+	static const int accumulated[] = { 0, 16, 16, 32,  48, 16, 80, 32 };
+	static const int behind[] = {
+		16, 0, 32, 16,  80, 64, 100, 70,  32, 32, 64, 64,
+		0, 16, 16, 32,  48, 16, 80, 32,  0, 48, 96, 64
+	};
+	static const int corner[] = { 0, 0, 16, 16 };
+	rfbScreenInfoPtr screen;
+	rfbClientPtr a, b, c;
+	int i;
+
+	screen = rfbGetScreen(&argc, argv, WIDTH, HEIGHT, 8, 3, 4);
+	if (!screen || !screen->damageJournal) {
+		fprintf(stderr, "no damage journal\n");
+		return 1;
+	}
+	screen->frameBuffer = (char *)calloc(WIDTH * HEIGHT, 4);
+	a = newClient(screen);
+	b = newClient(screen);
+	c = newClient(screen);
+
+	/* rounded up to tiles, and clipped to the screen at the edges */
+	rfbMarkRectAsModified(screen, 20, 5, 21, 6);
+	rfbMarkRectAsModified(screen, 95, 65, 100, 70);
+	expect("tile rounding", a, 2, rounded);
+	if (a->firstDamageTime == 0 || a->lastDamageTime == 0) {
+		fprintf(stderr, "tile rounding: damage times not set\n");
+		failed++;
+	}
+
+	/* nothing new, nothing picked up */
+	expect("no new damage", a, 0, NULL);
+	if (a->damageSuperseded) {
+		fprintf(stderr, "no new damage: superseded\n");
+		failed++;
+	}
+
+	/* each client gets what was marked since it last caught up */
+	rfbMarkRectAsModified(screen, 40, 40, 50, 50);
+	expect("catch up", a, 1, caughtUp);
+	if (!a->damageSuperseded) {
+		fprintf(stderr, "catch up: damage still waiting not superseded\n");
+		failed++;
+	}
+	expect("catch up later", b, 3, later);
+
+	/* accumulated rectangles are marked as tiles, too */
+	rfbAccumulateModifiedRect(screen, 1, 17, 2, 18);
+	rfbAccumulateModifiedRect(screen, 70, 20, 60, 30);
+	rfbCommitModifiedRects(screen);
+	expect("accumulated", a, 2, accumulated);
+	expect("accumulated, other client", b, 2, accumulated);
+
+	/* c falls behind by more generations than their times are kept, and
+	   still gets everything */
+	for (i = 0; i < 200; i++) {
+		rfbMarkRectAsModified(screen, i % 6 * 16, 48, i % 6 * 16 + 1, 49);
+		rfbDamageJournalCatchUp(a);
+	}
+	expect("behind", c, 6, behind);
+	if (c->firstDamageTime == 0) {
+		fprintf(stderr, "behind: no time of first damage\n");
+		failed++;
+	}
+	expect("behind, caught up", c, 0, NULL);
+	if (!rfbDamageJournalSleep(c)) {
+		fprintf(stderr, "behind: caught up but told to stay awake\n");
+		failed++;
+	}
+	rfbDamageJournalWakeUp(c);
+
+	/* after many generations of damage elsewhere, the tiles b saw
+	   damaged before do not look fresh to it again */
+	rfbDamageJournalCatchUp(b);
+	sraRgnMakeEmpty(b->modifiedRegion);
+	for (i = 0; i < 10000; i++) {
+		rfbMarkRectAsModified(screen, 0, 0, 1, 1);
+		rfbDamageJournalCatchUp(a);
+		if (i % 1000 == 999)
+			expect("old stamps", b, 1, corner);
+	}
+
+	freeClient(a);
+	freeClient(b);
+	freeClient(c);
+	free(screen->frameBuffer);
+	rfbScreenCleanup(screen);
+
+	printf("damagetest: %d failed\n", failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,797 @@
+/*
+ * Runs libvncserver and libvncclient in one process, connected by a
+ * socketpair, and times how the encodings cope with typical screen
+ * content. Every workload is replayed for every encoding and quality
+ * level: a frame is drawn into the server's framebuffer, marked, and the
+ * next frame only follows once the client has received all of it.
+ *
+ * One line of CSV is printed per run:
+ *
+ *   seconds                                from the frames being marked to
+ *                                          their being received, so
+ *                                          without drawing them
+ *   fps, bytes_per_frame and mbytes_per_s  throughput
+ *   ratio                                  raw bytes / bytes sent
+ *   lat_p50_ms .. lat_max_ms               from a frame being marked to
+ *                                          its last rectangle decoded
+ *   cpu_ms                                 of the whole process but the
+ *                                          drawing, the client's decoding
+ *                                          included
+ *   encode_ms                              spent in the server's encoders
+ *   content_aware                          whether the encoding was chosen
+ *                                          per rectangle
+ *
+ * Workloads are typing, scrolling, scatter, small changes all over the
+ * screen, drag, video, slideshow and alttab, switching between three full
+ * screen windows, focus, full screen changes while the pointer moves, which
+ * fails unless the square of -focussize around it comes first and as an
+ * update of its own, plus
+ * "record" with -record file: a file of raw frames of the screen's size
+ * in its pixel format (32 bits per pixel), played back in order.
+ *
+ * Usage: encbench [server options] [-size WxH] [-frames n]
+ *                 [-workloads a,b,..] [-encodings a,b,..]
+ *                 [-qualities a,b,..] [-contentaware off,on]
+ *                 [-record file] [-v]
+ *
+ * Quality -1 means lossless; it only makes a difference for tight and
+ * zywrle, the other encodings are run once. With -contentaware, every run
+ * is made with the per rectangle choice of the encoding off, on or both,
+ * and the client advertises zrle and tight as well, for the server to
+ * choose from. Server options such as -deferupdate or -encoderthreads are
+ * applied as usual.
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+#include <rfb/rfbregion.h>
+
+#define MAX_LIST 32
+#define TIMEOUT_US 10000000
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct bench bench;
+
+typedef struct {
+	const char *name;
+	/* draws the screen the client gets first */
+	void (*init)(bench *b);
+	/* draws frame n and marks or copies what changed */
+	void (*frame)(bench *b, int n);
+} workload;
+
+struct bench {
+	rfbScreenInfoPtr server;
+	int width, height;
+	uint32_t seed;
+	/* what the client has not received yet of the current frame */
+	sraRegionPtr pending;
+	/* when the first change of the current frame was marked, 0 if none */
+	uint64_t markTime;
+	FILE *record;
+	/* the window of the drag workload */
+	int winX, winY, winDX, winDY;
+	/* the screens the alttab workload switches between */
+	uint32_t *windows[3];
+	rfbClient *client;
+	/* let the server choose among zrle and tight as well */
+	rfbBool advertiseAll;
+	/* what is left of the focus square of the current frame, NULL but in
+	   the focus workload; rectangles of the current update inside and
+	   outside of it */
+	sraRegionPtr focusLeft;
+	rfbBool focusInside, focusOutside, focusBroken;
+};
+
+static rfbBool verbose;
+
+static uint64_t nowUs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t cpuUs(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static uint64_t threadCpuUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t rnd(bench *b)
+{
+	b->seed = b->seed * 1103515245 + 12345;
+	return b->seed >> 8;
+}
+
+static void quietLog(const char *format, ...)
+{
+	va_list args;
+
+	if (!verbose)
+		return;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+/* drawing */
+
+#define PIXEL(b, x, y) (((uint32_t *)(b)->server->frameBuffer)[(y) * (b)->width + (x)])
+#define RGB(r, g, b) ((uint32_t)(r) | ((uint32_t)(g) << 8) | ((uint32_t)(b) << 16))
+
+static void fillRect(bench *b, int x, int y, int w, int h, uint32_t colour)
+{
+	int i, j;
+
+	for (j = y; j < y + h; j++)
+		for (i = x; i < x + w; i++)
+			PIXEL(b, i, j) = colour;
+}
+
+/* a character cell of 8x16 with a random 6x10 glyph */
+static void drawChar(bench *b, int x, int y, uint32_t fg, uint32_t bg)
+{
+	int i, j;
+	uint32_t bits;
+
+	fillRect(b, x, y, 8, 16, bg);
+	for (j = 3; j < 13; j++) {
+		bits = rnd(b);
+		for (i = 1; i < 7; i++, bits >>= 1)
+			if (bits & 1)
+				PIXEL(b, x + i, y + j) = fg;
+	}
+}
+
+/* a line of text with words of random length */
+static void drawText(bench *b, int x, int y, int w, uint32_t fg, uint32_t bg)
+{
+	int i, end = x + w - 8;
+
+	fillRect(b, x, y, w, 16, bg);
+	for (i = x + 8; i <= end - 8; i += 8)
+		if (rnd(b) % 7)
+			drawChar(b, i, y, fg, bg);
+}
+
+/* smooth content with a little noise, shifted by dx */
+static void drawPhoto(bench *b, int x, int y, int w, int h, uint32_t seed, int dx)
+{
+	int i, j, c, gx, gy, fx, fy;
+	uint32_t v[4];
+	uint8_t channel[3];
+
+	for (j = 0; j < h; j++) {
+		gy = j / 32;
+		fy = j % 32;
+		for (i = 0; i < w; i++) {
+			gx = (i + dx) / 32;
+			fx = (i + dx) % 32;
+			for (c = 0; c < 3; c++) {
+				v[0] = (seed ^ (gx * 7919 + gy * 104729 + c * 31)) * 2654435761u >> 24;
+				v[1] = (seed ^ ((gx + 1) * 7919 + gy * 104729 + c * 31)) * 2654435761u >> 24;
+				v[2] = (seed ^ (gx * 7919 + (gy + 1) * 104729 + c * 31)) * 2654435761u >> 24;
+				v[3] = (seed ^ ((gx + 1) * 7919 + (gy + 1) * 104729 + c * 31)) * 2654435761u >> 24;
+				channel[c] = (uint8_t)MIN(255,
+					((v[0] * (32 - fx) + v[1] * fx) * (32 - fy) +
+					 (v[2] * (32 - fx) + v[3] * fx) * fy) / 1024 + rnd(b) % 8);
+			}
+			PIXEL(b, x + i, y + j) = RGB(channel[0], channel[1], channel[2]);
+		}
+	}
+}
+
+static void drawDesktop(bench *b, int x, int y, int w, int h)
+{
+	int i, j;
+
+	for (j = y; j < y + h; j++)
+		for (i = x; i < x + w; i++)
+			PIXEL(b, i, j) = RGB(40, 60 + j * 100 / b->height, 120 + i * 80 / b->width);
+}
+
+static void mark(bench *b, int x, int y, int w, int h)
+{
+	sraRegionPtr r = sraRgnCreateRect(x, y, x + w, y + h);
+
+	if (!b->markTime)
+		b->markTime = nowUs();
+	sraRgnOr(b->pending, r);
+	sraRgnDestroy(r);
+	rfbMarkRectAsModified(b->server, x, y, x + w, y + h);
+}
+
+static void copy(bench *b, int x, int y, int w, int h, int dx, int dy)
+{
+	sraRegionPtr r = sraRgnCreateRect(x + dx, y + dy, x + w + dx, y + h + dy);
+
+	if (!b->markTime)
+		b->markTime = nowUs();
+	sraRgnOr(b->pending, r);
+	sraRgnDestroy(r);
+	rfbDoCopyRect(b->server, x + dx, y + dy, x + w + dx, y + h + dy, dx, dy);
+}
+
+/* the workloads */
+
+#define LINES(b) ((b)->height / 16)
+
+static void textPage(bench *b)
+{
+	int l;
+
+	for (l = 0; l < LINES(b); l++)
+		drawText(b, 0, l * 16, b->width, RGB(0, 0, 0), RGB(255, 255, 255));
+}
+
+static void typingFrame(bench *b, int n)
+{
+	int columns = b->width / 8 - 2;
+	int x = 8 + (n % columns) * 8, y = ((n / columns) % LINES(b)) * 16;
+
+	drawChar(b, x, y, RGB(0, 0, 0), RGB(255, 255, 255));
+	/* the text cursor */
+	if (x + 8 < b->width)
+		fillRect(b, x + 8, y, 2, 16, RGB(0, 0, 0));
+	mark(b, x, y, MIN(16, b->width - x), 16);
+}
+
+/* small changes along both diagonals, more than maxRectsPerUpdate */
+#define SCATTER_CELLS 40
+
+static void scatterFrame(bench *b, int n)
+{
+	int k, x, y;
+
+	for (k = 0; k < SCATTER_CELLS; k++) {
+		x = (k * (b->width - 16) / SCATTER_CELLS + (n % 4) * 8) / 8 * 8;
+		y = k * (b->height - 16) / SCATTER_CELLS;
+		drawChar(b, x, y, RGB(0, 0, 0), RGB(255, 255, 255));
+		mark(b, x, y, 8, 16);
+		drawChar(b, b->width - 8 - x, y, RGB(0, 0, 0), RGB(255, 255, 255));
+		mark(b, b->width - 8 - x, y, 8, 16);
+	}
+}
+
+/* an odd size, so that rounding it down shows */
+#define FOCUS_SIZE 65
+#define FOCUS_X(b) ((b)->width / 3)
+#define FOCUS_Y(b) ((b)->height / 3)
+#define FOCUS_LEFT(b) (FOCUS_X(b) - FOCUS_SIZE / 2)
+#define FOCUS_TOP(b) (FOCUS_Y(b) - FOCUS_SIZE / 2)
+
+static void focusInit(bench *b)
+{
+	b->server->focusSize = FOCUS_SIZE;
+	b->server->focusSplit = TRUE;
+	drawPhoto(b, 0, 0, b->width, b->height, 0, 0);
+}
+
+static void focusFrame(bench *b, int n)
+{
+	int x = FOCUS_LEFT(b), y = FOCUS_TOP(b);
+
+	/* the client counts as interacting, and drawing gives the server the
+	   time to notice */
+	SendPointerEvent(b->client, FOCUS_X(b), FOCUS_Y(b), 0);
+	drawPhoto(b, 0, 0, b->width, b->height, n + 1, 0);
+	if (b->focusLeft)
+		sraRgnDestroy(b->focusLeft);
+	b->focusLeft = sraRgnCreateRect(x, y, x + FOCUS_SIZE, y + FOCUS_SIZE);
+	b->focusInside = b->focusOutside = FALSE;
+	mark(b, 0, 0, b->width, b->height);
+}
+
+static void scrollingFrame(bench *b, int n)
+{
+	int y = (LINES(b) - 1) * 16;
+
+	copy(b, 0, 16, b->width, y, 0, -16);
+	drawText(b, 0, y, b->width, RGB(0, 0, 0), RGB(255, 255, 255));
+	mark(b, 0, y, b->width, 16);
+}
+
+static void dragInit(bench *b)
+{
+	int l;
+
+	drawDesktop(b, 0, 0, b->width, b->height);
+	b->winX = b->winY = 0;
+	b->winDX = 6;
+	b->winDY = 3;
+	for (l = 0; l < b->height / 32; l++)
+		drawText(b, 0, l * 16, b->width / 2, RGB(0, 0, 0), RGB(230, 230, 230));
+}
+
+static void dragFrame(bench *b, int n)
+{
+	int w = b->width / 2, h = b->height / 32 * 16, l;
+	int oldX = b->winX, oldY = b->winY;
+
+	if (b->winX + b->winDX < 0 || b->winX + b->winDX + w > b->width)
+		b->winDX = -b->winDX;
+	if (b->winY + b->winDY < 0 || b->winY + b->winDY + h > b->height)
+		b->winDY = -b->winDY;
+	b->winX += b->winDX;
+	b->winY += b->winDY;
+
+	/* redrawn like a compositor without CopyRect would */
+	drawDesktop(b, oldX, oldY, w, h);
+	for (l = 0; l < h / 16; l++)
+		drawText(b, b->winX, b->winY + l * 16, w, RGB(0, 0, 0), RGB(230, 230, 230));
+	mark(b, oldX, oldY, w, h);
+	mark(b, b->winX, b->winY, w, h);
+}
+
+static void videoInit(bench *b)
+{
+	drawDesktop(b, 0, 0, b->width, b->height);
+}
+
+static void videoFrame(bench *b, int n)
+{
+	int w = b->width / 2, h = b->height / 2;
+
+	drawPhoto(b, w / 2, h / 2, w, h, 4711, n * 4);
+	mark(b, w / 2, h / 2, w, h);
+}
+
+static void slideshowInit(bench *b)
+{
+	drawPhoto(b, 0, 0, b->width, b->height, 0, 0);
+}
+
+static void slideshowFrame(bench *b, int n)
+{
+	drawPhoto(b, 0, 0, b->width, b->height, n + 1, 0);
+	mark(b, 0, 0, b->width, b->height);
+}
+
+static void alttabInit(bench *b)
+{
+	size_t size = (size_t)b->width * b->height * 4;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		switch (i) {
+		case 0: textPage(b); break;
+		case 1: drawPhoto(b, 0, 0, b->width, b->height, 4711, 0); break;
+		case 2: dragInit(b); break;
+		}
+		free(b->windows[i]);
+		if ((b->windows[i] = malloc(size)))
+			memcpy(b->windows[i], b->server->frameBuffer, size);
+	}
+	if (b->windows[0])
+		memcpy(b->server->frameBuffer, b->windows[0], size);
+}
+
+static void alttabFrame(bench *b, int n)
+{
+	uint32_t *window = b->windows[(n + 1) % 3];
+
+	if (window)
+		memcpy(b->server->frameBuffer, window, (size_t)b->width * b->height * 4);
+	mark(b, 0, 0, b->width, b->height);
+}
+
+static void recordInit(bench *b)
+{
+	rewind(b->record);
+	memset(b->server->frameBuffer, 0, b->width * b->height * 4);
+}
+
+/* marks the 64x64 tiles that differ from the previous frame */
+static void recordFrame(bench *b, int n)
+{
+	static uint32_t *next;
+	static size_t size;
+	int x, y, w, h, j;
+
+	if (size != (size_t)b->width * b->height * 4) {
+		size = (size_t)b->width * b->height * 4;
+		free(next);
+		next = malloc(size);
+	}
+	if (!next || fread(next, 1, size, b->record) != size)
+		return;
+	for (y = 0; y < b->height; y += 64)
+		for (x = 0; x < b->width; x += 64) {
+			w = MIN(64, b->width - x);
+			h = MIN(64, b->height - y);
+			for (j = y; j < y + h; j++)
+				if (memcmp(&PIXEL(b, x, j), next + j * b->width + x, w * 4))
+					break;
+			if (j == y + h)
+				continue;
+			for (j = y; j < y + h; j++)
+				memcpy(&PIXEL(b, x, j), next + j * b->width + x, w * 4);
+			mark(b, x, y, w, h);
+		}
+}
+
+static workload workloads[] = {
+	{ "typing", textPage, typingFrame },
+	{ "scrolling", textPage, scrollingFrame },
+	{ "scatter", textPage, scatterFrame },
+	{ "focus", focusInit, focusFrame },
+	{ "drag", dragInit, dragFrame },
+	{ "video", videoInit, videoFrame },
+	{ "slideshow", slideshowInit, slideshowFrame },
+	{ "alttab", alttabInit, alttabFrame },
+	{ "record", recordInit, recordFrame },
+	{ NULL, NULL, NULL }
+};
+
+static const char *encodings[] = {
+	"raw", "rre", "corre", "hextile", "ultra",
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	"zlib", "zlibhex", "zrle", "zywrle",
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	"tight",
+#endif
+#endif
+	NULL
+};
+
+/* the client side */
+
+static void gotRect(rfbClient *client, int x, int y, int w, int h)
+{
+	bench *b = rfbClientGetClientData(client, (void *)gotRect);
+	sraRegionPtr r = sraRgnCreateRect(x, y, x + w, y + h);
+
+	sraRgnSubtract(b->pending, r);
+	if (b->focusLeft) {
+		if (x >= FOCUS_LEFT(b) && x + w <= FOCUS_LEFT(b) + FOCUS_SIZE &&
+		    y >= FOCUS_TOP(b) && y + h <= FOCUS_TOP(b) + FOCUS_SIZE) {
+			b->focusInside = TRUE;
+		} else if (!sraRgnEmpty(b->focusLeft)) {
+			rfbErr("%dx%d+%d+%d sent before the focus square\n", w, h, x, y);
+			b->focusBroken = TRUE;
+		} else
+			b->focusOutside = TRUE;
+		sraRgnSubtract(b->focusLeft, r);
+	}
+	sraRgnDestroy(r);
+}
+
+static void gotUpdate(rfbClient *client)
+{
+	bench *b = rfbClientGetClientData(client, (void *)gotRect);
+
+	if (b->focusInside && b->focusOutside) {
+		rfbErr("focus square not sent as an update of its own\n");
+		b->focusBroken = TRUE;
+	}
+	b->focusInside = b->focusOutside = FALSE;
+}
+
+static rfbBool mallocFrameBuffer(rfbClient *client)
+{
+	free(client->frameBuffer);
+	client->frameBuffer = malloc(client->width * client->height * client->format.bitsPerPixel / 8);
+	return client->frameBuffer != NULL;
+}
+
+/* handles messages until all of the current frame was received */
+static rfbBool receiveFrame(bench *b, rfbClient *client)
+{
+	uint64_t start = nowUs();
+	int n;
+
+	while (!sraRgnEmpty(b->pending)) {
+		if (nowUs() - start > TIMEOUT_US) {
+			rfbErr("timed out waiting for an update\n");
+			return FALSE;
+		}
+		/* what libvncclient read ahead is not seen by select() */
+		n = client->buffered ? 1 : WaitForMessage(client, 100000);
+		if (n < 0 || (n > 0 && !HandleRFBServerMessage(client)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* one run */
+
+static int compareTimes(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(uint64_t *sorted, int n, int p)
+{
+	if (n == 0)
+		return 0;
+	return sorted[MIN(n - 1, n * p / 100)] / 1000.0;
+}
+
+static uint64_t encodeTimeUs(rfbStats *stats)
+{
+	uint64_t us = 0;
+	int i;
+
+	for (i = 0; i < stats->nEncodings; i++)
+		us += stats->encodings[i].encodeTimeUs;
+	return us;
+}
+
+static rfbBool run(bench *b, workload *w, const char *encoding, int quality, int frames)
+{
+	int sv[2], n, timed = 0, i;
+	rfbClientPtr cl;
+	rfbClient *client;
+	rfbClientIteratorPtr iterator;
+	rfbStats before, after;
+	uint64_t *latency, busy = 0, drawCpu = 0, cpuStart, cpuEnd, t;
+	char encodingsString[64];
+	double seconds, bytes;
+	int focusSize = b->server->focusSize;
+	rfbBool focusSplit = b->server->focusSplit, ok = FALSE;
+
+	latency = calloc(frames, sizeof(*latency));
+	if (!latency || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		free(latency);
+		return FALSE;
+	}
+
+	b->seed = 12345;
+	w->init(b);
+
+	cl = rfbNewClient(b->server, sv[0]);
+	if (!cl) {
+		close(sv[1]);
+		free(latency);
+		return FALSE;
+	}
+	if (!cl->onHold)
+		rfbStartOnHoldClient(cl);
+
+	client = rfbGetClient(8, 3, 4);
+	client->sock = sv[1];
+	client->MallocFrameBuffer = mallocFrameBuffer;
+	client->GotFrameBufferUpdate = gotRect;
+	client->FinishedFrameBufferUpdate = gotUpdate;
+	rfbClientSetClientData(client, (void *)gotRect, b);
+	b->client = client;
+	snprintf(encodingsString, sizeof(encodingsString), "%s%s copyrect", encoding,
+		 b->advertiseAll ? " zrle tight" : "");
+	client->appData.encodingsString = encodingsString;
+	client->appData.enableJPEG = quality >= 0;
+	if (quality >= 0)
+		client->appData.qualityLevel = quality;
+
+	/* the first update is the whole screen */
+	sraRgnDestroy(b->pending);
+	b->pending = sraRgnCreateRect(0, 0, b->width, b->height);
+	if (!rfbClientInitialise(client) || !receiveFrame(b, client))
+		goto done;
+
+	rfbGetStats(cl, &before);
+	cpuStart = cpuUs();
+	for (n = 0; n < frames; n++) {
+		b->markTime = 0;
+		t = threadCpuUs();
+		w->frame(b, n);
+		drawCpu += threadCpuUs() - t;
+		if (!b->markTime)
+			continue;
+		if (!receiveFrame(b, client))
+			goto done;
+		if (b->focusBroken) {
+			rfbErr("frame %d not sent focus first\n", n);
+			goto done;
+		}
+		latency[timed] = nowUs() - b->markTime;
+		busy += latency[timed++];
+	}
+	cpuEnd = cpuUs() - drawCpu;
+	rfbGetStats(cl, &after);
+
+	seconds = busy / 1e6;
+	bytes = (double)(after.bytesSent - before.bytesSent);
+	qsort(latency, timed, sizeof(*latency), compareTimes);
+	printf("%s,%s,%d,%d,%.3f,%.1f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.1f,%.1f,%d\n",
+	       w->name, encoding, quality, timed, seconds,
+	       seconds > 0 ? timed / seconds : 0,
+	       timed ? bytes / timed : 0,
+	       seconds > 0 ? bytes / seconds / 1e6 : 0,
+	       bytes > 0 ? (after.bytesSentIfRaw - before.bytesSentIfRaw) / bytes : 0,
+	       percentile(latency, timed, 50), percentile(latency, timed, 90),
+	       percentile(latency, timed, 99), percentile(latency, timed, 100),
+	       (cpuEnd - cpuStart) / 1000.0,
+	       (encodeTimeUs(&after) - encodeTimeUs(&before)) / 1000.0,
+	       b->server->contentAwareEncoding ? 1 : 0);
+	fflush(stdout);
+	ok = TRUE;
+
+done:
+	if (!ok)
+		rfbErr("%s with %s at quality %d failed\n", w->name, encoding, quality);
+	client->appData.encodingsString = NULL;
+	free(client->frameBuffer);
+	client->frameBuffer = NULL;
+	rfbClientCleanup(client);
+	b->client = NULL;
+	free(latency);
+	if (b->focusLeft) {
+		sraRgnDestroy(b->focusLeft);
+		b->focusLeft = NULL;
+	}
+	b->focusBroken = FALSE;
+	b->server->focusSize = focusSize;
+	b->server->focusSplit = focusSplit;
+
+	/* let the server see the client go before the next run */
+	for (i = 0; i < 500; i++) {
+		iterator = rfbGetClientIterator(b->server);
+		cl = rfbClientIteratorNext(iterator);
+		rfbReleaseClientIterator(iterator);
+		if (!cl)
+			break;
+		usleep(10000);
+	}
+	return ok;
+}
+
+/* option parsing */
+
+static int splitList(char *list, char **items)
+{
+	int n = 0;
+	char *item;
+
+	for (item = strtok(list, ","); item && n < MAX_LIST; item = strtok(NULL, ","))
+		items[n++] = item;
+	return n;
+}
+
+static rfbBool inList(char **items, int n, const char *name)
+{
+	int i;
+
+	if (n == 0)
+		return TRUE;
+	for (i = 0; i < n; i++)
+		if (strcmp(items[i], name) == 0)
+			return TRUE;
+	return FALSE;
+}
+
+static rfbBool hasQuality(const char *encoding)
+{
+	return strcmp(encoding, "tight") == 0 || strcmp(encoding, "zywrle") == 0;
+}
+
+/* one run per setting of content aware encoding asked for */
+static int runAll(bench *b, workload *w, const char *encoding, int quality, int frames,
+		  char **awareList, int nAware)
+{
+	int i, failed = 0;
+
+	if (nAware == 0)
+		return !run(b, w, encoding, quality, frames);
+	for (i = 0; i < nAware; i++) {
+		b->server->contentAwareEncoding = strcmp(awareList[i], "on") == 0;
+		failed += !run(b, w, encoding, quality, frames);
+	}
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	bench b;
+	char *workloadList[MAX_LIST], *encodingList[MAX_LIST], *qualityList[MAX_LIST];
+	char *awareList[MAX_LIST];
+	char *record = NULL;
+	char defaultQualities[] = "-1,2,5,9";
+	int nWorkloads = 0, nEncodings = 0, nQualities, nAware = 0, frames = 100;
+	int width = 1280, height = 720, i, j, k, failed = 0, serverArgc = 1;
+	workload *w;
+
+	rfbLog = rfbClientLog = rfbClientErr = quietLog;
+	nQualities = splitList(defaultQualities, qualityList);
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-v") == 0)
+			verbose = TRUE;
+		else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%dx%d", &width, &height);
+		else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+			frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-workloads") == 0 && i + 1 < argc)
+			nWorkloads = splitList(argv[++i], workloadList);
+		else if (strcmp(argv[i], "-encodings") == 0 && i + 1 < argc)
+			nEncodings = splitList(argv[++i], encodingList);
+		else if (strcmp(argv[i], "-qualities") == 0 && i + 1 < argc)
+			nQualities = splitList(argv[++i], qualityList);
+		else if (strcmp(argv[i], "-contentaware") == 0 && i + 1 < argc &&
+			 argv[i + 1][0] != '-')
+			nAware = splitList(argv[++i], awareList);
+		else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+			record = argv[++i];
+		else	/* what is left is for rfbGetScreen() */
+			argv[serverArgc++] = argv[i];
+	}
+	argc = serverArgc;
+	if (width < 64 || height < 64 || frames < 1) {
+		fprintf(stderr, "%s: bad -size or -frames\n", argv[0]);
+		return 1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.width = width;
+	b.height = height;
+	b.server = rfbGetScreen(&argc, argv, width, height, 8, 3, 4);
+	if (!b.server)
+		return 1;
+	b.server->frameBuffer = calloc(width * height, 4);
+	if (!b.server->frameBuffer)
+		return 1;
+	b.server->cursor = NULL;
+	b.server->port = b.server->ipv6port = 0;
+	b.server->autoPort = FALSE;
+	rfbInitServer(b.server);
+	rfbRunEventLoop(b.server, -1, TRUE);
+
+	if (record && !(b.record = fopen(record, "rb"))) {
+		perror(record);
+		return 1;
+	}
+	b.pending = sraRgnCreate();
+	b.advertiseAll = nAware > 0;
+
+	printf("workload,encoding,quality,frames,seconds,fps,bytes_per_frame,mbytes_per_s,"
+	       "ratio,lat_p50_ms,lat_p90_ms,lat_p99_ms,lat_max_ms,cpu_ms,encode_ms,"
+	       "content_aware\n");
+	for (w = workloads; w->name; w++) {
+		if (!inList(workloadList, nWorkloads, w->name) ||
+		    (strcmp(w->name, "record") == 0 && !b.record))
+			continue;
+		for (j = 0; encodings[j]; j++) {
+			if (!inList(encodingList, nEncodings, encodings[j]))
+				continue;
+			if (!hasQuality(encodings[j])) {
+				failed += runAll(&b, w, encodings[j], -1, frames,
+						 awareList, nAware);
+				continue;
+			}
+			for (k = 0; k < nQualities; k++)
+				failed += runAll(&b, w, encodings[j], atoi(qualityList[k]),
+						 frames, awareList, nAware);
+		}
+	}
+
+	sraRgnDestroy(b.pending);
+	for (i = 0; i < 3; i++)
+		free(b.windows[i]);
+	if (b.record)
+		fclose(b.record);
+	rfbShutdownServer(b.server, TRUE);
+	free(b.server->frameBuffer);
+	rfbScreenCleanup(b.server);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * Checks that clients still decode their updates correctly after their
+ * encoder memory was reclaimed. For every lossless encoding, a client is
+ * sent the screen, left idle until its encoder state is freed, and sent
+ * new content again, a few times over; what it shows must match the
+ * screen exactly. With Tight, the zlib streams freed must be marked for
+ * the client to reset, and the next update must use up the marks.
+ *
+ * Usage: reclaimtest [server options]
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#define WIDTH 320
+#define HEIGHT 240
+#define ROUNDS 3
+#define IDLE_MS 100
+#define TIMEOUT_US 10000000
+
+static rfbScreenInfoPtr server;
+static uint32_t seed;
+static int failed = 0;
+
+static const char *encodings[] = {
+	"raw", "rre", "corre", "hextile", "ultra",
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	"zlib", "zlibhex", "zrle",
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	"tight",
+#endif
+#endif
+	NULL
+};
+
+static uint64_t nowUs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint32_t rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static void quietLog(const char *format, ...)
+{
+}
+
+/* rectangles of two colours, a few colours, noise and one colour, so
+   that Tight uses its zlib streams */
+static void paint(uint32_t s)
+{
+	uint32_t *fb = (uint32_t *)server->frameBuffer;
+	int k, x, y, x0, y0, w, h;
+
+	seed = s;
+	for (k = 0; k < 12; k++) {
+		w = 20 + rnd() % 80;
+		h = 20 + rnd() % 80;
+		x0 = rnd() % (WIDTH - w);
+		y0 = rnd() % (HEIGHT - h);
+		for (y = y0; y < y0 + h; y++)
+			for (x = x0; x < x0 + w; x++)
+				switch (k % 4) {
+				case 0:
+					fb[y * WIDTH + x] = (x / 3 + y / 5) & 1 ? 0xffffff : s * 0x10101;
+					break;
+				case 1:
+					fb[y * WIDTH + x] = (x * 7 + y * 3) % 5 * 0x281432;
+					break;
+				case 2:
+					fb[y * WIDTH + x] = rnd() & 0xffffff;
+					break;
+				default:
+					fb[y * WIDTH + x] = s * 0x070503;
+				}
+		rfbMarkRectAsModified(server, x0, y0, x0 + w, y0 + h);
+	}
+}
+
+static rfbBool shows(rfbClient *client)
+{
+	uint32_t *a = (uint32_t *)server->frameBuffer, *b = (uint32_t *)client->frameBuffer;
+	int i;
+
+	for (i = 0; i < WIDTH * HEIGHT; i++)
+		if ((a[i] ^ b[i]) & 0xffffff)
+			return FALSE;
+	return TRUE;
+}
+
+static rfbBool mallocFrameBuffer(rfbClient *client)
+{
+	free(client->frameBuffer);
+	client->frameBuffer = calloc(client->width * client->height, client->format.bitsPerPixel / 8);
+	return client->frameBuffer != NULL;
+}
+
+/* handles messages for ms, or until the client shows the screen if ms is
+   0; FALSE if that took too long or the connection broke */
+static rfbBool receive(rfbClient *client, int ms)
+{
+	uint64_t start = nowUs();
+	int n;
+
+	while (ms ? nowUs() - start < (uint64_t)ms * 1000 : !shows(client)) {
+		if (nowUs() - start > TIMEOUT_US)
+			return FALSE;
+		/* what libvncclient read ahead is not seen by select() */
+		n = client->buffered ? 1 : WaitForMessage(client, 10000);
+		if (n < 0 || (n > 0 && !HandleRFBServerMessage(client)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static uint64_t reclaims(rfbClientPtr cl)
+{
+	rfbStats stats;
+
+	rfbGetStats(cl, &stats);
+	return stats.memoryReclaims;
+}
+
+static int resetStreams(rfbClientPtr cl)
+{
+	int streams;
+
+	LOCK(cl->sendMutex);
+	streams = cl->tightResetStreams;
+	UNLOCK(cl->sendMutex);
+	return streams;
+}
+
+static void run(const char *encoding)
+{
+	rfbBool tight = strcmp(encoding, "tight") == 0;
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	rfbClient *client;
+	uint64_t start;
+	int sv[2], round, i;
+
+	paint(1);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		failed++;
+		return;
+	}
+	cl = rfbNewClient(server, sv[0]);
+	if (!cl) {
+		close(sv[1]);
+		failed++;
+		return;
+	}
+	if (!cl->onHold)
+		rfbStartOnHoldClient(cl);
+
+	client = rfbGetClient(8, 3, 4);
+	client->sock = sv[1];
+	client->MallocFrameBuffer = mallocFrameBuffer;
+	client->appData.encodingsString = encoding;
+	client->appData.enableJPEG = FALSE;
+	if (!rfbClientInitialise(client)) {
+		fprintf(stderr, "%s: could not connect\n", encoding);
+		failed++;
+		goto done;
+	}
+
+	for (round = 0; round < ROUNDS; round++) {
+		if (!receive(client, 0)) {
+			fprintf(stderr, "%s: round %d not decoded\n", encoding, round);
+			failed++;
+			break;
+		}
+		if (tight && resetStreams(cl)) {
+			fprintf(stderr, "%s: round %d left streams to reset\n", encoding, round);
+			failed++;
+		}
+
+		/* once idle, the encoder memory goes, and only once */
+		start = nowUs();
+		while (reclaims(cl) < (uint64_t)round + 1 && nowUs() - start < TIMEOUT_US)
+			if (!receive(client, IDLE_MS))
+				break;
+		if (!receive(client, 2 * IDLE_MS) || reclaims(cl) != (uint64_t)round + 1) {
+			fprintf(stderr, "%s: round %d reclaimed %d times\n",
+				encoding, round, (int)reclaims(cl));
+			failed++;
+			break;
+		}
+		if (tight && !resetStreams(cl)) {
+			fprintf(stderr, "%s: round %d no streams to reset\n", encoding, round);
+			failed++;
+		}
+
+		paint(round + 2);
+	}
+
+done:
+	client->appData.encodingsString = NULL;
+	free(client->frameBuffer);
+	client->frameBuffer = NULL;
+	rfbClientCleanup(client);
+
+	/* let the server see the client go before the next run */
+	for (i = 0; i < 500; i++) {
+		iterator = rfbGetClientIterator(server);
+		cl = rfbClientIteratorNext(iterator);
+		rfbReleaseClientIterator(iterator);
+		if (!cl)
+			break;
+		usleep(10000);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	rfbLog = rfbClientLog = quietLog;
+	server = rfbGetScreen(&argc, argv, WIDTH, HEIGHT, 8, 3, 4);
+	if (!server)
+		return 1;
+	server->frameBuffer = (char *)calloc(WIDTH * HEIGHT, 4);
+	server->port = server->ipv6port = -1;
+	server->autoPort = FALSE;
+	server->httpPort = server->http6Port = -1;
+	server->cursor = NULL;
+	server->reclaimIdleTime = IDLE_MS;
+	rfbInitServer(server);
+	rfbRunEventLoop(server, -1, TRUE);
+
+	for (i = 0; encodings[i]; i++)
+		run(encodings[i]);
+
+	rfbShutdownServer(server, TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+
+	printf("reclaimtest: %d failed\n", failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Checks the scheduler with -fairschedule: clients connected over
+ * socketpairs watch a screen that changes all the time. The two uncapped
+ * clients of the same weight must get about the same number of updates,
+ * and a client capped by maxBandwidth must still get about what its cap
+ * allows next to them, but not much more.
+ *
+ * Usage: scheduletest [server options] [-seconds n]
+ */
+
+#ifdef __STRICT_ANSI__
+#define _BSD_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#define WIDTH 256
+#define HEIGHT 256
+#define VIEWERS 3
+/* the last viewer is capped to this many bytes/s, about 8 updates */
+#define CAP (2 * 1024 * 1024)
+#define WARMUP_US 500000
+
+typedef struct {
+	rfbClientPtr cl;
+	rfbClient *client;
+	pthread_t thread;
+	uint64_t bytes, updates;
+} viewer;
+
+static rfbScreenInfoPtr server;
+static pthread_mutex_t stopMutex = PTHREAD_MUTEX_INITIALIZER;
+static int stop = 0;
+static int failed = 0;
+
+static int stopped(void)
+{
+	int s;
+
+	pthread_mutex_lock(&stopMutex);
+	s = stop;
+	pthread_mutex_unlock(&stopMutex);
+	return s;
+}
+
+static void quietLog(const char *format, ...)
+{
+}
+
+static rfbBool mallocFrameBuffer(rfbClient *client)
+{
+	free(client->frameBuffer);
+	client->frameBuffer = malloc(client->width * client->height * client->format.bitsPerPixel / 8);
+	return client->frameBuffer != NULL;
+}
+
+/* handles messages, and so asks for the next update, until stopped */
+static void *view(void *data)
+{
+	viewer *v = (viewer *)data;
+	int n;
+
+	while (!stopped()) {
+		/* what libvncclient read ahead is not seen by select() */
+		n = v->client->buffered ? 1 : WaitForMessage(v->client, 100000);
+		if (n < 0 || (n > 0 && !HandleRFBServerMessage(v->client))) {
+			fprintf(stderr, "viewer lost its connection\n");
+			pthread_mutex_lock(&stopMutex);
+			failed++;
+			pthread_mutex_unlock(&stopMutex);
+			break;
+		}
+	}
+	return NULL;
+}
+
+static rfbBool connectViewer(viewer *v, int maxBandwidth)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return FALSE;
+	v->cl = rfbNewClient(server, sv[0]);
+	if (!v->cl) {
+		close(sv[1]);
+		return FALSE;
+	}
+	v->cl->maxBandwidth = maxBandwidth;
+	if (!v->cl->onHold)
+		rfbStartOnHoldClient(v->cl);
+
+	v->client = rfbGetClient(8, 3, 4);
+	v->client->sock = sv[1];
+	v->client->MallocFrameBuffer = mallocFrameBuffer;
+	v->client->appData.encodingsString = "raw";
+	if (!rfbClientInitialise(v->client))
+		return FALSE;
+	pthread_create(&v->thread, NULL, view, v);
+	return TRUE;
+}
+
+static uint64_t nowUs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* changes the whole screen every 2ms for us microseconds */
+static void animate(uint64_t us)
+{
+	uint64_t start = nowUs();
+	uint32_t k = 0;
+
+	while (nowUs() - start < us) {
+		memset(server->frameBuffer, k++ & 0xff, WIDTH * HEIGHT * 4);
+		rfbMarkRectAsModified(server, 0, 0, WIDTH, HEIGHT);
+		usleep(2000);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	viewer viewers[VIEWERS], *capped = &viewers[VIEWERS - 1];
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	int seconds = 3, i;
+	uint64_t allowed, update = WIDTH * HEIGHT * 4;
+
+	for (i = 1; i < argc - 1; i++)
+		if (!strcmp(argv[i], "-seconds"))
+			seconds = atoi(argv[i + 1]);
+
+	rfbLog = rfbClientLog = quietLog;
+	server = rfbGetScreen(&argc, argv, WIDTH, HEIGHT, 8, 3, 4);
+	if (!server)
+		return 1;
+	server->frameBuffer = (char *)calloc(WIDTH * HEIGHT, 4);
+	server->port = server->ipv6port = -1;
+	server->autoPort = FALSE;
+	server->httpPort = server->http6Port = -1;
+	server->fairScheduling = TRUE;
+	server->cursor = NULL;
+	rfbInitServer(server);
+	rfbRunEventLoop(server, -1, TRUE);
+
+	memset(viewers, 0, sizeof(viewers));
+	for (i = 0; i < VIEWERS; i++)
+		if (!connectViewer(&viewers[i], &viewers[i] == capped ? CAP : 0)) {
+			fprintf(stderr, "could not connect viewer %d\n", i);
+			return 1;
+		}
+
+	animate(WARMUP_US);
+	for (i = 0; i < VIEWERS; i++) {
+		viewers[i].bytes = rfbStatGetSentBytes(viewers[i].cl);
+		viewers[i].updates = rfbStatGetMessageCountSent(viewers[i].cl, rfbFramebufferUpdate);
+	}
+	animate((uint64_t)seconds * 1000000);
+	for (i = 0; i < VIEWERS; i++) {
+		viewers[i].bytes = rfbStatGetSentBytes(viewers[i].cl) - viewers[i].bytes;
+		viewers[i].updates = rfbStatGetMessageCountSent(viewers[i].cl,
+				rfbFramebufferUpdate) - viewers[i].updates;
+		printf("viewer %d: %llu updates, %llu bytes\n", i,
+		       (unsigned long long)viewers[i].updates,
+		       (unsigned long long)viewers[i].bytes);
+	}
+
+	/* the two uncapped viewers share alike */
+	if (viewers[0].updates < viewers[1].updates / 2 ||
+	    viewers[1].updates < viewers[0].updates / 2) {
+		fprintf(stderr, "uncapped viewers not treated alike\n");
+		failed++;
+	}
+	/* the capped one gets its due, give or take an update and the
+	   bucket it starts the window with */
+	allowed = (uint64_t)CAP * seconds;
+	if (capped->bytes < allowed / 2) {
+		fprintf(stderr, "capped viewer starved\n");
+		failed++;
+	}
+	if (capped->bytes > allowed + allowed / 4 + 2 * update) {
+		fprintf(stderr, "capped viewer over its cap\n");
+		failed++;
+	}
+	if (capped->updates >= viewers[0].updates) {
+		fprintf(stderr, "capped viewer not held back\n");
+		failed++;
+	}
+
+	pthread_mutex_lock(&stopMutex);
+	stop = 1;
+	pthread_mutex_unlock(&stopMutex);
+	for (i = 0; i < VIEWERS; i++) {
+		pthread_join(viewers[i].thread, NULL);
+		viewers[i].client->appData.encodingsString = NULL;
+		free(viewers[i].client->frameBuffer);
+		viewers[i].client->frameBuffer = NULL;
+		rfbClientCleanup(viewers[i].client);
+	}
+
+	/* let the server see the clients go */
+	for (i = 0; i < 500; i++) {
+		iterator = rfbGetClientIterator(server);
+		cl = rfbClientIteratorNext(iterator);
+		rfbReleaseClientIterator(iterator);
+		if (!cl)
+			break;
+		usleep(10000);
+	}
+	rfbShutdownServer(server, TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+
+	printf("scheduletest: %d failed\n", failed);
+	return failed ? 1 : 0;
+}
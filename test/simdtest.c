@@ -0,0 +1,315 @@
+/*
+ * Checks the vectorised pixel scanning kernels against the loops they
+ * replaced in the Tight encoder, the translation kernels against the
+ * translation tables, and the row sums of the scaling box filter against a
+ * plain loop, for every instruction set the CPU has. With "bench"
+ * as argument, the kernels are timed instead.
+ */
+
+#include <rfb/rfb.h>
+#include <time.h>
+#include "simd.h"
+
+#define BUF_PIXELS 4096
+#define BENCH_PIXELS (1920 * 1080)
+
+static const int levels[] = {
+	RFB_SIMD_NONE, RFB_SIMD_SSE2, RFB_SIMD_AVX2, RFB_SIMD_NEON
+};
+#define NUMBER_OF_LEVELS (sizeof(levels)/sizeof(int))
+
+static uint32_t seed = 12345;
+
+static uint32_t rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/* the loops of CheckSolidTile and FillPalette as they were */
+
+#define DEFINE_REFERENCE(bpp)						\
+static int refRun##bpp(const uint##bpp##_t *p, int n,			\
+		uint##bpp##_t c, uint##bpp##_t mask)			\
+{									\
+	int i;								\
+	for (i = 0; i < n; i++)						\
+		if ((uint##bpp##_t)(p[i] & mask) != c)			\
+			break;						\
+	return i;							\
+}									\
+									\
+static int refRun2_##bpp(const uint##bpp##_t *p, int n,			\
+		uint##bpp##_t c0, uint##bpp##_t c1, uint##bpp##_t mask,	\
+		int *n0)						\
+{									\
+	int i, k = 0;							\
+	for (i = 0; i < n; i++) {					\
+		uint##bpp##_t ci = p[i] & mask;				\
+		if (ci == c0)						\
+			k++;						\
+		else if (ci != c1)					\
+			break;						\
+	}								\
+	*n0 = k;							\
+	return i;							\
+}									\
+									\
+/* runs of up to three colours, with noise outside the mask */		\
+static void fill##bpp(uint##bpp##_t *p, int n, uint##bpp##_t mask,	\
+		int maxRun)						\
+{									\
+	uint##bpp##_t colours[3];					\
+	int i = 0, j, run;						\
+	colours[0] = rnd() & mask;					\
+	colours[1] = rnd() & mask;					\
+	colours[2] = rnd() & mask;					\
+	while (i < n) {							\
+		uint##bpp##_t c = colours[rnd() % 3];			\
+		run = 1 + rnd() % maxRun;				\
+		for (j = 0; j < run && i < n; j++, i++)			\
+			p[i] = c | (rnd() & ~mask);			\
+	}								\
+}									\
+									\
+static int check##bpp(uint##bpp##_t mask)				\
+{									\
+	static uint##bpp##_t buf[BUF_PIXELS];				\
+	int failed = 0, round, off, n, got, want, got0, want0;		\
+	for (round = 0; round < 200; round++) {				\
+		fill##bpp(buf, BUF_PIXELS, mask, round % 2 ? 300 : 8);	\
+		for (off = 0; off < 8; off++)				\
+			for (n = 0; n + off < BUF_PIXELS; n += 1 + n / 4) { \
+				const uint##bpp##_t *p = buf + off;	\
+				uint##bpp##_t c0 = p[0] & mask, c1 = p[n / 2] & mask; \
+				want = refRun##bpp(p, n, c0, mask);	\
+				got = rfbSimd->run##bpp(p, n, c0, mask); \
+				if (got != want) {			\
+					fprintf(stderr, "run" #bpp ": off %d n %d: %d, want %d\n", \
+						off, n, got, want);	\
+					failed++;			\
+				}					\
+				want = refRun2_##bpp(p, n, c0, c1, mask, &want0); \
+				got = rfbSimd->run2_##bpp(p, n, c0, c1, mask, &got0); \
+				if (got != want || got0 != want0) {	\
+					fprintf(stderr, "run2_" #bpp ": off %d n %d: %d/%d, want %d/%d\n", \
+						off, n, got, got0, want, want0); \
+					failed++;			\
+				}					\
+			}						\
+	}								\
+	return failed;							\
+}
+
+DEFINE_REFERENCE(8)
+DEFINE_REFERENCE(16)
+DEFINE_REFERENCE(32)
+
+/* client formats the translation kernels are meant for */
+
+static const rfbPixelFormat clientFormats[] = {
+	{ 32, 24, 0, 1, 255, 255, 255, 16, 8, 0, 0, 0 },	/* swizzle */
+	{ 32, 24, 1, 1, 255, 255, 255, 16, 8, 0, 0, 0 },	/* and swap */
+	{ 16, 16, 0, 1, 31, 63, 31, 11, 5, 0, 0, 0 },	/* RGB565 */
+	{ 16, 16, 1, 1, 31, 63, 31, 11, 5, 0, 0, 0 },
+	{ 16, 15, 0, 1, 31, 31, 31, 10, 5, 0, 0, 0 },	/* RGB555 */
+	{ 8, 8, 0, 1, 7, 7, 3, 0, 3, 6, 0, 0 },		/* BGR233 */
+#ifdef LIBVNCSERVER_ALLOW24BPP
+	{ 24, 24, 0, 1, 255, 255, 255, 0, 8, 16, 0, 0 },
+	{ 24, 24, 1, 1, 255, 255, 255, 0, 8, 16, 0, 0 },
+#endif
+};
+#define NUMBER_OF_FORMATS (sizeof(clientFormats)/sizeof(rfbPixelFormat))
+
+#define TR_WIDTH 77
+#define TR_HEIGHT 5
+#define TR_STRIDE (TR_WIDTH + 3)
+
+static void translate(rfbClientPtr cl, uint32_t *in, char *out)
+{
+	memset(out, 0, TR_WIDTH * TR_HEIGHT * 4);
+	rfbSetTranslateFunction(cl);
+	cl->translateFn(cl->translateLookupTable, &cl->screen->serverFormat,
+			&cl->format, (char *)in, out, TR_STRIDE * 4,
+			TR_WIDTH, TR_HEIGHT);
+}
+
+/*
+ * Compares against the translation tables, except for 24 bpp, where the
+ * tables have no 32 bpp path worth comparing to; there the plain C kernel
+ * is the reference.
+ */
+static int checkTranslation(rfbScreenInfoPtr screen, int level)
+{
+	static uint32_t in[TR_STRIDE * TR_HEIGHT];
+	static char want[TR_WIDTH * TR_HEIGHT * 4], got[TR_WIDTH * TR_HEIGHT * 4];
+	rfbClientRec cl;
+	size_t f;
+	int i, failed = 0;
+
+	memset(&cl, 0, sizeof(cl));
+	cl.screen = screen;
+	cl.host = "simdtest";
+
+	for (i = 0; i < TR_STRIDE * TR_HEIGHT; i++)
+		in[i] = rnd() ^ (rnd() << 16);
+
+	for (f = 0; f < NUMBER_OF_FORMATS; f++) {
+		int bytes = clientFormats[f].bitsPerPixel / 8;
+		cl.format = clientFormats[f];
+		if (bytes == 3) {
+			int y;
+			rfbSimdSetLevel(level);
+			translate(&cl, in, got);
+			rfbSimdSetLevel(RFB_SIMD_NONE);
+			for (y = 0; y < TR_HEIGHT; y++)
+				rfbSimd->translate32to24((rfbSimdTranslation *)cl.translateLookupTable,
+							 in + y * TR_STRIDE,
+							 (uint8_t *)want + y * TR_WIDTH * 3,
+							 TR_WIDTH);
+		} else {
+			rfbSimdSetLevel(RFB_SIMD_NONE);
+			translate(&cl, in, want);
+			rfbSimdSetLevel(level);
+			translate(&cl, in, got);
+		}
+		if (memcmp(want, got, TR_WIDTH * TR_HEIGHT * bytes) != 0) {
+			fprintf(stderr, "translation to format %d differs\n", (int)f);
+			failed++;
+		}
+	}
+	rfbSimdSetLevel(level);
+
+	free(cl.translateLookupTable);
+	return failed;
+}
+
+#define SUM_STRIDE 67
+
+static int checkSumRows(void)
+{
+	static uint8_t in[258 * SUM_STRIDE];
+	static uint16_t want[SUM_STRIDE], got[SUM_STRIDE];
+	int i, r, rows, n, failed = 0;
+
+	for (i = 0; i < (int)sizeof(in); i++)
+		in[i] = rnd() % 5 ? rnd() : 255;
+	for (rows = 1; rows <= 257; rows += rows < 4 ? 1 : 17)
+		for (n = 0; n + 3 <= SUM_STRIDE; n += 1 + n / 2) {
+			for (i = 0; i < n; i++)
+				for (want[i] = 0, r = 0; r < rows; r++)
+					want[i] += in[3 + r * SUM_STRIDE + i];
+			rfbSimd->sumRows(in + 3, SUM_STRIDE, rows, got, n);
+			if (memcmp(want, got, n * sizeof(uint16_t)) != 0) {
+				fprintf(stderr, "sumRows: %d rows of %d differ\n",
+					rows, n);
+				failed++;
+			}
+		}
+	return failed;
+}
+
+static double mpixels(clock_t start, int rounds)
+{
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	return secs > 0 ? (double)BENCH_PIXELS * rounds / secs / 1e6 : 0;
+}
+
+static void bench(const char *name)
+{
+	static uint32_t buf[BENCH_PIXELS];
+	static uint16_t sums[1920 * 4];
+	const int rounds = 50;
+	clock_t start;
+	int i, r, n0, sum = 0;
+
+	/* solid areas */
+	for (i = 0; i < BENCH_PIXELS; i++)
+		buf[i] = 0x99999999;
+	start = clock();
+	for (r = 0; r < rounds; r++)
+		sum += rfbSimd->run32(buf, BENCH_PIXELS, 0x00999999, 0x00ffffff);
+	rfbLog("%-6s run32    %8.0f Mpixel/s\n", name, mpixels(start, rounds));
+	start = clock();
+	for (r = 0; r < rounds; r++)
+		sum += rfbSimd->run16((uint16_t *)buf, BENCH_PIXELS, 0x9999, 0xffff);
+	rfbLog("%-6s run16    %8.0f Mpixel/s\n", name, mpixels(start, rounds));
+	start = clock();
+	for (r = 0; r < rounds; r++)
+		sum += rfbSimd->run8((uint8_t *)buf, BENCH_PIXELS, 0x99, 0xff);
+	rfbLog("%-6s run8     %8.0f Mpixel/s\n", name, mpixels(start, rounds));
+
+	/* two-coloured text */
+	for (i = 0; i < BENCH_PIXELS; i++)
+		buf[i] = (rnd() % 5) ? 0x00ffffff : 0;
+	start = clock();
+	for (r = 0; r < rounds; r++)
+		sum += rfbSimd->run2_32(buf, BENCH_PIXELS, 0x00ffffff, 0, 0x00ffffff, &n0);
+	rfbLog("%-6s run2_32  %8.0f Mpixel/s\n", name, mpixels(start, rounds));
+
+	/* translation, the output goes to the upper part of the buffer */
+	{
+		rfbSimdTranslation t = { { 0, 8, 16 }, { 31, 63, 31 }, { 11, 5, 0 }, 0 };
+		start = clock();
+		for (r = 0; r < rounds; r++)
+			rfbSimd->translate32to16(&t, buf, (uint16_t *)(buf + BENCH_PIXELS / 2),
+						 BENCH_PIXELS / 2);
+		rfbLog("%-6s to565    %8.0f Mpixel/s\n", name, mpixels(start, rounds) / 2);
+		t.outMax[0] = t.outMax[1] = t.outMax[2] = 255;
+		t.outShift[0] = 16; t.outShift[1] = 8; t.outShift[2] = 0;
+		start = clock();
+		for (r = 0; r < rounds; r++)
+			rfbSimd->translate32to32(&t, buf, buf + BENCH_PIXELS / 2,
+						 BENCH_PIXELS / 2);
+		rfbLog("%-6s toBGR    %8.0f Mpixel/s\n", name, mpixels(start, rounds) / 2);
+	}
+
+	/* box filter, halving the size */
+	start = clock();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i + 1 < BENCH_PIXELS / 1920; i += 2)
+			rfbSimd->sumRows((uint8_t *)(buf + i * 1920), 1920 * 4, 2,
+					 sums, 1920 * 4);
+	rfbLog("%-6s sumRows  %8.0f Mpixel/s\n", name, mpixels(start, rounds));
+
+	if (sum == 42)
+		rfbLog("\n");
+}
+
+int main(int argc, char **argv)
+{
+	rfbScreenInfoPtr screen = rfbGetScreen(&argc, argv, 16, 16, 8, 3, 4);
+	int failed = 0;
+	size_t i;
+
+	if (!screen)
+		return 1;
+
+	for (i = 0; i < NUMBER_OF_LEVELS; i++) {
+		int f;
+		if (rfbSimdSetLevel(levels[i]) != levels[i])
+			continue;
+		if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+			bench(rfbSimdLevelName(levels[i]));
+			continue;
+		}
+		f = check8(0xff) + check8(0x3f) +
+			check16(0xffff) + check16(0x7bef) +
+			check32(0xffffffff) + check32(0x00ffffff) +
+			checkSumRows();
+		if (levels[i] != RFB_SIMD_NONE) {
+			f += checkTranslation(screen, levels[i]);
+			/* BGRX framebuffer */
+			screen->serverFormat.redShift = 16;
+			screen->serverFormat.blueShift = 0;
+			f += checkTranslation(screen, levels[i]);
+			screen->serverFormat.redShift = 0;
+			screen->serverFormat.blueShift = 16;
+		}
+		rfbLog("%s kernels: %d failed\n", rfbSimdLevelName(levels[i]), f);
+		failed += f;
+	}
+
+	rfbScreenCleanup(screen);
+	return failed ? 1 : 0;
+}
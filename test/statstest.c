@@ -0,0 +1,102 @@
+/*
+ * Checks the client statistics: the encode times the encoder threads
+ * collect in copies of a client add up in the client itself, also for
+ * encodings the client has not counted anything for yet, and the
+ * rfbStatGet* totals are not cut off at 32 bits.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+static int failed = 0;
+
+static void check(const char *what, uint64_t got, uint64_t expected)
+{
+	if (got != expected) {
+		fprintf(stderr, "%s: got %llu, expected %llu\n", what,
+			(unsigned long long)got, (unsigned long long)expected);
+		failed++;
+	}
+}
+
+static rfbEncodingStats *findEncoding(rfbStats *stats, uint32_t encoding)
+{
+	int i;
+
+	for (i = 0; i < stats->nEncodings; i++)
+		if (stats->encodings[i].encoding == encoding)
+			return &stats->encodings[i];
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	rfbClientPtr cl, shadow;
+	rfbEncodingStats *e;
+	rfbStats stats;
+	uint64_t big = (uint64_t)5 << 32;
+	int i;
+
+	cl = (rfbClientPtr)calloc(1, sizeof(rfbClientRec));
+	shadow = (rfbClientPtr)calloc(1, sizeof(rfbClientRec));
+
+	/* a copy that collected nothing adds nothing */
+	rfbStatRecordEncodingSent(cl, rfbEncodingTight, 100, 400);
+	rfbStatRecordEncodeTime(cl, rfbEncodingTight, 10);
+	rfbStatMergeSlots(cl, shadow);
+	rfbGetStats(cl, &stats);
+	e = findEncoding(&stats, rfbEncodingTight);
+	if (!e) {
+		fprintf(stderr, "no Tight statistics\n");
+		return 1;
+	}
+	check("empty copy", e->encodeTimeUs, 10);
+
+	/* times and histogram buckets add up, Hextile only ever timed in
+	   the copy */
+	for (i = 0; i < 3; i++)
+		rfbStatRecordEncodeTime(shadow, rfbEncodingTight, 1000);
+	rfbStatRecordEncodeTime(shadow, rfbEncodingHextile, 1);
+	rfbStatMergeSlots(cl, shadow);
+	rfbStatRecordEncodingSent(cl, rfbEncodingHextile, 10, 40);
+	rfbGetStats(cl, &stats);
+	e = findEncoding(&stats, rfbEncodingTight);
+	check("merged time", e->encodeTimeUs, 3010);
+	/* 10us is in bucket 3 (8-15us), 1000us in bucket 9 (512-1023us) */
+	check("own bucket", e->encodeTimeHistogram[3], 1);
+	check("merged bucket", e->encodeTimeHistogram[9], 3);
+	e = findEncoding(&stats, rfbEncodingHextile);
+	if (!e) {
+		fprintf(stderr, "no Hextile statistics\n");
+		failed++;
+	} else {
+		check("merged into a new slot", e->encodeTimeUs, 1);
+		check("merged into a new bucket", e->encodeTimeHistogram[0], 1);
+	}
+
+	/* merging again adds the copy's times again: the caller resets the
+	   copy in between */
+	rfbStatMergeSlots(cl, shadow);
+	rfbGetStats(cl, &stats);
+	check("merged twice", findEncoding(&stats, rfbEncodingTight)->encodeTimeUs, 6010);
+
+	/* the totals are 64 bits wide */
+	rfbStatLookupEncoding(cl, rfbEncodingTight)->bytesSent += big;
+	rfbStatLookupEncoding(cl, rfbEncodingTight)->bytesSentIfRaw += big;
+	rfbStatLookupEncoding(cl, rfbEncodingTight)->sentCount += big;
+	rfbStatLookupMessage(cl, rfbFramebufferUpdate)->bytesRcvd = big;
+	check("sent bytes", rfbStatGetSentBytes(cl), big + 110);
+	check("sent bytes if raw", rfbStatGetSentBytesIfRaw(cl), big + 440);
+	check("received bytes", rfbStatGetRcvdBytes(cl), big);
+	check("rectangles", rfbStatGetEncodingCountSent(cl, rfbEncodingTight), big + 1);
+	rfbGetStats(cl, &stats);
+	check("stats sent bytes", stats.bytesSent, big + 110);
+
+	rfbResetStats(cl);
+	rfbResetStats(shadow);
+	free(cl);
+	free(shadow);
+
+	printf("statstest: %d failed\n", failed);
+	return failed ? 1 : 0;
+}